@@ -0,0 +1,102 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <yaml-cpp/yaml.h>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+#include "bench.hpp"
+#include "../src/assets.hpp"
+#include "../src/core.hpp"
+
+using std::string;
+namespace fs = std::filesystem;
+
+static size_t bytesIn(const string& path) {
+  size_t bytes = 0;
+  for (auto const& entry : fs::recursive_directory_iterator(path))
+    if (entry.is_regular_file())
+      bytes += entry.file_size();
+  return bytes;
+}
+
+// Every object runs one of a few scripts of about 2 KB.
+static shared_ptr<core::IWorld> sharedScriptsWorld(size_t count, size_t scripts) {
+  auto world = core::Worlds::createNew("bench");
+  string body;
+  for (int line = 0; line < 50; line++)
+    body += "local v" + std::to_string(line) + " = object:getPosition().x * " + std::to_string(line) + "\n";
+  for (size_t i = 0; i < count; i++) {
+    auto id = "object-" + std::to_string(i);
+    world->newObject(id)->setPosition(t::position{1.0 * i, 0, 0});
+    world->saveScriptToObject(id, "script", "-- script " + std::to_string(i % scripts) + "\n" + body);
+  }
+  return world;
+}
+
+// The same world as one loose script file per object, as worlds were
+// saved before assets.
+static void writeLoose(const string& from, const string& to) {
+  fs::remove_all(to);
+  fs::create_directories(to + "/scripts");
+  auto yaml = YAML::LoadFile(from + "/world.yaml");
+  for (auto object : yaml["objects"]) {
+    for (auto plugin : object["plugins"]) {
+      auto asset = plugin["asset"].as<string>();
+      plugin.remove("asset");
+      fs::copy_file(from + "/assets/" + asset,
+        to + "/scripts/" + object["id"].as<string>() + "_" + plugin["id"].as<string>());
+    }
+  }
+  std::ofstream(to + "/world.yaml") << YAML::Dump(yaml);
+}
+
+TEST_CASE("Worlds sharing a few scripts") {
+  for (size_t count : {1000, 10000}) {
+    auto suffix = " " + std::to_string(count) + " objects";
+    auto world = sharedScriptsWorld(count, 4);
+    world->save("bench_world_assets");
+    writeLoose("bench_world_assets", "bench_world_loose");
+    world->saveSnapshot("bench_world.bin");
+
+    BENCHMARK("save with assets" + suffix) {
+      world->save("bench_world_assets");
+    };
+    BENCHMARK("load loose scripts" + suffix) {
+      return core::Worlds::load("bench", "bench_world_loose");
+    };
+    BENCHMARK("load assets" + suffix) {
+      return core::Worlds::load("bench", "bench_world_assets");
+    };
+    BENCHMARK("load snapshot" + suffix) {
+      return core::Worlds::loadSnapshot("bench", "bench_world.bin");
+    };
+
+    WARN("bytes on disk" + suffix + ": loose " + std::to_string(bytesIn("bench_world_loose"))
+      + ", assets " + std::to_string(bytesIn("bench_world_assets"))
+      + ", snapshot " + std::to_string(fs::file_size("bench_world.bin")));
+    auto loaded = core::Worlds::load("bench", "bench_world_assets");
+    auto again = core::Worlds::load("bench", "bench_world_assets");
+    WARN("script blobs in memory for three copies of the world" + suffix + ": "
+      + std::to_string(core::Assets::sharedCount()));
+
+    fs::remove_all("bench_world_assets");
+    fs::remove_all("bench_world_loose");
+    fs::remove("bench_world.bin");
+  }
+}
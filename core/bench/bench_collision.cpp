@@ -0,0 +1,120 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "../src/collision.hpp"
+#include "../src/core.hpp"
+#include "../src/physics.hpp"
+
+using std::string;
+using std::vector;
+using core::Collisions;
+using core::Shape;
+
+namespace {
+
+// Half spheres, half boxes, in a cube of the given side, moving at up to
+// 2 m/s. Density is about how many neighbours each object has.
+std::shared_ptr<core::IWorld> scene(size_t count, double side, bool ground) {
+  std::mt19937 random{11};
+  std::uniform_real_distribution<double> place(0, side);
+  std::uniform_real_distribution<double> speed(-2, 2);
+  auto world = core::Worlds::createNew("collisions");
+  world->setPhysics(core::PhysicsOptions{1.0 / 90});
+  for (size_t i = 0; i < count; i++) {
+    auto id = std::to_string(i);
+    world->newObject(id)->setPosition(t::position{place(random), ground ? 0.4 : place(random), place(random)});
+    auto shape = i % 2 ? Shape::sphere(0.5) : Shape::box(t::double3{0.5, 0.5, 0.5});
+    world->savePluginToObject(id, Collisions::asPlugin("shape", shape));
+    world->savePluginToObject(id, core::Physics::asPlugin("body", core::Body{1, t::double3{speed(random), 0, speed(random)}}));
+  }
+  if (ground) {
+    world->newObject("ground")->setPosition(t::position{side / 2, 0, side / 2});
+    auto half = side / 2 + 10;
+    world->savePluginToObject("ground", Collisions::asPlugin("shape", Shape::mesh({
+      t::double3{-half, 0, -half}, t::double3{half, 0, -half}, t::double3{half, 0, half},
+      t::double3{-half, 0, -half}, t::double3{half, 0, half}, t::double3{-half, 0, half}
+    })));
+  }
+  return world;
+}
+
+// A listener on every object: contacts are computed and emitted in full.
+string measure(const std::shared_ptr<core::IWorld>& world, int rounds) {
+  auto listener = Collisions::asPlugin("listener", Shape{});
+  auto anyObject = world->getObject("0");
+  world->subscribe(anyObject.get(), listener.get(), core::EventFilter{core::Event::COLLISION});
+  world->round();
+  world->round();
+  size_t events = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++) {
+    world->round();
+    events += world->takeEvents(anyObject.get(), listener.get()).size();
+  }
+  auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  char text[128];
+  snprintf(text, sizeof(text), "%.2f ms per round, %.0f%% of a 90 Hz tick, %zu contact events per round",
+    elapsed / rounds, elapsed / rounds / (1000.0 / 90) * 100, events / rounds);
+  return text;
+}
+
+}  // namespace
+
+TEST_CASE("Collisions of thousands of moving objects") {
+  for (size_t count : {1000, 5000, 20000}) {
+    auto label = std::to_string(count / 1000) + "k";
+    // About one object per 1000 cubic meters, and one per 8.
+    WARN(label + " sparse: " + measure(scene(count, std::cbrt(count * 1000.0), false), 20));
+    WARN(label + " dense: " + measure(scene(count, std::cbrt(count * 8.0), false), 20));
+    // Everything resting on one big ground mesh, and touching it.
+    WARN(label + " on a ground mesh: " + measure(scene(count, std::sqrt(count * 8.0), true), 20));
+  }
+
+  // The pass alone, without a world around it.
+  std::mt19937 random{5};
+  std::uniform_real_distribution<double> place(0, 40);
+  std::uniform_real_distribution<double> step(-0.02, 0.02);
+  core::Colliders colliders;
+  vector<std::shared_ptr<core::IPlugin>> plugins;
+  vector<t::position> positions;
+  for (uint32_t i = 0; i < 5000; i++) {
+    plugins.push_back(Collisions::asPlugin("shape", i % 2 ? Shape::sphere(0.5) : Shape::box(t::double3{0.5, 0.5, 0.5})));
+    colliders.attach(core::ObjectHandle{i, 0}, plugins.back().get());
+    positions.push_back(t::position{place(random), place(random), place(random)});
+  }
+  vector<core::Colliders::Pair> pairs;
+  vector<core::Contact> contacts;
+  BENCHMARK("place, sweep and test 5k dense colliders") {
+    for (size_t i = 0; i < positions.size(); i++) {
+      positions[i] = positions[i] + t::double3{step(random), step(random), step(random)};
+      colliders.place(i, t::transform<double>{positions[i], t::rotation{}, t::scale{1, 1, 1}});
+    }
+    pairs.clear();
+    contacts.clear();
+    colliders.findPairs(&pairs);
+    colliders.collide(pairs, 0, pairs.size(), 1.0 / 90, &contacts);
+    return contacts.size();
+  };
+}
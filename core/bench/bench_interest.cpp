@@ -0,0 +1,114 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <memory>
+#include <random>
+#include <string>
+
+#include "bench.hpp"
+#include "../src/core.hpp"
+#include "../src/interest.hpp"
+
+using std::string;
+using std::shared_ptr;
+
+// Counts bytes as the replication encoding would: kind, id, doubles.
+class CountingSink : public core::InterestSink {
+ public:
+  void update(const string& objectId, const core::UpdateCommand& command) override {
+    bytes += 3 + objectId.size() + 4 * sizeof(double);
+  }
+  void transform(core::IObject* object, bool entered) override {
+    bytes += 3 + object->getId().size() + 10 * sizeof(double);
+  }
+  void leave(const string& objectId) override { bytes += 3 + objectId.size(); }
+
+  uint64_t bytes = 0;
+};
+
+// Objects wander over a square kilometer, subscribers follow some of them.
+struct Crowd {
+  Crowd(size_t count, size_t subscribers) : world{core::Worlds::createNew("bench")} {
+    std::uniform_real_distribution<double> place(0, 1000);
+    for (size_t i = 0; i < count; i++) {
+      auto object = world->newObject("object-" + std::to_string(i));
+      object->setPosition(t::position{place(random), 0, place(random)});
+      handles.push_back(object->getHandle());
+    }
+    for (size_t i = 0; i < subscribers; i++)
+      sinks.push_back(std::make_shared<CountingSink>());
+  }
+
+  void tick() {
+    std::uniform_real_distribution<double> step(-0.5, 0.5);
+    for (size_t i = 0; i < handles.size(); i++) {
+      auto object = world->getObject("object-" + std::to_string(i));
+      auto position = object->getPosition();
+      world->enqueue(core::command::SetPosition{handles[i], t::position{position.x + step(random), 0, position.z + step(random)}});
+    }
+    world->round();
+  }
+
+  uint64_t bytes() {
+    uint64_t total = 0;
+    for (auto const& sink : sinks)
+      total += sink->bytes;
+    return total;
+  }
+
+  std::mt19937 random{1};
+  shared_ptr<core::IWorld> world;
+  vector<core::ObjectHandle> handles;
+  vector<shared_ptr<CountingSink>> sinks;
+};
+
+TEST_CASE("Interest filtering cost and bytes") {
+  const size_t subscribers = 32;
+  for (size_t count : {1000, 5000}) {
+    auto suffix = " " + std::to_string(count) + " objects, " + std::to_string(subscribers) + " subscribers";
+    Crowd crowd(count, subscribers);
+    BENCHMARK("round without interest" + suffix) {
+      crowd.tick();
+    };
+
+    core::InterestManager interest(crowd.world);
+    for (size_t i = 0; i < subscribers; i++) {
+      core::Interest area;
+      area.follow = "object-" + std::to_string(i);
+      area.radius = 100;
+      area.fullRateRadius = 25;
+      interest.subscribe(area, crowd.sinks[i]);
+    }
+    interest.flush();
+    BENCHMARK("round with interest" + suffix) {
+      crowd.tick();
+      interest.flush();
+    };
+
+    const int ticks = 20;
+    auto before = crowd.bytes();
+    for (int i = 0; i < ticks; i++) {
+      crowd.tick();
+      interest.flush();
+    }
+    CountingSink broadcast;
+    for (size_t i = 0; i < count; i++)
+      broadcast.update("object-" + std::to_string(i), core::command::SetPosition{});
+    WARN("bytes per tick" + suffix + ": filtered " + std::to_string((crowd.bytes() - before) / ticks)
+      + ", broadcast " + std::to_string(broadcast.bytes * subscribers));
+  }
+}
@@ -0,0 +1,124 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <cmath>
+#include <vector>
+
+#include "bench.hpp"
+#include "../src/math.hpp"
+
+using std::vector;
+
+// The vector classes types.hpp had before: a hierarchy with virtual
+// destructors, so every value carries a vtable pointer.
+namespace legacy {
+
+class double2 {
+ public:
+  explicit double2(double x = 0, double y = 0) : x{x}, y{y} {}
+  ~double2() {}
+  double x, y;
+};
+
+class double3 : public double2 {
+ public:
+  explicit double3(double x = 0, double y = 0, double z = 0) : double2(x, y), z{z} {}
+  virtual ~double3() {}
+  double z;
+};
+
+class double4 : public double3 {
+ public:
+  explicit double4(double x = 0, double y = 0, double z = 0, double w = 0) : double3(x, y, z), w{w} {}
+  virtual ~double4() {}
+  double w;
+};
+
+static double3 transformPoint(const double* m, const double3& p) {
+  return double3{
+    m[0] * p.x + m[4] * p.y + m[8] * p.z + m[12],
+    m[1] * p.x + m[5] * p.y + m[9] * p.z + m[13],
+    m[2] * p.x + m[6] * p.y + m[10] * p.z + m[14]
+  };
+}
+
+static double4 multiply(const double4& a, const double4& b) {
+  return double4{
+    a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+    a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+    a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w,
+    a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z
+  };
+}
+
+}  // namespace legacy
+
+const size_t BENCH_count = 1000000;
+
+TEST_CASE("Batch transforms vs legacy classes") {
+  auto half = std::sqrt(0.5);
+  auto transform = t::transform<double>{t::double3{1, 2, 3}, t::quatd{0, half, 0, half}, t::double3{2, 2, 2}};
+  auto matrix = t::toMatrix(transform);
+  auto matrixf = t::mat4f{};
+  for (int i = 0; i < 16; i++)
+    matrixf.m[i] = static_cast<float>(matrix.m[i]);
+
+  vector<legacy::double3> legacyPoints, legacyOut(BENCH_count);
+  vector<t::double3> points, out(BENCH_count);
+  vector<t::float3> pointsf, outf(BENCH_count);
+  for (size_t i = 0; i < BENCH_count; i++) {
+    legacyPoints.push_back(legacy::double3{1.0 * i, 2, 3});
+    points.push_back(t::double3{1.0 * i, 2, 3});
+    pointsf.push_back(t::float3{1.0f * i, 2, 3});
+  }
+
+  BENCHMARK("legacy double3 transform 1M points") {
+    for (size_t i = 0; i < BENCH_count; i++)
+      legacyOut[i] = legacy::transformPoint(matrix.m, legacyPoints[i]);
+    return legacyOut.back().x;
+  };
+  BENCHMARK("double3 batch transform 1M points") {
+    t::batch::transformPoints(matrix, points.data(), out.data(), BENCH_count);
+    return out.back().x;
+  };
+  BENCHMARK("float3 batch transform 1M points") {
+    t::batch::transformPoints(matrixf, pointsf.data(), outf.data(), BENCH_count);
+    return outf.back().x;
+  };
+
+  vector<legacy::double4> legacyA(BENCH_count, legacy::double4{0, half, 0, half}), legacyQ(BENCH_count);
+  vector<t::quatd> a(BENCH_count, t::quatd{0, half, 0, half}), q(BENCH_count);
+  vector<t::quatf> af(BENCH_count, t::quatf{0, 0.7071f, 0, 0.7071f}), qf(BENCH_count);
+
+  BENCHMARK("legacy double4 quaternion multiply 1M") {
+    for (size_t i = 0; i < BENCH_count; i++)
+      legacyQ[i] = legacy::multiply(legacyA[i], legacyA[i]);
+    return legacyQ.back().w;
+  };
+  BENCHMARK("quatd batch multiply 1M") {
+    t::batch::multiply(a.data(), a.data(), q.data(), BENCH_count);
+    return q.back().w;
+  };
+  BENCHMARK("quatf batch multiply 1M") {
+    t::batch::multiply(af.data(), af.data(), qf.data(), BENCH_count);
+    return qf.back().w;
+  };
+  BENCHMARK("quatd batch normalize 1M") {
+    t::batch::normalize(q.data(), BENCH_count);
+    return q.back().w;
+  };
+}
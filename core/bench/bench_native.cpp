@@ -0,0 +1,79 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "bench.hpp"
+#include "../src/core.hpp"
+#include "../src/native.hpp"
+
+using std::string;
+using core::NativeSpec;
+using core::Natives;
+
+namespace {
+
+// The mover of test/native_plugin.cpp as a plugin called once per object,
+// the way every other plugin type runs.
+class MoverPlugin : public core::IPlugin {
+ public:
+  const string& getId() { return id; }
+  Type getType() { return SCRIPT; }
+  void saveToFile(const string& path) {}
+  void saveTo(std::ostream& out) {}
+  bool execute(core::IWorld* world, core::IObject* object) {
+    object->setPosition(object->getPosition() + t::double3{1, 0, 0} * (1.0 / 30));
+    return true;
+  }
+
+  string id = "move";
+};
+
+template <typename F>
+string roundTime(size_t count, F plugin) {
+  auto world = core::Worlds::createNew("native");
+  for (size_t i = 0; i < count; i++) {
+    auto id = std::to_string(i);
+    world->newObject(id);
+    world->savePluginToObject(id, plugin());
+  }
+  world->round();
+  const int rounds = 20;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < rounds; i++)
+    world->round();
+  auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  char text[64];
+  snprintf(text, sizeof(text), "%.2f ms per round", elapsed / rounds);
+  return text;
+}
+
+}  // namespace
+
+TEST_CASE("Native batches against per object plugins") {
+  // One state shared by all objects, like a script shared by them.
+  auto mover = Natives::asPlugin("move", NativeSpec{TEST_NATIVE_MODULE, "mover", "1 0 0"});
+  for (size_t count : {10000, 100000}) {
+    auto label = std::to_string(count / 1000) + "k movers, ";
+    WARN(label + "native batch: " + roundTime(count, [&]() { return mover; }));
+    WARN(label + "one call per object: " + roundTime(count, []() { return std::make_shared<MoverPlugin>(); }));
+  }
+}
@@ -0,0 +1,120 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "../src/core.hpp"
+#include "../src/physics.hpp"
+
+using std::string;
+using std::vector;
+using core::Body;
+using core::Physics;
+
+namespace {
+
+// The same integration over an array of structures, as plain per object
+// code would do it.
+struct PlainBody {
+  t::position position;
+  t::double3 velocity;
+  t::double3 force;
+  double inverseMass;
+  double damping;
+};
+
+void integratePlain(vector<PlainBody>* bodies, double seconds, const t::double3& gravity) {
+  for (auto& body : *bodies) {
+    auto damp = 1 / (1 + body.damping * seconds);
+    body.velocity = (body.velocity + (body.force * body.inverseMass + gravity) * seconds) * damp;
+    body.position = body.position + body.velocity * seconds;
+    body.force = t::double3{};
+  }
+}
+
+Body bodyOf(size_t i) {
+  return Body{1.0 + i % 5, t::double3{double(i % 3), 0, double(i % 7)}, 0.01};
+}
+
+template <typename F>
+double bodiesPerMillisecond(size_t count, int repeat, F step) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < repeat; i++)
+    step();
+  auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  return count * repeat / elapsed;
+}
+
+string rate(double perMillisecond) {
+  char text[64];
+  snprintf(text, sizeof(text), "%.0f bodies/ms", perMillisecond);
+  return text;
+}
+
+}  // namespace
+
+TEST_CASE("Physics integration from 10k to 1M bodies") {
+  const t::double3 gravity{0, -9.81, 0};
+  const double step = 1.0 / 90;
+  auto workers = std::max<size_t>(std::thread::hardware_concurrency(), 2);
+
+  for (size_t count : {10000, 100000, 1000000}) {
+    auto label = std::to_string(count / 1000) + "k";
+    auto repeat = static_cast<int>(std::max<size_t>(10000000 / count, 5));
+
+    vector<PlainBody> plain;
+    for (size_t i = 0; i < count; i++) {
+      auto body = bodyOf(i);
+      plain.push_back(PlainBody{t::position{double(i), 0, 0}, body.velocity, t::double3{}, 1 / body.mass, body.damping});
+    }
+    WARN(label + " array of structures: " + rate(bodiesPerMillisecond(count, repeat, [&]() {
+      integratePlain(&plain, step, gravity);
+    })));
+
+    core::PhysicsBodies bodies;
+    vector<std::shared_ptr<core::IPlugin>> plugins;
+    for (size_t i = 0; i < count; i++) {
+      plugins.push_back(Physics::asPlugin("body", bodyOf(i)));
+      bodies.attach(core::ObjectHandle{static_cast<uint32_t>(i), 0}, plugins.back().get());
+    }
+    WARN(label + " columns: " + rate(bodiesPerMillisecond(count, repeat, [&]() {
+      bodies.integrate(0, count, step, gravity);
+    })));
+
+    // Whole rounds: gathering positions, writing them back and the spatial
+    // index catching up with the moved objects.
+    auto world = core::Worlds::createNew("physics");
+    world->setPhysics(core::PhysicsOptions{step, gravity});
+    for (size_t i = 0; i < count; i++) {
+      auto id = std::to_string(i);
+      world->newObject(id)->setPosition(t::position{double(i % 1000), 0, double(i / 1000)});
+      world->savePluginToObject(id, Physics::asPlugin("body", bodyOf(i)));
+    }
+    world->round();
+    auto rounds = std::max(repeat / 10, 3);
+    WARN(label + " world rounds: " + rate(bodiesPerMillisecond(count, rounds, [&]() { world->round(); })));
+    world->setWorkers(workers);
+    WARN(label + " world rounds, " + std::to_string(workers) + " workers: "
+      + rate(bodiesPerMillisecond(count, rounds, [&]() { world->round(); })));
+  }
+}
@@ -0,0 +1,88 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <memory>
+#include <string>
+
+#include "bench.hpp"
+#include "../src/core.hpp"
+#include "../src/replication.hpp"
+
+using std::string;
+using std::shared_ptr;
+
+// Two cores, count objects on each; a round on the emitter moves them all.
+struct Pair {
+  Pair(size_t count, shared_ptr<core::Transport> transportA, shared_ptr<core::Transport> transportB)
+    : a{core::Worlds::createNew("a")}, b{core::Worlds::createNew("b")},
+      ra{a, transportA}, rb{b, transportB} {
+    ra.addPeer(transportB->getAddress());
+    rb.addPeer(transportA->getAddress());
+    for (size_t i = 0; i < count; i++) {
+      auto id = std::to_string(i);
+      handles.push_back(a->newObject(id)->getHandle());
+      b->newObject(id);
+    }
+  }
+
+  // Returns once b applied a frame with the moves of the round.
+  void round(double x) {
+    for (auto handle : handles)
+      a->enqueue(core::command::SetPosition{handle, t::position{x, 0, 0}});
+    a->round();
+    auto target = rb.getStats().framesApplied + 1;
+    ra.poll();
+    while (rb.getStats().framesApplied < target) {
+      rb.poll();
+      ra.poll();
+    }
+  }
+
+  shared_ptr<core::IWorld> a;
+  shared_ptr<core::IWorld> b;
+  core::Replicator ra;
+  core::Replicator rb;
+  vector<core::ObjectHandle> handles;
+};
+
+TEST_CASE("Replication throughput and latency") {
+  double x = 0;
+  for (size_t count : {1, 1000, 10000}) {
+    auto suffix = " " + std::to_string(count) + " updates";
+    core::MemoryNetwork network;
+    Pair memory(count, network.open("a"), network.open("b"));
+    BENCHMARK("in process round" + suffix) {
+      memory.round(x++);
+    };
+    // A SetPosition update took a kind, an id and three doubles.
+    auto const& stats = memory.ra.getStats();
+    WARN("bytes per move" + suffix + ": " + std::to_string(stats.frameBytes / stats.transformUpdates)
+      + " in frames, " + std::to_string(1 + 1 + std::to_string(count - 1).size() + 3 * sizeof(double))
+      + " as updates");
+  }
+
+  // Larger bursts overflow the default socket buffers, measuring the
+  // retransmissions more than the replication.
+  for (size_t count : {1, 1000}) {
+    auto suffix = " " + std::to_string(count) + " updates";
+    Pair udp(count, std::make_shared<core::UdpTransport>("127.0.0.1:0"),
+      std::make_shared<core::UdpTransport>("127.0.0.1:0"));
+    BENCHMARK("udp loopback round" + suffix) {
+      udp.round(x++);
+    };
+  }
+}
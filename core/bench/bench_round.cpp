@@ -0,0 +1,193 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <cmath>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "../src/core.hpp"
+#include "../src/profiler.hpp"
+
+using std::string;
+using std::vector;
+
+// Stand-in for a plugin with some per-object work: orbits the object.
+class OrbitPlugin : public core::IPlugin {
+ public:
+  const string& getId() override { return id; }
+  Type getType() override { return SCRIPT; }
+  void saveToFile(const string& path) override {}
+  void saveTo(std::ostream& out) override {}
+  bool execute(core::IWorld* world, core::IObject* object) override {
+    auto pos = object->getPosition();
+    for (int i = 0; i < 64; i++) {
+      auto angle = std::atan2(pos.y, pos.x) + 0.001;
+      auto radius = std::sqrt(pos.x * pos.x + pos.y * pos.y);
+      pos.x = radius * std::cos(angle);
+      pos.y = radius * std::sin(angle);
+    }
+    object->setPosition(pos);
+    return true;
+  }
+
+ private:
+  string id = "orbit";
+};
+
+TEST_CASE("Parallel round scaling") {
+  size_t cores = std::max(1u, std::thread::hardware_concurrency());
+  vector<size_t> workerCounts;
+  for (size_t workers = 1; workers < cores; workers *= 2)
+    workerCounts.push_back(workers);
+  workerCounts.push_back(cores);
+
+  for (size_t count : {10000, 100000}) {
+    auto world = core::Worlds::createNew("bench");
+    for (size_t i = 0; i < count; i++) {
+      auto id = std::to_string(i);
+      world->newObject(id)->setPosition(t::position{1.0 + i, 1, 0});
+      world->savePluginToObject(id, std::make_shared<OrbitPlugin>());
+    }
+
+    for (auto workers : workerCounts) {
+      world->setWorkers(workers);
+      BENCHMARK("round " + std::to_string(count) + " objects, " + std::to_string(workers) + " workers") {
+        world->round();
+      };
+    }
+  }
+}
+
+TEST_CASE("Profiler overhead on round") {
+  auto world = core::Worlds::createNew("bench");
+  for (size_t i = 0; i < 10000; i++) {
+    auto id = std::to_string(i);
+    world->newObject(id)->setPosition(t::position{1.0 + i, 1, 0});
+    world->savePluginToObject(id, std::make_shared<OrbitPlugin>());
+  }
+
+  BENCHMARK("round 10000 objects, profiler disabled") {
+    world->round();
+  };
+  core::Profiler::setEnabled(true);
+  BENCHMARK("round 10000 objects, profiler enabled") {
+    world->round();
+  };
+  core::Profiler::setEnabled(false);
+  core::Profiler::reset();
+}
+
+// Polls for something that does not happen, as idle plugins did before
+// they could sleep.
+class PollPlugin : public core::IPlugin {
+ public:
+  const string& getId() override { return id; }
+  Type getType() override { return SCRIPT; }
+  void saveToFile(const string& path) override {}
+  void saveTo(std::ostream& out) override {}
+  bool execute(core::IWorld* world, core::IObject* object) override {
+    return object->getPosition().x >= 0;
+  }
+
+ private:
+  string id = "poll";
+};
+
+class WaitPlugin : public core::IPlugin {
+ public:
+  const string& getId() override { return id; }
+  Type getType() override { return SCRIPT; }
+  void saveToFile(const string& path) override {}
+  void saveTo(std::ostream& out) override {}
+  bool execute(core::IWorld* world, core::IObject* object) override {
+    world->sleep(object, this, core::Wait{0, 0, "never"});
+    return true;
+  }
+
+ private:
+  string id = "wait";
+};
+
+TEST_CASE("Idle plugins") {
+  const size_t objects = 100000;
+  auto polling = core::Worlds::createNew("polling");
+  auto sleeping = core::Worlds::createNew("sleeping");
+  auto poll = std::make_shared<PollPlugin>();
+  auto wait = std::make_shared<WaitPlugin>();
+  for (size_t i = 0; i < objects; i++) {
+    auto id = std::to_string(i);
+    polling->newObject(id);
+    polling->savePluginToObject(id, poll);
+    sleeping->newObject(id);
+    sleeping->savePluginToObject(id, wait);
+  }
+  sleeping->round();
+
+  BENCHMARK(std::to_string(objects) + " polling plugins") {
+    polling->round();
+  };
+  BENCHMARK(std::to_string(objects) + " sleeping plugins") {
+    sleeping->round();
+  };
+}
+
+// Takes the events addressed to its object, running only when there are.
+class EventPlugin : public core::IPlugin {
+ public:
+  const string& getId() override { return id; }
+  Type getType() override { return SCRIPT; }
+  void saveToFile(const string& path) override {}
+  void saveTo(std::ostream& out) override {}
+  bool execute(core::IWorld* world, core::IObject* object) override {
+    if (object->getPosition().x == 0) {
+      world->subscribe(object, this, core::EventFilter{core::Event::CUSTOM, object->getId(), "ping"});
+      world->setEventDriven(object, this, true);
+      object->setPosition(t::position{1, 0, 0});
+    }
+    world->takeEvents(object, this);
+    return true;
+  }
+
+ private:
+  string id = "events";
+};
+
+// Rounds cost the events dispatched rather than the objects listening.
+TEST_CASE("Event driven plugins") {
+  const size_t objects = 100000;
+  auto world = core::Worlds::createNew("events");
+  auto plugin = std::make_shared<EventPlugin>();
+  for (size_t i = 0; i < objects; i++) {
+    auto id = std::to_string(i);
+    world->newObject(id);
+    world->savePluginToObject(id, plugin);
+  }
+  world->round();
+  world->round();
+
+  for (size_t events : {0, 100, 1000, 10000}) {
+    size_t next = 0;
+    BENCHMARK(std::to_string(objects) + " listeners, " + std::to_string(events) + " events per round") {
+      for (size_t i = 0; i < events; i++)
+        world->emit(core::Event{core::Event::CUSTOM, std::to_string(next++ * 7919 % objects), "", "ping"});
+      world->round();
+    };
+  }
+}
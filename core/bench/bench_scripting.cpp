@@ -0,0 +1,199 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "../src/core.hpp"
+#include "../src/script_environment.hpp"
+#include "../src/scripting.hpp"
+
+using std::string;
+using std::vector;
+
+const auto BENCH_script = R"script(
+local world, object, plugin = ...
+local sum = 0
+for i = 1, 200 do sum = sum + i * i end
+return sum
+)script";
+
+// Every round executes each object's script once: executions per second
+// is objects / mean round time.
+TEST_CASE("Script executions vs pool size") {
+  size_t cores = std::max(1u, std::thread::hardware_concurrency());
+  vector<size_t> sizes;
+  for (size_t size = 1; size < cores; size *= 2)
+    sizes.push_back(size);
+  sizes.push_back(cores);
+
+  const size_t objects = 20000;
+  auto world = core::Worlds::createNew("bench");
+  for (size_t i = 0; i < objects; i++) {
+    auto id = std::to_string(i);
+    world->newObject(id);
+    world->saveScriptToObject(id, "bench", BENCH_script);
+  }
+
+  for (auto size : sizes) {
+    core::Scripts::setPoolSize(size);
+    world->setWorkers(size);
+    BENCHMARK(std::to_string(objects) + " script executions, pool of " + std::to_string(size)) {
+      world->round();
+    };
+  }
+}
+
+// Loading compiles every plugin once: with the bytecode cache only the
+// first object of each distinct script parses its source.
+TEST_CASE("World startup with shared scripts") {
+  const size_t objects = 10000;
+  vector<string> scripts;
+  for (int i = 0; i < 4; i++)
+    scripts.push_back(string(BENCH_script) + "-- variant " + std::to_string(i) + "\n");
+  auto world = core::Worlds::createNew("bench");
+  for (size_t i = 0; i < objects; i++) {
+    auto id = std::to_string(i);
+    world->newObject(id);
+    world->saveScriptToObject(id, "bench", scripts[i % scripts.size()]);
+  }
+  world->saveSnapshot("bench_scripts.bin");
+
+  BENCHMARK(std::to_string(objects) + " objects, " + std::to_string(scripts.size()) + " scripts") {
+    return core::Worlds::loadSnapshot("bench", "bench_scripts.bin");
+  };
+  auto stats = core::Scripts::getBytecodeCacheStats();
+  WARN("bytecode cache: " + std::to_string(stats.hits) + " hits, " + std::to_string(stats.misses) + " misses");
+  std::remove("bench_scripts.bin");
+}
+
+// The budget hook runs every thousand instructions. With one runaway
+// script among the objects, rounds stay close to the budget it is given.
+TEST_CASE("Script budgets") {
+  const size_t objects = 2000;
+  auto world = core::Worlds::createNew("bench");
+  for (size_t i = 0; i < objects; i++) {
+    auto id = std::to_string(i);
+    world->newObject(id);
+    world->saveScriptToObject(id, "bench", BENCH_script);
+  }
+  core::Scripts::setPoolSize(1);
+  world->setWorkers(1);
+  auto budget = core::Scripts::getBudget();
+
+  core::Scripts::setBudget(core::ScriptBudget{0, 0, 10, 3});
+  BENCHMARK(std::to_string(objects) + " scripts, no budget") {
+    world->round();
+  };
+  core::Scripts::setBudget(budget);
+  BENCHMARK(std::to_string(objects) + " scripts, default budget") {
+    world->round();
+  };
+
+  world->newObject("runaway");
+  world->saveScriptToObject("runaway", "loop", "while true do end");
+  core::Scripts::setBudget(core::ScriptBudget{1000000, 0, 1000000, 1000000});
+  BENCHMARK(std::to_string(objects) + " scripts and a runaway one, 1M instructions each") {
+    world->round();
+  };
+  core::Scripts::setBudget(budget);
+  WARN("suspensions " + std::to_string(core::Scripts::getStats().suspensions));
+}
+
+// Each call moves the object 10000 times: updates per second is 10000 /
+// mean time. The naive binding copies positions into userdata both ways,
+// as sol2 does by default for value types.
+TEST_CASE("Lua transform updates") {
+  core::BytecodeCache cache;
+  core::ScriptEnvironment environment(0, &cache);
+  auto& lua = environment.lua;
+  lua.new_usertype<t::position>("c_position",
+    "new", [](double x, double y, double z) { return t::position{x, y, z}; },
+    "x", &t::position::x, "y", &t::position::y, "z", &t::position::z);
+  lua["naiveGetPosition"] = [](core::IObject& object) { return object.getPosition(); };
+  lua["naiveSetPosition"] = [](core::IObject& object, const t::position& position) { object.setPosition(position); };
+
+  auto world = core::Worlds::createNew("bench");
+  auto object = world->newObject("object");
+  auto other = world->newObject("other");
+
+  sol::protected_function naive = lua.load(R"script(
+local object = ...
+for i = 1, 10000 do
+  local p = naiveGetPosition(object)
+  naiveSetPosition(object, c_position.new(p.x + 1, p.y, p.z))
+end
+)script");
+  sol::protected_function direct = lua.load(R"script(
+local object = ...
+for i = 1, 10000 do
+  local x, y, z = object:getPosition()
+  object:setPosition(x + 1, y, z)
+end
+)script");
+  sol::protected_function byHandle = lua.load(R"script(
+local world, object, other = ...
+local handle = other:getHandle()
+for i = 1, 10000 do
+  local x, y, z = world:getPosition(handle)
+  object:setPosition(x + 1, y, z)
+end
+)script");
+
+  BENCHMARK("10000 updates, naive binding") {
+    return naive(object.get()).valid();
+  };
+  BENCHMARK("10000 updates, zero-copy binding") {
+    return direct(object.get()).valid();
+  };
+  BENCHMARK("10000 updates, reading another object by handle") {
+    return byHandle(world.get(), object.get(), other.get()).valid();
+  };
+}
+
+// Idle scripts either check a condition every round or wait for a signal,
+// which leaves nothing to run until it is raised.
+TEST_CASE("Idle scripts") {
+  const size_t objects = 20000;
+  auto polling = core::Worlds::createNew("polling");
+  auto waiting = core::Worlds::createNew("waiting");
+  for (size_t i = 0; i < objects; i++) {
+    auto id = std::to_string(i);
+    polling->newObject(id);
+    polling->saveScriptToObject(id, "idle", R"script(
+local world, object = ...
+local x = object:getPosition()
+if x < 0 then print('moved') end
+)script");
+    waiting->newObject(id);
+    waiting->saveScriptToObject(id, "idle", R"script(
+waitFor('moved')
+print('moved')
+)script");
+  }
+  waiting->round();
+
+  BENCHMARK(std::to_string(objects) + " polling scripts") {
+    polling->round();
+  };
+  BENCHMARK(std::to_string(objects) + " waiting scripts") {
+    waiting->round();
+  };
+}
@@ -0,0 +1,119 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <filesystem>
+#include <string>
+
+#include "bench.hpp"
+#include "../src/core.hpp"
+
+using std::string;
+namespace fs = std::filesystem;
+
+// One in ten objects carries a script, the rest are plain transforms.
+static shared_ptr<core::IWorld> benchWorld(size_t count) {
+  auto world = core::Worlds::createNew("bench");
+  for (size_t i = 0; i < count; i++) {
+    auto id = "object-" + std::to_string(i);
+    auto object = world->newObject(id);
+    object->setPosition(t::position{1.0 * i, 2, 3});
+    object->setRotation(t::rotation{0, 0, 0, 1});
+    if (i % 10 == 0)
+      world->saveScriptToObject(id, "script", "local x = " + std::to_string(i));
+  }
+  return world;
+}
+
+TEST_CASE("Snapshot vs yaml load and save") {
+  for (size_t count : {1000, 10000, 100000}) {
+    auto suffix = " " + std::to_string(count);
+    auto world = benchWorld(count);
+    world->save("bench_world_yaml");
+    world->saveSnapshot("bench_world.bin");
+
+    BENCHMARK("yaml save" + suffix) {
+      world->save("bench_world_yaml");
+    };
+    BENCHMARK("snapshot save" + suffix) {
+      world->saveSnapshot("bench_world.bin");
+    };
+    BENCHMARK("yaml load" + suffix) {
+      return core::Worlds::load("bench", "bench_world_yaml");
+    };
+    BENCHMARK("snapshot load" + suffix) {
+      return core::Worlds::loadSnapshot("bench", "bench_world.bin");
+    };
+
+    size_t yamlBytes = 0;
+    for (auto const& entry : fs::recursive_directory_iterator("bench_world_yaml"))
+      if (entry.is_regular_file())
+        yamlBytes += entry.file_size();
+    WARN("bytes on disk" + suffix + ": yaml " + std::to_string(yamlBytes)
+      + ", snapshot " + std::to_string(fs::file_size("bench_world.bin")));
+
+    fs::remove_all("bench_world_yaml");
+    fs::remove("bench_world.bin");
+  }
+}
+
+TEST_CASE("Incremental save with few changes") {
+  for (size_t count : {10000, 100000}) {
+    auto suffix = " " + std::to_string(count);
+    auto world = benchWorld(count);
+    world->saveIncremental("bench_world.bin");
+    auto moved = world->getObject("object-0");
+
+    BENCHMARK("snapshot save" + suffix) {
+      world->saveSnapshot("bench_world_full.bin");
+    };
+    BENCHMARK("incremental save, 1 object changed" + suffix) {
+      moved->setPosition(t::position{1, 1, 1});
+      world->saveIncremental("bench_world.bin");
+    };
+
+    fs::remove("bench_world.bin");
+    fs::remove("bench_world.bin.journal");
+    fs::remove("bench_world_full.bin");
+  }
+}
+
+TEST_CASE("Stream vs load time to first round") {
+  for (size_t count : {10000, 100000}) {
+    auto suffix = " " + std::to_string(count);
+    benchWorld(count)->saveSnapshot("bench_world.bin");
+
+    BENCHMARK("load then round" + suffix) {
+      auto world = core::Worlds::loadSnapshot("bench", "bench_world.bin");
+      world->round();
+      return world;
+    };
+    BENCHMARK("stream then round" + suffix) {
+      auto world = core::Worlds::stream("bench", "bench_world.bin");
+      world->round();
+      return world;
+    };
+    core::StreamOptions options;
+    options.background = true;
+    BENCHMARK("background stream then round" + suffix) {
+      auto world = core::Worlds::stream("bench", "bench_world.bin", options);
+      world->round();
+      return world;
+    };
+
+    fs::remove("bench_world.bin");
+  }
+}
@@ -0,0 +1,123 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "../src/core.hpp"
+#include "../src/spatial.hpp"
+
+using std::string;
+using std::vector;
+
+// 100k unit objects over a square kilometer, two hundred meters high.
+TEST_CASE("Spatial index updates and queries") {
+  const size_t count = 100000;
+  std::mt19937 random{3};
+  std::uniform_real_distribution<double> place(0, 1000);
+  std::uniform_real_distribution<double> height(0, 200);
+  std::uniform_real_distribution<double> step(-0.5, 0.5);
+
+  vector<t::position> positions;
+  for (size_t i = 0; i < count; i++)
+    positions.push_back(t::position{place(random), height(random), place(random)});
+  auto bounds = [&](size_t i) { return core::objectBounds(positions[i], t::rotation{0, 0, 0, 1}, t::scale{1, 1, 1}); };
+
+  core::SpatialIndex index;
+  BENCHMARK("build 100k") {
+    core::SpatialIndex built;
+    for (size_t i = 0; i < count; i++)
+      built.set(static_cast<uint32_t>(i), bounds(i));
+    return built.size();
+  };
+  for (size_t i = 0; i < count; i++)
+    index.set(static_cast<uint32_t>(i), bounds(i));
+
+  // Every object moves by up to half a meter per axis each tick.
+  BENCHMARK("move all 100k") {
+    for (size_t i = 0; i < count; i++) {
+      positions[i] = positions[i] + t::double3{step(random), step(random), step(random)};
+      index.set(static_cast<uint32_t>(i), bounds(i));
+    }
+  };
+  BENCHMARK("move all 100k, no index") {
+    double sum = 0;
+    for (size_t i = 0; i < count; i++) {
+      positions[i] = positions[i] + t::double3{step(random), step(random), step(random)};
+      sum += bounds(i).min.x;
+    }
+    return sum;
+  };
+  WARN("height after moves " + std::to_string(index.height()));
+
+  vector<uint32_t> found;
+  vector<core::SpatialIndex::Hit> hits;
+  auto center = [&]() { return t::double3{place(random), height(random), place(random)}; };
+  BENCHMARK("radius 20 query") {
+    found.clear();
+    index.querySphere(center(), 20, &found);
+    return found.size();
+  };
+  BENCHMARK("radius 20 scan") {
+    auto c = center();
+    size_t inside = 0;
+    for (size_t i = 0; i < count; i++)
+      inside += bounds(i).distanceSquared(c) <= 400;
+    return inside;
+  };
+  BENCHMARK("box 40x40x40 query") {
+    auto c = center();
+    found.clear();
+    index.queryBox(core::Aabb{c, c + t::double3{40, 40, 40}}, &found);
+    return found.size();
+  };
+  BENCHMARK("ray 500 query") {
+    hits.clear();
+    index.queryRay(center(), t::double3{0.6, 0, 0.8}, 500, &hits);
+    return hits.size();
+  };
+  BENCHMARK("nearest 16 query") {
+    hits.clear();
+    index.queryNearest(center(), 16, &hits);
+    return hits.size();
+  };
+
+  // Through the world: moves go through the store, the index catches up
+  // on the next query.
+  auto world = core::Worlds::createNew("bench");
+  vector<std::shared_ptr<core::IObject>> objects;
+  for (size_t i = 0; i < count; i++) {
+    objects.push_back(world->newObject("object-" + std::to_string(i)));
+    objects.back()->setPosition(positions[i]);
+  }
+  world->queryRadius(center(), 1);
+  BENCHMARK("world move all 100k and query") {
+    for (auto const& object : objects)
+      object->setPosition(object->getPosition() + t::double3{step(random), step(random), step(random)});
+    return world->queryRadius(center(), 20).size();
+  };
+  BENCHMARK("world move 1% and query") {
+    for (size_t i = 0; i < count; i += 100)
+      objects[i]->setPosition(objects[i]->getPosition() + t::double3{step(random), step(random), step(random)});
+    return world->queryRadius(center(), 20).size();
+  };
+  BENCHMARK("world radius 20 query") {
+    return world->queryRadius(center(), 20).size();
+  };
+}
@@ -0,0 +1,119 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "bench.hpp"
+#include "../src/core.hpp"
+#include "../src/store.hpp"
+
+using std::map;
+using std::string;
+using std::vector;
+using std::shared_ptr;
+using std::make_shared;
+
+// Layout the world used before the object store: one heap node per object
+// inside a red-black tree keyed by id.
+class MapObject {
+ public:
+  t::position position = t::position{0, 0, 0};
+  t::rotation rotation = t::rotation{0, 0, 0, 0};
+  t::scale scale = t::scale{1, 1, 1};
+  map<string, shared_ptr<core::IPlugin>> plugins;
+
+  void runPlugins() {
+    for (auto const& [key, val] : plugins)
+      val->execute(nullptr, nullptr);
+  }
+};
+
+static string objectId(size_t i) {
+  return "object-" + std::to_string(i);
+}
+
+static vector<string> shuffledIds(size_t count) {
+  vector<string> ids;
+  for (size_t i = 0; i < count; i++)
+    ids.push_back(objectId(i));
+  std::shuffle(ids.begin(), ids.end(), std::mt19937(42));
+  return ids;
+}
+
+TEST_CASE("Object store vs map layout") {
+  for (size_t count : {1000, 10000, 100000, 1000000}) {
+    auto suffix = " " + std::to_string(count);
+
+    map<string, shared_ptr<MapObject>> mapObjects;
+    for (size_t i = 0; i < count; i++)
+      mapObjects[objectId(i)] = make_shared<MapObject>();
+
+    core::ObjectStore<int> store;
+    for (size_t i = 0; i < count; i++)
+      store.create(objectId(i), 0);
+
+    auto world = core::Worlds::createNew("bench");
+    for (size_t i = 0; i < count; i++)
+      world->newObject(objectId(i));
+
+    auto lookups = shuffledIds(count);
+
+    BENCHMARK("map round" + suffix) {
+      for (auto const& [key, val] : mapObjects)
+        val->runPlugins();
+    };
+    BENCHMARK("world round" + suffix) {
+      world->round();
+    };
+
+    BENCHMARK("map transform pass" + suffix) {
+      double sum = 0;
+      for (auto const& [key, val] : mapObjects)
+        sum += val->position.x + val->rotation.w + val->scale.z;
+      return sum;
+    };
+    BENCHMARK("store transform pass" + suffix) {
+      double sum = 0;
+      for (size_t i = 0; i < store.size(); i++)
+        sum += store.positions[i].x + store.rotations[i].w + store.scales[i].z;
+      return sum;
+    };
+
+    BENCHMARK("map lookup" + suffix) {
+      size_t found = 0;
+      for (auto const& id : lookups)
+        found += mapObjects.count(id);
+      return found;
+    };
+    BENCHMARK("store lookup" + suffix) {
+      size_t found = 0;
+      for (auto const& id : lookups)
+        found += store.find(id).valid();
+      return found;
+    };
+    BENCHMARK("world lookup" + suffix) {
+      size_t found = 0;
+      for (auto const& id : lookups)
+        found += world->getObject(id) != nullptr;
+      return found;
+    };
+  }
+}
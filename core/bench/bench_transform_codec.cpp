@@ -0,0 +1,102 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <cmath>
+#include <string>
+
+#include "bench.hpp"
+#include "../src/transform_codec.hpp"
+
+using std::string;
+
+// Most of a scene stands still: one object in ten walks, one in fifty
+// also turns, the rest never moves.
+struct Scene {
+  explicit Scene(size_t count) {
+    for (uint32_t id = 0; id < count; id++) {
+      t::transform<double> transform;
+      transform.position = t::double3{id * 0.5, 0, id * 0.25};
+      states.push_back({id, transform});
+    }
+  }
+
+  void tick() {
+    frame++;
+    for (size_t i = 0; i < states.size(); i += 10) {
+      states[i].transform.position.x += 0.011;
+      states[i].transform.position.z += 0.007 * std::sin(frame * 0.1);
+    }
+    for (size_t i = 0; i < states.size(); i += 50)
+      states[i].transform.rotation = t::normalize(t::quatd{0, std::sin(frame * 0.01), 0, std::cos(frame * 0.01)});
+  }
+
+  uint32_t frame = 0;
+  vector<core::TransformState> states;
+};
+
+TEST_CASE("Transform codec bytes and throughput") {
+  const size_t count = 10000;
+  // Position, rotation and scale as doubles, plus the id.
+  const double raw = 10 * sizeof(double) + sizeof(uint32_t);
+
+  // Receiver acknowledging each frame after latency ticks.
+  for (uint32_t latency : {1, 5}) {
+    Scene scene(count);
+    core::TransformEncoder encoder;
+    core::TransformDecoder decoder;
+    size_t bytes = 0;
+    const int ticks = 200;
+    vector<string> inFlight;
+    for (int tick = 0; tick < ticks; tick++) {
+      scene.tick();
+      auto packet = encoder.encode(scene.frame, scene.states);
+      decoder.decode(packet);
+      if (tick > 0)
+        bytes += packet.size();
+      if (scene.frame > latency)
+        encoder.acknowledge(scene.frame - latency);
+    }
+    WARN("ack after " + std::to_string(latency) + " ticks: "
+      + std::to_string(static_cast<double>(bytes) / (ticks - 1) / count) + " bytes per object per tick, raw doubles "
+      + std::to_string(raw));
+  }
+
+  Scene scene(count);
+  core::TransformEncoder encoder;
+  core::TransformDecoder decoder;
+  auto full = encoder.encode(++scene.frame, scene.states);
+  WARN("complete frame: " + std::to_string(static_cast<double>(full.size()) / count) + " bytes per object");
+  decoder.decode(full);
+  encoder.acknowledge(scene.frame);
+
+  BENCHMARK("encode complete frame 10000 objects") {
+    return core::TransformEncoder().encode(1, scene.states);
+  };
+  BENCHMARK("decode complete frame 10000 objects") {
+    return core::TransformDecoder().decode(full);
+  };
+  scene.tick();
+  auto delta = encoder.encode(scene.frame, scene.states);
+  BENCHMARK("encode delta frame 10000 objects") {
+    core::TransformEncoder deltaEncoder = encoder;
+    return deltaEncoder.encode(scene.frame + 1, scene.states);
+  };
+  BENCHMARK("decode delta frame 10000 objects") {
+    core::TransformDecoder deltaDecoder = decoder;
+    return deltaDecoder.decode(delta);
+  };
+}
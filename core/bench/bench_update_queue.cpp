@@ -0,0 +1,110 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "bench.hpp"
+#include "../src/core.hpp"
+#include "../src/update_queue.hpp"
+
+using core::UpdateQueue;
+using core::UpdateCommand;
+using core::ObjectHandle;
+namespace command = core::command;
+
+static std::atomic<size_t> allocations = 0;
+
+void* operator new(size_t size) {
+  allocations++;
+  if (void* memory = std::malloc(size))
+    return memory;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept { std::free(memory); }
+void operator delete(void* memory, size_t) noexcept { std::free(memory); }
+
+const size_t BENCH_commands = 1000000;
+
+TEST_CASE("Update queue throughput") {
+  UpdateQueue queue(BENCH_commands);
+
+  BENCHMARK("enqueue + drain 1M transforms, 1 producer") {
+    for (size_t i = 0; i < BENCH_commands; i++)
+      queue.enqueue(command::SetPosition{ObjectHandle{0, 0}, t::position{1, 2, 3}});
+    return queue.drain([](UpdateCommand& c) {});
+  };
+
+  for (size_t producers : {2, 4}) {
+    BENCHMARK("enqueue + drain 1M transforms, " + std::to_string(producers) + " producers") {
+      vector<std::thread> threads;
+      for (size_t p = 0; p < producers; p++) {
+        threads.emplace_back([&]() {
+          for (size_t i = 0; i < BENCH_commands / producers; i++)
+            queue.enqueue(command::SetPosition{ObjectHandle{0, 0}, t::position{1, 2, 3}});
+        });
+      }
+      size_t drained = 0;
+      while (drained < BENCH_commands)
+        drained += queue.drain([](UpdateCommand& c) {});
+      for (auto& thread : threads)
+        thread.join();
+      return drained;
+    };
+  }
+}
+
+TEST_CASE("Update queue steady state does not allocate") {
+  UpdateQueue queue(1 << 16);
+  auto round = [&]() {
+    for (size_t i = 0; i < 50000; i++)
+      queue.enqueue(command::SetRotation{ObjectHandle{0, 0}, t::rotation{0, 0, 0, 1}});
+    queue.drain([](UpdateCommand& c) {});
+  };
+  round();
+
+  auto before = allocations.load();
+  for (int i = 0; i < 10; i++)
+    round();
+  REQUIRE(allocations.load() == before);
+}
+
+TEST_CASE("World round with transform commands does not allocate") {
+  auto world = core::Worlds::createNew("bench");
+  vector<ObjectHandle> handles;
+  for (size_t i = 0; i < 10000; i++)
+    handles.push_back(world->newObject(std::to_string(i))->getHandle());
+  auto round = [&]() {
+    for (auto handle : handles)
+      world->enqueue(command::SetPosition{handle, t::position{1, 2, 3}});
+    world->round();
+  };
+  round();
+
+  auto before = allocations.load();
+  for (int i = 0; i < 10; i++)
+    round();
+  REQUIRE(allocations.load() == before);
+
+  BENCHMARK("round applying 10k transform commands") {
+    round();
+  };
+}
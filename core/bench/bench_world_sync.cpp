@@ -0,0 +1,81 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "bench.hpp"
+#include "../src/core.hpp"
+#include "../src/replication.hpp"
+#include "../src/scripting.hpp"
+#include "../src/world_sync.hpp"
+
+using std::string;
+using std::shared_ptr;
+
+// Objects with a transform, every tenth one with a small script.
+static shared_ptr<core::IWorld> makeWorld(size_t count) {
+  auto world = core::Worlds::createNew("server");
+  for (size_t i = 0; i < count; i++) {
+    auto id = "object-" + std::to_string(i);
+    world->newObject(id)->setPosition(t::position{1.0 * i, 0, 0});
+    if (i % 10 == 0)
+      world->savePluginToObject(id, core::Scripts::asDeferredPlugin("script", "local world, object = ...\n"
+        "object:setPosition(object:getPosition())\n"));
+  }
+  return world;
+}
+
+// Whole join, from the first datagram to the last object loaded.
+static size_t join(shared_ptr<core::IWorld> source, shared_ptr<core::Transport> serverTransport,
+    shared_ptr<core::Transport> clientTransport, bool wait) {
+  auto joiner = core::Worlds::createNew("joiner");
+  core::WorldSyncServer server(source, serverTransport);
+  core::WorldSyncClient client(joiner, clientTransport, serverTransport->getAddress());
+  while (!client.done()) {
+    client.poll();
+    server.poll();
+    if (wait)
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+  }
+  return joiner->objectCount();
+}
+
+TEST_CASE("World sync join time") {
+  for (size_t count : {1000, 10000, 100000}) {
+    auto suffix = " " + std::to_string(count) + " objects";
+    auto source = makeWorld(count);
+    core::MemoryNetwork network;
+    auto serverTransport = network.open("server");
+    auto clientTransport = network.open("client");
+    BENCHMARK("in process join" + suffix) {
+      return join(source, serverTransport, clientTransport, false);
+    };
+  }
+
+  for (size_t count : {1000, 10000}) {
+    auto suffix = " " + std::to_string(count) + " objects";
+    auto source = makeWorld(count);
+    auto serverTransport = std::make_shared<core::UdpTransport>("127.0.0.1:0");
+    auto clientTransport = std::make_shared<core::UdpTransport>("127.0.0.1:0");
+    BENCHMARK("udp loopback join" + suffix) {
+      return join(source, serverTransport, clientTransport, true);
+    };
+  }
+}
@@ -0,0 +1,151 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "../src/core.hpp"
+#include "../src/tick.hpp"
+
+using std::string;
+using std::vector;
+
+// Runs a world without the desktop client:
+//   server <world directory or snapshot> [options]
+//     --rate <rounds per second>     30
+//     --budget <milliseconds>        the whole tick
+//     --workers <threads>            1
+//     --low <plugin id>              plugin that may be spread, repeatable
+//     --stats <seconds>              10, 0 disables
+//     --save <snapshot file>         saved incrementally on exit
+//     --save-every <seconds>         60 when saving
+//     --reload                       reload scripts changed on disk
+
+static core::TickScheduler* running = nullptr;
+
+static void onSignal(int) {
+  if (running != nullptr)
+    running->stop();
+}
+
+static void usage() {
+  printf("usage: server <world directory or snapshot> [--rate hz] [--budget ms] [--workers n]\n"
+         "              [--low plugin]... [--stats seconds] [--save file] [--save-every seconds]\n"
+         "              [--reload]\n");
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+  string path = argv[1];
+  core::TickOptions options;
+  size_t workers = 1;
+  vector<string> lowPriority;
+  double statsEvery = 10;
+  string saveFile;
+  double saveEvery = 60;
+  bool reload = false;
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--reload") {
+      reload = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    string value = argv[++i];
+    if (option == "--rate")
+      options.rate = std::atof(value.c_str());
+    else if (option == "--budget")
+      options.budget = std::atof(value.c_str()) / 1000;
+    else if (option == "--workers")
+      workers = std::strtoul(value.c_str(), nullptr, 10);
+    else if (option == "--low")
+      lowPriority.push_back(value);
+    else if (option == "--stats")
+      statsEvery = std::atof(value.c_str());
+    else if (option == "--save")
+      saveFile = value;
+    else if (option == "--save-every")
+      saveEvery = std::atof(value.c_str());
+    else {
+      usage();
+      return 1;
+    }
+  }
+
+  try {
+    auto world = core::Worlds::stream("server", path);
+    world->setWorkers(workers);
+    for (auto const& pluginId : lowPriority)
+      world->setLowPriority(pluginId, true);
+    if (!saveFile.empty())
+      printf("Saving to %s\n", saveFile.c_str());
+    if (reload && std::filesystem::is_directory(path)) {
+      world->watchScripts(path);
+      printf("Reloading scripts changed in %s\n", path.c_str());
+    } else if (reload) {
+      printf("Scripts only reload for world directories, not snapshots\n");
+    }
+
+    core::TickScheduler ticks(world, options);
+    auto lastStats = core::TickScheduler::steadySeconds();
+    auto lastSave = lastStats;
+    ticks.setRoundListener([&](const core::TickStats& stats) {
+      auto now = core::TickScheduler::steadySeconds();
+      if (statsEvery > 0 && now - lastStats >= statsEvery) {
+        lastStats = now;
+        auto progress = world->getLoadProgress();
+        printf("%zu objects%s, %llu rounds, round %.2f/%.2f ms mean/max, jitter %.2f/%.2f ms, "
+               "%llu overruns, %llu dropped, spread %zu\n",
+               world->objectCount(), progress.done ? "" : " (loading)",
+               static_cast<unsigned long long>(stats.rounds), stats.meanRound * 1000, stats.maxRound * 1000,
+               stats.meanJitter * 1000, stats.maxJitter * 1000,
+               static_cast<unsigned long long>(stats.overruns), static_cast<unsigned long long>(stats.dropped),
+               stats.spread);
+      }
+      if (!saveFile.empty() && saveEvery > 0 && now - lastSave >= saveEvery) {
+        lastSave = now;
+        world->saveIncremental(saveFile);
+      }
+    });
+
+    running = &ticks;
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+    printf("Running %s at %.1f rounds per second\n", path.c_str(), options.rate);
+    ticks.run();
+    running = nullptr;
+
+    if (!saveFile.empty())
+      world->saveIncremental(saveFile);
+    printf("Stopped after %llu rounds\n", static_cast<unsigned long long>(ticks.getStats().rounds));
+  } catch (const std::exception& e) {
+    printf("%s\n", e.what());
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,253 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "assets.hpp"
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+
+using std::runtime_error;
+namespace fs = std::filesystem;
+
+namespace core {
+
+// SHA-256, FIPS 180-4.
+
+static constexpr uint32_t ROUND_CONSTANTS[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t rotateRight(uint32_t value, int bits) { return (value >> bits) | (value << (32 - bits)); }
+
+static void compressBlock(std::array<uint32_t, 8>* state, const uint8_t* block) {
+  uint32_t w[64];
+  for (int i = 0; i < 16; i++)
+    w[i] = (uint32_t(block[i * 4]) << 24) | (uint32_t(block[i * 4 + 1]) << 16)
+      | (uint32_t(block[i * 4 + 2]) << 8) | uint32_t(block[i * 4 + 3]);
+  for (int i = 16; i < 64; i++) {
+    auto s0 = rotateRight(w[i - 15], 7) ^ rotateRight(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    auto s1 = rotateRight(w[i - 2], 17) ^ rotateRight(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+  auto [a, b, c, d, e, f, g, h] = *state;
+  for (int i = 0; i < 64; i++) {
+    auto s1 = rotateRight(e, 6) ^ rotateRight(e, 11) ^ rotateRight(e, 25);
+    auto choice = (e & f) ^ (~e & g);
+    auto t1 = h + s1 + choice + ROUND_CONSTANTS[i] + w[i];
+    auto s0 = rotateRight(a, 2) ^ rotateRight(a, 13) ^ rotateRight(a, 22);
+    auto majority = (a & b) ^ (a & c) ^ (b & c);
+    auto t2 = s0 + majority;
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  uint32_t result[8] = {a, b, c, d, e, f, g, h};
+  for (int i = 0; i < 8; i++)
+    (*state)[i] += result[i];
+}
+
+string Assets::hash(string_view content) {
+  std::array<uint32_t, 8> state = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  auto data = reinterpret_cast<const uint8_t*>(content.data());
+  size_t full = content.size() / 64 * 64;
+  for (size_t i = 0; i < full; i += 64)
+    compressBlock(&state, data + i);
+
+  // Padding: a one bit, zeros, then the length in bits, big endian.
+  uint8_t tail[128] = {};
+  auto rest = content.size() - full;
+  std::memcpy(tail, data + full, rest);
+  tail[rest] = 0x80;
+  size_t tailSize = rest < 56 ? 64 : 128;
+  uint64_t bits = static_cast<uint64_t>(content.size()) * 8;
+  for (int i = 0; i < 8; i++)
+    tail[tailSize - 1 - i] = static_cast<uint8_t>(bits >> (i * 8));
+  for (size_t i = 0; i < tailSize; i += 64)
+    compressBlock(&state, tail + i);
+
+  static constexpr char DIGITS[] = "0123456789abcdef";
+  string result;
+  result.reserve(64);
+  for (auto word : state) {
+    for (int shift = 28; shift >= 0; shift -= 4)
+      result.push_back(DIGITS[(word >> shift) & 0xf]);
+  }
+  return result;
+}
+
+// Shared blobs
+
+namespace {
+
+// Keys view the blob they map to. The deleter of a blob drops its entry,
+// unless the content was shared again in between.
+struct SharedBlobs {
+  std::mutex lock;
+  std::unordered_map<string_view, std::weak_ptr<const string>> blobs;
+};
+
+SharedBlobs& sharedBlobs() {
+  static auto shared = new SharedBlobs();
+  return *shared;
+}
+
+}  // namespace
+
+shared_ptr<const string> Assets::share(string_view content) {
+  auto& shared = sharedBlobs();
+  std::lock_guard<std::mutex> guard(shared.lock);
+  auto found = shared.blobs.find(content);
+  if (found != shared.blobs.end()) {
+    auto blob = found->second.lock();
+    if (blob != nullptr)
+      return blob;
+    shared.blobs.erase(found);
+  }
+  shared_ptr<const string> blob(new string(content), [](const string* released) {
+    auto& shared = sharedBlobs();
+    {
+      std::lock_guard<std::mutex> guard(shared.lock);
+      auto found = shared.blobs.find(*released);
+      if (found != shared.blobs.end() && found->first.data() == released->data())
+        shared.blobs.erase(found);
+    }
+    delete released;
+  });
+  shared.blobs.emplace(*blob, blob);
+  return blob;
+}
+
+size_t Assets::sharedCount() {
+  auto& shared = sharedBlobs();
+  std::lock_guard<std::mutex> guard(shared.lock);
+  return shared.blobs.size();
+}
+
+// Store
+
+AssetStore::AssetStore(const string& directory) : directory{directory} {
+  std::error_code error;
+  for (auto const& entry : fs::directory_iterator(directory, error)) {
+    auto name = entry.path().filename().string();
+    // Anything but a hash, like a blob left half written, is not a blob.
+    if (entry.is_regular_file(error) && name.size() == 64 && name.find_first_not_of("0123456789abcdef") == string::npos)
+      stored.insert(name);
+  }
+}
+
+// Written aside then renamed, so that a crash never leaves a partial blob
+// under a valid name.
+string AssetStore::put(string_view content) {
+  auto name = Assets::hash(content);
+  if (stored.contains(name))
+    return name;
+  fs::create_directories(directory);
+  auto file = directory + "/" + name;
+  {
+    std::ofstream out(file + ".writing", std::ios::binary);
+    out.write(content.data(), content.size());
+    if (!out)
+      throw runtime_error("cannot write asset " + file);
+  }
+  fs::rename(file + ".writing", file);
+  stored.insert(name);
+  loaded[name] = Assets::share(content);
+  return name;
+}
+
+bool AssetStore::has(const string& hash) {
+  return stored.contains(hash);
+}
+
+shared_ptr<const string> AssetStore::get(const string& hash) {
+  auto found = loaded.find(hash);
+  if (found != loaded.end())
+    return found->second;
+  std::ifstream in(directory + "/" + hash, std::ios::binary);
+  if (!in)
+    throw runtime_error("missing asset " + hash);
+  std::stringstream buffer;
+  buffer << in.rdbuf();
+  auto content = buffer.str();
+  if (Assets::hash(content) != hash)
+    throw runtime_error("corrupt asset " + hash);
+  auto blob = Assets::share(content);
+  loaded[hash] = blob;
+  return blob;
+}
+
+vector<string> AssetStore::missing(const vector<string>& hashes) {
+  vector<string> result;
+  for (auto const& hash : hashes) {
+    if (!stored.contains(hash))
+      result.push_back(hash);
+  }
+  return result;
+}
+
+vector<string> AssetStore::list() const {
+  return vector<string>(stored.begin(), stored.end());
+}
+
+size_t AssetStore::prune(const std::unordered_set<string>& keep) {
+  size_t removed = 0;
+  for (auto it = stored.begin(); it != stored.end();) {
+    if (keep.contains(*it)) {
+      ++it;
+      continue;
+    }
+    fs::remove(directory + "/" + *it);
+    loaded.erase(*it);
+    it = stored.erase(it);
+    removed++;
+  }
+  return removed;
+}
+
+size_t AssetStore::prune(const std::unordered_set<string>& candidates, const std::unordered_set<string>& keep) {
+  size_t removed = 0;
+  for (auto const& hash : candidates) {
+    if (keep.contains(hash) || !stored.contains(hash))
+      continue;
+    fs::remove(directory + "/" + hash);
+    loaded.erase(hash);
+    stored.erase(hash);
+    removed++;
+  }
+  return removed;
+}
+
+}  // namespace core
@@ -0,0 +1,81 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORE_SRC_ASSETS_HPP_
+#define CORE_SRC_ASSETS_HPP_
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using std::shared_ptr;
+using std::string;
+using std::string_view;
+using std::vector;
+
+namespace core {
+
+// Blobs of a world (script sources, later any asset) named by their
+// content: the SHA-256 of the bytes, in lowercase hex.
+class Assets {
+ public:
+  static string hash(string_view content);
+  // The in memory copy of content shared by everything holding the same
+  // bytes, across objects and worlds, for as long as one holds it.
+  static shared_ptr<const string> share(string_view content);
+  // Distinct blobs currently shared.
+  static size_t sharedCount();
+};
+
+// Content addressed store in a directory, one file per blob named by its
+// hash, so identical blobs are stored once however many objects use them.
+// Files are never changed once written. Blobs read are checked against
+// their name and shared through Assets::share. Not thread safe.
+class AssetStore {
+ public:
+  explicit AssetStore(const string& directory);
+
+  // Writes the blob unless the store has it already, returns its hash.
+  string put(string_view content);
+  bool has(const string& hash);
+  // Throws std::runtime_error when the blob is missing or corrupt.
+  shared_ptr<const string> get(const string& hash);
+  // The hashes the store lacks, the ones to fetch from a peer.
+  vector<string> missing(const vector<string>& hashes);
+  vector<string> list() const;
+  // Deletes the blobs not in keep, returns how many.
+  size_t prune(const std::unordered_set<string>& keep);
+  // The same limited to the blobs in candidates, so that blobs the caller
+  // never wrote stay whatever they are.
+  size_t prune(const std::unordered_set<string>& candidates, const std::unordered_set<string>& keep);
+
+  const string& getDirectory() const { return directory; }
+
+ private:
+  string directory;
+  // Blobs on disk, and the ones read or written through this store.
+  std::unordered_set<string> stored;
+  std::unordered_map<string, shared_ptr<const string>> loaded;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_ASSETS_HPP_
@@ -0,0 +1,101 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "bytecode_cache.hpp"
+
+#include "journal.hpp"
+
+using std::lock_guard;
+using std::mutex;
+
+namespace core {
+
+uint64_t BytecodeCache::hash(const string& source) {
+  return Journals::checksum(source);
+}
+
+shared_ptr<const string> BytecodeCache::find(const string& source) {
+  auto key = hash(source);
+  lock_guard<mutex> guard(lock);
+  auto found = entries.find(key);
+  if (found != entries.end() && found->second.source == source) {
+    used.splice(used.begin(), used, found->second.used);
+    hits++;
+    return found->second.bytecode;
+  }
+  misses++;
+  return nullptr;
+}
+
+void BytecodeCache::store(const string& source, const string& bytecode) {
+  auto key = hash(source);
+  lock_guard<mutex> guard(lock);
+  insert(key, source, std::make_shared<const string>(bytecode));
+}
+
+void BytecodeCache::insert(uint64_t key, const string& source, shared_ptr<const string> bytecode) {
+  auto found = entries.find(key);
+  if (found != entries.end())
+    erase(found);
+  used.push_front(key);
+  entries.emplace(key, Entry{source, bytecode, used.begin()});
+  bytes += source.size() + bytecode->size();
+  evict();
+}
+
+// The entry just used stays even when larger than the limit on its own.
+void BytecodeCache::evict() {
+  while (bytes > maxBytes && used.size() > 1) {
+    erase(entries.find(used.back()));
+    evictions++;
+  }
+}
+
+void BytecodeCache::erase(unordered_map<uint64_t, Entry>::iterator entry) {
+  bytes -= entry->second.source.size() + entry->second.bytecode->size();
+  used.erase(entry->second.used);
+  entries.erase(entry);
+}
+
+void BytecodeCache::setMaxBytes(size_t maxBytes) {
+  lock_guard<mutex> guard(lock);
+  this->maxBytes = maxBytes;
+  evict();
+}
+
+void BytecodeCache::clear() {
+  lock_guard<mutex> guard(lock);
+  entries.clear();
+  used.clear();
+  bytes = 0;
+  evictions = 0;
+  hits = 0;
+  misses = 0;
+}
+
+BytecodeCacheStats BytecodeCache::stats() {
+  lock_guard<mutex> guard(lock);
+  BytecodeCacheStats result;
+  result.hits = hits;
+  result.misses = misses;
+  result.entries = entries.size();
+  result.bytes = bytes;
+  result.evictions = evictions;
+  return result;
+}
+
+}  // namespace core
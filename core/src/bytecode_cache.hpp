@@ -0,0 +1,89 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_BYTECODE_CACHE_HPP_
+#define CORE_SRC_BYTECODE_CACHE_HPP_
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+using std::string;
+using std::shared_ptr;
+using std::unordered_map;
+
+namespace core {
+
+struct BytecodeCacheStats {
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t entries = 0;
+  // Source and bytecode held in memory, and the entries dropped to stay
+  // within the limit.
+  size_t bytes = 0;
+  size_t evictions = 0;
+};
+
+// Compiled chunks keyed by the content of their source, shared by every
+// lua state. Entries keep the source they were built from so that a hash
+// collision can never hand out the wrong bytecode. Lua loads bytecode
+// without verification, so the cache only ever holds chunks this process
+// dumped itself and stays in memory. The least recently used entries go
+// past maxBytes.
+class BytecodeCache {
+ public:
+  static constexpr size_t DEFAULT_MAX_BYTES = 64 << 20;
+
+  // Returns nullptr on a miss.
+  shared_ptr<const string> find(const string& source);
+  void store(const string& source, const string& bytecode);
+
+  void setMaxBytes(size_t maxBytes);
+  void clear();
+  BytecodeCacheStats stats();
+
+  static uint64_t hash(const string& source);
+
+ private:
+  struct Entry {
+    string source;
+    shared_ptr<const string> bytecode;
+    std::list<uint64_t>::iterator used;
+  };
+
+  // With the lock held.
+  void insert(uint64_t key, const string& source, shared_ptr<const string> bytecode);
+  void evict();
+  void erase(unordered_map<uint64_t, Entry>::iterator entry);
+
+  std::mutex lock;
+  unordered_map<uint64_t, Entry> entries;
+  // Most recently used first.
+  std::list<uint64_t> used;
+  size_t bytes = 0;
+  size_t maxBytes = DEFAULT_MAX_BYTES;
+  size_t evictions = 0;
+  size_t hits = 0;
+  size_t misses = 0;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_BYTECODE_CACHE_HPP_
@@ -0,0 +1,607 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "collision.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+using std::ofstream;
+
+namespace core {
+
+Shape Shape::sphere(double radius) {
+  Shape shape;
+  shape.kind = SPHERE;
+  shape.radius = radius;
+  return shape;
+}
+
+Shape Shape::box(const t::double3& halfExtents) {
+  Shape shape;
+  shape.kind = BOX;
+  shape.halfExtents = halfExtents;
+  return shape;
+}
+
+// Vertices left over after the last whole triangle are dropped.
+Shape Shape::mesh(vector<t::double3> triangles) {
+  Shape shape;
+  shape.kind = MESH;
+  triangles.resize(triangles.size() / 3 * 3);
+  shape.triangles = std::make_shared<const vector<t::double3>>(std::move(triangles));
+  return shape;
+}
+
+// Blob layout, in native byte order like the transforms of snapshots: the
+// kind as a byte, the radius and half extents as doubles, then the vertex
+// count as 64 bits followed by three doubles per vertex.
+static constexpr size_t BLOB_HEADER = 1 + 4 * sizeof(double) + sizeof(uint64_t);
+
+class ColliderPlugin : public IPlugin {
+ public:
+  ColliderPlugin(const string& id, const Shape& shape) : id{id}, shape{shape} {}
+
+  const string& getId() { return id; }
+  Type getType() { return COLLIDER; }
+
+  void saveToFile(const string& path) {
+    ofstream out(path, std::ios::binary);
+    saveTo(out);
+    out.close();
+  }
+
+  void saveTo(std::ostream& out) {
+    out.put(static_cast<char>(shape.kind));
+    double fields[4] = {shape.radius, shape.halfExtents.x, shape.halfExtents.y, shape.halfExtents.z};
+    out.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+    uint64_t vertices = shape.triangles != nullptr ? shape.triangles->size() : 0;
+    out.write(reinterpret_cast<const char*>(&vertices), sizeof(vertices));
+    if (vertices > 0)
+      out.write(reinterpret_cast<const char*>(shape.triangles->data()), vertices * sizeof(t::double3));
+  }
+
+  // The world tests colliders itself and never runs them.
+  bool execute(IWorld* world, IObject* object) { return true; }
+
+  string id;
+  Shape shape;
+};
+
+shared_ptr<IPlugin> Collisions::asPlugin(const string& id, const Shape& shape) {
+  return std::make_shared<ColliderPlugin>(id, shape);
+}
+
+shared_ptr<IPlugin> Collisions::asPlugin(const string& id, const string& data) {
+  auto malformed = [&id]() { return std::runtime_error("Malformed shape of collider plugin " + id); };
+  if (data.size() < BLOB_HEADER || static_cast<uint8_t>(data[0]) > Shape::MESH)
+    throw malformed();
+  Shape shape;
+  shape.kind = static_cast<Shape::Kind>(data[0]);
+  double fields[4];
+  std::memcpy(fields, &data[1], sizeof(fields));
+  shape.radius = fields[0];
+  shape.halfExtents = t::double3{fields[1], fields[2], fields[3]};
+  uint64_t vertices;
+  std::memcpy(&vertices, &data[1 + sizeof(fields)], sizeof(vertices));
+  if (vertices > (data.size() - BLOB_HEADER) / sizeof(t::double3)
+      || data.size() != BLOB_HEADER + vertices * sizeof(t::double3))
+    throw malformed();
+  if (shape.kind == Shape::MESH) {
+    vector<t::double3> triangles(vertices);
+    std::memcpy(triangles.data(), &data[BLOB_HEADER], vertices * sizeof(t::double3));
+    shape.triangles = std::make_shared<const vector<t::double3>>(std::move(triangles));
+  }
+  return asPlugin(id, shape);
+}
+
+Shape Collisions::getShape(const shared_ptr<IPlugin>& plugin) {
+  if (plugin == nullptr || plugin->getType() != IPlugin::COLLIDER)
+    return Shape{};
+  return static_cast<ColliderPlugin*>(plugin.get())->shape;
+}
+
+// Narrowphase. Normals point from the first shape towards the second.
+
+namespace {
+
+struct Box {
+  t::double3 center;
+  t::double3 axes[3];
+  double half[3];
+};
+
+double component(const t::double3& v, int axis) {
+  return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+
+t::double3 normalized(const t::double3& v) {
+  auto length = t::length(v);
+  return length > 0 ? v * (1 / length) : v;
+}
+
+Box boxOf(const Shape& shape, const t::transform<double>& transform) {
+  Box box;
+  box.center = transform.position;
+  box.axes[0] = t::rotate(transform.rotation, t::double3{1, 0, 0});
+  box.axes[1] = t::rotate(transform.rotation, t::double3{0, 1, 0});
+  box.axes[2] = t::rotate(transform.rotation, t::double3{0, 0, 1});
+  box.half[0] = shape.halfExtents.x * std::abs(transform.scale.x);
+  box.half[1] = shape.halfExtents.y * std::abs(transform.scale.y);
+  box.half[2] = shape.halfExtents.z * std::abs(transform.scale.z);
+  return box;
+}
+
+double radiusOf(const Shape& shape, const t::transform<double>& transform) {
+  auto const& s = transform.scale;
+  return shape.radius * std::max({std::abs(s.x), std::abs(s.y), std::abs(s.z)});
+}
+
+// Half of the box's extent along the unit axis.
+double projectedRadius(const Box& box, const t::double3& axis) {
+  return box.half[0] * std::abs(t::dot(box.axes[0], axis)) + box.half[1] * std::abs(t::dot(box.axes[1], axis))
+    + box.half[2] * std::abs(t::dot(box.axes[2], axis));
+}
+
+bool insideBox(const Box& box, const t::double3& point) {
+  auto d = point - box.center;
+  for (int k = 0; k < 3; k++) {
+    if (std::abs(t::dot(d, box.axes[k])) > box.half[k] + 1e-9)
+      return false;
+  }
+  return true;
+}
+
+Aabb triangleBounds(const t::double3* v) {
+  return Aabb{
+    t::double3{std::min({v[0].x, v[1].x, v[2].x}), std::min({v[0].y, v[1].y, v[2].y}), std::min({v[0].z, v[1].z, v[2].z})},
+    t::double3{std::max({v[0].x, v[1].x, v[2].x}), std::max({v[0].y, v[1].y, v[2].y}), std::max({v[0].z, v[1].z, v[2].z})}
+  };
+}
+
+// Real-Time Collision Detection, 5.1.5: by the Voronoi region of p.
+t::double3 closestOnTriangle(const t::double3& p, const t::double3& a, const t::double3& b, const t::double3& c) {
+  auto ab = b - a;
+  auto ac = c - a;
+  auto ap = p - a;
+  auto d1 = t::dot(ab, ap);
+  auto d2 = t::dot(ac, ap);
+  if (d1 <= 0 && d2 <= 0)
+    return a;
+  auto bp = p - b;
+  auto d3 = t::dot(ab, bp);
+  auto d4 = t::dot(ac, bp);
+  if (d3 >= 0 && d4 <= d3)
+    return b;
+  auto vc = d1 * d4 - d3 * d2;
+  if (vc <= 0 && d1 >= 0 && d3 <= 0)
+    return a + ab * (d1 / (d1 - d3));
+  auto cp = p - c;
+  auto d5 = t::dot(ab, cp);
+  auto d6 = t::dot(ac, cp);
+  if (d6 >= 0 && d5 <= d6)
+    return c;
+  auto vb = d5 * d2 - d1 * d6;
+  if (vb <= 0 && d2 >= 0 && d6 <= 0)
+    return a + ac * (d2 / (d2 - d6));
+  auto va = d3 * d6 - d5 * d4;
+  if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0)
+    return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+  auto denominator = 1 / (va + vb + vc);
+  return a + ab * (vb * denominator) + ac * (vc * denominator);
+}
+
+bool sphereSphere(const t::double3& a, double ra, const t::double3& b, double rb, Contact* contact) {
+  auto d = b - a;
+  auto reach = ra + rb;
+  auto squared = t::dot(d, d);
+  if (squared > reach * reach)
+    return false;
+  auto distance = std::sqrt(squared);
+  contact->normal = distance > 0 ? d * (1 / distance) : t::double3{0, 1, 0};
+  contact->depth = reach - distance;
+  contact->point = a + contact->normal * (ra - contact->depth / 2);
+  return true;
+}
+
+// A center inside the box leaves through the nearest face.
+bool sphereBox(const t::double3& center, double radius, const Box& box, Contact* contact) {
+  auto d = center - box.center;
+  double local[3];
+  double clamped[3];
+  auto inside = true;
+  for (int k = 0; k < 3; k++) {
+    local[k] = t::dot(d, box.axes[k]);
+    clamped[k] = std::clamp(local[k], -box.half[k], box.half[k]);
+    inside = inside && clamped[k] == local[k];
+  }
+  if (!inside) {
+    auto closest = box.center + box.axes[0] * clamped[0] + box.axes[1] * clamped[1] + box.axes[2] * clamped[2];
+    auto delta = closest - center;
+    auto squared = t::dot(delta, delta);
+    if (squared > radius * radius)
+      return false;
+    auto distance = std::sqrt(squared);
+    contact->normal = delta * (1 / distance);
+    contact->depth = radius - distance;
+    contact->point = closest;
+    return true;
+  }
+  auto face = 0;
+  for (int k = 1; k < 3; k++) {
+    if (box.half[k] - std::abs(local[k]) < box.half[face] - std::abs(local[face]))
+      face = k;
+  }
+  auto toFace = box.half[face] - std::abs(local[face]);
+  auto outward = box.axes[face] * (local[face] < 0 ? -1.0 : 1.0);
+  contact->normal = outward * -1;
+  contact->depth = radius + toFace;
+  contact->point = center + outward * toFace;
+  return true;
+}
+
+// Separating axes: the faces of both boxes and the cross products of their
+// edges. The contact point is the average of the corners inside the other
+// box, or between the deepest points for edges crossing.
+bool boxBox(const Box& a, const Box& b, Contact* contact) {
+  auto between = b.center - a.center;
+  auto depth = std::numeric_limits<double>::max();
+  t::double3 normal;
+  auto separated = [&](t::double3 axis) {
+    auto squared = t::dot(axis, axis);
+    if (squared < 1e-12)
+      return false;
+    axis = axis * (1 / std::sqrt(squared));
+    auto distance = t::dot(between, axis);
+    auto overlap = projectedRadius(a, axis) + projectedRadius(b, axis) - std::abs(distance);
+    if (overlap < 0)
+      return true;
+    if (overlap < depth) {
+      depth = overlap;
+      normal = distance < 0 ? axis * -1 : axis;
+    }
+    return false;
+  };
+  for (int k = 0; k < 3; k++) {
+    if (separated(a.axes[k]) || separated(b.axes[k]))
+      return false;
+  }
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      if (separated(t::cross(a.axes[i], b.axes[j])))
+        return false;
+    }
+  }
+
+  t::double3 sum;
+  auto inside = 0;
+  auto corners = [&](const Box& box, const Box& other) {
+    for (int corner = 0; corner < 8; corner++) {
+      auto point = box.center;
+      for (int k = 0; k < 3; k++)
+        point = point + box.axes[k] * (corner & (1 << k) ? box.half[k] : -box.half[k]);
+      if (insideBox(other, point)) {
+        sum = sum + point;
+        inside++;
+      }
+    }
+  };
+  corners(a, b);
+  corners(b, a);
+  if (inside > 0) {
+    contact->point = sum * (1.0 / inside);
+  } else {
+    auto deepestA = a.center;
+    auto deepestB = b.center;
+    for (int k = 0; k < 3; k++) {
+      deepestA = deepestA + a.axes[k] * (t::dot(a.axes[k], normal) < 0 ? -a.half[k] : a.half[k]);
+      deepestB = deepestB + b.axes[k] * (t::dot(b.axes[k], normal) < 0 ? b.half[k] : -b.half[k]);
+    }
+    contact->point = (deepestA + deepestB) * 0.5;
+  }
+  contact->normal = normal;
+  contact->depth = depth;
+  return true;
+}
+
+// The nearest triangle within the radius makes the contact.
+bool sphereMesh(const t::double3& center, double radius, const vector<t::double3>& triangles, Contact* contact) {
+  auto reach = Aabb{center - t::double3{radius, radius, radius}, center + t::double3{radius, radius, radius}};
+  auto best = radius * radius;
+  const t::double3* nearest = nullptr;
+  t::double3 closest;
+  for (size_t i = 0; i + 2 < triangles.size(); i += 3) {
+    auto v = &triangles[i];
+    if (!reach.overlaps(triangleBounds(v)))
+      continue;
+    auto point = closestOnTriangle(center, v[0], v[1], v[2]);
+    auto delta = point - center;
+    auto squared = t::dot(delta, delta);
+    if (squared <= best) {
+      best = squared;
+      nearest = v;
+      closest = point;
+    }
+  }
+  if (nearest == nullptr)
+    return false;
+  auto distance = std::sqrt(best);
+  if (distance > 0) {
+    contact->normal = (closest - center) * (1 / distance);
+  } else {
+    contact->normal = normalized(t::cross(nearest[1] - nearest[0], nearest[2] - nearest[0]));
+    if (contact->normal == t::double3{})
+      contact->normal = t::double3{0, 1, 0};
+  }
+  contact->depth = radius - distance;
+  contact->point = closest;
+  return true;
+}
+
+// Separating axes per triangle: the box faces, the triangle's normal and
+// the cross products of their edges. The deepest triangle makes the contact.
+bool boxMesh(const Box& box, const Aabb& bounds, const vector<t::double3>& triangles, Contact* contact) {
+  auto deepest = -1.0;
+  for (size_t i = 0; i + 2 < triangles.size(); i += 3) {
+    auto v = &triangles[i];
+    if (!bounds.overlaps(triangleBounds(v)))
+      continue;
+    t::double3 edges[3] = {v[1] - v[0], v[2] - v[1], v[0] - v[2]};
+    auto depth = std::numeric_limits<double>::max();
+    t::double3 normal;
+    auto separated = [&](t::double3 axis) {
+      auto squared = t::dot(axis, axis);
+      if (squared < 1e-12)
+        return false;
+      axis = axis * (1 / std::sqrt(squared));
+      auto center = t::dot(box.center, axis);
+      auto extent = projectedRadius(box, axis);
+      auto low = std::min({t::dot(v[0], axis), t::dot(v[1], axis), t::dot(v[2], axis)});
+      auto high = std::max({t::dot(v[0], axis), t::dot(v[1], axis), t::dot(v[2], axis)});
+      // How far the box moves back to clear the triangle ahead of it, or
+      // forward to clear the triangle behind it.
+      auto ahead = center + extent - low;
+      auto behind = high - (center - extent);
+      if (ahead < 0 || behind < 0)
+        return true;
+      if (std::min(ahead, behind) < depth) {
+        depth = std::min(ahead, behind);
+        normal = ahead < behind ? axis : axis * -1;
+      }
+      return false;
+    };
+    auto apart = separated(t::cross(edges[0], edges[1]));
+    for (int k = 0; k < 3 && !apart; k++)
+      apart = separated(box.axes[k]);
+    for (int k = 0; k < 3 && !apart; k++) {
+      for (int e = 0; e < 3 && !apart; e++)
+        apart = separated(t::cross(box.axes[k], edges[e]));
+    }
+    if (apart || depth <= deepest)
+      continue;
+    deepest = depth;
+    contact->normal = normal;
+    contact->depth = depth;
+    contact->point = closestOnTriangle(box.center, v[0], v[1], v[2]);
+  }
+  return deepest >= 0;
+}
+
+double lowest(const Aabb& bounds, int axis) { return component(bounds.min, axis); }
+double highest(const Aabb& bounds, int axis) { return component(bounds.max, axis); }
+
+}  // namespace
+
+// Colliders
+
+void Colliders::attach(ObjectHandle object, IPlugin* plugin) {
+  detach(object);
+  if (bySlot.size() <= object.index)
+    bySlot.resize(object.index + 1, NONE);
+  bySlot[object.index] = static_cast<uint32_t>(objects.size());
+  objects.push_back(object);
+  shapes.push_back(static_cast<ColliderPlugin*>(plugin)->shape);
+  transforms.emplace_back();
+  bounds.emplace_back();
+  centers.emplace_back();
+  previousCenters.emplace_back();
+  triangles.emplace_back();
+  placed.push_back(0);
+  sorted = false;
+}
+
+void Colliders::detach(ObjectHandle object) {
+  if (object.index >= bySlot.size() || bySlot[object.index] == NONE)
+    return;
+  auto index = bySlot[object.index];
+  if (objects[index] == object)
+    remove(index);
+}
+
+void Colliders::remove(uint32_t index) {
+  auto last = static_cast<uint32_t>(objects.size() - 1);
+  bySlot[objects[index].index] = NONE;
+  if (index != last) {
+    objects[index] = objects[last];
+    shapes[index] = std::move(shapes[last]);
+    transforms[index] = transforms[last];
+    bounds[index] = bounds[last];
+    centers[index] = centers[last];
+    previousCenters[index] = previousCenters[last];
+    triangles[index] = std::move(triangles[last]);
+    placed[index] = placed[last];
+    bySlot[objects[index].index] = index;
+  }
+  objects.pop_back();
+  shapes.pop_back();
+  transforms.pop_back();
+  bounds.pop_back();
+  centers.pop_back();
+  previousCenters.pop_back();
+  triangles.pop_back();
+  placed.pop_back();
+  sorted = false;
+}
+
+// Zero rotations, as objects are created with, are no rotation. Meshes
+// are only transformed again when their object moved.
+void Colliders::place(size_t i, const t::transform<double>& transform) {
+  auto placing = transform;
+  placing.rotation = placing.rotation == t::rotation{0, 0, 0, 0} ? t::rotation{} : t::normalize(placing.rotation);
+  if (placed[i] && transforms[i] == placing) {
+    previousCenters[i] = centers[i];
+    return;
+  }
+  transforms[i] = placing;
+  auto const& shape = shapes[i];
+  switch (shape.kind) {
+    case Shape::SPHERE: {
+      auto radius = radiusOf(shape, placing);
+      auto reach = t::double3{radius, radius, radius};
+      bounds[i] = Aabb{placing.position - reach, placing.position + reach};
+      break;
+    }
+    case Shape::BOX: {
+      auto box = boxOf(shape, placing);
+      auto extent = t::double3{projectedRadius(box, t::double3{1, 0, 0}), projectedRadius(box, t::double3{0, 1, 0}),
+        projectedRadius(box, t::double3{0, 0, 1})};
+      bounds[i] = Aabb{placing.position - extent, placing.position + extent};
+      break;
+    }
+    case Shape::MESH: {
+      auto& world = triangles[i];
+      world.clear();
+      if (shape.triangles != nullptr) {
+        for (auto const& vertex : *shape.triangles)
+          world.push_back(placing.position + t::rotate(placing.rotation, placing.scale * vertex));
+      }
+      auto box = world.empty() ? Aabb{placing.position, placing.position} : Aabb{world[0], world[0]};
+      for (auto const& vertex : world)
+        box = merge(box, Aabb{vertex, vertex});
+      bounds[i] = box;
+      break;
+    }
+  }
+  auto center = (bounds[i].min + bounds[i].max) * 0.5;
+  previousCenters[i] = placed[i] ? centers[i] : center;
+  centers[i] = center;
+  placed[i] = 1;
+}
+
+// The sweep axis changes only once another one spreads the colliders
+// clearly more, as that means sorting again from scratch.
+void Colliders::findPairs(vector<Pair>* out) {
+  auto count = objects.size();
+  if (count < 2)
+    return;
+  double sum[3] = {};
+  double squares[3] = {};
+  for (size_t i = 0; i < count; i++) {
+    for (int k = 0; k < 3; k++) {
+      auto c = component(centers[i], k);
+      sum[k] += c;
+      squares[k] += c * c;
+    }
+  }
+  double spread[3];
+  for (int k = 0; k < 3; k++)
+    spread[k] = squares[k] - sum[k] * sum[k] / count;
+  auto widest = static_cast<int>(std::max_element(spread, spread + 3) - spread);
+  auto byLowest = [this](uint32_t a, uint32_t b) { return lowest(bounds[a], axis) < lowest(bounds[b], axis); };
+  if (!sorted || (widest != axis && spread[widest] > 1.5 * spread[axis])) {
+    axis = widest;
+    order.resize(count);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), byLowest);
+    sorted = true;
+  } else {
+    for (size_t k = 1; k < count; k++) {
+      auto item = order[k];
+      auto m = k;
+      for (; m > 0 && byLowest(item, order[m - 1]); m--)
+        order[m] = order[m - 1];
+      order[m] = item;
+    }
+  }
+
+  for (size_t k = 0; k < count; k++) {
+    auto i = order[k];
+    if (!placed[i])
+      continue;
+    auto reach = highest(bounds[i], axis);
+    for (size_t m = k + 1; m < count; m++) {
+      auto j = order[m];
+      if (lowest(bounds[j], axis) > reach)
+        break;
+      if (!placed[j] || (shapes[i].kind == Shape::MESH && shapes[j].kind == Shape::MESH))
+        continue;
+      if (bounds[i].overlaps(bounds[j]))
+        out->push_back(Pair{std::min(i, j), std::max(i, j)});
+    }
+  }
+}
+
+void Colliders::collide(const vector<Pair>& pairs, size_t begin, size_t end, double seconds,
+    vector<Contact>* out) const {
+  for (size_t p = begin; p < end; p++) {
+    auto [a, b] = pairs[p];
+    Contact contact;
+    if (!collide(a, b, &contact))
+      continue;
+    contact.a = a;
+    contact.b = b;
+    auto closing = (centers[b] - previousCenters[b]) - (centers[a] - previousCenters[a]);
+    contact.speed = seconds > 0 ? std::max(0.0, -t::dot(closing, contact.normal)) / seconds : 0;
+    out->push_back(contact);
+  }
+}
+
+bool Colliders::collide(uint32_t a, uint32_t b, Contact* contact) const {
+  auto const& shapeA = shapes[a];
+  auto const& shapeB = shapes[b];
+  if (shapeA.kind > shapeB.kind) {
+    if (!collide(b, a, contact))
+      return false;
+    contact->normal = contact->normal * -1;
+    return true;
+  }
+  auto const& placeA = transforms[a];
+  auto const& placeB = transforms[b];
+  if (shapeA.kind == Shape::SPHERE) {
+    auto radius = radiusOf(shapeA, placeA);
+    switch (shapeB.kind) {
+      case Shape::SPHERE:
+        return sphereSphere(placeA.position, radius, placeB.position, radiusOf(shapeB, placeB), contact);
+      case Shape::BOX:
+        return sphereBox(placeA.position, radius, boxOf(shapeB, placeB), contact);
+      case Shape::MESH:
+        return sphereMesh(placeA.position, radius, triangles[b], contact);
+    }
+  }
+  if (shapeA.kind == Shape::BOX) {
+    if (shapeB.kind == Shape::BOX)
+      return boxBox(boxOf(shapeA, placeA), boxOf(shapeB, placeB), contact);
+    return boxMesh(boxOf(shapeA, placeA), bounds[a], triangles[b], contact);
+  }
+  return false;
+}
+
+}  // namespace core
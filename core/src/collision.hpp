@@ -0,0 +1,138 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_COLLISION_HPP_
+#define CORE_SRC_COLLISION_HPP_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "core.hpp"
+#include "spatial.hpp"
+#include "store.hpp"
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+
+namespace core {
+
+// Shapes are in object space: they move, rotate and scale with the object.
+struct Shape {
+  enum Kind : uint8_t { SPHERE, BOX, MESH };
+
+  Kind kind = SPHERE;
+  // Scaled by the largest scale of the object.
+  double radius = 0.5;
+  // Half the size of the box along each of its axes.
+  t::double3 halfExtents = t::double3{0.5, 0.5, 0.5};
+  // Three vertices per triangle. Meshes are for static geometry: they
+  // collide with spheres and boxes, not with each other, and are tested
+  // triangle by triangle.
+  shared_ptr<const vector<t::double3>> triangles;
+
+  static Shape sphere(double radius);
+  static Shape box(const t::double3& halfExtents);
+  static Shape mesh(vector<t::double3> triangles);
+};
+
+// Collider plugins give the object they are on a shape. At the end of each
+// round the world finds the colliders touching and emits a COLLISION event
+// for each of the two objects, see Event. Nothing is computed while no one
+// subscribes to collisions. An object has one collider: a second one
+// attached takes over.
+class Collisions {
+ public:
+  static shared_ptr<IPlugin> asPlugin(const string& id, const Shape& shape);
+  // From the blob saveTo() writes, throws std::runtime_error when malformed.
+  static shared_ptr<IPlugin> asPlugin(const string& id, const string& data);
+  // Plugins that are not colliders read as the default sphere.
+  static Shape getShape(const shared_ptr<IPlugin>& plugin);
+};
+
+struct Contact {
+  // Colliders touching, by index in Colliders.
+  uint32_t a = 0;
+  uint32_t b = 0;
+  t::double3 point;
+  // Unit vector from a towards b.
+  t::double3 normal;
+  // How far the shapes overlap along the normal.
+  double depth = 0;
+  // How fast they were closing along the normal, from how far they moved
+  // since they were last placed.
+  double speed = 0;
+};
+
+// Colliders attached to a world's objects in dense columns, removal swaps
+// the last one into the hole. Each pass places every collider at its
+// object's transform, sweeps and prunes their bounds along the axis they
+// spread the most on, then tests the overlapping pairs. The sweep order is
+// kept from one pass to the next, where it is nearly sorted already.
+// Not thread safe, place() and collide() excepted as documented.
+class Colliders {
+ public:
+  struct Pair {
+    uint32_t a;
+    uint32_t b;
+  };
+
+  size_t size() const { return objects.size(); }
+  // The plugin must come from Collisions::asPlugin, it replaces the
+  // object's previous collider.
+  void attach(ObjectHandle object, IPlugin* plugin);
+  void detach(ObjectHandle object);
+  // Moves collider i to the transform. Safe from several threads on
+  // different colliders.
+  void place(size_t i, const t::transform<double>& transform);
+  // Pairs of placed colliders with overlapping bounds, each once with a < b.
+  void findPairs(vector<Pair>* out);
+  // Appends the contacts of pairs in [begin, end) to out, speeds are over
+  // the seconds since the previous placement. Safe from several threads.
+  void collide(const vector<Pair>& pairs, size_t begin, size_t end, double seconds, vector<Contact>* out) const;
+
+  // Dense columns, all of length size() and in the same order.
+  vector<ObjectHandle> objects;
+  vector<Shape> shapes;
+  // As last placed, with a normalized rotation.
+  vector<t::transform<double>> transforms;
+  vector<Aabb> bounds;
+  vector<t::double3> centers;
+  vector<t::double3> previousCenters;
+  // Mesh triangles in world space, empty for the other shapes.
+  vector<vector<t::double3>> triangles;
+
+ private:
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  void remove(uint32_t index);
+  bool collide(uint32_t a, uint32_t b, Contact* contact) const;
+
+  vector<uint8_t> placed;
+  // Collider of each object slot, NONE for objects without one.
+  vector<uint32_t> bySlot;
+  // Colliders by the minimum of their bounds along the sweep axis.
+  vector<uint32_t> order;
+  int axis = 0;
+  bool sorted = false;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_COLLISION_HPP_
@@ -0,0 +1,139 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "compress.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+using std::runtime_error;
+
+namespace core {
+
+static constexpr size_t MIN_MATCH = 4;
+static constexpr size_t MAX_OFFSET = 65535;
+static constexpr int HASH_BITS = 14;
+// Trailing bytes always sent as literals, so matching never reads past the input.
+static constexpr size_t LAST_LITERALS = 5;
+
+static uint32_t read32(const char* at) {
+  uint32_t value;
+  std::memcpy(&value, at, sizeof(value));
+  return value;
+}
+
+static uint32_t hash(uint32_t value) {
+  return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void putLength(size_t length, string* out) {
+  for (; length >= 255; length -= 255)
+    out->push_back(static_cast<char>(255));
+  out->push_back(static_cast<char>(length));
+}
+
+static void putSequence(const char* literals, size_t literalCount, size_t offset, size_t matchLength, string* out) {
+  auto extra = matchLength - MIN_MATCH;
+  uint8_t token = static_cast<uint8_t>((std::min<size_t>(literalCount, 15) << 4) | std::min<size_t>(extra, 15));
+  out->push_back(static_cast<char>(token));
+  if (literalCount >= 15)
+    putLength(literalCount - 15, out);
+  out->append(literals, literalCount);
+  if (matchLength == 0)
+    return;
+  out->push_back(static_cast<char>(offset & 0xff));
+  out->push_back(static_cast<char>(offset >> 8));
+  if (extra >= 15)
+    putLength(extra - 15, out);
+}
+
+void compress(string_view input, string* out) {
+  auto data = input.data();
+  auto size = input.size();
+  size_t anchor = 0;
+  if (size > MIN_MATCH + LAST_LITERALS) {
+    // Positions + 1 of the last occurrence of each hashed 4 bytes, 0 for none.
+    std::vector<uint32_t> table(size_t(1) << HASH_BITS, 0);
+    auto limit = size - LAST_LITERALS;
+    for (size_t i = 0; i + MIN_MATCH <= limit;) {
+      auto value = read32(data + i);
+      auto& slot = table[hash(value)];
+      auto candidate = static_cast<size_t>(slot) - 1;
+      slot = static_cast<uint32_t>(i + 1);
+      if (candidate == SIZE_MAX || i - candidate > MAX_OFFSET || read32(data + candidate) != value) {
+        i++;
+        continue;
+      }
+      auto length = MIN_MATCH;
+      while (i + length < limit && data[candidate + length] == data[i + length])
+        length++;
+      putSequence(data + anchor, i - anchor, i - candidate, length, out);
+      i += length;
+      anchor = i;
+    }
+  }
+  putSequence(data + anchor, size - anchor, 0, 0, out);
+}
+
+void decompress(string_view block, size_t size, string* out) {
+  auto start = out->size();
+  auto end = start + size;
+  out->reserve(end);
+  size_t at = 0;
+  auto next = [&]() -> uint8_t {
+    if (at >= block.size())
+      throw runtime_error("truncated compressed block");
+    return static_cast<uint8_t>(block[at++]);
+  };
+  auto length = [&](size_t value) {
+    if (value != 15)
+      return value;
+    uint8_t more;
+    do {
+      more = next();
+      value += more;
+    } while (more == 255);
+    return value;
+  };
+
+  while (true) {
+    auto token = next();
+    auto literals = length(token >> 4);
+    if (literals > block.size() - at || literals > end - out->size())
+      throw runtime_error("corrupt compressed block");
+    out->append(block.data() + at, literals);
+    at += literals;
+    if (at == block.size())
+      break;
+
+    size_t offset = next();
+    offset |= static_cast<size_t>(next()) << 8;
+    auto match = length(token & 15) + MIN_MATCH;
+    if (offset == 0 || offset > out->size() - start || match > end - out->size())
+      throw runtime_error("corrupt compressed block");
+    // Byte by byte: the match may overlap what it copies.
+    auto from = out->size() - offset;
+    for (size_t i = 0; i < match; i++)
+      out->push_back((*out)[from + i]);
+  }
+  if (out->size() != end)
+    throw runtime_error("compressed block of the wrong size");
+}
+
+}  // namespace core
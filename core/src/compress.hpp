@@ -0,0 +1,54 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORE_SRC_COMPRESS_HPP_
+#define CORE_SRC_COMPRESS_HPP_
+
+#include <string>
+#include <string_view>
+
+using std::string;
+using std::string_view;
+
+namespace core {
+
+// Byte oriented LZ77 block compression in the manner of LZ4: fast on both
+// ends, with references to repeats up to 64 KB back. Good at what worlds
+// repeat most, ids with a common prefix and scripts shared by objects.
+//
+// A block is a series of sequences:
+//
+//   token u8       literal count in the high 4 bits, match length - 4 in
+//                  the low 4; 15 means more follows as bytes added while
+//                  they are 255
+//   literals
+//   offset u16     distance back to the match, absent in the last sequence
+//   match length bytes
+//
+// The last sequence holds the trailing literals only. The uncompressed
+// size is not stored, callers keep it next to the block.
+
+// Appends the compressed input to out.
+void compress(string_view input, string* out);
+// Appends the size bytes the block decompresses to. Throws
+// std::runtime_error when the block is corrupt or not of that size.
+void decompress(string_view block, size_t size, string* out);
+
+}  // namespace core
+
+#endif  // CORE_SRC_COMPRESS_HPP_
@@ -16,66 +16,111 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 #include <yaml-cpp/yaml.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <map>
-#include <queue>
+#include <mutex>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
+#include <variant>
 
 #include "core.hpp"
+#include "assets.hpp"
+#include "collision.hpp"
+#include "events.hpp"
+#include "journal.hpp"
+#include "log.hpp"
+#include "native.hpp"
+#include "physics.hpp"
+#include "scheduler.hpp"
 #include "scripting.hpp"
+#include "sleep.hpp"
+#include "snapshot.hpp"
+#include "profiler.hpp"
+#include "spatial.hpp"
+#include "store.hpp"
+#include "stream.hpp"
+#include "update_queue.hpp"
+#include "watcher.hpp"
 
 using std::string;
 using std::map;
-using std::queue;
 using std::vector;
 using std::ofstream;
-using std::ifstream;
-using std::stringstream;
 namespace fs = std::filesystem;
 
 namespace core {
 
-class UpdateCommand {
- public:
-  void execute() {}
-  void operator()() { execute(); }
-};
+template <class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
+template <class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
 
-class UpdateQueue {
- public:
-  void enqueue(shared_ptr<UpdateCommand> command) { updateQueue.push(command); }
-  bool empty() { return updateQueue.empty(); }
-  size_t size() { return updateQueue.size(); }
-  bool processNext() {
-    if (updateQueue.empty())
-      return false;
-    auto entry = updateQueue.front();
-    entry->execute();
-    updateQueue.pop();
-    return true;
-  }
- private:
-  queue<shared_ptr<UpdateCommand>> updateQueue;
-};
+class Object;
+using Objects = ObjectStore<shared_ptr<Object>>;
 
 class Object : public IObject {
  public:
-  explicit Object(const string& id) : id{id} {}
+  Object(const string& id, Objects* store, SleepSchedule* sleeps, EventBus* events, PhysicsBodies* bodies,
+      Colliders* colliders, NativeBatches* natives)
+    : id{id}, store{store}, sleeps{sleeps}, events{events}, bodies{bodies}, colliders{colliders}, natives{natives} {}
 
   const string& getId() override { return id; }
 
-  void setPosition(const t::position& pos) { this->position = pos; }
-  const t::position& getPosition() { return this->position; }
+  void setPosition(const t::position& pos) {
+    position() = pos;
+    touch(DIRTY_TRANSFORM);
+  }
+  t::position getPosition() { return position(); }
 
-  void setRotation(const t::rotation& rot) { this->rotation = rot; }
-  const t::rotation& getRotation() { return this->rotation; }
+  void setRotation(const t::rotation& rot) {
+    rotation() = rot;
+    touch(DIRTY_TRANSFORM);
+  }
+  t::rotation getRotation() { return rotation(); }
 
-  void setScale(const t::scale& s) { this->scale = s; }
-  const t::scale& getScale() { return this->scale; }
+  void setScale(const t::scale& s) {
+    scale() = s;
+    touch(DIRTY_TRANSFORM);
+  }
+  t::scale getScale() { return scale(); }
 
-  void addPlugin(const string& id, shared_ptr<IPlugin> plugin) { plugins[id] = plugin; }
+  // Objects have one body and one collider: a new one drops the plugin
+  // that had it, whatever its id.
+  void addPlugin(const string& id, shared_ptr<IPlugin> plugin) {
+    auto type = plugin->getType();
+    if (type == IPlugin::PHYSICS || type == IPlugin::COLLIDER) {
+      std::erase_if(plugins, [&](const auto& entry) {
+        if (entry.first == id || entry.second->getType() != type)
+          return false;
+        release(entry.second.get());
+        return true;
+      });
+    }
+    auto& entry = plugins[id];
+    if (entry != nullptr)
+      release(entry.get());
+    entry = plugin;
+    if (plugin->getType() == IPlugin::PHYSICS && store) {
+      bodies->attach(handle, plugin.get());
+      body = plugin.get();
+    }
+    if (plugin->getType() == IPlugin::COLLIDER && store) {
+      colliders->attach(handle, plugin.get());
+      collider = plugin.get();
+    }
+    if (plugin->getType() == IPlugin::NATIVE && store) {
+      natives->attach(handle, plugin.get());
+      nativeCount++;
+    }
+    touch(DIRTY_PLUGINS);
+    updateDormant();
+  }
   shared_ptr<IPlugin> getPlugin(const string& id) { return plugins[id]; }
+  const map<string, shared_ptr<IPlugin>>& getPlugins() { return plugins; }
   vector<string> listPluginIds() {
     vector<string> result;
     for (auto const& [key, val] : plugins)
@@ -83,131 +128,1040 @@ class Object : public IObject {
     return result;
   }
   void removePlugin(const string& pluginId) {
-    if (plugins.count(pluginId) == 0)
+    auto found = plugins.find(pluginId);
+    if (found == plugins.end())
       return;
-    plugins.erase(pluginId);
+    release(found->second.get());
+    plugins.erase(found);
+    touch(DIRTY_PLUGINS);
+    updateDormant();
+  }
+  void clearPlugins() {
+    cancelSleeps();
+    if (store)
+      events->unsubscribe(handle);
+    detachBody();
+    detachCollider();
+    detachNatives();
+    plugins.clear();
+    touch(DIRTY_PLUGINS);
+    updateDormant();
   }
   void replacePlugin(const string& id, shared_ptr<IPlugin> plugin) {
     removePlugin(id);
     addPlugin(id, plugin);
   }
 
-  void runPlugins(IWorld* world) {
-    for (auto const& [key, val] : plugins)
+  // Plugins with an id in skipped wait for another round, sleeping ones
+  // until they are woken. The world integrates the body, tests the
+  // collider and batches native plugins itself.
+  void runPlugins(IWorld* world, const std::unordered_set<string>* skipped = nullptr) {
+    for (auto const& [key, val] : plugins) {
+      if (skipped != nullptr && skipped->contains(key))
+        continue;
+      if (val.get() == body || val.get() == collider || val->getType() == IPlugin::NATIVE)
+        continue;
+      if (!sleeping.empty() && sleeping.contains(val.get()))
+        continue;
+      CORE_PROFILE_DYNAMIC_SCOPE(key);
       val->execute(world, this);
+    }
+  }
+
+  void attach(ObjectHandle handle) { this->handle = handle; }
+  ObjectHandle getHandle() override { return handle; }
+
+  // Sleeps come from the schedule and only change between rounds. A plugin
+  // sleeping again replaces its previous sleep.
+  void sleep(IPlugin* plugin, uint64_t token) {
+    auto attached = std::any_of(plugins.begin(), plugins.end(), [plugin](const auto& entry) {
+      return entry.second.get() == plugin;
+    });
+    if (!attached) {
+      sleeps->cancel(token);
+      return;
+    }
+    cancelSleep(plugin);
+    sleeping[plugin] = token;
+    updateDormant();
+  }
+  uint64_t sleepToken(IPlugin* plugin) {
+    auto found = sleeping.find(plugin);
+    return found != sleeping.end() ? found->second : 0;
+  }
+  void wake(IPlugin* plugin, uint64_t token) {
+    auto found = sleeping.find(plugin);
+    if (found == sleeping.end() || found->second != token)
+      return;
+    sleeping.erase(found);
+    updateDormant();
+  }
+
+  // Called when the object leaves the store while still referenced
+  // elsewhere: the transforms are copied out so the object stays usable.
+  void detach() {
+    if (store == nullptr)
+      return;
+    detached.position = store->position(handle);
+    detached.rotation = store->rotation(handle);
+    detached.scale = store->scale(handle);
+    detachBody();
+    detachCollider();
+    detachNatives();
+    store = nullptr;
+    cancelSleeps();
   }
 
  private:
+  t::position& position() { return store ? store->position(handle) : detached.position; }
+  t::rotation& rotation() { return store ? store->rotation(handle) : detached.rotation; }
+  t::scale& scale() { return store ? store->scale(handle) : detached.scale; }
+  void touch(uint8_t flags) {
+    if (store)
+      store->markDirty(handle, flags);
+  }
+  // Objects with nothing but a body, a collider or native plugins are
+  // dormant too.
+  void updateDormant() {
+    if (store) {
+      auto running = plugins.size() - (body != nullptr ? 1 : 0) - (collider != nullptr ? 1 : 0) - nativeCount;
+      store->dormant[store->denseIndex(handle)] = !plugins.empty() && sleeping.size() == running;
+    }
+  }
+  // Drops what the world keeps for a plugin leaving the object.
+  void release(IPlugin* plugin) {
+    cancelSleep(plugin);
+    if (store)
+      events->unsubscribe(handle, plugin);
+    if (plugin == body)
+      detachBody();
+    if (plugin == collider)
+      detachCollider();
+    if (plugin->getType() == IPlugin::NATIVE)
+      detachNative(plugin);
+  }
+  void detachBody() {
+    if (body == nullptr)
+      return;
+    bodies->detach(handle);
+    body = nullptr;
+  }
+  void detachCollider() {
+    if (collider == nullptr)
+      return;
+    colliders->detach(handle);
+    collider = nullptr;
+  }
+  void detachNative(IPlugin* plugin) {
+    if (store == nullptr)
+      return;
+    natives->detach(handle, plugin);
+    nativeCount--;
+  }
+  void detachNatives() {
+    for (auto const& [key, val] : plugins) {
+      if (val->getType() == IPlugin::NATIVE)
+        detachNative(val.get());
+    }
+  }
+  void cancelSleep(IPlugin* plugin) {
+    auto found = sleeping.find(plugin);
+    if (found == sleeping.end())
+      return;
+    sleeps->cancel(found->second);
+    sleeping.erase(found);
+  }
+  void cancelSleeps() {
+    for (auto const& [plugin, token] : sleeping)
+      sleeps->cancel(token);
+    sleeping.clear();
+  }
+
   string id;
-  t::position position = t::position{0, 0, 0};
-  t::rotation rotation = t::rotation{0, 0, 0, 0};
-  t::scale scale = t::scale{1, 1, 1};
+  Objects* store;
+  SleepSchedule* sleeps;
+  EventBus* events;
+  PhysicsBodies* bodies;
+  Colliders* colliders;
+  NativeBatches* natives;
+  ObjectHandle handle;
+  struct {
+    t::position position = t::position{0, 0, 0};
+    t::rotation rotation = t::rotation{0, 0, 0, 0};
+    t::scale scale = t::scale{1, 1, 1};
+  } detached;
   map<string, shared_ptr<IPlugin>> plugins;
+  // Physics plugin whose body moves the object, see PhysicsBodies, and
+  // collider plugin giving it a shape, see Colliders.
+  IPlugin* body = nullptr;
+  IPlugin* collider = nullptr;
+  // Native plugins among the plugins, see NativeBatches.
+  size_t nativeCount = 0;
+  // Sleeping plugins and their token in the schedule.
+  std::unordered_map<IPlugin*, uint64_t> sleeping;
 };
 
 class World : public IWorld {
  public:
   explicit World(const string& id) : id{id} {}
+  ~World() {
+    if (compaction.joinable())
+      compaction.join();
+    for (auto const& object : objects.payloads)
+      object->detach();
+  }
 
   const string& getId() { return id; }
 
   size_t objectCount() { return objects.size(); }
-  shared_ptr<IObject> newObject(const string& id) {
-    auto object = make_shared<Object>(id);
-    objects[id] = object;
-    return object;
+  shared_ptr<IObject> newObject(const string& id) { return createObject(id); }
+  shared_ptr<IObject> getObject(const string& id) { return findObject(id); }
+  IObject* resolve(ObjectHandle handle) {
+    return objects.contains(handle) ? objects.payload(handle).get() : nullptr;
+  }
+  void deleteObject(const string& id) {
+    auto handle = objects.find(id);
+    if (!handle.valid())
+      return;
+    if (!snapshotFile.empty())
+      deletedIds.push_back(id);
+    if (events.wants(Event::OBJECT_DELETED, id))
+      events.emit(Event{Event::OBJECT_DELETED, id});
+    events.unsubscribe(handle);
+    spatial.remove(handle.index);
+    objects.payload(handle)->detach();
+    objects.destroy(handle);
   }
-  shared_ptr<IObject> getObject(const string& id) { return objects[id]; }
-  void deleteObject(const string& id) { objects.erase(id); }
   vector<string> listObjectIds() {
-    vector<string> result;
-    for (auto const& [key, val] : objects)
-      result.push_back(key);
+    vector<string> result = objects.ids;
+    std::sort(result.begin(), result.end());
+    return result;
+  }
+
+  vector<string> queryRadius(const t::position& center, double radius) {
+    syncSpatial();
+    vector<uint32_t> items;
+    spatial.querySphere(center, radius, &items);
+    return idsOf(items);
+  }
+  vector<string> queryBox(const t::position& min, const t::position& max) {
+    syncSpatial();
+    vector<uint32_t> items;
+    spatial.queryBox(Aabb{min, max}, &items);
+    return idsOf(items);
+  }
+  vector<RayHit> queryRay(const t::position& origin, const t::double3& direction, double maxDistance) {
+    vector<RayHit> result;
+    auto length = t::length(direction);
+    if (length == 0)
+      return result;
+    syncSpatial();
+    vector<SpatialIndex::Hit> hits;
+    spatial.queryRay(origin, direction * (1 / length), maxDistance, &hits);
+    for (auto const& hit : hits) {
+      auto handle = objects.slotHandle(hit.item);
+      if (handle.valid())
+        result.push_back(RayHit{objects.id(handle), hit.distance});
+    }
     return result;
   }
+  vector<string> queryNearest(const t::position& point, size_t count) {
+    syncSpatial();
+    vector<SpatialIndex::Hit> hits;
+    spatial.queryNearest(point, count, &hits);
+    vector<uint32_t> items;
+    for (auto const& hit : hits)
+      items.push_back(hit.item);
+    return idsOf(items);
+  }
 
   void saveScriptToObject(const string& objectId, const string& pluginId, const string& code) {
-    if (objects.count(objectId) == 0)
+    auto object = findObject(objectId);
+    if (object == nullptr)
       return;
-    auto object = objects[objectId];
     auto plugin = Scripts::asPlugin(pluginId, code);
     object->replacePlugin(pluginId, plugin);
   }
 
+  void savePluginToObject(const string& objectId, shared_ptr<IPlugin> plugin) {
+    auto object = findObject(objectId);
+    if (object == nullptr)
+      return;
+    object->replacePlugin(plugin->getId(), plugin);
+  }
+
+  void enqueue(UpdateCommand command) {
+    if (roundWorld == this)
+      roundBuffer->push_back(std::move(command));
+    else
+      updateQueue.enqueue(std::move(command));
+  }
+
+  uint64_t addUpdateListener(UpdateListener listener) {
+    updateListeners.emplace_back(++lastListenerId, std::move(listener));
+    return lastListenerId;
+  }
+  void removeUpdateListener(uint64_t id) {
+    std::erase_if(updateListeners, [id](const auto& entry) { return entry.first == id; });
+  }
+
+  void setWorkers(size_t workers) {
+    if (workers <= 1)
+      pool.reset();
+    else if (pool == nullptr || pool->workerCount() != workers)
+      pool = std::make_unique<WorkStealingPool>(workers);
+  }
+
+  void setLowPriority(const string& pluginId, bool low) {
+    if (low)
+      lowPriority.insert(pluginId);
+    else
+      lowPriority.erase(pluginId);
+  }
+  void setLowPrioritySpread(size_t spread) { lowPrioritySpread = std::max<size_t>(spread, 1); }
+
+  void setPhysics(const PhysicsOptions& options) {
+    physics = options;
+    physics.parallelChunk = std::max<size_t>(physics.parallelChunk, 1);
+  }
+
+  void sleep(IObject* object, IPlugin* plugin, const Wait& wait) {
+    if (roundWorld != this) {
+      applySleep(SleepRequest{object->getHandle(), plugin, wait, steadySeconds()});
+      return;
+    }
+    std::lock_guard<std::mutex> guard(sleepLock);
+    sleepRequests.push_back(SleepRequest{object->getHandle(), plugin, wait, steadySeconds()});
+  }
+
+  void signal(const string& name) {
+    std::lock_guard<std::mutex> guard(sleepLock);
+    signals.push_back(name);
+  }
+
+  void subscribe(IObject* object, IPlugin* plugin, const EventFilter& filter) {
+    events.subscribe(object->getHandle(), plugin, filter);
+  }
+  void unsubscribe(IObject* object, IPlugin* plugin) { events.unsubscribe(object->getHandle(), plugin); }
+  void setEventDriven(IObject* object, IPlugin* plugin, bool driven) {
+    events.setEventDriven(object->getHandle(), plugin, driven);
+  }
+  void emit(const Event& event) { events.emit(event); }
+  vector<Event> takeEvents(IObject* object, IPlugin* plugin) { return events.take(object->getHandle(), plugin); }
+
+  void watchScripts(const string& path) {
+    reloaders.clear();
+    fs::create_directories(path + "/scripts");
+    reloaders.push_back(std::make_unique<ScriptReloader>(path + "/scripts"));
+    scriptFiles.clear();
+  }
+
   void round() {
-    for (auto const& [key, val] : objects)
-      val->runPlugins(this);
-    while (updateQueue.processNext()) {}
+    CORE_PROFILE_SCOPE("round");
+    rounds++;
+    if (stream != nullptr) {
+      CORE_PROFILE_SCOPE("stream chunk");
+      streamChunk();
+    }
+    CORE_PROFILE_COUNTER("objects", objects.size());
+    if (!reloaders.empty())
+      applyReloads();
+    syncSpatial();
+    wakeSleepers();
+    runningPlugins = true;
+    if (pool != nullptr && objects.size() > ROUND_CHUNK)
+      runPluginsParallel();
+    else
+      runPluginsSerial();
+    runningPlugins = false;
+    if (natives.size() > 0)
+      runNatives();
+    applySleeps();
+    applyRoundBuffers();
+    if (bodies.size() > 0)
+      integrateBodies();
+    CORE_PROFILE_COUNTER("queue depth", updateQueue.size());
+    {
+      CORE_PROFILE_SCOPE("drain queue");
+      updateQueue.drain([this](UpdateCommand& command) { apply(command); });
+    }
+    if (colliders.size() > 1 && events.wants(Event::COLLISION))
+      detectCollisions();
+    if (loading && progress.firstRoundSeconds < 0)
+      progress.firstRoundSeconds = secondsSince(loadStart);
+  }
+
+  LoadProgress getLoadProgress() {
+    if (stream != nullptr)
+      progress.total = stream->total();
+    return progress;
+  }
+
+  void startStream(const string& path, const StreamOptions& options) {
+    loading = true;
+    loadStart = std::chrono::steady_clock::now();
+    progress = LoadProgress{};
+    progress.done = false;
+    stream = std::make_unique<WorldStream>(path, options);
+    progress.total = stream->total();
+    // Deletes made while the rest streams in go to the next journal.
+    if (!stream->getSnapshotFile().empty())
+      trackSnapshot(stream->getSnapshotFile());
+  }
+
+  // Adds whatever is left of the stream right away. Saving what a failed
+  // load left would lose the rest of the world, so it throws instead.
+  void finishStream() {
+    while (stream != nullptr)
+      streamChunk(true);
+    if (!progress.error.empty())
+      throw std::runtime_error("World " + id + " failed to load and is not saved: " + progress.error);
+  }
+
+  void createFromCommand(command::CreateObject& c) {
+    auto object = createObject(c.id);
+    object->setPosition(c.position);
+    object->setRotation(c.rotation);
+    object->setScale(c.scale);
+    for (auto const& plugin : c.plugins)
+      object->replacePlugin(plugin->getId(), plugin);
   }
 
   void save(const string& path);
+  void saveSnapshot(const string& file);
+  void saveIncremental(const string& file);
+  vector<string> saveBatches(size_t batchBytes);
+  void loadSnapshot(const Snapshot& snapshot);
+  // Returns where the complete batches end, see Journals::replay.
+  uint64_t replayJournal(const string& file);
+  // Takes the file as the base of incremental saves, as if just saved.
+  void trackSnapshot(const string& file);
 
  private:
+  // Journals smaller than this are never compacted, above it they are
+  // once they reach half the size of the snapshot.
+  static constexpr uint64_t COMPACT_MIN_BYTES = 1 << 20;
+
+  shared_ptr<Object> createObject(const string& id) {
+    deleteObject(id);
+    auto object = make_shared<Object>(id, &objects, &sleeps, &events, &bodies, &colliders, &natives);
+    object->attach(objects.create(id, object));
+    if (events.wants(Event::OBJECT_CREATED, id))
+      events.emit(Event{Event::OBJECT_CREATED, id});
+    return object;
+  }
+
+  static double steadySeconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  // Objects of a streamed snapshot come with its journals applied, so they
+  // are clean for incremental saves as soon as they are added. Anything a
+  // round changes afterwards stays dirty, and so do objects that replace
+  // one created while the world streamed in.
+  void streamChunk(bool wait = false) {
+    stream->take(&streamed, wait);
+    auto tracked = !stream->getSnapshotFile().empty();
+    for (auto& object : streamed) {
+      auto replaces = tracked && objects.find(object.id).valid();
+      createFromCommand(object);
+      if (tracked && !replaces)
+        objects.dirty[objects.denseIndex(objects.find(object.id))] = CLEAN;
+    }
+    progress.loaded += streamed.size();
+    streamed.clear();
+    if (!stream->exhausted())
+      return;
+
+    progress.total = stream->total();
+    progress.error = stream->error();
+    stream.reset();
+    progress.done = true;
+    progress.loadedSeconds = secondsSince(loadStart);
+  }
+
+  void startCompaction();
+  void waitCompaction() {
+    if (compaction.joinable())
+      compaction.join();
+  }
+
+  // Objects handed to a parallel task at once. The partition only depends
+  // on object count, never on worker count, so applying the chunk buffers
+  // in chunk order gives the same update sequence for any number of threads.
+  static constexpr size_t ROUND_CHUNK = 256;
+  // Collider pairs tested by a parallel task at once.
+  static constexpr size_t COLLISION_CHUNK = 1024;
+
+  void runPluginsSerial() {
+    CORE_PROFILE_SCOPE("plugins");
+    roundBuffers.resize(std::max<size_t>(roundBuffers.size(), 1));
+    roundWorld = this;
+    roundBuffer = &roundBuffers[0];
+    // Plugins may create or delete objects while running, which moves
+    // others in the store: walk the handles of the objects the round
+    // started with. Objects created meanwhile run from the next round.
+    roundHandles.assign(objects.handles.begin(), objects.handles.end());
+    for (size_t i = 0; i < roundHandles.size(); i++) {
+      if (!objects.contains(roundHandles[i]))
+        continue;
+      auto dense = objects.denseIndex(roundHandles[i]);
+      if (objects.dormant[dense])
+        continue;
+      auto object = objects.payloads[dense];
+      object->runPlugins(this, skippedPlugins(i));
+    }
+    roundWorld = nullptr;
+    roundBuffer = nullptr;
+  }
+
+  // Plugins running here must not create or delete objects directly, they
+  // go through enqueue() and the structural change happens at drain time.
+  void runPluginsParallel() {
+    auto count = objects.size();
+    auto chunks = (count + ROUND_CHUNK - 1) / ROUND_CHUNK;
+    roundBuffers.resize(std::max(roundBuffers.size(), chunks));
+    CORE_PROFILE_SCOPE("plugins");
+    pool->run(chunks, [this, count](size_t chunk, size_t worker) {
+      CORE_PROFILE_SCOPE("round chunk");
+      roundWorld = this;
+      roundBuffer = &roundBuffers[chunk];
+      auto end = std::min(count, (chunk + 1) * ROUND_CHUNK);
+      for (size_t i = chunk * ROUND_CHUNK; i < end; i++) {
+        if (!objects.dormant[i])
+          objects.payloads[i]->runPlugins(this, skippedPlugins(i));
+      }
+      roundWorld = nullptr;
+      roundBuffer = nullptr;
+    });
+  }
+
+  // Low priority plugins of the object at dense index i, unless it is its
+  // turn to run them this round.
+  const std::unordered_set<string>* skippedPlugins(size_t i) const {
+    if (lowPrioritySpread <= 1 || lowPriority.empty() || (i + rounds) % lowPrioritySpread == 0)
+      return nullptr;
+    return &lowPriority;
+  }
+
+  struct SleepRequest {
+    ObjectHandle object;
+    IPlugin* plugin;
+    Wait wait;
+    double time;
+  };
+
+  // One batch per behaviour, after the other plugins. Transforms are
+  // gathered into the columns of each group and only the ones the batch
+  // changed are written back, and told to the update listeners.
+  void runNatives() {
+    CORE_PROFILE_SCOPE("native plugins");
+    auto host = Natives::hostOf(this);
+    for (auto& group : natives.groups) {
+      auto count = group.objects.size();
+      if (count == 0)
+        continue;
+      CORE_PROFILE_DYNAMIC_SCOPE(group.behaviour->name);
+      group.resize();
+      for (size_t i = 0; i < count; i++) {
+        auto dense = objects.denseIndex(group.objects[i]);
+        auto const& position = objects.positions[dense];
+        auto const& rotation = objects.rotations[dense];
+        auto const& scale = objects.scales[dense];
+        group.ids[i] = objects.ids[dense].c_str();
+        group.x[i] = position.x;
+        group.y[i] = position.y;
+        group.z[i] = position.z;
+        group.rotationX[i] = rotation.x;
+        group.rotationY[i] = rotation.y;
+        group.rotationZ[i] = rotation.z;
+        group.rotationW[i] = rotation.w;
+        group.scaleX[i] = scale.x;
+        group.scaleY[i] = scale.y;
+        group.scaleZ[i] = scale.z;
+        group.changed[i] = 0;
+      }
+      natives.update(&group, physics.timeStep, rounds, &host);
+      for (size_t i = 0; i < count; i++) {
+        if (!group.changed[i])
+          continue;
+        auto dense = objects.denseIndex(group.objects[i]);
+        auto position = t::position{group.x[i], group.y[i], group.z[i]};
+        auto rotation = t::rotation{group.rotationX[i], group.rotationY[i], group.rotationZ[i], group.rotationW[i]};
+        auto scale = t::scale{group.scaleX[i], group.scaleY[i], group.scaleZ[i]};
+        if (!updateListeners.empty()) {
+          if (position != objects.positions[dense])
+            notify(command::SetPosition{group.objects[i], position});
+          if (rotation != objects.rotations[dense])
+            notify(command::SetRotation{group.objects[i], rotation});
+          if (scale != objects.scales[dense])
+            notify(command::SetScale{group.objects[i], scale});
+        }
+        objects.positions[dense] = position;
+        objects.rotations[dense] = rotation;
+        objects.scales[dense] = scale;
+        objects.dirty[dense] |= DIRTY_TRANSFORM;
+        objects.moved[dense] = 1;
+      }
+    }
+  }
+
+  // Positions are gathered from the store into the body columns, advanced
+  // and written back for the bodies still moving, so resting bodies leave
+  // their objects clean. Bodies never share an object, chunks of them can
+  // run on the workers in any order. The update listeners hear about the
+  // moves afterwards, from this thread.
+  void integrateBodies() {
+    CORE_PROFILE_SCOPE("physics");
+    CORE_PROFILE_COUNTER("bodies", bodies.size());
+    auto count = bodies.size();
+    auto chunk = physics.parallelChunk;
+    bodyObjects.resize(count);
+    auto integrate = [this](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        auto dense = objects.denseIndex(bodies.objects[i]);
+        bodyObjects[i] = static_cast<uint32_t>(dense);
+        auto const& position = objects.positions[dense];
+        bodies.x[i] = position.x;
+        bodies.y[i] = position.y;
+        bodies.z[i] = position.z;
+      }
+      bodies.integrate(begin, end, physics.timeStep, physics.gravity);
+      for (size_t i = begin; i < end; i++) {
+        if (bodies.vx[i] == 0 && bodies.vy[i] == 0 && bodies.vz[i] == 0)
+          continue;
+        auto dense = bodyObjects[i];
+        objects.positions[dense] = t::position{bodies.x[i], bodies.y[i], bodies.z[i]};
+        objects.dirty[dense] |= DIRTY_TRANSFORM;
+        objects.moved[dense] = 1;
+      }
+    };
+    if (pool == nullptr || count <= chunk) {
+      integrate(0, count);
+    } else {
+      pool->run((count + chunk - 1) / chunk, [&](size_t task, size_t worker) {
+        integrate(task * chunk, std::min(count, (task + 1) * chunk));
+      });
+    }
+    if (updateListeners.empty())
+      return;
+    for (size_t i = 0; i < count; i++) {
+      if (bodies.vx[i] != 0 || bodies.vy[i] != 0 || bodies.vz[i] != 0)
+        notify(command::SetPosition{bodies.objects[i], objects.positions[bodyObjects[i]]});
+    }
+  }
+
+  // Colliders are placed where the round left their objects. Contacts are
+  // emitted in pair order, for each of the two objects someone listens to.
+  void detectCollisions() {
+    CORE_PROFILE_SCOPE("collisions");
+    auto count = colliders.size();
+    auto chunk = physics.parallelChunk;
+    auto place = [this](size_t begin, size_t end) {
+      for (size_t i = begin; i < end; i++) {
+        auto dense = objects.denseIndex(colliders.objects[i]);
+        colliders.place(i, t::transform<double>{objects.positions[dense], objects.rotations[dense], objects.scales[dense]});
+      }
+    };
+    if (pool == nullptr || count <= chunk) {
+      place(0, count);
+    } else {
+      pool->run((count + chunk - 1) / chunk, [&](size_t task, size_t worker) {
+        place(task * chunk, std::min(count, (task + 1) * chunk));
+      });
+    }
+
+    collisionPairs.clear();
+    colliders.findPairs(&collisionPairs);
+    CORE_PROFILE_COUNTER("collision pairs", collisionPairs.size());
+    auto pairs = collisionPairs.size();
+    auto tasks = pool == nullptr ? 1 : std::max<size_t>((pairs + COLLISION_CHUNK - 1) / COLLISION_CHUNK, 1);
+    contacts.resize(std::max(contacts.size(), tasks));
+    if (tasks <= 1) {
+      colliders.collide(collisionPairs, 0, pairs, physics.timeStep, &contacts[0]);
+    } else {
+      pool->run(tasks, [&](size_t task, size_t worker) {
+        colliders.collide(collisionPairs, task * COLLISION_CHUNK, std::min(pairs, (task + 1) * COLLISION_CHUNK),
+          physics.timeStep, &contacts[task]);
+      });
+    }
+
+    for (size_t task = 0; task < tasks; task++) {
+      for (auto const& contact : contacts[task]) {
+        auto const& a = objects.id(colliders.objects[contact.a]);
+        auto const& b = objects.id(colliders.objects[contact.b]);
+        if (events.wants(Event::COLLISION, a))
+          events.emit(Event{Event::COLLISION, a, b, "", "", contact.point, contact.normal, contact.depth, contact.speed});
+        if (events.wants(Event::COLLISION, b))
+          events.emit(Event{Event::COLLISION, b, a, "", "", contact.point, contact.normal * -1, contact.depth,
+            contact.speed});
+      }
+      contacts[task].clear();
+    }
+  }
+
+  // Events and signals raised since the last round, then the rounds and
+  // times due.
+  void wakeSleepers() {
+    {
+      CORE_PROFILE_SCOPE("dispatch events");
+      received.clear();
+      events.dispatch(&received);
+    }
+    {
+      std::lock_guard<std::mutex> guard(sleepLock);
+      raised.swap(signals);
+    }
+    if (sleeps.size() == 0) {
+      raised.clear();
+      return;
+    }
+    CORE_PROFILE_SCOPE("wake sleepers");
+    woken.clear();
+    for (auto const& receiver : received) {
+      if (!objects.contains(receiver.object))
+        continue;
+      auto token = objects.payload(receiver.object)->sleepToken(receiver.plugin);
+      if (token != 0 && sleeps.wakesOnEvents(token)) {
+        sleeps.cancel(token);
+        woken.push_back(SleepSchedule::Sleeper{receiver.object, receiver.plugin, token});
+      }
+    }
+    for (auto const& name : raised)
+      sleeps.signal(name, &woken);
+    raised.clear();
+    sleeps.due(rounds, steadySeconds(), &woken);
+    for (auto const& sleeper : woken) {
+      if (objects.contains(sleeper.object))
+        objects.payload(sleeper.object)->wake(sleeper.plugin, sleeper.token);
+    }
+    CORE_PROFILE_COUNTER("sleepers", sleeps.size());
+  }
+
+  // Requested sleeps, then event driven plugins left without events.
+  void applySleeps() {
+    {
+      std::lock_guard<std::mutex> guard(sleepLock);
+      appliedSleeps.swap(sleepRequests);
+    }
+    for (auto const& request : appliedSleeps)
+      applySleep(request);
+    appliedSleeps.clear();
+    received.clear();
+    events.idle(&received);
+    for (auto const& receiver : received) {
+      if (objects.contains(receiver.object) && objects.payload(receiver.object)->sleepToken(receiver.plugin) == 0)
+        applySleep(SleepRequest{receiver.object, receiver.plugin, Wait{0, 0, string(), true}, 0});
+    }
+  }
+
+  void applySleep(const SleepRequest& request) {
+    if (!objects.contains(request.object))
+      return;
+    auto token = sleeps.add(request.object, request.plugin, request.wait, rounds, request.time);
+    if (token != 0)
+      objects.payload(request.object)->sleep(request.plugin, token);
+  }
+
+  // Scripts compiled by a reloader replace the plugin their file is named
+  // after. The new version starts over: the old one's sleeps,
+  // subscriptions and suspended run go with it.
+  void applyReloads() {
+    reloads.clear();
+    for (auto const& reloader : reloaders)
+      reloader->take(&reloads);
+    if (reloads.empty())
+      return;
+    CORE_PROFILE_SCOPE("reload scripts");
+    auto live = [this](const auto& targets) {
+      return std::all_of(targets.begin(), targets.end(), [this](const auto& t) { return objects.contains(t.first); });
+    };
+    for (auto const& reload : reloads) {
+      auto found = scriptFiles.find(reload.file);
+      if (found == scriptFiles.end() || !live(found->second)) {
+        indexScriptFiles();
+        found = scriptFiles.find(reload.file);
+        if (found == scriptFiles.end())
+          continue;
+      }
+      for (auto const& [handle, pluginId] : found->second) {
+        auto object = objects.payload(handle);
+        auto plugin = object->getPlugins().find(pluginId);
+        if (plugin == object->getPlugins().end() || plugin->second->getType() != IPlugin::SCRIPT)
+          continue;
+        // Saving the world writes back the running sources.
+        std::stringstream current;
+        plugin->second->saveTo(current);
+        if (current.str() != reload.source)
+          object->replacePlugin(pluginId, Scripts::asDeferredPlugin(pluginId, reload.source));
+      }
+    }
+  }
+
+  // Editable script file names, several plugins share one when ids with
+  // underscores make the names collide.
+  void indexScriptFiles() {
+    scriptFiles.clear();
+    for (size_t i = 0; i < objects.size(); i++) {
+      for (auto const& [pluginId, plugin] : objects.payloads[i]->getPlugins()) {
+        if (plugin->getType() == IPlugin::SCRIPT)
+          scriptFiles[objects.ids[i] + "_" + pluginId].push_back(std::make_pair(objects.handles[i], pluginId));
+      }
+    }
+  }
+
+  // Buffers are cleared but keep their capacity, so steady state rounds
+  // do not allocate for commands.
+  void applyRoundBuffers() {
+    CORE_PROFILE_SCOPE("apply round buffers");
+    for (auto& buffer : roundBuffers) {
+      for (auto& command : buffer)
+        apply(command);
+      buffer.clear();
+    }
+  }
+
+  void apply(UpdateCommand& command) {
+    if (!updateListeners.empty())
+      notify(command);
+    std::visit(overloaded {
+      [this](command::SetPosition& c) {
+        if (objects.contains(c.object)) {
+          objects.position(c.object) = c.position;
+          objects.markDirty(c.object, DIRTY_TRANSFORM);
+        }
+      },
+      [this](command::SetRotation& c) {
+        if (objects.contains(c.object)) {
+          objects.rotation(c.object) = c.rotation;
+          objects.markDirty(c.object, DIRTY_TRANSFORM);
+        }
+      },
+      [this](command::SetScale& c) {
+        if (objects.contains(c.object)) {
+          objects.scale(c.object) = c.scale;
+          objects.markDirty(c.object, DIRTY_TRANSFORM);
+        }
+      },
+      [this](command::CreateObject& c) { createFromCommand(c); },
+      [this](command::DeleteObject& c) {
+        if (objects.contains(c.object))
+          deleteObject(objects.id(c.object));
+      },
+      [this](command::AttachPlugin& c) {
+        if (objects.contains(c.object))
+          objects.payload(c.object)->replacePlugin(c.plugin->getId(), c.plugin);
+      },
+      [this](command::RemovePlugin& c) {
+        if (objects.contains(c.object))
+          objects.payload(c.object)->removePlugin(c.pluginId);
+      },
+    }, command);
+  }
+
+  // Before applying, so that a delete still resolves to its object id.
+  void notify(const UpdateCommand& command) {
+    auto objectId = std::visit(overloaded {
+      [](const command::CreateObject& c) { return c.id; },
+      [this](const auto& c) { return objects.contains(c.object) ? objects.id(c.object) : string(); },
+    }, command);
+    if (!objectId.empty())
+      for (auto const& [id, listener] : updateListeners)
+        listener(objectId, command);
+  }
+
+  // Moved objects are found with a scan over one byte per object, the
+  // index is only touched for those. Never while plugins run, so queries
+  // from parallel plugins only read it.
+  void syncSpatial() {
+    if (runningPlugins)
+      return;
+    CORE_PROFILE_SCOPE("sync spatial index");
+    auto& moved = objects.moved;
+    auto watched = events.wants(Event::TRANSFORM_CHANGED);
+    for (auto it = std::find(moved.begin(), moved.end(), 1); it != moved.end(); it = std::find(it + 1, moved.end(), 1)) {
+      *it = 0;
+      auto i = it - moved.begin();
+      spatial.set(objects.handles[i].index, objectBounds(objects.positions[i], objects.rotations[i], objects.scales[i]));
+      if (watched && events.wants(Event::TRANSFORM_CHANGED, objects.ids[i]))
+        events.emit(Event{Event::TRANSFORM_CHANGED, objects.ids[i]});
+    }
+  }
+
+  // Index items are store slots.
+  vector<string> idsOf(const vector<uint32_t>& items) {
+    vector<string> result;
+    result.reserve(items.size());
+    for (auto item : items) {
+      auto handle = objects.slotHandle(item);
+      if (handle.valid())
+        result.push_back(objects.id(handle));
+    }
+    return result;
+  }
+
+  shared_ptr<Object> findObject(const string& id) {
+    auto handle = objects.find(id);
+    if (!handle.valid())
+      return nullptr;
+    return objects.payload(handle);
+  }
+
   string id;
-  map<string, shared_ptr<Object>> objects;
+  Objects objects;
+  SpatialIndex spatial;
+  bool runningPlugins = false;
   UpdateQueue updateQueue;
+  std::unique_ptr<WorkStealingPool> pool;
+  vector<vector<UpdateCommand>> roundBuffers;
+  vector<ObjectHandle> roundHandles;
+  uint64_t rounds = 0;
+  // Sleeping plugins. Requests made while plugins run and signals wait
+  // under the lock for the end and the start of a round.
+  SleepSchedule sleeps;
+  std::mutex sleepLock;
+  vector<SleepRequest> sleepRequests;
+  vector<SleepRequest> appliedSleeps;
+  vector<string> signals;
+  vector<string> raised;
+  vector<SleepSchedule::Sleeper> woken;
+  EventBus events;
+  vector<EventBus::Receiver> received;
+  PhysicsBodies bodies;
+  PhysicsOptions physics;
+  // Dense index of the object of each body during integrateBodies().
+  vector<uint32_t> bodyObjects;
+  Colliders colliders;
+  vector<Colliders::Pair> collisionPairs;
+  // Per narrowphase task, emptied once emitted.
+  vector<vector<Contact>> contacts;
+  NativeBatches natives;
+  std::unordered_set<string> lowPriority;
+  size_t lowPrioritySpread = 1;
+  vector<std::pair<uint64_t, UpdateListener>> updateListeners;
+  uint64_t lastListenerId = 0;
+  // Scripts watched on disk, and the object and plugin of each file.
+  vector<std::unique_ptr<ScriptReloader>> reloaders;
+  vector<ScriptReload> reloads;
+  std::unordered_map<string, vector<std::pair<ObjectHandle, string>>> scriptFiles;
+  // Incremental save state: the snapshot the journal applies to, objects
+  // deleted since the last save and the background compaction.
+  string snapshotFile;
+  vector<string> deletedIds;
+  std::thread compaction;
+  std::atomic<bool> compacting = false;
+  std::atomic<uint64_t> snapshotBytes = 0;
+  // Streamed loading, see Worlds::stream.
+  std::unique_ptr<WorldStream> stream;
+  vector<command::CreateObject> streamed;
+  LoadProgress progress;
+  bool loading = false;
+  std::chrono::steady_clock::time_point loadStart;
+  // Set on the threads running plugins, so that enqueue() lands in the
+  // buffer of the chunk being processed.
+  static thread_local World* roundWorld;
+  static thread_local vector<UpdateCommand>* roundBuffer;
 };
 
+thread_local World* World::roundWorld = nullptr;
+thread_local vector<UpdateCommand>* World::roundBuffer = nullptr;
+
+shared_ptr<IPlugin> Plugins::fromBlob(const string& id, IPlugin::Type type, const string& blob, bool deferred) {
+  switch (type) {
+    case IPlugin::SCRIPT:
+      return deferred ? Scripts::asDeferredPlugin(id, blob) : Scripts::asPlugin(id, blob);
+    case IPlugin::PHYSICS:
+      return Physics::asPlugin(id, blob);
+    case IPlugin::COLLIDER:
+      return Collisions::asPlugin(id, blob);
+    case IPlugin::NATIVE:
+      return Natives::asPlugin(id, blob);
+  }
+  return nullptr;
+}
+
+shared_ptr<IPlugin> Plugins::fromNetwork(const string& id, IPlugin::Type type, const string& blob, bool deferred) {
+  if (type == IPlugin::NATIVE && !Natives::allowedFromNetwork(blob))
+    return nullptr;
+  return fromBlob(id, type, blob, deferred);
+}
+
 shared_ptr<IWorld> Worlds::createNew(const string& id) {
   return make_shared<World>(id);
 }
 
 // World loading and saving
 
-void loadObjectFromYaml(shared_ptr<IWorld> world, const string& path, YAML::Node objectConf);
-void loadPluginFromYalm(shared_ptr<IWorld> world, const string& objectId, const string& path, YAML::Node pluginConf);
+shared_ptr<IWorld> Worlds::loadSnapshot(const string& id, const string& file) {
+  auto world = make_shared<World>(id);
+  world->loadSnapshot(Snapshot(file));
+  world->replayJournal(file + journal::COMPACTING_SUFFIX);
+  // Saves append to the journal from here on.
+  Journals::truncate(file + journal::SUFFIX, world->replayJournal(file + journal::SUFFIX));
+  world->trackSnapshot(file);
+  return world;
+}
+
+void Worlds::convertToSnapshot(const string& path, const string& file) {
+  load("convert", path)->saveSnapshot(file);
+}
+
+void Worlds::convertToYaml(const string& file, const string& path) {
+  loadSnapshot("convert", file)->save(path);
+}
 
 shared_ptr<IWorld> Worlds::load(const string& id, const string& path) {
   auto world = make_shared<World>(id);
   auto config = YAML::LoadFile(path + "/world.yaml");
-  for (auto const& objectConf : config["objects"])
-    loadObjectFromYaml(world, path, objectConf);
+  AssetStore assets(path + "/assets");
+  auto scripts = listScriptFiles(path);
+  for (auto const& objectConf : config["objects"]) {
+    auto object = objectFromYaml(path, objectConf, false, &assets, scripts);
+    world->createFromCommand(object);
+  }
 
   return world;
 }
 
-void loadObjectFromYaml(shared_ptr<IWorld> world, const string& path, YAML::Node objectConf) {
-  auto objectId = objectConf["id"].as<string>();
-  auto object = world->newObject(objectId);
-  object->setPosition(t::position{
-    objectConf["position"]["x"].as<double>(),
-    objectConf["position"]["y"].as<double>(),
-    objectConf["position"]["z"].as<double>()
-  });
-  object->setRotation(t::rotation{
-    objectConf["rotation"]["x"].as<double>(),
-    objectConf["rotation"]["y"].as<double>(),
-    objectConf["rotation"]["z"].as<double>(),
-    objectConf["rotation"]["w"].as<double>()
-  });
-  object->setScale(t::scale{
-    objectConf["scale"]["x"].as<double>(),
-    objectConf["scale"]["y"].as<double>(),
-    objectConf["scale"]["z"].as<double>()
-  });
-  for (auto const& pluginConf : objectConf["plugins"])
-    loadPluginFromYalm(world, objectId, path, pluginConf);
-}
-
-void loadPluginFromYalm(shared_ptr<IWorld> world, const string& objectId, const string& path, YAML::Node pluginConf) {
-  auto pluginId = pluginConf["id"].as<string>();
-  if (pluginConf["type"].as<string>() == "script") {
-    ifstream scriptFile(path + "/scripts/" + objectId +"_" + pluginId);
-    stringstream buffer;
-    buffer << scriptFile.rdbuf();
-    scriptFile.close();
-    world->saveScriptToObject(objectId, pluginId, buffer.str());
-  }
+shared_ptr<IWorld> Worlds::stream(const string& id, const string& path, const StreamOptions& options) {
+  auto world = make_shared<World>(id);
+  world->startStream(path, options);
+  return world;
 }
 
 void World::save(const string& path)  {
+  finishStream();
   auto worldPath = fs::path(path);
   if (!fs::exists(path))
     fs::create_directories(path);
 
-  auto scriptsPath = fs::path(path + "/scripts");
-  if (!fs::exists(scriptsPath))
-    fs::create_directories(scriptsPath);
+  // Each distinct source is stored once, named by its hash. Of the blobs
+  // the directory holds, only the ones the replaced world.yaml used and
+  // this save no longer does go. Loose script files go once their source
+  // is in the assets, unless they were edited since it was read.
+  AssetStore assets(path + "/assets");
+  std::unordered_map<string, string> hashes;
+  std::unordered_set<string> used;
+  std::unordered_set<string> previous;
+  if (fs::exists(path + "/world.yaml")) {
+    for (auto const& objectConf : YAML::LoadFile(path + "/world.yaml")["objects"]) {
+      for (auto const& pluginConf : objectConf["plugins"]) {
+        if (pluginConf["asset"])
+          previous.insert(pluginConf["asset"].as<string>());
+      }
+    }
+  }
+  std::unordered_set<string> looseFiles;
+  if (fs::is_directory(path + "/scripts")) {
+    for (auto const& entry : fs::directory_iterator(path + "/scripts"))
+      looseFiles.insert(entry.path().filename().string());
+  }
+  vector<std::pair<string, string>> migrated;
+  std::ostringstream blob;
 
   YAML::Emitter yaml;
   yaml.SetIndent(2);
@@ -216,7 +1170,8 @@ void World::save(const string& path)  {
   yaml << YAML::Key << "objects";
   yaml << YAML::Value << YAML::BeginSeq;
 
-  for (auto const& [objectId, object] : objects) {
+  for (auto const& objectId : listObjectIds()) {
+    auto object = findObject(objectId);
     yaml << YAML::BeginMap;
     yaml << YAML::Key << "id";
     yaml << YAML::Value << objectId;
@@ -241,15 +1196,48 @@ void World::save(const string& path)  {
     yaml << YAML::EndMap;
 
     yaml << YAML::Key << "plugins" << YAML::Value << YAML::BeginSeq;
-    for (auto const& pluginId : object->listPluginIds()) {
-      auto plugin = object->getPlugin(pluginId);
+    for (auto const& [pluginId, plugin] : object->getPlugins()) {
       yaml << YAML::BeginMap;
       yaml << YAML::Key << "id" << YAML::Value << pluginId;
+      // Bodies are a few numbers of their own, written in place.
+      if (plugin->getType() == IPlugin::Type::PHYSICS) {
+        auto body = Physics::getBody(plugin);
+        yaml << YAML::Key << "type" << YAML::Value << "physics";
+        yaml << YAML::Key << "mass" << YAML::Value << body.mass;
+        yaml << YAML::Key << "velocity" << YAML::Value << YAML::BeginMap;
+        yaml << YAML::Key << "x" << YAML::Value << body.velocity.x;
+        yaml << YAML::Key << "y" << YAML::Value << body.velocity.y;
+        yaml << YAML::Key << "z" << YAML::Value << body.velocity.z;
+        yaml << YAML::EndMap;
+        yaml << YAML::Key << "damping" << YAML::Value << body.damping;
+        yaml << YAML::EndMap;
+        continue;
+      }
+      // Native plugins point to their module, the config is theirs.
+      if (plugin->getType() == IPlugin::Type::NATIVE) {
+        auto spec = Natives::getSpec(plugin);
+        yaml << YAML::Key << "type" << YAML::Value << "native";
+        yaml << YAML::Key << "library" << YAML::Value << Natives::libraryFor(path, spec.library);
+        yaml << YAML::Key << "behaviour" << YAML::Value << spec.behaviour;
+        yaml << YAML::Key << "config" << YAML::Value << spec.config;
+        yaml << YAML::EndMap;
+        continue;
+      }
+
+      blob.str("");
+      plugin->saveTo(blob);
+      auto& hash = hashes[blob.str()];
+      if (hash.empty())
+        hash = assets.put(blob.str());
+      used.insert(hash);
+      if (plugin->getType() == IPlugin::Type::SCRIPT && looseFiles.contains(objectId + "_" + pluginId))
+        migrated.emplace_back(objectId + "_" + pluginId, blob.str());
       if (plugin->getType() == IPlugin::Type::SCRIPT)
         yaml << YAML::Key << "type" << YAML::Value << "script";
+      if (plugin->getType() == IPlugin::Type::COLLIDER)
+        yaml << YAML::Key << "type" << YAML::Value << "collider";
+      yaml << YAML::Key << "asset" << YAML::Value << hash;
       yaml << YAML::EndMap;
-
-      plugin->saveToFile(path + "/scripts/" + objectId + "_" + pluginId);
     }
     yaml << YAML::EndSeq;
 
@@ -262,6 +1250,179 @@ void World::save(const string& path)  {
   ofstream yamlOut(path + "/world.yaml");
   yamlOut << yaml.c_str();
   yamlOut.close();
+  assets.prune(previous, used);
+  for (auto const& [file, source] : migrated) {
+    std::ifstream in(path + "/scripts/" + file, std::ios::binary);
+    std::stringstream content;
+    content << in.rdbuf();
+    in.close();
+    if (content.str() == source)
+      fs::remove(path + "/scripts/" + file);
+  }
+  std::error_code notEmpty;
+  fs::remove(path + "/scripts", notEmpty);
+}
+
+// Objects are written and read back in store order, so that a loaded
+// snapshot saves to the same bytes.
+void World::saveSnapshot(const string& file) {
+  CORE_PROFILE_SCOPE("save snapshot");
+  finishStream();
+  if (file == snapshotFile)
+    waitCompaction();
+  SnapshotWriter writer;
+  std::ostringstream blob;
+  for (size_t i = 0; i < objects.size(); i++) {
+    writer.addObject(objects.ids[i], objects.positions[i], objects.rotations[i], objects.scales[i]);
+    for (auto const& [pluginId, plugin] : objects.payloads[i]->getPlugins()) {
+      blob.str("");
+      plugin->saveTo(blob);
+      writer.addPlugin(pluginId, plugin->getType(), blob.str());
+    }
+  }
+  writer.write(file);
+  // Journals next to the file describe changes to the old content, they
+  // go only once the new one is in place.
+  fs::remove(file + journal::SUFFIX);
+  fs::remove(file + journal::COMPACTING_SUFFIX);
+}
+
+void World::trackSnapshot(const string& file) {
+  snapshotFile = file;
+  snapshotBytes = fs::file_size(file);
+  deletedIds.clear();
+  std::fill(objects.dirty.begin(), objects.dirty.end(), CLEAN);
+}
+
+// Finding dirty objects is a scan over one byte per object, what gets
+// written is proportional to the changes only.
+void World::saveIncremental(const string& file) {
+  CORE_PROFILE_SCOPE("save incremental");
+  finishStream();
+  if (file != snapshotFile || !fs::exists(file)) {
+    saveSnapshot(file);
+    trackSnapshot(file);
+    return;
+  }
+
+  JournalWriter writer;
+  for (auto const& deletedId : deletedIds)
+    writer.remove(deletedId);
+  deletedIds.clear();
+
+  std::ostringstream blob;
+  for (size_t i = 0; i < objects.size(); i++) {
+    auto flags = objects.dirty[i];
+    if (flags == CLEAN)
+      continue;
+    objects.dirty[i] = CLEAN;
+    if ((flags & DIRTY_PLUGINS) == 0) {
+      writer.transform(objects.ids[i], objects.positions[i], objects.rotations[i], objects.scales[i]);
+      continue;
+    }
+    auto const& plugins = objects.payloads[i]->getPlugins();
+    writer.object(objects.ids[i], objects.positions[i], objects.rotations[i], objects.scales[i], plugins.size());
+    for (auto const& [pluginId, plugin] : plugins) {
+      blob.str("");
+      plugin->saveTo(blob);
+      writer.plugin(pluginId, plugin->getType(), blob.str());
+    }
+  }
+  if (writer.empty())
+    return;
+
+  auto journalBytes = writer.append(file + journal::SUFFIX);
+  if (journalBytes > std::max(COMPACT_MIN_BYTES, snapshotBytes / 2))
+    startCompaction();
+}
+
+vector<string> World::saveBatches(size_t batchBytes) {
+  CORE_PROFILE_SCOPE("save batches");
+  finishStream();
+  vector<string> batches;
+  JournalWriter writer;
+  std::ostringstream blob;
+  for (size_t i = 0; i < objects.size(); i++) {
+    auto const& plugins = objects.payloads[i]->getPlugins();
+    writer.object(objects.ids[i], objects.positions[i], objects.rotations[i], objects.scales[i], plugins.size());
+    for (auto const& [pluginId, plugin] : plugins) {
+      blob.str("");
+      plugin->saveTo(blob);
+      writer.plugin(pluginId, plugin->getType(), blob.str());
+    }
+    if (writer.size() >= batchBytes)
+      batches.push_back(writer.take());
+  }
+  if (!writer.empty())
+    batches.push_back(writer.take());
+  return batches;
+}
+
+// The journal is moved aside so that saves can keep appending to a new one
+// while the old one is folded into the snapshot. A journal left aside by a
+// failed compaction is folded first, the current one waits for next time.
+void World::startCompaction() {
+  if (compacting)
+    return;
+  waitCompaction();
+  auto aside = snapshotFile + journal::COMPACTING_SUFFIX;
+  if (!fs::exists(aside))
+    fs::rename(snapshotFile + journal::SUFFIX, aside);
+  compacting = true;
+  compaction = std::thread([this, file = snapshotFile, aside]() {
+    try {
+      Journals::compact(file, aside);
+      fs::remove(aside);
+      snapshotBytes = fs::file_size(file);
+    } catch (const std::exception& ex) {
+      Log::error(string("Journal compaction failed: ") + ex.what());
+    }
+    compacting = false;
+  });
+}
+
+uint64_t World::replayJournal(const string& file) {
+  return Journals::replay(file, [this](const JournalEntry& entry) {
+    auto objectId = string(entry.id);
+    if (entry.kind == journal::DELETE) {
+      deleteObject(objectId);
+      return;
+    }
+    auto object = findObject(objectId);
+    if (object == nullptr)
+      object = createObject(objectId);
+    object->setPosition(entry.position);
+    object->setRotation(entry.rotation);
+    object->setScale(entry.scale);
+    if (entry.kind != journal::OBJECT)
+      return;
+    object->clearPlugins();
+    for (auto const& plugin : entry.plugins) {
+      auto pluginId = string(plugin.id);
+      if (auto loaded = Plugins::fromBlob(pluginId, plugin.type, string(plugin.blob)))
+        object->addPlugin(pluginId, loaded);
+    }
+  });
+}
+
+void World::loadSnapshot(const Snapshot& snapshot) {
+  objects.reserve(objects.size() + snapshot.objectCount());
+  for (size_t i = 0; i < snapshot.objectCount(); i++) {
+    auto id = string(snapshot.objectId(i));
+    auto object = make_shared<Object>(id, &objects, &sleeps, &events, &bodies, &colliders, &natives);
+    auto handle = objects.create(id, object);
+    object->attach(handle);
+    objects.position(handle) = snapshot.position(i);
+    objects.rotation(handle) = snapshot.rotation(i);
+    objects.scale(handle) = snapshot.scale(i);
+
+    auto first = snapshot.firstPlugin(i);
+    for (auto p = first; p < first + snapshot.pluginCount(i); p++) {
+      auto pluginId = string(snapshot.pluginId(p));
+      if (auto plugin = Plugins::fromBlob(pluginId, snapshot.pluginType(p), string(snapshot.pluginBlob(p))))
+        object->addPlugin(pluginId, plugin);
+    }
+  }
 }
 
 }  // namespace core
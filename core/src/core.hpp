@@ -18,11 +18,14 @@
 #ifndef CORE_SRC_CORE_HPP_
 #define CORE_SRC_CORE_HPP_
 
+#include <functional>
 #include <memory>
+#include <ostream>
 #include <string>
 #include <vector>
 
 #include "types.hpp"
+#include "update_queue.hpp"
 
 using std::string;
 using std::vector;
@@ -34,35 +37,145 @@ class IWorld;
 class IObject;
 class IPlugin;
 
+struct StreamOptions {
+  // Objects added to the world at the start of each round.
+  size_t chunkSize = 1024;
+  // Decode objects on a separate thread instead of inside round().
+  bool background = false;
+  // Background mode: decoded objects allowed to wait for a round.
+  size_t maxBuffered = 8192;
+};
+
+struct LoadProgress {
+  size_t loaded = 0;
+  // Objects in the source, 0 while still unknown.
+  size_t total = 0;
+  bool done = true;
+  // Seconds since the load started, negative until reached.
+  double firstRoundSeconds = -1;
+  double loadedSeconds = -1;
+  // Why the load stopped early, the world then holds only part of its
+  // objects and refuses to be saved.
+  string error;
+};
+
+// Bodies of physics plugins (see physics.hpp) are integrated at the end
+// of every round, after the commands enqueued by plugins are applied.
+struct PhysicsOptions {
+  // Seconds of simulated time per round, the default TickLoop rate.
+  double timeStep = 1.0 / 30;
+  // Acceleration of every body with a mass. None by default: nothing
+  // stops bodies from falling forever yet.
+  t::double3 gravity;
+  // Bodies above this count are integrated in chunks of this size on the
+  // round workers, see IWorld::setWorkers.
+  size_t parallelChunk = 16384;
+};
+
 class Worlds {
  public:
   static shared_ptr<IWorld> createNew(const string& id);
   static shared_ptr<IWorld> load(const string& id, const string& path);
+  // Returns an empty world right away and adds the objects of path (a
+  // world.yaml directory or a snapshot file) a chunk per round. Scripts
+  // compile when they first run. Saving a world finishes its load first.
+  static shared_ptr<IWorld> stream(const string& id, const string& path, const StreamOptions& options = {});
+  // Binary snapshot of a whole world in a single file, see snapshot.hpp.
+  static shared_ptr<IWorld> loadSnapshot(const string& id, const string& file);
+  static void convertToSnapshot(const string& path, const string& file);
+  static void convertToYaml(const string& file, const string& path);
 };
 
 class IPlugin {
  public:
-  enum Type {SCRIPT};
+  enum Type {SCRIPT, PHYSICS, COLLIDER, NATIVE};
   virtual ~IPlugin() {}
   virtual const string& getId() = 0;
   virtual Type getType() = 0;
   virtual void saveToFile(const string& path) = 0;
+  // Same content saveToFile() writes, used to pack plugins in snapshots.
+  virtual void saveTo(std::ostream& out) = 0;
   virtual bool execute(IWorld* world, IObject* object) = 0;
 };
 
+class Plugins {
+ public:
+  // Plugin of the type from the blob its saveTo() wrote, nullptr for types
+  // this build does not know. Deferred scripts compile when first run.
+  static shared_ptr<IPlugin> fromBlob(const string& id, IPlugin::Type type, const string& blob, bool deferred = false);
+  // The same for blobs coming from other processes, which must not pick
+  // the code this one loads: native plugins are nullptr unless their
+  // module is allowed, see Natives::allowFromNetwork.
+  static shared_ptr<IPlugin> fromNetwork(const string& id, IPlugin::Type type, const string& blob,
+    bool deferred = false);
+};
+
+// Transforms are returned by value: objects keep them in the world's
+// store, where they move as other objects are created or deleted.
 class IObject {
  public:
   virtual ~IObject() {}
   virtual const string& getId() = 0;
+  // Target for commands sent through IWorld::enqueue.
+  virtual ObjectHandle getHandle() = 0;
   virtual void setPosition(const t::position& pos) = 0;
-  virtual const t::position& getPosition() = 0;
+  virtual t::position getPosition() = 0;
   virtual void setRotation(const t::rotation& pos) = 0;
-  virtual const t::rotation& getRotation() = 0;
+  virtual t::rotation getRotation() = 0;
   virtual void setScale(const t::scale& pos) = 0;
-  virtual const t::scale& getScale() = 0;
+  virtual t::scale getScale() = 0;
   virtual vector<string> listPluginIds() = 0;
+  virtual void removePlugin(const string& pluginId) = 0;
 };
 
+struct RayHit {
+  string objectId;
+  double distance;
+};
+
+// What a sleeping plugin waits for, the first one reached wakes it. A wait
+// with nothing set does not sleep.
+struct Wait {
+  // Round to wake in, counted from the current one: 1 is the next round.
+  uint64_t rounds = 0;
+  // Seconds from now, woken by the first round starting after them.
+  double seconds = 0;
+  // Name passed to IWorld::signal.
+  string signal;
+  // Events dispatched to the plugin on the object, see IWorld::subscribe.
+  bool events = false;
+};
+
+struct Event {
+  enum Type : uint8_t { TRANSFORM_CHANGED, OBJECT_CREATED, OBJECT_DELETED, COLLISION, CUSTOM };
+  Type type = CUSTOM;
+  // Object the event is about, and the other object of a collision.
+  string objectId;
+  string otherId;
+  // Custom events only.
+  string name;
+  string data;
+  // Collisions only, see collision.hpp: the contact point, the unit
+  // vector from the object towards the other, how deep they overlap and
+  // how fast they were closing along the normal.
+  t::position point;
+  t::double3 normal;
+  double depth = 0;
+  double speed = 0;
+};
+
+// Empty fields match anything.
+struct EventFilter {
+  Event::Type type = Event::CUSTOM;
+  string objectId;
+  // Custom events only.
+  string name;
+};
+
+// Called for each command about to be applied at the end of a round, with
+// the id of the object it targets. Commands on deleted objects are skipped.
+using UpdateListener = std::function<void(const string& objectId, const UpdateCommand& command)>;
+
 class IWorld {
  public:
   virtual ~IWorld() {}
@@ -70,11 +183,75 @@ class IWorld {
   virtual size_t objectCount() = 0;
   virtual shared_ptr<IObject> newObject(const string& id) = 0;
   virtual shared_ptr<IObject> getObject(const string& id) = 0;
+  // Object behind a handle without the id lookup, nullptr once deleted.
+  // The pointer is valid until the object is deleted.
+  virtual IObject* resolve(ObjectHandle handle) = 0;
   virtual vector<string> listObjectIds() = 0;
   virtual void deleteObject(const string& key) = 0;
+  // Spatial queries over object bounds: the unit cube centered on the
+  // object, scaled then rotated. While plugins run they see objects as
+  // they were when the round started.
+  virtual vector<string> queryRadius(const t::position& center, double radius) = 0;
+  virtual vector<string> queryBox(const t::position& min, const t::position& max) = 0;
+  // Nearest first, up to maxDistance along the normalized direction.
+  virtual vector<RayHit> queryRay(const t::position& origin, const t::double3& direction, double maxDistance) = 0;
+  // The count objects nearest to point, nearest first.
+  virtual vector<string> queryNearest(const t::position& point, size_t count) = 0;
   virtual void saveScriptToObject(const string& objectId, const string& pluginId, const string& code) = 0;
+  virtual void savePluginToObject(const string& objectId, shared_ptr<IPlugin> plugin) = 0;
+  // Commands are applied at the end of the round: first the ones enqueued
+  // by plugins, in object order, then the ones coming from other threads.
+  virtual void enqueue(UpdateCommand command) = 0;
+  // Returns the id to remove the listener with.
+  virtual uint64_t addUpdateListener(UpdateListener listener) = 0;
+  virtual void removeUpdateListener(uint64_t id) = 0;
+  // Lets round() skip the plugin on the object until the wait is over,
+  // which costs nothing per round while it lasts. Called by plugins from
+  // their own execute() or between rounds, it applies from the next round.
+  virtual void sleep(IObject* object, IPlugin* plugin, const Wait& wait) = 0;
+  // Wakes the plugins waiting for the signal at the start of the next
+  // round. Safe from any thread.
+  virtual void signal(const string& name) = 0;
+  // Events are batched: emitted ones, and the ones the world raises for
+  // transforms and objects, are handed to subscribers at the start of the
+  // next round. Each plugin on an object has its own queue, emptied by
+  // takeEvents(). All of these are safe from plugins while they run.
+  virtual void subscribe(IObject* object, IPlugin* plugin, const EventFilter& filter) = 0;
+  // Drops every subscription of the plugin on the object, and its queue.
+  virtual void unsubscribe(IObject* object, IPlugin* plugin) = 0;
+  // Event driven plugins sleep whenever their queue is empty at the end of
+  // a round, so they only run in rounds with events for them.
+  virtual void setEventDriven(IObject* object, IPlugin* plugin, bool driven) = 0;
+  virtual void emit(const Event& event) = 0;
+  virtual vector<Event> takeEvents(IObject* object, IPlugin* plugin) = 0;
+  // Recompiles the editable scripts of path (the world.yaml directory the
+  // world was loaded from), path/scripts/<object id>_<plugin id>, on a
+  // background thread whenever they change on disk, and swaps them into
+  // their plugin at the start of a round. Scripts that fail to compile
+  // keep running their previous version. Loading prefers these files to
+  // the assets, saving moves them into the assets. The assets themselves
+  // are never to be edited.
+  virtual void watchScripts(const string& path) = 0;
+  // Number of threads running plugins during round(), 1 runs them serially.
+  virtual void setWorkers(size_t workers) = 0;
+  // Plugins with a low priority id may be spread over several rounds when
+  // rounds run late, see TickScheduler.
+  virtual void setLowPriority(const string& pluginId, bool low) = 0;
+  // Low priority plugins run on one object out of spread each round, the
+  // objects taking turns, so each still runs them every spread rounds.
+  virtual void setLowPrioritySpread(size_t spread) = 0;
+  virtual void setPhysics(const PhysicsOptions& options) = 0;
   virtual void round() = 0;
+  virtual LoadProgress getLoadProgress() = 0;
   virtual void save(const string& path) = 0;
+  virtual void saveSnapshot(const string& file) = 0;
+  // Writes a full snapshot the first time, then appends only the objects
+  // changed since the previous save to a journal next to it. The journal
+  // is folded back into the snapshot in the background once it grows.
+  virtual void saveIncremental(const string& file) = 0;
+  // The whole world in memory, as journal batch payloads (see journal.hpp)
+  // of about batchBytes each holding one object entry per object.
+  virtual vector<string> saveBatches(size_t batchBytes) = 0;
 };
 
 }  // namespace core
@@ -0,0 +1,228 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "events.hpp"
+#include <algorithm>
+
+namespace core {
+
+uint64_t EventBus::objectKey(ObjectHandle object) {
+  return (static_cast<uint64_t>(object.index) << 32) | object.generation;
+}
+
+EventBus::Queue& EventBus::queueOf(ObjectHandle object, IPlugin* plugin) {
+  auto [found, added] = queueIds.try_emplace(Key{objectKey(object), plugin}, 0);
+  if (added) {
+    found->second = ++lastQueue;
+    queues.emplace(lastQueue, Queue{lastQueue, Receiver{object, plugin}});
+    objectQueues[objectKey(object)].push_back(lastQueue);
+  }
+  return queues.at(found->second);
+}
+
+void EventBus::routeKey(string* key, Event::Type type, const string& objectId, const string& name) {
+  key->assign(1, static_cast<char>('0' + type));
+  key->append(objectId);
+  key->push_back('\0');
+  key->append(name);
+}
+
+void EventBus::count(const EventFilter& filter, int delta) {
+  typeCounts[filter.type] += delta;
+  if (filter.objectId.empty()) {
+    anyObjectCounts[filter.type] += delta;
+    return;
+  }
+  string key(1, static_cast<char>('0' + filter.type));
+  key.append(filter.objectId);
+  if ((objectCounts[key] += delta) == 0)
+    objectCounts.erase(key);
+}
+
+void EventBus::subscribe(ObjectHandle object, IPlugin* plugin, const EventFilter& filter) {
+  auto normalized = filter;
+  if (normalized.type != Event::CUSTOM)
+    normalized.name.clear();
+  std::lock_guard<std::mutex> guard(lock);
+  auto& queue = queueOf(object, plugin);
+  for (auto const& existing : queue.filters) {
+    if (existing.type == normalized.type && existing.objectId == normalized.objectId && existing.name == normalized.name)
+      return;
+  }
+  string route;
+  routeKey(&route, normalized.type, normalized.objectId, normalized.name);
+  routes[route].push_back(queue.id);
+  count(normalized, 1);
+  queue.filters.push_back(std::move(normalized));
+}
+
+void EventBus::drop(uint64_t id) {
+  auto found = queues.find(id);
+  auto& queue = found->second;
+  string route;
+  for (auto const& filter : queue.filters) {
+    routeKey(&route, filter.type, filter.objectId, filter.name);
+    auto& ids = routes[route];
+    ids.erase(std::remove(ids.begin(), ids.end(), queue.id), ids.end());
+    if (ids.empty())
+      routes.erase(route);
+    count(filter, -1);
+  }
+  queueIds.erase(Key{objectKey(queue.receiver.object), queue.receiver.plugin});
+  queues.erase(found);
+}
+
+void EventBus::unsubscribe(ObjectHandle object, IPlugin* plugin) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto found = queueIds.find(Key{objectKey(object), plugin});
+  if (found == queueIds.end())
+    return;
+  auto id = found->second;
+  drop(id);
+  auto ids = objectQueues.find(objectKey(object));
+  std::erase(ids->second, id);
+  if (ids->second.empty())
+    objectQueues.erase(ids);
+}
+
+void EventBus::unsubscribe(ObjectHandle object) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto ids = objectQueues.find(objectKey(object));
+  if (ids == objectQueues.end())
+    return;
+  for (auto id : ids->second)
+    drop(id);
+  objectQueues.erase(ids);
+}
+
+void EventBus::setEventDriven(ObjectHandle object, IPlugin* plugin, bool driven) {
+  std::lock_guard<std::mutex> guard(lock);
+  if (!driven && !queueIds.contains(Key{objectKey(object), plugin}))
+    return;
+  auto& queue = queueOf(object, plugin);
+  queue.driven = driven;
+  if (driven && !queue.awake) {
+    queue.awake = true;
+    awake.push_back(queue.id);
+  }
+}
+
+void EventBus::emit(Event event) {
+  std::lock_guard<std::mutex> guard(emitLock);
+  emitted.push_back(std::move(event));
+}
+
+bool EventBus::wants(Event::Type type) {
+  std::lock_guard<std::mutex> guard(lock);
+  return typeCounts[type] > 0;
+}
+
+bool EventBus::wants(Event::Type type, const string& objectId) {
+  std::lock_guard<std::mutex> guard(lock);
+  if (typeCounts[type] == 0)
+    return false;
+  if (anyObjectCounts[type] > 0)
+    return true;
+  routeKey(&route, type, objectId, string());
+  route.pop_back();
+  return objectCounts.contains(route);
+}
+
+void EventBus::dispatch(vector<Receiver>* out) {
+  {
+    std::lock_guard<std::mutex> guard(emitLock);
+    dispatching.swap(emitted);
+  }
+  if (dispatching.empty())
+    return;
+  std::lock_guard<std::mutex> guard(lock);
+  dispatches++;
+  static const string any;
+  for (auto const& event : dispatching) {
+    lastEvent++;
+    auto const& name = event.type == Event::CUSTOM ? event.name : any;
+    routeKey(&route, event.type, event.objectId, name);
+    deliver(event, route, out);
+    if (!name.empty()) {
+      routeKey(&route, event.type, event.objectId, any);
+      deliver(event, route, out);
+    }
+    if (event.objectId.empty())
+      continue;
+    routeKey(&route, event.type, any, name);
+    deliver(event, route, out);
+    if (!name.empty()) {
+      routeKey(&route, event.type, any, any);
+      deliver(event, route, out);
+    }
+  }
+  dispatching.clear();
+}
+
+void EventBus::deliver(const Event& event, const string& route, vector<Receiver>* out) {
+  auto found = routes.find(route);
+  if (found == routes.end())
+    return;
+  for (auto id : found->second) {
+    auto& queue = queues.at(id);
+    if (queue.lastEvent == lastEvent)
+      continue;
+    queue.lastEvent = lastEvent;
+    if (queue.events.size() >= MAX_QUEUED) {
+      droppedEvents++;
+      continue;
+    }
+    queue.events.push_back(event);
+    if (queue.lastDispatch != dispatches) {
+      queue.lastDispatch = dispatches;
+      out->push_back(queue.receiver);
+    }
+    if (queue.driven && !queue.awake) {
+      queue.awake = true;
+      awake.push_back(queue.id);
+    }
+  }
+}
+
+vector<Event> EventBus::take(ObjectHandle object, IPlugin* plugin) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto found = queueIds.find(Key{objectKey(object), plugin});
+  if (found == queueIds.end())
+    return vector<Event>();
+  return std::exchange(queues.at(found->second).events, vector<Event>());
+}
+
+void EventBus::idle(vector<Receiver>* out) {
+  std::lock_guard<std::mutex> guard(lock);
+  std::erase_if(awake, [this, out](uint64_t id) {
+    auto found = queues.find(id);
+    if (found == queues.end())
+      return true;
+    auto& queue = found->second;
+    if (!queue.driven) {
+      queue.awake = false;
+      return true;
+    }
+    if (!queue.events.empty())
+      return false;
+    queue.awake = false;
+    out->push_back(queue.receiver);
+    return true;
+  });
+}
+
+}  // namespace core
@@ -0,0 +1,129 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORE_SRC_EVENTS_HPP_
+#define CORE_SRC_EVENTS_HPP_
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "core.hpp"
+#include "store.hpp"
+
+using std::string;
+using std::vector;
+
+namespace core {
+
+// Subscriptions of plugins on objects and their queues of events.
+// Emitted events wait for dispatch(), which the world calls once per
+// round: the cost is in the events and their subscribers, never in the
+// objects that have nothing to do with them. Everything is thread safe,
+// dispatch() excepted which must not overlap with plugins running.
+class EventBus {
+ public:
+  // Events past this many in one queue are dropped until it is taken.
+  static constexpr size_t MAX_QUEUED = 4096;
+
+  struct Receiver {
+    ObjectHandle object;
+    IPlugin* plugin = nullptr;
+  };
+
+  void subscribe(ObjectHandle object, IPlugin* plugin, const EventFilter& filter);
+  void unsubscribe(ObjectHandle object, IPlugin* plugin);
+  // Drops the subscriptions of every plugin of a deleted object.
+  void unsubscribe(ObjectHandle object);
+  void setEventDriven(ObjectHandle object, IPlugin* plugin, bool driven);
+
+  void emit(Event event);
+  // Whether an event of the type about the object would reach anyone:
+  // lets the world skip building events nobody listens to.
+  bool wants(Event::Type type, const string& objectId);
+  bool wants(Event::Type type);
+
+  // Moves the events emitted so far to the queues of their subscribers,
+  // and appends to out the receivers that got any.
+  void dispatch(vector<Receiver>* out);
+  vector<Event> take(ObjectHandle object, IPlugin* plugin);
+  // Event driven receivers that ran since they last got events and have
+  // none left, they are not reported again until they get more.
+  void idle(vector<Receiver>* out);
+
+  size_t dropped() const { return droppedEvents; }
+
+ private:
+  using Key = std::pair<uint64_t, IPlugin*>;
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return std::hash<uint64_t>()(key.first) ^ (std::hash<IPlugin*>()(key.second) * 31);
+    }
+  };
+  struct Queue {
+    uint64_t id;
+    Receiver receiver;
+    vector<EventFilter> filters;
+    vector<Event> events;
+    bool driven = false;
+    // Event driven and possibly running: checked by idle().
+    bool awake = false;
+    // Last event queued, so overlapping filters deliver it once, and the
+    // last dispatch reporting the receiver.
+    uint64_t lastEvent = 0;
+    uint64_t lastDispatch = 0;
+  };
+
+  static uint64_t objectKey(ObjectHandle object);
+  Queue& queueOf(ObjectHandle object, IPlugin* plugin);
+  // Subscriptions are grouped by type, object id and name.
+  static void routeKey(string* key, Event::Type type, const string& objectId, const string& name);
+  void count(const EventFilter& filter, int delta);
+  void drop(uint64_t id);
+  void deliver(const Event& event, const string& route, vector<Receiver>* out);
+
+  std::mutex lock;
+  std::unordered_map<uint64_t, Queue> queues;
+  std::unordered_map<Key, uint64_t, KeyHash> queueIds;
+  // Queues of each object, by object key.
+  std::unordered_map<uint64_t, vector<uint64_t>> objectQueues;
+  std::unordered_map<string, vector<uint64_t>> routes;
+  // Subscriptions per type, the ones on any object per type, and the ones
+  // per type and object id.
+  size_t typeCounts[Event::CUSTOM + 1] = {};
+  size_t anyObjectCounts[Event::CUSTOM + 1] = {};
+  std::unordered_map<string, size_t> objectCounts;
+  vector<uint64_t> awake;
+  uint64_t lastQueue = 0;
+  uint64_t lastEvent = 0;
+  uint64_t dispatches = 0;
+  size_t droppedEvents = 0;
+
+  std::mutex emitLock;
+  vector<Event> emitted;
+  vector<Event> dispatching;
+  string route;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_EVENTS_HPP_
@@ -0,0 +1,274 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "interest.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <variant>
+
+#include "profiler.hpp"
+
+namespace core {
+
+namespace {
+
+double distanceSquared(const t::position& a, const t::position& b) {
+  auto d = a - b;
+  return t::dot(d, d);
+}
+
+bool inside(const t::position& position, const t::position& center, double radius) {
+  return distanceSquared(position, center) <= radius * radius;
+}
+
+}  // namespace
+
+InterestManager::InterestManager(shared_ptr<IWorld> world) : world{world} {
+  listener = world->addUpdateListener([this](const string& objectId, const UpdateCommand& command) {
+    onUpdate(objectId, command);
+  });
+}
+
+InterestManager::~InterestManager() {
+  world->removeUpdateListener(listener);
+}
+
+uint32_t InterestManager::subscribe(const Interest& interest, shared_ptr<InterestSink> sink) {
+  Subscriber subscriber;
+  subscriber.id = nextId++;
+  subscriber.interest = interest;
+  subscriber.sink = sink;
+  subscriber.center = interest.center;
+  subscribers.push_back(std::move(subscriber));
+  return subscribers.back().id;
+}
+
+void InterestManager::setInterest(uint32_t subscriber, const Interest& interest) {
+  auto found = find(subscriber);
+  if (found == nullptr)
+    return;
+  found->interest = interest;
+  found->center = interest.center;
+  found->scanNeeded = true;
+}
+
+void InterestManager::unsubscribe(uint32_t subscriber) {
+  std::erase_if(subscribers, [subscriber](const Subscriber& s) { return s.id == subscriber; });
+}
+
+InterestManager::Subscriber* InterestManager::find(uint32_t subscriber) {
+  for (auto& s : subscribers)
+    if (s.id == subscriber)
+      return &s;
+  return nullptr;
+}
+
+uint32_t InterestManager::slot(const string& objectId) {
+  auto [found, added] = slots.try_emplace(objectId, 0);
+  if (!added)
+    return found->second;
+  if (freeSlots.empty()) {
+    found->second = static_cast<uint32_t>(slotIds.size());
+    slotIds.push_back(objectId);
+  } else {
+    found->second = freeSlots.back();
+    freeSlots.pop_back();
+    slotIds[found->second] = objectId;
+  }
+  stats.slots = slots.size();
+  return found->second;
+}
+
+// Subscribers forget the object first. Indexes still queued to enter or
+// refresh then find no object, or one that takes the slot later and is
+// checked like any other.
+void InterestManager::freeSlot(const string& objectId) {
+  auto found = slots.find(objectId);
+  if (found == slots.end())
+    return;
+  auto index = found->second;
+  for (auto& subscriber : subscribers) {
+    bool shown = subscriber.isShown(index);
+    subscriber.show(index, false);
+    subscriber.at(index) = Visible{};
+    if (shown)
+      subscriber.sink->leave(objectId);
+  }
+  slotIds[index].clear();
+  freeSlots.push_back(index);
+  slots.erase(found);
+  stats.slots = slots.size();
+}
+
+// Runs before the command is applied: a position command brings the new
+// position, other commands are filtered on the current one.
+void InterestManager::onUpdate(const string& objectId, const UpdateCommand& command) {
+  CORE_PROFILE_SCOPE("interest filter");
+  if (std::holds_alternative<command::DeleteObject>(command)) {
+    freeSlot(objectId);
+    return;
+  }
+  if (subscribers.empty())
+    return;
+  auto index = slot(objectId);
+
+  t::position position;
+  if (auto c = std::get_if<command::SetPosition>(&command)) {
+    position = c->position;
+  } else if (auto c = std::get_if<command::CreateObject>(&command)) {
+    position = c->position;
+  } else {
+    auto object = world->getObject(objectId);
+    if (object == nullptr)
+      return;
+    position = object->getPosition();
+  }
+  bool transformOnly = std::holds_alternative<command::SetPosition>(command)
+    || std::holds_alternative<command::SetRotation>(command)
+    || std::holds_alternative<command::SetScale>(command);
+
+  for (auto& subscriber : subscribers) {
+    auto const& interest = subscriber.interest;
+    // The followed object is the center, whatever the area still says.
+    auto d2 = objectId == interest.follow ? 0 : distanceSquared(position, subscriber.center);
+    if (d2 > interest.radius * interest.radius) {
+      if (subscriber.isShown(index)) {
+        subscriber.show(index, false);
+        subscriber.at(index).stale = false;
+        subscriber.sink->leave(objectId);
+      }
+      stats.dropped++;
+      continue;
+    }
+    auto& visible = subscriber.at(index);
+    // Announced whole at the next flush, once the command is applied.
+    if (!subscriber.isShown(index)) {
+      if (!visible.entering) {
+        visible.entering = true;
+        subscriber.entering.push_back(index);
+      }
+      continue;
+    }
+    if (!transformOnly || d2 <= interest.fullRateRadius * interest.fullRateRadius
+        || tick - visible.lastSent >= interval(subscriber, d2)) {
+      subscriber.sink->update(objectId, command);
+      visible.lastSent = tick;
+      stats.sent++;
+      continue;
+    }
+    if (!visible.stale) {
+      visible.stale = true;
+      subscriber.stale.push_back(index);
+    }
+    stats.throttled++;
+  }
+}
+
+void InterestManager::flush() {
+  CORE_PROFILE_SCOPE("interest flush");
+  tick++;
+  for (auto& subscriber : subscribers) {
+    auto const& interest = subscriber.interest;
+    if (!interest.follow.empty()) {
+      auto followed = world->getObject(interest.follow);
+      if (followed != nullptr)
+        subscriber.center = followed->getPosition();
+    }
+    auto rescan = interest.radius / 4;
+    if (subscriber.scanNeeded || distanceSquared(subscriber.center, subscriber.scannedAt) > rescan * rescan)
+      scan(&subscriber);
+
+    for (auto index : subscriber.entering) {
+      auto& visible = subscriber.at(index);
+      visible.entering = false;
+      auto object = world->getObject(slotIds[index]);
+      if (object == nullptr || subscriber.isShown(index) || !inside(object->getPosition(), subscriber.center, interest.radius))
+        continue;
+      visible = Visible{tick, false, false};
+      subscriber.show(index, true);
+      subscriber.sink->transform(object.get(), true);
+      stats.sent++;
+    }
+    subscriber.entering.clear();
+    refresh(&subscriber);
+  }
+}
+
+// Candidates come from the world's spatial index, flush checks them
+// again by position. Shown objects are checked for leaving.
+void InterestManager::scan(Subscriber* subscriber) {
+  auto radius = subscriber->interest.radius;
+  for (auto const& objectId : world->queryRadius(subscriber->center, radius)) {
+    auto index = slot(objectId);
+    auto& visible = subscriber->at(index);
+    if (!subscriber->isShown(index) && !visible.entering) {
+      visible.entering = true;
+      subscriber->entering.push_back(index);
+    }
+  }
+  for (uint32_t index = 0; index < subscriber->shown.size(); index++) {
+    if (!subscriber->shown[index])
+      continue;
+    auto object = world->getObject(slotIds[index]);
+    if (object != nullptr && inside(object->getPosition(), subscriber->center, radius))
+      continue;
+    subscriber->show(index, false);
+    subscriber->at(index).stale = false;
+    subscriber->sink->leave(slotIds[index]);
+  }
+  subscriber->scannedAt = subscriber->center;
+  subscriber->scanNeeded = false;
+  stats.scans++;
+}
+
+// Throttled objects get their latest transform once due, or leave if they
+// ended up outside.
+void InterestManager::refresh(Subscriber* subscriber) {
+  auto const& interest = subscriber->interest;
+  std::erase_if(subscriber->stale, [&](uint32_t index) {
+    auto& visible = subscriber->at(index);
+    auto object = world->getObject(slotIds[index]);
+    if (!subscriber->isShown(index) || !visible.stale || object == nullptr)
+      return true;
+    auto d2 = distanceSquared(object->getPosition(), subscriber->center);
+    if (d2 > interest.radius * interest.radius) {
+      subscriber->show(index, false);
+      visible.stale = false;
+      subscriber->sink->leave(slotIds[index]);
+      return true;
+    }
+    if (tick - visible.lastSent < interval(*subscriber, d2))
+      return false;
+    subscriber->sink->transform(object.get(), false);
+    visible.lastSent = tick;
+    visible.stale = false;
+    stats.sent++;
+    return true;
+  });
+}
+
+uint64_t InterestManager::interval(const Subscriber& subscriber, double distanceSquared) const {
+  auto const& interest = subscriber.interest;
+  auto band = interest.radius - interest.fullRateRadius;
+  if (band <= 0 || interest.maxInterval <= 1)
+    return 1;
+  auto far = std::clamp((std::sqrt(distanceSquared) - interest.fullRateRadius) / band, 0.0, 1.0);
+  return 1 + static_cast<uint64_t>(std::lround(far * (interest.maxInterval - 1)));
+}
+
+}  // namespace core
@@ -0,0 +1,147 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_INTEREST_HPP_
+#define CORE_SRC_INTEREST_HPP_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "core.hpp"
+
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+namespace core {
+
+// Area of interest of one subscriber (a core or terminal): a sphere that
+// may follow an object, usually the subscriber's own avatar.
+struct Interest {
+  // Object the area moves with, center is used while empty or missing.
+  string follow;
+  t::position center = t::position{0, 0, 0};
+  double radius = 50;
+  // Inside this distance every update is sent. Further out transform
+  // updates of an object are sent at most every 1 to maxInterval
+  // flushes, growing with the distance.
+  double fullRateRadius = 10;
+  uint32_t maxInterval = 8;
+};
+
+// Receives what a subscriber should see, on the world thread.
+class InterestSink {
+ public:
+  virtual ~InterestSink() {}
+  // Drained commands on objects inside the area.
+  virtual void update(const string& objectId, const UpdateCommand& command) = 0;
+  // The current transform of an object that entered the area, or of a far
+  // one whose throttled updates are due.
+  virtual void transform(IObject* object, bool entered) = 0;
+  virtual void leave(const string& objectId) = 0;
+};
+
+struct InterestStats {
+  // Per subscriber, updates sent, throttled or dropped as out of the area.
+  uint64_t sent = 0;
+  uint64_t throttled = 0;
+  uint64_t dropped = 0;
+  uint64_t scans = 0;
+  // Objects indexed, deleted ones give their slot back.
+  size_t slots = 0;
+};
+
+// Filters the commands a world drains per subscriber, by distance from
+// the subscriber to the object. Objects are checked when commands about
+// them are drained, and the area is queried again from the world's spatial
+// index when it moved by more than a quarter of its radius.
+class InterestManager {
+ public:
+  explicit InterestManager(shared_ptr<IWorld> world);
+  ~InterestManager();
+  InterestManager(const InterestManager&) = delete;
+  InterestManager& operator=(const InterestManager&) = delete;
+
+  uint32_t subscribe(const Interest& interest, shared_ptr<InterestSink> sink);
+  void setInterest(uint32_t subscriber, const Interest& interest);
+  void unsubscribe(uint32_t subscriber);
+
+  // Call after each round: moves the areas that follow objects, announces
+  // the objects that entered and sends the throttled transforms now due.
+  void flush();
+  const InterestStats& getStats() const { return stats; }
+
+ private:
+  // What a subscriber knows of an object, by object slot. Whether it is
+  // shown lives apart, most commands only need that bit.
+  struct Visible {
+    uint64_t lastSent = 0;
+    bool stale = false;
+    bool entering = false;
+  };
+  struct Subscriber {
+    uint32_t id;
+    Interest interest;
+    shared_ptr<InterestSink> sink;
+    t::position center;
+    t::position scannedAt;
+    bool scanNeeded = true;
+    vector<Visible> objects;
+    vector<bool> shown;
+    vector<uint32_t> entering;
+    vector<uint32_t> stale;
+
+    Visible& at(uint32_t slot) {
+      if (slot >= objects.size())
+        objects.resize(slot + 1);
+      return objects[slot];
+    }
+    bool isShown(uint32_t slot) const { return slot < shown.size() && shown[slot]; }
+    void show(uint32_t slot, bool value) {
+      if (slot >= shown.size())
+        shown.resize(slot + 1);
+      shown[slot] = value;
+    }
+  };
+
+  // Object ids are hashed once per command, subscribers index by slot.
+  // Slots of deleted objects are reused, as the store does.
+  uint32_t slot(const string& objectId);
+  void freeSlot(const string& objectId);
+  void onUpdate(const string& objectId, const UpdateCommand& command);
+  void scan(Subscriber* subscriber);
+  void refresh(Subscriber* subscriber);
+  uint64_t interval(const Subscriber& subscriber, double distanceSquared) const;
+  Subscriber* find(uint32_t subscriber);
+
+  shared_ptr<IWorld> world;
+  uint64_t listener;
+  vector<Subscriber> subscribers;
+  std::unordered_map<string, uint32_t> slots;
+  vector<string> slotIds;
+  vector<uint32_t> freeSlots;
+  uint32_t nextId = 1;
+  uint64_t tick = 0;
+  InterestStats stats;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_INTEREST_HPP_
@@ -0,0 +1,299 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "journal.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+
+#include "snapshot.hpp"
+
+using std::ifstream;
+using std::ofstream;
+using std::runtime_error;
+using std::stringstream;
+using std::unordered_map;
+namespace fs = std::filesystem;
+
+namespace core {
+
+uint64_t Journals::checksum(string_view data) {
+  uint64_t hash = 14695981039346656037ull;
+  for (auto c : data) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+void JournalWriter::putString(const string& value) {
+  auto size = static_cast<uint32_t>(value.size());
+  put(&size, sizeof(size));
+  put(value.data(), value.size());
+}
+
+void JournalWriter::putTransforms(const t::position& position, const t::rotation& rotation, const t::scale& scale) {
+  double values[10] = {
+    position.x, position.y, position.z,
+    rotation.x, rotation.y, rotation.z, rotation.w,
+    scale.x, scale.y, scale.z
+  };
+  put(values, sizeof(values));
+}
+
+void JournalWriter::transform(const string& id, const t::position& position, const t::rotation& rotation,
+    const t::scale& scale) {
+  payload.push_back(journal::TRANSFORM);
+  putString(id);
+  putTransforms(position, rotation, scale);
+}
+
+void JournalWriter::object(const string& id, const t::position& position, const t::rotation& rotation,
+    const t::scale& scale, size_t pluginCount) {
+  payload.push_back(journal::OBJECT);
+  putString(id);
+  putTransforms(position, rotation, scale);
+  auto count = static_cast<uint32_t>(pluginCount);
+  put(&count, sizeof(count));
+}
+
+void JournalWriter::plugin(const string& id, IPlugin::Type type, const string& blob) {
+  auto pluginType = static_cast<uint32_t>(type);
+  put(&pluginType, sizeof(pluginType));
+  putString(id);
+  auto size = static_cast<uint64_t>(blob.size());
+  put(&size, sizeof(size));
+  put(blob.data(), blob.size());
+}
+
+void JournalWriter::remove(const string& id) {
+  payload.push_back(journal::DELETE);
+  putString(id);
+}
+
+uint64_t JournalWriter::append(const string& file) {
+  uint64_t before = fs::exists(file) ? fs::file_size(file) : 0;
+  bool fresh = before == 0;
+  ofstream journalOut(file, std::ios::binary | std::ios::app);
+  if (fresh) {
+    journalOut.write(journal::MAGIC, sizeof(journal::MAGIC));
+    journalOut.write(reinterpret_cast<const char*>(&journal::VERSION), sizeof(journal::VERSION));
+  }
+  uint64_t header[2] = {payload.size(), Journals::checksum(payload)};
+  journalOut.write(reinterpret_cast<const char*>(header), sizeof(header));
+  journalOut.write(payload.data(), payload.size());
+  journalOut.close();
+  if (!journalOut) {
+    std::error_code error;
+    fs::resize_file(file, before, error);
+    throw runtime_error("cannot append to journal " + file);
+  }
+  payload.clear();
+  return fs::file_size(file);
+}
+
+string JournalWriter::take() {
+  string result;
+  result.swap(payload);
+  return result;
+}
+
+// Sequential reader over a batch payload, throws when an entry overruns it.
+class JournalReader {
+ public:
+  explicit JournalReader(string_view data) : data{data} {}
+
+  bool done() const { return position == data.size(); }
+
+  template <typename T>
+  T read() {
+    T value;
+    std::memcpy(&value, take(sizeof(T)).data(), sizeof(T));
+    return value;
+  }
+  string_view take(size_t size) {
+    if (size > data.size() - position)
+      throw runtime_error("truncated journal entry");
+    auto result = data.substr(position, size);
+    position += size;
+    return result;
+  }
+  string_view readString() { return take(read<uint32_t>()); }
+
+ private:
+  string_view data;
+  size_t position = 0;
+};
+
+static void readEntry(JournalReader* reader, JournalEntry* entry) {
+  entry->kind = static_cast<journal::Kind>(reader->read<uint8_t>());
+  entry->id = reader->readString();
+  entry->plugins.clear();
+  if (entry->kind == journal::DELETE)
+    return;
+  if (entry->kind != journal::TRANSFORM && entry->kind != journal::OBJECT)
+    throw runtime_error("unknown journal entry " + std::to_string(entry->kind));
+
+  double values[10];
+  std::memcpy(values, reader->take(sizeof(values)).data(), sizeof(values));
+  entry->position = t::position{values[0], values[1], values[2]};
+  entry->rotation = t::rotation{values[3], values[4], values[5], values[6]};
+  entry->scale = t::scale{values[7], values[8], values[9]};
+  if (entry->kind == journal::TRANSFORM)
+    return;
+
+  auto count = reader->read<uint32_t>();
+  for (uint32_t i = 0; i < count; i++) {
+    JournalPlugin plugin;
+    plugin.type = static_cast<IPlugin::Type>(reader->read<uint32_t>());
+    plugin.id = reader->readString();
+    plugin.blob = reader->take(reader->read<uint64_t>());
+    entry->plugins.push_back(plugin);
+  }
+}
+
+uint64_t Journals::replay(const string& file, const function<void(const JournalEntry&)>& apply) {
+  if (!fs::exists(file))
+    return 0;
+  ifstream journalIn(file, std::ios::binary);
+  stringstream buffer;
+  buffer << journalIn.rdbuf();
+  auto content = buffer.str();
+
+  // The first append was cut short.
+  constexpr auto HEADER_SIZE = sizeof(journal::MAGIC) + sizeof(uint32_t);
+  if (content.size() < HEADER_SIZE && std::memcmp(content.data(), journal::MAGIC, content.size()) == 0)
+    return 0;
+  JournalReader reader(content);
+  if (content.size() < HEADER_SIZE
+      || std::memcmp(reader.take(sizeof(journal::MAGIC)).data(), journal::MAGIC, sizeof(journal::MAGIC)) != 0)
+    throw runtime_error("invalid journal " + file);
+  auto version = reader.read<uint32_t>();
+  if (version != journal::VERSION)
+    throw runtime_error("unsupported journal version " + std::to_string(version));
+
+  uint64_t end = HEADER_SIZE;
+  while (true) {
+    // Whatever follows an incomplete or corrupted batch was never committed.
+    if (reader.done())
+      break;
+    string_view payload;
+    try {
+      auto size = reader.read<uint64_t>();
+      auto sum = reader.read<uint64_t>();
+      payload = reader.take(size);
+      if (checksum(payload) != sum)
+        break;
+    } catch (const runtime_error&) {
+      break;
+    }
+    read(payload, apply);
+    end = payload.data() + payload.size() - content.data();
+  }
+  return end;
+}
+
+void Journals::truncate(const string& file, uint64_t end) {
+  if (fs::exists(file) && fs::file_size(file) > end)
+    fs::resize_file(file, end);
+}
+
+void Journals::read(string_view payload, const function<void(const JournalEntry&)>& apply) {
+  JournalReader entries(payload);
+  JournalEntry entry;
+  while (!entries.done()) {
+    readEntry(&entries, &entry);
+    apply(entry);
+  }
+}
+
+void Journals::compact(const string& snapshotFile, const string& journalFile) {
+  struct Plugin {
+    string id;
+    IPlugin::Type type;
+    string blob;
+  };
+  struct Object {
+    string id;
+    t::position position;
+    t::rotation rotation;
+    t::scale scale;
+    vector<Plugin> plugins;
+    bool deleted = false;
+  };
+
+  vector<Object> objects;
+  unordered_map<string, size_t> index;
+  {
+    Snapshot snapshot(snapshotFile);
+    objects.resize(snapshot.objectCount());
+    index.reserve(snapshot.objectCount());
+    for (size_t i = 0; i < snapshot.objectCount(); i++) {
+      auto& object = objects[i];
+      object.id = string(snapshot.objectId(i));
+      object.position = snapshot.position(i);
+      object.rotation = snapshot.rotation(i);
+      object.scale = snapshot.scale(i);
+      auto first = snapshot.firstPlugin(i);
+      for (auto p = first; p < first + snapshot.pluginCount(i); p++)
+        object.plugins.push_back(Plugin{
+          string(snapshot.pluginId(p)), snapshot.pluginType(p), string(snapshot.pluginBlob(p))});
+      index[object.id] = i;
+    }
+  }
+
+  replay(journalFile, [&](const JournalEntry& entry) {
+    auto id = string(entry.id);
+    auto it = index.find(id);
+    if (entry.kind == journal::DELETE) {
+      if (it != index.end()) {
+        objects[it->second].deleted = true;
+        index.erase(it);
+      }
+      return;
+    }
+    if (it == index.end()) {
+      it = index.emplace(id, objects.size()).first;
+      objects.emplace_back();
+      objects.back().id = id;
+    }
+    auto& object = objects[it->second];
+    object.position = entry.position;
+    object.rotation = entry.rotation;
+    object.scale = entry.scale;
+    if (entry.kind == journal::OBJECT) {
+      object.plugins.clear();
+      for (auto const& plugin : entry.plugins)
+        object.plugins.push_back(Plugin{string(plugin.id), plugin.type, string(plugin.blob)});
+    }
+  });
+
+  SnapshotWriter writer;
+  for (auto const& object : objects) {
+    if (object.deleted)
+      continue;
+    writer.addObject(object.id, object.position, object.rotation, object.scale);
+    for (auto const& plugin : object.plugins)
+      writer.addPlugin(plugin.id, plugin.type, plugin.blob);
+  }
+  writer.write(snapshotFile);
+}
+
+}  // namespace core
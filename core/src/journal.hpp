@@ -0,0 +1,128 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_JOURNAL_HPP_
+#define CORE_SRC_JOURNAL_HPP_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "core.hpp"
+#include "types.hpp"
+
+using std::function;
+using std::string;
+using std::string_view;
+using std::vector;
+
+namespace core {
+
+// Append only log of the changes made to a world since its snapshot was
+// written. Each save appends one batch:
+//
+//   uint64 payload size
+//   uint64 payload checksum (FNV-1a)
+//   entries
+//
+// so that a batch cut short by a crash is detected and dropped on replay.
+// Entries carry whole object state, replaying a batch twice is harmless.
+namespace journal {
+
+constexpr char MAGIC[8] = {'V', 'R', 'J', 'O', 'U', 'R', 'N', '\0'};
+constexpr uint32_t VERSION = 1;
+
+// Journal files sit next to the snapshot they apply to. While compaction
+// runs, the journal being folded in is renamed with the second suffix.
+constexpr char SUFFIX[] = ".journal";
+constexpr char COMPACTING_SUFFIX[] = ".journal.compacting";
+
+enum Kind : uint8_t {
+  TRANSFORM = 1,  // id, transforms
+  OBJECT = 2,     // id, transforms, full plugin list
+  DELETE = 3      // id
+};
+
+}  // namespace journal
+
+struct JournalPlugin {
+  string_view id;
+  IPlugin::Type type;
+  string_view blob;
+};
+
+// Views point into the replay buffer and are only valid during the callback.
+struct JournalEntry {
+  journal::Kind kind;
+  string_view id;
+  t::position position;
+  t::rotation rotation;
+  t::scale scale;
+  vector<JournalPlugin> plugins;
+};
+
+// Builds one batch in memory. Plugins belong to the last object() entry.
+class JournalWriter {
+ public:
+  bool empty() const { return payload.empty(); }
+  size_t size() const { return payload.size(); }
+  void transform(const string& id, const t::position& position, const t::rotation& rotation, const t::scale& scale);
+  void object(const string& id, const t::position& position, const t::rotation& rotation, const t::scale& scale,
+    size_t pluginCount);
+  void plugin(const string& id, IPlugin::Type type, const string& blob);
+  void remove(const string& id);
+
+  // Appends the batch to the journal file, creating it if needed, and
+  // returns the resulting journal size. The writer is left empty. A failed
+  // append is cut off again, later ones must not follow a torn batch.
+  uint64_t append(const string& file);
+  // Hands over the batch payload instead, leaving the writer empty.
+  string take();
+
+ private:
+  void put(const void* data, size_t size) { payload.append(static_cast<const char*>(data), size); }
+  void putString(const string& value);
+  void putTransforms(const t::position& position, const t::rotation& rotation, const t::scale& scale);
+
+  string payload;
+};
+
+class Journals {
+ public:
+  // Calls apply for every entry of every complete batch, in order, and
+  // returns the offset right after the last one. A missing file, or one
+  // cut short within its header, replays nothing and returns 0.
+  static uint64_t replay(const string& file, const function<void(const JournalEntry&)>& apply);
+  // Cuts the journal at the offset replay returned: batches appended after
+  // a torn one would never be replayed.
+  static void truncate(const string& file, uint64_t end);
+  // Calls apply for every entry of a batch payload, throws
+  // std::runtime_error when it is truncated.
+  static void read(string_view payload, const function<void(const JournalEntry&)>& apply);
+  // FNV-1a, as batches are checked with.
+  static uint64_t checksum(string_view data);
+
+  // Folds the journal into the snapshot without creating any plugin: the
+  // result goes to a temporary file that then replaces the snapshot.
+  static void compact(const string& snapshotFile, const string& journalFile);
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_JOURNAL_HPP_
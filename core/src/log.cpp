@@ -0,0 +1,43 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "log.hpp"
+#include <cstdio>
+#include <mutex>
+
+namespace core {
+
+namespace {
+
+std::mutex lock;
+Log::Sink sink = [](const string& message) { fprintf(stderr, "%s\n", message.c_str()); };
+
+}  // namespace
+
+Log::Sink Log::setSink(Sink next) {
+  std::lock_guard<std::mutex> guard(lock);
+  std::swap(sink, next);
+  return next;
+}
+
+void Log::error(const string& message) {
+  std::lock_guard<std::mutex> guard(lock);
+  if (sink != nullptr)
+    sink(message);
+}
+
+}  // namespace core
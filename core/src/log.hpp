@@ -0,0 +1,43 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_LOG_HPP_
+#define CORE_SRC_LOG_HPP_
+
+#include <functional>
+#include <string>
+
+using std::string;
+
+namespace core {
+
+// Diagnostics with nobody to return them to, such as script errors and
+// failures of background threads. They go to stderr unless another sink
+// is set; a null sink drops them. Sinks are called under a lock, from
+// whatever thread hit the problem.
+class Log {
+ public:
+  using Sink = std::function<void(const string& message)>;
+
+  // Returns the sink set before.
+  static Sink setSink(Sink sink);
+  static void error(const string& message);
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_LOG_HPP_
@@ -0,0 +1,209 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "math.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define CORE_MATH_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace t::batch {
+
+#ifdef CORE_MATH_SSE2
+
+// Quaternions as one register of floats or two of doubles (xy, zw).
+// The product is w * b plus the other three components of a, each times a
+// signed permutation of b, see t::operator*(quat, quat).
+
+static inline __m128 multiply(__m128 a, __m128 b) {
+  const __m128 signX = _mm_setr_ps(1, -1, 1, -1);
+  const __m128 signY = _mm_setr_ps(1, 1, -1, -1);
+  const __m128 signZ = _mm_setr_ps(-1, 1, 1, -1);
+  auto r = _mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 3, 3, 3)), b);
+  r = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(0, 0, 0, 0)),
+    _mm_shuffle_ps(b, b, _MM_SHUFFLE(0, 1, 2, 3))), signX));
+  r = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 1, 1, 1)),
+    _mm_shuffle_ps(b, b, _MM_SHUFFLE(1, 0, 3, 2))), signY));
+  r = _mm_add_ps(r, _mm_mul_ps(_mm_mul_ps(_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 2, 2, 2)),
+    _mm_shuffle_ps(b, b, _MM_SHUFFLE(2, 3, 0, 1))), signZ));
+  return r;
+}
+
+static inline void multiply(__m128d axy, __m128d azw, __m128d bxy, __m128d bzw, __m128d* rxy, __m128d* rzw) {
+  const __m128d plusMinus = _mm_setr_pd(1, -1);
+  const __m128d minusMinus = _mm_setr_pd(-1, -1);
+  const __m128d minusPlus = _mm_setr_pd(-1, 1);
+  auto ax = _mm_unpacklo_pd(axy, axy);
+  auto ay = _mm_unpackhi_pd(axy, axy);
+  auto az = _mm_unpacklo_pd(azw, azw);
+  auto aw = _mm_unpackhi_pd(azw, azw);
+  auto byx = _mm_shuffle_pd(bxy, bxy, 1);
+  auto bwz = _mm_shuffle_pd(bzw, bzw, 1);
+
+  auto lo = _mm_mul_pd(aw, bxy);
+  auto hi = _mm_mul_pd(aw, bzw);
+  // x: (bw, -bz, by, -bx)
+  lo = _mm_add_pd(lo, _mm_mul_pd(ax, _mm_mul_pd(bwz, plusMinus)));
+  hi = _mm_add_pd(hi, _mm_mul_pd(ax, _mm_mul_pd(byx, plusMinus)));
+  // y: (bz, bw, -bx, -by)
+  lo = _mm_add_pd(lo, _mm_mul_pd(ay, bzw));
+  hi = _mm_add_pd(hi, _mm_mul_pd(ay, _mm_mul_pd(bxy, minusMinus)));
+  // z: (-by, bx, bw, -bz)
+  lo = _mm_add_pd(lo, _mm_mul_pd(az, _mm_mul_pd(byx, minusPlus)));
+  hi = _mm_add_pd(hi, _mm_mul_pd(az, _mm_mul_pd(bwz, plusMinus)));
+  *rxy = lo;
+  *rzw = hi;
+}
+
+void transformPoints(const mat4f& m, const float3* points, float3* out, size_t count) {
+  auto c0 = _mm_load_ps(&m.m[0]);
+  auto c1 = _mm_load_ps(&m.m[4]);
+  auto c2 = _mm_load_ps(&m.m[8]);
+  auto c3 = _mm_load_ps(&m.m[12]);
+  for (size_t i = 0; i < count; i++) {
+    auto p = points[i];
+    auto r = _mm_add_ps(
+      _mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(p.x)), _mm_mul_ps(c1, _mm_set1_ps(p.y))),
+      _mm_add_ps(_mm_mul_ps(c2, _mm_set1_ps(p.z)), c3));
+    alignas(16) float result[4];
+    _mm_store_ps(result, r);
+    out[i] = float3{result[0], result[1], result[2]};
+  }
+}
+
+void transformPoints(const mat4d& m, const double3* points, double3* out, size_t count) {
+  auto c0xy = _mm_load_pd(&m.m[0]);
+  auto c0zw = _mm_load_pd(&m.m[2]);
+  auto c1xy = _mm_load_pd(&m.m[4]);
+  auto c1zw = _mm_load_pd(&m.m[6]);
+  auto c2xy = _mm_load_pd(&m.m[8]);
+  auto c2zw = _mm_load_pd(&m.m[10]);
+  auto c3xy = _mm_load_pd(&m.m[12]);
+  auto c3zw = _mm_load_pd(&m.m[14]);
+  for (size_t i = 0; i < count; i++) {
+    auto x = _mm_set1_pd(points[i].x);
+    auto y = _mm_set1_pd(points[i].y);
+    auto z = _mm_set1_pd(points[i].z);
+    auto xy = _mm_add_pd(_mm_add_pd(_mm_mul_pd(c0xy, x), _mm_mul_pd(c1xy, y)), _mm_add_pd(_mm_mul_pd(c2xy, z), c3xy));
+    auto zw = _mm_add_pd(_mm_add_pd(_mm_mul_pd(c0zw, x), _mm_mul_pd(c1zw, y)), _mm_add_pd(_mm_mul_pd(c2zw, z), c3zw));
+    _mm_storeu_pd(&out[i].x, xy);
+    _mm_store_sd(&out[i].z, zw);
+  }
+}
+
+void multiply(const quatf* a, const quatf* b, quatf* out, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    _mm_store_ps(&out[i].x, multiply(_mm_load_ps(&a[i].x), _mm_load_ps(&b[i].x)));
+}
+
+void multiply(const quatd* a, const quatd* b, quatd* out, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    __m128d xy, zw;
+    multiply(_mm_load_pd(&a[i].x), _mm_load_pd(&a[i].z), _mm_load_pd(&b[i].x), _mm_load_pd(&b[i].z), &xy, &zw);
+    _mm_store_pd(&out[i].x, xy);
+    _mm_store_pd(&out[i].z, zw);
+  }
+}
+
+void normalize(quatf* q, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    auto v = _mm_load_ps(&q[i].x);
+    auto squares = _mm_mul_ps(v, v);
+    auto sum = _mm_add_ps(squares, _mm_shuffle_ps(squares, squares, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum = _mm_add_ps(sum, _mm_shuffle_ps(sum, sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    if (_mm_cvtss_f32(sum) == 0)
+      continue;
+    _mm_store_ps(&q[i].x, _mm_div_ps(v, _mm_sqrt_ps(sum)));
+  }
+}
+
+void normalize(quatd* q, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    auto xy = _mm_load_pd(&q[i].x);
+    auto zw = _mm_load_pd(&q[i].z);
+    auto squares = _mm_add_pd(_mm_mul_pd(xy, xy), _mm_mul_pd(zw, zw));
+    auto sum = _mm_add_pd(squares, _mm_shuffle_pd(squares, squares, 1));
+    if (_mm_cvtsd_f64(sum) == 0)
+      continue;
+    auto length = _mm_sqrt_pd(sum);
+    _mm_store_pd(&q[i].x, _mm_div_pd(xy, length));
+    _mm_store_pd(&q[i].z, _mm_div_pd(zw, length));
+  }
+}
+
+#else
+
+void transformPoints(const mat4f& m, const float3* points, float3* out, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    out[i] = transformPoint(m, points[i]);
+}
+
+void transformPoints(const mat4d& m, const double3* points, double3* out, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    out[i] = transformPoint(m, points[i]);
+}
+
+void multiply(const quatf* a, const quatf* b, quatf* out, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    out[i] = a[i] * b[i];
+}
+
+void multiply(const quatd* a, const quatd* b, quatd* out, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    out[i] = a[i] * b[i];
+}
+
+void normalize(quatf* q, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    q[i] = t::normalize(q[i]);
+}
+
+void normalize(quatd* q, size_t count) {
+  for (size_t i = 0; i < count; i++)
+    q[i] = t::normalize(q[i]);
+}
+
+#endif  // CORE_MATH_SSE2
+
+// Rotation products go through the quaternion kernel, the rest is simple
+// enough for the compiler to vectorize.
+template <typename T>
+static void composeTransforms(const transform<T>* parents, const transform<T>* children, transform<T>* out,
+    size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    auto const& parent = parents[i];
+    auto const& child = children[i];
+    auto position = parent.position + rotate(parent.rotation, parent.scale * child.position);
+    auto scale = parent.scale * child.scale;
+    multiply(&parent.rotation, &child.rotation, &out[i].rotation, 1);
+    out[i].position = position;
+    out[i].scale = scale;
+  }
+}
+
+void compose(const transform<float>* parents, const transform<float>* children, transform<float>* out,
+    size_t count) {
+  composeTransforms(parents, children, out, count);
+}
+
+void compose(const transform<double>* parents, const transform<double>* children, transform<double>* out,
+    size_t count) {
+  composeTransforms(parents, children, out, count);
+}
+
+}  // namespace t::batch
@@ -0,0 +1,51 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_MATH_HPP_
+#define CORE_SRC_MATH_HPP_
+
+#include <cstddef>
+
+#include "types.hpp"
+
+// Batch kernels over arrays of math types. They use SSE2 where available
+// (any x86-64 target) and fall back to the scalar functions of types.hpp
+// elsewhere. Input and output arrays may be the same, otherwise they must
+// not overlap.
+namespace t::batch {
+
+// out[i] = m * points[i], as positions (w = 1).
+void transformPoints(const mat4f& m, const float3* points, float3* out, size_t count);
+void transformPoints(const mat4d& m, const double3* points, double3* out, size_t count);
+
+// out[i] = a[i] * b[i]
+void multiply(const quatf* a, const quatf* b, quatf* out, size_t count);
+void multiply(const quatd* a, const quatd* b, quatd* out, size_t count);
+
+// In place, zero quaternions are left unchanged.
+void normalize(quatf* q, size_t count);
+void normalize(quatd* q, size_t count);
+
+// out[i] = compose(parents[i], children[i])
+void compose(const transform<float>* parents, const transform<float>* children, transform<float>* out,
+  size_t count);
+void compose(const transform<double>* parents, const transform<double>* children, transform<double>* out,
+  size_t count);
+
+}  // namespace t::batch
+
+#endif  // CORE_SRC_MATH_HPP_
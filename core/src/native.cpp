@@ -0,0 +1,314 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "native.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <unordered_set>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+using std::ofstream;
+
+namespace core {
+
+namespace {
+
+// A module loaded once per path, unloaded with its last plugin.
+class NativeLibrary {
+ public:
+  static shared_ptr<NativeLibrary> open(const string& path) {
+    static std::mutex lock;
+    static std::map<string, std::weak_ptr<NativeLibrary>> loaded;
+    std::lock_guard<std::mutex> guard(lock);
+    if (auto library = loaded[path].lock())
+      return library;
+    auto library = std::make_shared<NativeLibrary>(path);
+    loaded[path] = library;
+    return library;
+  }
+
+  explicit NativeLibrary(const string& path) {
+#ifdef _WIN32
+    handle = LoadLibraryA(path.c_str());
+    if (handle == nullptr)
+      throw std::runtime_error("Cannot load native module " + path);
+    auto entry = reinterpret_cast<CoreNativeEntry>(GetProcAddress(handle, CORE_NATIVE_ENTRY));
+#else
+    handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (handle == nullptr)
+      throw std::runtime_error("Cannot load native module " + path + ": " + dlerror());
+    auto entry = reinterpret_cast<CoreNativeEntry>(dlsym(handle, CORE_NATIVE_ENTRY));
+#endif
+    module = entry != nullptr ? entry() : nullptr;
+    if (module == nullptr) {
+      close();
+      throw std::runtime_error("Native module " + path + " has no " + CORE_NATIVE_ENTRY);
+    }
+    if (module->abiVersion != CORE_NATIVE_ABI_VERSION) {
+      auto version = module->abiVersion;
+      close();
+      throw std::runtime_error("Native module " + path + " was built for ABI version " + std::to_string(version)
+        + ", not " + std::to_string(CORE_NATIVE_ABI_VERSION));
+    }
+  }
+  ~NativeLibrary() { close(); }
+
+  const CoreNativeBehaviour* find(const string& name) const {
+    for (uint32_t i = 0; i < module->behaviourCount; i++) {
+      if (module->behaviours[i].name != nullptr && name == module->behaviours[i].name)
+        return &module->behaviours[i];
+    }
+    return nullptr;
+  }
+
+ private:
+  void close() {
+    if (handle == nullptr)
+      return;
+#ifdef _WIN32
+    FreeLibrary(handle);
+#else
+    dlclose(handle);
+#endif
+    handle = nullptr;
+  }
+
+#ifdef _WIN32
+  HMODULE handle = nullptr;
+#else
+  void* handle = nullptr;
+#endif
+  const CoreNativeModule* module = nullptr;
+};
+
+void emitEvent(void* context, const char* objectId, const char* name, const char* data) {
+  auto world = static_cast<IWorld*>(context);
+  world->emit(Event{Event::CUSTOM, objectId != nullptr ? objectId : "", "", name != nullptr ? name : "",
+    data != nullptr ? data : ""});
+}
+
+void raiseSignal(void* context, const char* name) {
+  if (name != nullptr)
+    static_cast<IWorld*>(context)->signal(name);
+}
+
+}  // namespace
+
+// Blob layout: the library path and the behaviour name, each after its
+// length as 32 bits in native byte order, then the config up to the end.
+class NativePlugin : public IPlugin {
+ public:
+  NativePlugin(const string& id, const NativeSpec& spec) : id{id}, spec{spec} {
+    library = NativeLibrary::open(spec.library);
+    behaviour = library->find(spec.behaviour);
+    if (behaviour == nullptr || behaviour->update == nullptr)
+      throw std::runtime_error("Native module " + spec.library + " has no behaviour " + spec.behaviour);
+    if (behaviour->create != nullptr)
+      state = behaviour->create(spec.config.data(), spec.config.size());
+  }
+  ~NativePlugin() {
+    if (behaviour->destroy != nullptr)
+      behaviour->destroy(state);
+  }
+
+  const string& getId() { return id; }
+  Type getType() { return NATIVE; }
+
+  void saveToFile(const string& path) {
+    ofstream out(path, std::ios::binary);
+    saveTo(out);
+    out.close();
+  }
+
+  void saveTo(std::ostream& out) {
+    for (auto const* field : {&spec.library, &spec.behaviour}) {
+      auto length = static_cast<uint32_t>(field->size());
+      out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+      out.write(field->data(), length);
+    }
+    out.write(spec.config.data(), spec.config.size());
+  }
+
+  // A batch of one. Worlds batch the objects of a behaviour themselves and
+  // never call this, other callers get the default time step.
+  bool execute(IWorld* world, IObject* object) {
+    auto position = object->getPosition();
+    auto rotation = object->getRotation();
+    auto scale = object->getScale();
+    double x = position.x, y = position.y, z = position.z;
+    double rx = rotation.x, ry = rotation.y, rz = rotation.z, rw = rotation.w;
+    double sx = scale.x, sy = scale.y, sz = scale.z;
+    auto objectId = object->getId().c_str();
+    uint8_t changed = 0;
+    auto host = Natives::hostOf(world);
+    CoreNativeBatch batch{1, &objectId, &state, &x, &y, &z, &rx, &ry, &rz, &rw, &sx, &sy, &sz, &changed,
+      PhysicsOptions{}.timeStep, 0, &host};
+    behaviour->update(&batch);
+    if (changed) {
+      object->setPosition(t::position{x, y, z});
+      object->setRotation(t::rotation{rx, ry, rz, rw});
+      object->setScale(t::scale{sx, sy, sz});
+    }
+    return true;
+  }
+
+  string id;
+  NativeSpec spec;
+  shared_ptr<NativeLibrary> library;
+  const CoreNativeBehaviour* behaviour = nullptr;
+  void* state = nullptr;
+};
+
+shared_ptr<IPlugin> Natives::asPlugin(const string& id, const NativeSpec& spec) {
+  return std::make_shared<NativePlugin>(id, spec);
+}
+
+namespace {
+
+std::mutex allowedLock;
+std::unordered_set<string> allowed;
+
+NativeSpec specOf(const string& id, const string& data) {
+  NativeSpec spec;
+  size_t offset = 0;
+  for (auto* field : {&spec.library, &spec.behaviour}) {
+    uint32_t length;
+    if (data.size() - offset < sizeof(length))
+      throw std::runtime_error("Malformed native plugin " + id);
+    std::memcpy(&length, &data[offset], sizeof(length));
+    offset += sizeof(length);
+    if (data.size() - offset < length)
+      throw std::runtime_error("Malformed native plugin " + id);
+    field->assign(data, offset, length);
+    offset += length;
+  }
+  spec.config.assign(data, offset);
+  return spec;
+}
+
+}  // namespace
+
+shared_ptr<IPlugin> Natives::asPlugin(const string& id, const string& data) {
+  return asPlugin(id, specOf(id, data));
+}
+
+void Natives::allowFromNetwork(const string& library) {
+  std::lock_guard<std::mutex> guard(allowedLock);
+  allowed.insert(library);
+}
+
+bool Natives::allowedFromNetwork(const string& data) {
+  try {
+    auto spec = specOf("", data);
+    std::lock_guard<std::mutex> guard(allowedLock);
+    return allowed.contains(spec.library);
+  } catch (const std::runtime_error&) {
+    return false;
+  }
+}
+
+NativeSpec Natives::getSpec(const shared_ptr<IPlugin>& plugin) {
+  if (plugin == nullptr || plugin->getType() != IPlugin::NATIVE)
+    return NativeSpec{};
+  return static_cast<NativePlugin*>(plugin.get())->spec;
+}
+
+string Natives::libraryIn(const string& worldPath, const string& library) {
+  std::filesystem::path path(library);
+  if (!path.has_parent_path() || path.is_absolute())
+    return library;
+  return (std::filesystem::absolute(worldPath) / path).lexically_normal().string();
+}
+
+// Paths relative to the working directory are rebased on the world's.
+// Libraries next to the world file keep a ./ so that they do not read
+// back as bare names.
+string Natives::libraryFor(const string& worldPath, const string& library) {
+  std::filesystem::path path(library);
+  if (!path.has_parent_path())
+    return library;
+  auto relative = std::filesystem::proximate(std::filesystem::absolute(path), worldPath);
+  if (relative.is_absolute())
+    return library;
+  return relative.has_parent_path() ? relative.string() : "./" + relative.string();
+}
+
+CoreNativeHost Natives::hostOf(IWorld* world) {
+  return CoreNativeHost{world, emitEvent, raiseSignal};
+}
+
+void NativeBatches::Group::resize() {
+  auto count = objects.size();
+  ids.resize(count);
+  for (auto* column : {&x, &y, &z, &rotationX, &rotationY, &rotationZ, &rotationW, &scaleX, &scaleY, &scaleZ})
+    column->resize(count);
+  changed.resize(count);
+}
+
+void NativeBatches::attach(ObjectHandle object, IPlugin* plugin) {
+  auto native = static_cast<NativePlugin*>(plugin);
+  auto [entry, added] = entries.try_emplace(Key{object.index, plugin});
+  if (!added)
+    return;
+  auto [found, created] = byBehaviour.try_emplace(native->behaviour, static_cast<uint32_t>(groups.size()));
+  if (created)
+    groups.push_back(Group{native->behaviour});
+  auto& group = groups[found->second];
+  entry->second = Entry{found->second, static_cast<uint32_t>(group.objects.size())};
+  group.objects.push_back(object);
+  group.plugins.push_back(plugin);
+  group.states.push_back(native->state);
+}
+
+void NativeBatches::detach(ObjectHandle object, IPlugin* plugin) {
+  auto found = entries.find(Key{object.index, plugin});
+  if (found == entries.end())
+    return;
+  auto [groupIndex, index] = found->second;
+  entries.erase(found);
+  auto& group = groups[groupIndex];
+  auto last = group.objects.size() - 1;
+  if (index != last) {
+    group.objects[index] = group.objects[last];
+    group.plugins[index] = group.plugins[last];
+    group.states[index] = group.states[last];
+    entries[Key{group.objects[index].index, group.plugins[index]}].index = index;
+  }
+  group.objects.pop_back();
+  group.plugins.pop_back();
+  group.states.pop_back();
+}
+
+void NativeBatches::update(Group* group, double seconds, uint64_t round, const CoreNativeHost* host) {
+  CoreNativeBatch batch{group->objects.size(), group->ids.data(), group->states.data(),
+    group->x.data(), group->y.data(), group->z.data(),
+    group->rotationX.data(), group->rotationY.data(), group->rotationZ.data(), group->rotationW.data(),
+    group->scaleX.data(), group->scaleY.data(), group->scaleZ.data(), group->changed.data(),
+    seconds, round, host};
+  group->behaviour->update(&batch);
+}
+
+}  // namespace core
@@ -0,0 +1,132 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_NATIVE_HPP_
+#define CORE_SRC_NATIVE_HPP_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "core.hpp"
+#include "native_abi.h"
+#include "store.hpp"
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+
+namespace core {
+
+// What a native plugin is saved as: the behaviour of a module and the
+// config its state is created from.
+struct NativeSpec {
+  // Shared library path, as given to dlopen. World files hold it relative
+  // to the world directory, see Natives::libraryIn.
+  string library;
+  string behaviour;
+  string config;
+};
+
+// Native plugins run behaviours of shared libraries built against
+// native_abi.h. The world updates all the objects of a behaviour in one
+// batch per round, right after the other plugins ran. A plugin executed
+// on its own, outside of a world, updates a batch of just its object.
+class Natives {
+ public:
+  // Throws std::runtime_error when the library does not load, was built
+  // for another ABI version or has no such behaviour. Modules stay loaded
+  // while any of their plugins is alive.
+  static shared_ptr<IPlugin> asPlugin(const string& id, const NativeSpec& spec);
+  // From the blob saveTo() writes, throws std::runtime_error as above and
+  // when malformed.
+  static shared_ptr<IPlugin> asPlugin(const string& id, const string& data);
+  // Empty for plugins that are not native.
+  static NativeSpec getSpec(const shared_ptr<IPlugin>& plugin);
+  // Modules that plugins received from other processes may load, by the
+  // exact library path their blob names. None by default.
+  static void allowFromNetwork(const string& library);
+  // Whether the blob names an allowed module, without loading it.
+  static bool allowedFromNetwork(const string& data);
+  // A library path as read from the world at worldPath, and as written
+  // back to it. Relative paths are relative to the world directory, bare
+  // file names are left for dlopen to search.
+  static string libraryIn(const string& worldPath, const string& library);
+  static string libraryFor(const string& worldPath, const string& library);
+  // Forwards the host calls of batches to the world.
+  static CoreNativeHost hostOf(IWorld* world);
+};
+
+// Native plugins attached to a world's objects, grouped by behaviour with
+// a column per batch field so that each group is handed over as is. The
+// world gathers transforms into the columns before a batch and writes
+// back the changed ones after. Removal swaps the last entry of the group
+// into the hole. Not thread safe.
+class NativeBatches {
+ public:
+  struct Group {
+    const CoreNativeBehaviour* behaviour;
+    vector<ObjectHandle> objects;
+    vector<IPlugin*> plugins;
+    vector<void*> states;
+    // Filled by the world for each batch.
+    vector<const char*> ids;
+    vector<double> x, y, z;
+    vector<double> rotationX, rotationY, rotationZ, rotationW;
+    vector<double> scaleX, scaleY, scaleZ;
+    vector<uint8_t> changed;
+
+    // Sizes the columns filled by the world to the objects.
+    void resize();
+  };
+
+  size_t size() const { return entries.size(); }
+  // The plugin must come from Natives::asPlugin. An object may hold any
+  // number of native plugins, even of the same behaviour.
+  void attach(ObjectHandle object, IPlugin* plugin);
+  void detach(ObjectHandle object, IPlugin* plugin);
+  // Runs the batch of the group over its columns as they are.
+  void update(Group* group, double seconds, uint64_t round, const CoreNativeHost* host);
+
+  // Groups are never removed, empty ones are skipped.
+  vector<Group> groups;
+
+ private:
+  struct Key {
+    uint32_t slot;
+    IPlugin* plugin;
+    bool operator==(const Key& other) const { return slot == other.slot && plugin == other.plugin; }
+  };
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return std::hash<IPlugin*>()(key.plugin) ^ (static_cast<size_t>(key.slot) * 0x9e3779b97f4a7c15ULL);
+    }
+  };
+  struct Entry {
+    uint32_t group;
+    uint32_t index;
+  };
+
+  std::unordered_map<const CoreNativeBehaviour*, uint32_t> byBehaviour;
+  std::unordered_map<Key, Entry, KeyHash> entries;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_NATIVE_HPP_
@@ -0,0 +1,108 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_NATIVE_ABI_H_
+#define CORE_SRC_NATIVE_ABI_H_
+
+/*
+  C interface between the core and native plugin modules, shared libraries
+  built against this header alone. A module exports core_native_module(),
+  returning the behaviours it implements. Each behaviour updates every
+  object it is attached to in one call per round, a batch of columns.
+
+  The version changes whenever any struct here changes: the core refuses
+  modules built for another one.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CORE_NATIVE_ABI_VERSION 1
+#define CORE_NATIVE_ENTRY "core_native_module"
+
+#ifdef _WIN32
+#define CORE_NATIVE_EXPORT __declspec(dllexport)
+#else
+#define CORE_NATIVE_EXPORT __attribute__((visibility("default")))
+#endif
+
+/* Services of the world running the batch, safe to call from update(). */
+typedef struct CoreNativeHost {
+  void* context;
+  /* Custom event about the object, see IWorld::emit. */
+  void (*emit)(void* context, const char* objectId, const char* name, const char* data);
+  /* Wakes the plugins waiting for the signal, see IWorld::signal. */
+  void (*signal)(void* context, const char* name);
+} CoreNativeHost;
+
+/*
+  The objects of one behaviour. Every column holds count entries in the
+  same order. Transforms are copies: an update setting changed[i] has the
+  transform of object i written back to the world after the call.
+*/
+typedef struct CoreNativeBatch {
+  size_t count;
+  const char* const* ids;
+  /* What create() returned for the plugin on each object. */
+  void* const* states;
+  double* x;
+  double* y;
+  double* z;
+  double* rotationX;
+  double* rotationY;
+  double* rotationZ;
+  double* rotationW;
+  double* scaleX;
+  double* scaleY;
+  double* scaleZ;
+  uint8_t* changed;
+  /* Simulated seconds per round and the round number. */
+  double seconds;
+  uint64_t round;
+  const CoreNativeHost* host;
+} CoreNativeBatch;
+
+typedef struct CoreNativeBehaviour {
+  /* Name plugins refer to the behaviour by, unique in its module. */
+  const char* name;
+  /* State of a plugin from the config it was saved with, optional. */
+  void* (*create)(const char* config, size_t length);
+  /* Optional, called with each state create() returned. */
+  void (*destroy)(void* state);
+  void (*update)(CoreNativeBatch* batch);
+} CoreNativeBehaviour;
+
+typedef struct CoreNativeModule {
+  /* CORE_NATIVE_ABI_VERSION the module was built with. */
+  uint32_t abiVersion;
+  uint32_t behaviourCount;
+  const CoreNativeBehaviour* behaviours;
+} CoreNativeModule;
+
+/* Type of the exported core_native_module(). The module stays loaded
+   while plugins use it, the returned table must live as long. */
+typedef const CoreNativeModule* (*CoreNativeEntry)(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  /* CORE_SRC_NATIVE_ABI_H_ */
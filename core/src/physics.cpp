@@ -0,0 +1,285 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "physics.hpp"
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define CORE_PHYSICS_SSE2
+#include <emmintrin.h>
+#endif
+
+using std::ofstream;
+
+namespace core {
+
+// Blob layout: mass, velocity x, y, z and damping as doubles in native
+// byte order, like the transforms of snapshots.
+static constexpr size_t BLOB_FIELDS = 5;
+
+class BodyPlugin : public IPlugin {
+ public:
+  BodyPlugin(const string& id, const Body& body) : id{id}, body{body} {}
+  ~BodyPlugin() {
+    if (bodies != nullptr)
+      bodies->detach(object);
+  }
+
+  const string& getId() { return id; }
+  Type getType() { return PHYSICS; }
+
+  void saveToFile(const string& path) {
+    ofstream out(path, std::ios::binary);
+    saveTo(out);
+    out.close();
+  }
+
+  void saveTo(std::ostream& out) {
+    auto state = getBody();
+    double fields[BLOB_FIELDS] = {state.mass, state.velocity.x, state.velocity.y, state.velocity.z, state.damping};
+    out.write(reinterpret_cast<const char*>(fields), sizeof(fields));
+  }
+
+  // The world integrates bodies itself and never runs them.
+  bool execute(IWorld* world, IObject* object) { return true; }
+
+  Body getBody() {
+    if (bodies == nullptr)
+      return body;
+    return Body{body.mass, t::double3{bodies->vx[index], bodies->vy[index], bodies->vz[index]}, bodies->damping[index]};
+  }
+
+  void setBody(const Body& body) {
+    this->body = body;
+    if (bodies == nullptr)
+      return;
+    bodies->inverseMass[index] = body.mass > 0 ? 1 / body.mass : 0;
+    bodies->damping[index] = body.damping;
+    setVelocity(body.velocity);
+  }
+
+  void setVelocity(const t::double3& velocity) {
+    if (bodies == nullptr) {
+      body.velocity = velocity;
+      return;
+    }
+    bodies->vx[index] = velocity.x;
+    bodies->vy[index] = velocity.y;
+    bodies->vz[index] = velocity.z;
+  }
+
+  void applyForce(const t::double3& force) {
+    if (bodies == nullptr) {
+      this->force = this->force + force;
+      return;
+    }
+    bodies->fx[index] += force.x;
+    bodies->fy[index] += force.y;
+    bodies->fz[index] += force.z;
+  }
+
+  void applyImpulse(const t::double3& impulse) {
+    if (body.mass > 0)
+      setVelocity(getBody().velocity + impulse * (1 / body.mass));
+  }
+
+  string id;
+  // Only up to date while detached, the mass always is.
+  Body body;
+  t::double3 force;
+  // Where the state lives while attached.
+  PhysicsBodies* bodies = nullptr;
+  ObjectHandle object;
+  uint32_t index = 0;
+};
+
+static BodyPlugin* asBody(const shared_ptr<IPlugin>& plugin) {
+  if (plugin == nullptr || plugin->getType() != IPlugin::PHYSICS)
+    return nullptr;
+  return static_cast<BodyPlugin*>(plugin.get());
+}
+
+shared_ptr<IPlugin> Physics::asPlugin(const string& id, const Body& body) {
+  return std::make_shared<BodyPlugin>(id, body);
+}
+
+shared_ptr<IPlugin> Physics::asPlugin(const string& id, const string& data) {
+  double fields[BLOB_FIELDS];
+  if (data.size() != sizeof(fields))
+    throw std::runtime_error("Malformed body of physics plugin " + id);
+  std::memcpy(fields, data.data(), sizeof(fields));
+  return asPlugin(id, Body{fields[0], t::double3{fields[1], fields[2], fields[3]}, fields[4]});
+}
+
+Body Physics::getBody(const shared_ptr<IPlugin>& plugin) {
+  auto body = asBody(plugin);
+  return body != nullptr ? body->getBody() : Body{};
+}
+
+void Physics::setBody(const shared_ptr<IPlugin>& plugin, const Body& state) {
+  if (auto body = asBody(plugin))
+    body->setBody(state);
+}
+
+void Physics::setVelocity(const shared_ptr<IPlugin>& plugin, const t::double3& velocity) {
+  if (auto body = asBody(plugin))
+    body->setVelocity(velocity);
+}
+
+void Physics::applyForce(const shared_ptr<IPlugin>& plugin, const t::double3& force) {
+  if (auto body = asBody(plugin))
+    body->applyForce(force);
+}
+
+void Physics::applyImpulse(const shared_ptr<IPlugin>& plugin, const t::double3& impulse) {
+  if (auto body = asBody(plugin))
+    body->applyImpulse(impulse);
+}
+
+// Bodies
+
+PhysicsBodies::~PhysicsBodies() {
+  while (!objects.empty())
+    detach(objects.back());
+}
+
+void PhysicsBodies::attach(ObjectHandle object, IPlugin* plugin) {
+  auto body = static_cast<BodyPlugin*>(plugin);
+  if (body->bodies != nullptr)
+    body->bodies->detach(body->object);
+  detach(object);
+  if (bySlot.size() <= object.index)
+    bySlot.resize(object.index + 1, NONE);
+
+  auto index = static_cast<uint32_t>(objects.size());
+  bySlot[object.index] = index;
+  auto const& state = body->body;
+  objects.push_back(object);
+  x.push_back(0);
+  y.push_back(0);
+  z.push_back(0);
+  vx.push_back(state.velocity.x);
+  vy.push_back(state.velocity.y);
+  vz.push_back(state.velocity.z);
+  fx.push_back(body->force.x);
+  fy.push_back(body->force.y);
+  fz.push_back(body->force.z);
+  inverseMass.push_back(state.mass > 0 ? 1 / state.mass : 0);
+  damping.push_back(state.damping);
+  plugins.push_back(body);
+  body->bodies = this;
+  body->object = object;
+  body->index = index;
+  body->force = t::double3{};
+}
+
+void PhysicsBodies::detach(ObjectHandle object) {
+  if (object.index >= bySlot.size() || bySlot[object.index] == NONE)
+    return;
+  auto index = bySlot[object.index];
+  if (objects[index] != object)
+    return;
+  auto body = static_cast<BodyPlugin*>(plugins[index]);
+  body->body = body->getBody();
+  body->force = t::double3{fx[index], fy[index], fz[index]};
+  body->bodies = nullptr;
+  remove(index);
+}
+
+void PhysicsBodies::remove(uint32_t index) {
+  auto last = static_cast<uint32_t>(objects.size() - 1);
+  bySlot[objects[index].index] = NONE;
+  if (index != last) {
+    objects[index] = objects[last];
+    x[index] = x[last];
+    y[index] = y[last];
+    z[index] = z[last];
+    vx[index] = vx[last];
+    vy[index] = vy[last];
+    vz[index] = vz[last];
+    fx[index] = fx[last];
+    fy[index] = fy[last];
+    fz[index] = fz[last];
+    inverseMass[index] = inverseMass[last];
+    damping[index] = damping[last];
+    plugins[index] = plugins[last];
+    static_cast<BodyPlugin*>(plugins[index])->index = index;
+    bySlot[objects[index].index] = index;
+  }
+  objects.pop_back();
+  x.pop_back();
+  y.pop_back();
+  z.pop_back();
+  vx.pop_back();
+  vy.pop_back();
+  vz.pop_back();
+  fx.pop_back();
+  fy.pop_back();
+  fz.pop_back();
+  inverseMass.pop_back();
+  damping.pop_back();
+  plugins.pop_back();
+}
+
+// Damping scales the velocity by 1 / (1 + damping * dt), which stays
+// stable for any time step. Kinematic bodies (inverse mass 0) ignore
+// gravity as well as forces.
+static inline void integrateAxis(double* p, double* v, double* f, double inverseMass, double damp, double gravity,
+    double seconds) {
+  auto acceleration = *f * inverseMass + (inverseMass > 0 ? gravity : 0);
+  *v = (*v + acceleration * seconds) * damp;
+  *p += *v * seconds;
+  *f = 0;
+}
+
+void PhysicsBodies::integrate(size_t begin, size_t end, double seconds, const t::double3& gravity) {
+  auto i = begin;
+#ifdef CORE_PHYSICS_SSE2
+  // Two bodies per register, every column loaded and stored once.
+  auto dt = _mm_set1_pd(seconds);
+  auto one = _mm_set1_pd(1);
+  auto zero = _mm_setzero_pd();
+  auto gx = _mm_set1_pd(gravity.x);
+  auto gy = _mm_set1_pd(gravity.y);
+  auto gz = _mm_set1_pd(gravity.z);
+  auto axis = [&](double* p, double* v, double* f, __m128d inverse, __m128d falls, __m128d damp, __m128d g) {
+    auto acceleration = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(f), inverse), _mm_and_pd(falls, g));
+    auto velocity = _mm_mul_pd(_mm_add_pd(_mm_loadu_pd(v), _mm_mul_pd(acceleration, dt)), damp);
+    _mm_storeu_pd(v, velocity);
+    _mm_storeu_pd(p, _mm_add_pd(_mm_loadu_pd(p), _mm_mul_pd(velocity, dt)));
+    _mm_storeu_pd(f, zero);
+  };
+  for (; i + 2 <= end; i += 2) {
+    auto inverse = _mm_loadu_pd(&inverseMass[i]);
+    auto falls = _mm_cmpgt_pd(inverse, zero);
+    auto damp = _mm_div_pd(one, _mm_add_pd(one, _mm_mul_pd(_mm_loadu_pd(&damping[i]), dt)));
+    axis(&x[i], &vx[i], &fx[i], inverse, falls, damp, gx);
+    axis(&y[i], &vy[i], &fy[i], inverse, falls, damp, gy);
+    axis(&z[i], &vz[i], &fz[i], inverse, falls, damp, gz);
+  }
+#endif
+  for (; i < end; i++) {
+    auto damp = 1 / (1 + damping[i] * seconds);
+    integrateAxis(&x[i], &vx[i], &fx[i], inverseMass[i], damp, gravity.x, seconds);
+    integrateAxis(&y[i], &vy[i], &fy[i], inverseMass[i], damp, gravity.y, seconds);
+    integrateAxis(&z[i], &vz[i], &fz[i], inverseMass[i], damp, gravity.z, seconds);
+  }
+}
+
+}  // namespace core
@@ -0,0 +1,105 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_PHYSICS_HPP_
+#define CORE_SRC_PHYSICS_HPP_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "core.hpp"
+#include "store.hpp"
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+
+namespace core {
+
+struct Body {
+  // Zero or less for a kinematic body: forces and gravity leave it alone,
+  // it only moves with its velocity.
+  double mass = 1;
+  t::double3 velocity;
+  // Fraction of the velocity lost per second.
+  double damping = 0;
+};
+
+// Physics plugins hold a rigid body moving the object they are on. The
+// world integrates every body at the end of each round, see PhysicsOptions.
+// An object moves with one body: a second one attached takes over.
+class Physics {
+ public:
+  static shared_ptr<IPlugin> asPlugin(const string& id, const Body& body = Body{});
+  // From the blob saveTo() writes, throws std::runtime_error when malformed.
+  static shared_ptr<IPlugin> asPlugin(const string& id, const string& data);
+  // These are safe from the plugins of the body's object while they run,
+  // and from anywhere between rounds. Plugins that are not bodies read as
+  // a default body and ignore the rest.
+  static Body getBody(const shared_ptr<IPlugin>& plugin);
+  static void setBody(const shared_ptr<IPlugin>& plugin, const Body& body);
+  static void setVelocity(const shared_ptr<IPlugin>& plugin, const t::double3& velocity);
+  // Accumulated until the next integration, which clears it.
+  static void applyForce(const shared_ptr<IPlugin>& plugin, const t::double3& force);
+  // Changes the velocity right away.
+  static void applyImpulse(const shared_ptr<IPlugin>& plugin, const t::double3& impulse);
+};
+
+// Bodies attached to a world's objects, in structure of arrays so that
+// integrate() is one pass over contiguous columns. Removal swaps the last
+// body into the hole, like ObjectStore. The world owns the positions: it
+// gathers them into the pass and writes back the ones that moved.
+// Not thread safe, integrate() excepted on disjoint ranges.
+class PhysicsBodies {
+ public:
+  ~PhysicsBodies();
+
+  size_t size() const { return objects.size(); }
+  // The plugin must come from Physics::asPlugin. Its body state moves in
+  // here until it is detached, replacing the object's previous body.
+  void attach(ObjectHandle object, IPlugin* plugin);
+  // Hands the state back to the plugin of the object's body, if any.
+  void detach(ObjectHandle object);
+  // Velocities from forces, gravity and damping, then positions from the
+  // velocities (semi-implicit Euler) for bodies in [begin, end). Forces
+  // are cleared.
+  void integrate(size_t begin, size_t end, double seconds, const t::double3& gravity);
+
+  // Dense columns, all of length size() and in the same order.
+  vector<ObjectHandle> objects;
+  // Positions, only meaningful between the world's gather and write back.
+  vector<double> x, y, z;
+  vector<double> vx, vy, vz;
+  vector<double> fx, fy, fz;
+  vector<double> inverseMass;
+  vector<double> damping;
+  vector<IPlugin*> plugins;
+
+ private:
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  void remove(uint32_t index);
+
+  // Body of each object slot, NONE for objects without one.
+  vector<uint32_t> bySlot;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_PHYSICS_HPP_
@@ -0,0 +1,360 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "profiler.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <unordered_map>
+
+using std::shared_ptr;
+using std::unordered_map;
+
+namespace core {
+
+static thread_local uint64_t threadAllocations = 0;
+
+#ifdef CORE_PROFILE_ALLOCATIONS
+}  // namespace core
+
+void* operator new(std::size_t size) {
+  core::threadAllocations++;
+  if (void* p = std::malloc(size == 0 ? 1 : size))
+    return p;
+  throw std::bad_alloc();
+}
+void* operator new[](std::size_t size) { return operator new(size); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+namespace core {
+#endif
+
+namespace {
+
+constexpr size_t BUCKETS = 64;
+
+// Bucket b holds durations in [2^b, 2^(b+1)) nanoseconds.
+struct Histogram {
+  uint64_t buckets[BUCKETS] = {};
+  uint64_t count = 0;
+  uint64_t total = 0;
+  uint64_t max = 0;
+  uint64_t allocations = 0;
+
+  void add(uint64_t nanos, uint64_t allocated) {
+    buckets[nanos == 0 ? 0 : std::bit_width(nanos) - 1]++;
+    count++;
+    total += nanos;
+    max = std::max(max, nanos);
+    allocations += allocated;
+  }
+
+  void merge(const Histogram& other) {
+    for (size_t i = 0; i < BUCKETS; i++)
+      buckets[i] += other.buckets[i];
+    count += other.count;
+    total += other.total;
+    max = std::max(max, other.max);
+    allocations += other.allocations;
+  }
+
+  uint64_t percentile(double fraction) const {
+    auto wanted = static_cast<uint64_t>(fraction * count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+      seen += buckets[i];
+      if (seen > wanted)
+        return std::min(max, (uint64_t{2} << i) - 1);
+    }
+    return max;
+  }
+};
+
+// Only its own thread writes to a log, the lock is there for readers and
+// so is uncontended while recording.
+struct ThreadLog {
+  explicit ThreadLog(uint32_t thread) : thread{thread}, events(Profiler::EVENTS_PER_THREAD) {}
+
+  void push(const ProfileEvent& event) {
+    events[written % events.size()] = event;
+    written++;
+  }
+
+  uint32_t thread;
+  std::mutex lock;
+  vector<ProfileEvent> events;
+  uint64_t written = 0;
+  vector<Histogram> histograms;
+};
+
+struct Registry {
+  std::mutex lock;
+  vector<string> names;
+  unordered_map<string, uint32_t> ids;
+  vector<shared_ptr<ThreadLog>> logs;
+  std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+};
+
+Registry& registry() {
+  static Registry instance;
+  return instance;
+}
+
+// Logs outlive their thread, so the events of finished workers still show.
+ThreadLog& threadLog() {
+  thread_local shared_ptr<ThreadLog> log;
+  if (log == nullptr) {
+    auto& r = registry();
+    std::lock_guard<std::mutex> guard(r.lock);
+    log = std::make_shared<ThreadLog>(static_cast<uint32_t>(r.logs.size()));
+    r.logs.push_back(log);
+  }
+  return *log;
+}
+
+vector<string> names() {
+  auto& r = registry();
+  std::lock_guard<std::mutex> guard(r.lock);
+  return r.names;
+}
+
+vector<shared_ptr<ThreadLog>> logs() {
+  auto& r = registry();
+  std::lock_guard<std::mutex> guard(r.lock);
+  return r.logs;
+}
+
+void writeJsonString(std::ostream& out, const string& value) {
+  out << '"';
+  for (unsigned char c : value) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      out << escaped;
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+template<typename T>
+void writeValue(std::ostream& out, const T& value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+T readValue(std::istream& in) {
+  T value;
+  if (!in.read(reinterpret_cast<char*>(&value), sizeof(T)))
+    throw std::runtime_error("Truncated profile log");
+  return value;
+}
+
+}  // namespace
+
+void Profiler::reset() {
+  for (auto const& log : logs()) {
+    std::lock_guard<std::mutex> guard(log->lock);
+    log->written = 0;
+    log->histograms.clear();
+  }
+}
+
+uint32_t Profiler::intern(const string& name) {
+  auto& r = registry();
+  std::lock_guard<std::mutex> guard(r.lock);
+  auto found = r.ids.find(name);
+  if (found != r.ids.end())
+    return found->second;
+  auto id = static_cast<uint32_t>(r.names.size());
+  r.names.push_back(name);
+  r.ids.emplace(name, id);
+  return id;
+}
+
+uint32_t Profiler::internCached(const string& name) {
+  thread_local unordered_map<string, uint32_t> cache;
+  auto found = cache.find(name);
+  if (found != cache.end())
+    return found->second;
+  auto id = intern(name);
+  cache.emplace(name, id);
+  return id;
+}
+
+uint64_t Profiler::now() {
+  auto elapsed = std::chrono::steady_clock::now() - registry().epoch;
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+}
+
+uint64_t Profiler::allocations() {
+  return threadAllocations;
+}
+
+void Profiler::scope(uint32_t name, uint64_t start, uint64_t end, uint64_t allocations) {
+  auto& log = threadLog();
+  auto duration = end - start;
+  std::lock_guard<std::mutex> guard(log.lock);
+  log.push(ProfileEvent{start, static_cast<int64_t>(duration), name, log.thread,
+    static_cast<uint32_t>(allocations), ProfileEvent::SCOPE, {}});
+  if (log.histograms.size() <= name)
+    log.histograms.resize(name + 1);
+  log.histograms[name].add(duration, allocations);
+}
+
+void Profiler::counter(uint32_t name, int64_t value) {
+  auto& log = threadLog();
+  auto start = now();
+  std::lock_guard<std::mutex> guard(log.lock);
+  log.push(ProfileEvent{start, value, name, log.thread, 0, ProfileEvent::COUNTER, {}});
+}
+
+void Profiler::mark(uint32_t name) {
+  auto& log = threadLog();
+  auto start = now();
+  std::lock_guard<std::mutex> guard(log.lock);
+  log.push(ProfileEvent{start, 0, name, log.thread, 0, ProfileEvent::MARK, {}});
+}
+
+vector<ProfileStats> Profiler::stats() {
+  vector<Histogram> merged;
+  for (auto const& log : logs()) {
+    std::lock_guard<std::mutex> guard(log->lock);
+    if (merged.size() < log->histograms.size())
+      merged.resize(log->histograms.size());
+    for (size_t i = 0; i < log->histograms.size(); i++)
+      merged[i].merge(log->histograms[i]);
+  }
+
+  auto allNames = names();
+  vector<ProfileStats> result;
+  for (size_t i = 0; i < merged.size(); i++) {
+    auto const& histogram = merged[i];
+    if (histogram.count == 0)
+      continue;
+    ProfileStats stats;
+    stats.name = allNames[i];
+    stats.count = histogram.count;
+    stats.totalNanos = histogram.total;
+    stats.maxNanos = histogram.max;
+    stats.p50Nanos = histogram.percentile(0.5);
+    stats.p99Nanos = histogram.percentile(0.99);
+    stats.allocations = histogram.allocations;
+    result.push_back(stats);
+  }
+  std::sort(result.begin(), result.end(),
+    [](const ProfileStats& a, const ProfileStats& b) { return a.totalNanos > b.totalNanos; });
+  return result;
+}
+
+ProfileLog Profiler::collect() {
+  ProfileLog result;
+  for (auto const& log : logs()) {
+    std::lock_guard<std::mutex> guard(log->lock);
+    auto size = log->events.size();
+    auto first = log->written > size ? log->written - size : 0;
+    for (auto i = first; i < log->written; i++)
+      result.events.push_back(log->events[i % size]);
+  }
+  // Names are read last so that every event refers to a known one.
+  result.names = names();
+  std::stable_sort(result.events.begin(), result.events.end(),
+    [](const ProfileEvent& a, const ProfileEvent& b) { return a.start < b.start; });
+  return result;
+}
+
+void Profiler::writeChromeTrace(std::ostream& out) {
+  auto log = collect();
+  char time[32];
+  out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[";
+  bool first = true;
+  for (auto const& event : log.events) {
+    out << (first ? "\n" : ",\n");
+    first = false;
+    out << "{\"name\":";
+    writeJsonString(out, log.names[event.name]);
+    snprintf(time, sizeof(time), "%.3f", event.start / 1000.0);
+    out << ",\"pid\":1,\"tid\":" << event.thread << ",\"ts\":" << time;
+    switch (event.kind) {
+      case ProfileEvent::SCOPE:
+        snprintf(time, sizeof(time), "%.3f", event.value / 1000.0);
+        out << ",\"ph\":\"X\",\"dur\":" << time << ",\"args\":{\"allocations\":" << event.allocations << "}}";
+        break;
+      case ProfileEvent::COUNTER:
+        out << ",\"ph\":\"C\",\"args\":{\"value\":" << event.value << "}}";
+        break;
+      case ProfileEvent::MARK:
+        out << ",\"ph\":\"i\",\"s\":\"t\"}";
+        break;
+    }
+  }
+  out << "\n]}\n";
+}
+
+void Profiler::writeBinary(std::ostream& out) {
+  auto log = collect();
+  out.write(profile::MAGIC, sizeof(profile::MAGIC));
+  writeValue(out, profile::VERSION);
+  writeValue(out, static_cast<uint32_t>(log.names.size()));
+  writeValue(out, static_cast<uint64_t>(log.events.size()));
+  for (auto const& name : log.names) {
+    writeValue(out, static_cast<uint32_t>(name.size()));
+    out.write(name.data(), name.size());
+  }
+  out.write(reinterpret_cast<const char*>(log.events.data()), log.events.size() * sizeof(ProfileEvent));
+}
+
+ProfileLog Profiler::readBinary(std::istream& in) {
+  char magic[sizeof(profile::MAGIC)];
+  if (!in.read(magic, sizeof(magic)) || memcmp(magic, profile::MAGIC, sizeof(magic)) != 0)
+    throw std::runtime_error("Not a profile log");
+  if (readValue<uint32_t>(in) != profile::VERSION)
+    throw std::runtime_error("Unsupported profile log version");
+
+  ProfileLog log;
+  auto nameCount = readValue<uint32_t>(in);
+  auto eventCount = readValue<uint64_t>(in);
+  for (uint32_t i = 0; i < nameCount; i++) {
+    string name(readValue<uint32_t>(in), '\0');
+    if (!in.read(name.data(), name.size()))
+      throw std::runtime_error("Truncated profile log");
+    log.names.push_back(std::move(name));
+  }
+  for (uint64_t i = 0; i < eventCount; i++) {
+    auto event = readValue<ProfileEvent>(in);
+    if (event.name >= nameCount)
+      throw std::runtime_error("Profile event with unknown name");
+    log.events.push_back(event);
+  }
+  return log;
+}
+
+}  // namespace core
@@ -0,0 +1,183 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_PROFILER_HPP_
+#define CORE_SRC_PROFILER_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace core {
+
+// Instrumentation of the engine hot paths: scoped timers, counters and
+// marks, recorded by each thread into its own ring of the last
+// Profiler::EVENTS_PER_THREAD events plus per name duration histograms.
+//
+// The CORE_PROFILE_* macros compile to nothing unless CORE_PROFILE is
+// defined, and cost one relaxed load while the profiler is disabled at
+// runtime (the default). Building with CORE_PROFILE_ALLOCATIONS also
+// counts the allocations made inside each scope.
+
+struct ProfileEvent {
+  enum Kind : uint8_t { SCOPE, COUNTER, MARK };
+  // Nanoseconds since the profiler started.
+  uint64_t start;
+  // Duration in nanoseconds for scopes, the value for counters.
+  int64_t value;
+  uint32_t name;
+  uint32_t thread;
+  uint32_t allocations;
+  Kind kind;
+  uint8_t padding[3];
+};
+static_assert(sizeof(ProfileEvent) == 32);
+
+struct ProfileStats {
+  string name;
+  uint64_t count = 0;
+  uint64_t totalNanos = 0;
+  uint64_t maxNanos = 0;
+  // Upper bounds of the power of two histogram bucket holding them.
+  uint64_t p50Nanos = 0;
+  uint64_t p99Nanos = 0;
+  uint64_t allocations = 0;
+};
+
+// Events of every thread ordered by start, names indexed by event.name.
+struct ProfileLog {
+  vector<string> names;
+  vector<ProfileEvent> events;
+};
+
+// Binary log layout, host byte order:
+//
+//   char[8]   MAGIC
+//   uint32_t  VERSION
+//   uint32_t  name count
+//   uint64_t  event count
+//   per name: uint32_t length, char[length]
+//   ProfileEvent[event count]
+namespace profile {
+
+constexpr char MAGIC[8] = {'V', 'R', 'P', 'R', 'O', 'F', '\0', '\0'};
+constexpr uint32_t VERSION = 1;
+
+}  // namespace profile
+
+class Profiler {
+ public:
+  static constexpr size_t EVENTS_PER_THREAD = 1 << 16;
+
+  static void setEnabled(bool enabled) { active.store(enabled, std::memory_order_relaxed); }
+  static bool enabled() { return active.load(std::memory_order_relaxed); }
+  // Drops every recorded event and histogram, names stay interned.
+  static void reset();
+
+  static uint32_t intern(const string& name);
+  // Same as intern, through a per thread cache for names built at runtime.
+  static uint32_t internCached(const string& name);
+  static uint64_t now();
+  // Allocations made so far by the calling thread, always 0 unless built
+  // with CORE_PROFILE_ALLOCATIONS.
+  static uint64_t allocations();
+
+  static void scope(uint32_t name, uint64_t start, uint64_t end, uint64_t allocations);
+  static void counter(uint32_t name, int64_t value);
+  static void mark(uint32_t name);
+
+  // Scopes by total time, the most expensive first.
+  static vector<ProfileStats> stats();
+  static ProfileLog collect();
+  // Chrome trace event format, opens in chrome://tracing or Perfetto.
+  static void writeChromeTrace(std::ostream& out);
+  static void writeBinary(std::ostream& out);
+  static ProfileLog readBinary(std::istream& in);
+
+ private:
+  static inline std::atomic<bool> active = false;
+};
+
+class ProfileScope {
+ public:
+  explicit ProfileScope(uint32_t name) {
+    if (Profiler::enabled())
+      begin(name);
+  }
+  explicit ProfileScope(const string& name) {
+    if (Profiler::enabled())
+      begin(Profiler::internCached(name));
+  }
+  ~ProfileScope() {
+    if (running)
+      Profiler::scope(name, start, Profiler::now(), Profiler::allocations() - allocationsAtStart);
+  }
+  ProfileScope(const ProfileScope&) = delete;
+  ProfileScope& operator=(const ProfileScope&) = delete;
+
+ private:
+  void begin(uint32_t name) {
+    running = true;
+    this->name = name;
+    allocationsAtStart = Profiler::allocations();
+    start = Profiler::now();
+  }
+
+  bool running = false;
+  uint32_t name = 0;
+  uint64_t start = 0;
+  uint64_t allocationsAtStart = 0;
+};
+
+}  // namespace core
+
+#define CORE_PROFILE_JOIN2(a, b) a##b
+#define CORE_PROFILE_JOIN(a, b) CORE_PROFILE_JOIN2(a, b)
+
+#ifdef CORE_PROFILE
+// Times the rest of the enclosing block under a string literal name.
+#define CORE_PROFILE_SCOPE(name) \
+  static const uint32_t CORE_PROFILE_JOIN(profileName, __LINE__) = core::Profiler::intern(name); \
+  core::ProfileScope CORE_PROFILE_JOIN(profileScope, __LINE__)(CORE_PROFILE_JOIN(profileName, __LINE__))
+// Same with a name only known at runtime, such as a plugin id.
+#define CORE_PROFILE_DYNAMIC_SCOPE(name) \
+  core::ProfileScope CORE_PROFILE_JOIN(profileScope, __LINE__)(name)
+// value is only evaluated while the profiler is enabled.
+#define CORE_PROFILE_COUNTER(name, value) \
+  do { \
+    if (core::Profiler::enabled()) \
+      core::Profiler::counter(core::Profiler::internCached(name), static_cast<int64_t>(value)); \
+  } while (0)
+#define CORE_PROFILE_MARK(name) \
+  do { \
+    if (core::Profiler::enabled()) \
+      core::Profiler::mark(core::Profiler::internCached(name)); \
+  } while (0)
+#else
+#define CORE_PROFILE_SCOPE(name)
+#define CORE_PROFILE_DYNAMIC_SCOPE(name)
+#define CORE_PROFILE_COUNTER(name, value) do {} while (0)
+#define CORE_PROFILE_MARK(name) do {} while (0)
+#endif
+
+#endif  // CORE_SRC_PROFILER_HPP_
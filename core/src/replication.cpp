@@ -0,0 +1,882 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "replication.hpp"
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <variant>
+
+#include "log.hpp"
+#include "profiler.hpp"
+
+namespace core {
+
+using namespace replication;
+
+namespace {
+
+template <class... Ts> struct overloaded : Ts... { using Ts::operator()...; };
+template <class... Ts> overloaded(Ts...) -> overloaded<Ts...>;
+
+class Writer {
+ public:
+  explicit Writer(string* out) : out{out} {}
+
+  template<typename T>
+  void put(T value) { out->append(reinterpret_cast<const char*>(&value), sizeof(T)); }
+  void putShortString(const string& value) {
+    put(static_cast<uint16_t>(value.size()));
+    out->append(value);
+  }
+  void putString(const string& value) {
+    put(static_cast<uint32_t>(value.size()));
+    out->append(value);
+  }
+
+ private:
+  string* out;
+};
+
+class Reader {
+ public:
+  Reader(const char* data, size_t size) : data{data}, size{size} {}
+
+  template<typename T>
+  T get() {
+    T value;
+    memcpy(&value, take(sizeof(T)), sizeof(T));
+    return value;
+  }
+  string getShortString() {
+    auto length = get<uint16_t>();
+    return string(take(length), length);
+  }
+  string getString() {
+    auto length = get<uint32_t>();
+    return string(take(length), length);
+  }
+
+ private:
+  const char* take(size_t bytes) {
+    if (size - position < bytes)
+      throw std::runtime_error("Truncated replication datagram");
+    auto result = data + position;
+    position += bytes;
+    return result;
+  }
+
+  const char* data;
+  size_t size;
+  size_t position = 0;
+};
+
+void putHeader(string* datagram, Kind kind, uint16_t count, uint64_t emitter, uint64_t session,
+    uint64_t sequence, uint64_t base) {
+  string header;
+  header.reserve(HEADER_SIZE);
+  header.append(MAGIC, sizeof(MAGIC));
+  Writer out(&header);
+  out.put(VERSION);
+  out.put(static_cast<uint8_t>(kind));
+  out.put(count);
+  out.put(emitter);
+  out.put(session);
+  out.put(sequence);
+  out.put(base);
+  datagram->replace(0, HEADER_SIZE, header);
+}
+
+void putPlugin(Writer* out, IPlugin* plugin) {
+  std::ostringstream blob;
+  plugin->saveTo(blob);
+  out->putShortString(plugin->getId());
+  out->put(static_cast<uint8_t>(plugin->getType()));
+  out->putString(blob.str());
+}
+
+shared_ptr<IPlugin> getPlugin(Reader* in) {
+  auto id = in->getShortString();
+  auto type = in->get<uint8_t>();
+  auto blob = in->getString();
+  auto plugin = Plugins::fromNetwork(id, static_cast<IPlugin::Type>(type), blob);
+  if (plugin == nullptr)
+    Log::error("Unknown or refused replicated plugin type " + std::to_string(type));
+  return plugin;
+}
+
+}  // namespace
+
+// UDP
+
+namespace {
+
+#ifdef _WIN32
+using socklen_t = int;
+constexpr intptr_t NO_SOCKET = static_cast<intptr_t>(INVALID_SOCKET);
+void closeSocket(intptr_t socket) { closesocket(static_cast<SOCKET>(socket)); }
+#else
+constexpr intptr_t NO_SOCKET = -1;
+void closeSocket(intptr_t socket) { close(static_cast<int>(socket)); }
+#endif
+
+sockaddr_in parseAddress(const string& address) {
+  auto colon = address.rfind(':');
+  if (colon == string::npos)
+    throw std::runtime_error("Invalid address " + address);
+  sockaddr_in result{};
+  result.sin_family = AF_INET;
+  result.sin_port = htons(static_cast<uint16_t>(std::stoi(address.substr(colon + 1))));
+  if (inet_pton(AF_INET, address.substr(0, colon).c_str(), &result.sin_addr) != 1)
+    throw std::runtime_error("Invalid address " + address);
+  return result;
+}
+
+string formatAddress(const sockaddr_in& address) {
+  char host[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &address.sin_addr, host, sizeof(host));
+  return string(host) + ":" + std::to_string(ntohs(address.sin_port));
+}
+
+}  // namespace
+
+UdpTransport::UdpTransport(const string& bindAddress) : buffer(1 << 16) {
+#ifdef _WIN32
+  static WSADATA wsa;
+  static int started = WSAStartup(MAKEWORD(2, 2), &wsa);
+#endif
+  auto local = parseAddress(bindAddress);
+  socket = static_cast<intptr_t>(::socket(AF_INET, SOCK_DGRAM, 0));
+  if (socket == NO_SOCKET)
+    throw std::runtime_error("Cannot open UDP socket");
+  if (::bind(socket, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0) {
+    closeSocket(socket);
+    throw std::runtime_error("Cannot bind UDP socket to " + bindAddress);
+  }
+#ifdef _WIN32
+  u_long nonBlocking = 1;
+  ioctlsocket(socket, FIONBIO, &nonBlocking);
+#else
+  fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+#endif
+  socklen_t length = sizeof(local);
+  getsockname(socket, reinterpret_cast<sockaddr*>(&local), &length);
+  address = formatAddress(local);
+}
+
+UdpTransport::~UdpTransport() {
+  closeSocket(socket);
+}
+
+// Failed sends are dropped like lost datagrams.
+void UdpTransport::send(const string& to, const string& datagram) {
+  auto peer = parseAddress(to);
+  sendto(socket, datagram.data(), static_cast<int>(datagram.size()), 0,
+    reinterpret_cast<sockaddr*>(&peer), sizeof(peer));
+}
+
+bool UdpTransport::receive(string* from, string* datagram) {
+  sockaddr_in peer{};
+  socklen_t length = sizeof(peer);
+  auto received = recvfrom(socket, buffer.data(), static_cast<int>(buffer.size()), 0,
+    reinterpret_cast<sockaddr*>(&peer), &length);
+  if (received < 0)
+    return false;
+  *from = formatAddress(peer);
+  datagram->assign(buffer.data(), received);
+  return true;
+}
+
+// In process network
+
+class MemoryTransport : public Transport {
+ public:
+  MemoryTransport(MemoryNetwork* network, const string& address) : network{network}, address{address} {}
+
+  const string& getAddress() override { return address; }
+  void send(const string& to, const string& datagram) override { network->deliver(address, to, datagram); }
+  bool receive(string* from, string* datagram) override {
+    MemoryNetwork::Datagram received;
+    if (!network->take(address, &received))
+      return false;
+    *from = std::move(received.from);
+    *datagram = std::move(received.data);
+    return true;
+  }
+
+ private:
+  MemoryNetwork* network;
+  string address;
+};
+
+shared_ptr<Transport> MemoryNetwork::open(const string& address) {
+  std::lock_guard<std::mutex> guard(lock);
+  inboxes[address];
+  return std::make_shared<MemoryTransport>(this, address);
+}
+
+void MemoryNetwork::setConditions(const LinkConditions& conditions) {
+  std::lock_guard<std::mutex> guard(lock);
+  this->conditions = conditions;
+}
+
+uint64_t MemoryNetwork::dropped() {
+  std::lock_guard<std::mutex> guard(lock);
+  return droppedCount;
+}
+
+void MemoryNetwork::deliver(const string& from, const string& to, const string& data) {
+  std::lock_guard<std::mutex> guard(lock);
+  std::uniform_real_distribution<double> chance(0, 1);
+  auto inbox = inboxes.find(to);
+  if (inbox == inboxes.end() || chance(random) < conditions.loss) {
+    droppedCount++;
+    return;
+  }
+  auto copies = chance(random) < conditions.duplicate ? 2 : 1;
+  for (int i = 0; i < copies; i++) {
+    if (chance(random) < conditions.reorder)
+      inbox->second.push_front(Datagram{from, data});
+    else
+      inbox->second.push_back(Datagram{from, data});
+  }
+}
+
+bool MemoryNetwork::take(const string& address, Datagram* datagram) {
+  std::lock_guard<std::mutex> guard(lock);
+  auto& inbox = inboxes[address];
+  if (inbox.empty())
+    return false;
+  *datagram = std::move(inbox.front());
+  inbox.pop_front();
+  return true;
+}
+
+// Replicator
+
+Replicator::Replicator(shared_ptr<IWorld> world, shared_ptr<Transport> transport, const ReplicationOptions& options)
+  : world{world}, transport{transport}, options{options} {
+  std::random_device device;
+  emitterId = (static_cast<uint64_t>(device()) << 32) | device();
+  session = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::system_clock::now().time_since_epoch()).count();
+  listener = world->addUpdateListener([this](const string& objectId, const UpdateCommand& command) {
+    record(objectId, command);
+  });
+}
+
+Replicator::~Replicator() {
+  world->removeUpdateListener(listener);
+}
+
+void Replicator::addPeer(const string& address) {
+  std::erase(lost, address);
+  auto peer = std::find_if(peers.begin(), peers.end(), [&](const Peer& p) { return p.address == address; });
+  if (peer != peers.end() && peer->held) {
+    // Sent on the next poll, as a retransmission.
+    peer->held = false;
+    peer->lastProgress = Clock::time_point{};
+    return;
+  }
+  removePeer(address);
+  peers.push_back(Peer{address, nextSequence, nextSequence - 1, Clock::now()});
+  peers.back().encoder = TransformEncoder(options.quantization);
+  peers.back().frame = peers.back().frameAcked = lastFrame;
+  forgetTransforms();
+}
+
+bool Replicator::holdPeer(const string& address) {
+  auto peer = std::find_if(peers.begin(), peers.end(), [&](const Peer& p) { return p.address == address; });
+  if (peer != peers.end() && !peer->held)
+    return false;
+  std::erase(lost, address);
+  removePeer(address);
+  peers.push_back(Peer{address, nextSequence, nextSequence - 1, Clock::now(), true});
+  peers.back().encoder = TransformEncoder(options.quantization);
+  peers.back().frame = peers.back().frameAcked = lastFrame;
+  forgetTransforms();
+  return true;
+}
+
+void Replicator::removePeer(const string& address) {
+  std::erase_if(peers, [&](const Peer& peer) { return peer.address == address; });
+}
+
+void Replicator::record(const string& objectId, const UpdateCommand& command) {
+  if (peers.empty())
+    return;
+  if (std::holds_alternative<command::SetPosition>(command) || std::holds_alternative<command::SetRotation>(command)
+      || std::holds_alternative<command::SetScale>(command)) {
+    recordMove(objectId, command);
+    return;
+  }
+
+  string update;
+  Writer out(&update);
+  auto header = [&](UpdateKind kind) {
+    out.put(static_cast<uint8_t>(kind));
+    out.putShortString(objectId);
+  };
+  auto number = numbers.find(objectId);
+  std::visit(overloaded {
+    [&](const command::CreateObject& c) {
+      // A replaced object keeps its number, frames go on from its new transform.
+      if (number != numbers.end())
+        transformOf(number->second)->transform = t::transform<double>{c.position, c.rotation, c.scale};
+      header(CREATE_OBJECT);
+      out.put(c.position);
+      out.put(c.rotation);
+      out.put(c.scale);
+      out.put(static_cast<uint16_t>(c.plugins.size()));
+      for (auto const& plugin : c.plugins)
+        putPlugin(&out, plugin.get());
+    },
+    [&](const command::DeleteObject& c) {
+      if (number != numbers.end()) {
+        transforms.erase(transformOf(number->second));
+        numbers.erase(number);
+        moved = true;
+      }
+      header(DELETE_OBJECT);
+    },
+    [&](const command::AttachPlugin& c) {
+      header(ATTACH_PLUGIN);
+      putPlugin(&out, c.plugin.get());
+    },
+    [&](const command::RemovePlugin& c) {
+      header(REMOVE_PLUGIN);
+      out.putShortString(c.pluginId);
+    },
+    [](const auto& move) {},
+  }, command);
+
+  if (update.size() > MAX_UPDATE) {
+    Log::error("Update of " + objectId + " too large to replicate");
+    return;
+  }
+  history.push_back(Entry{nextSequence++, std::move(update)});
+}
+
+// A move only changes the latest transform of its object. Objects get
+// their number, through the stream, when they first move.
+void Replicator::recordMove(const string& objectId, const UpdateCommand& command) {
+  stats.transformUpdates++;
+  auto number = numbers.find(objectId);
+  vector<TransformState>::iterator state;
+  if (number != numbers.end()) {
+    state = transformOf(number->second);
+  } else {
+    // Listeners hear about commands before they apply.
+    auto object = world->getObject(objectId);
+    if (object == nullptr)
+      return;
+    numbers.emplace(objectId, nextNumber);
+    transforms.push_back(TransformState{nextNumber,
+      t::transform<double>{object->getPosition(), object->getRotation(), object->getScale()}});
+    state = std::prev(transforms.end());
+    string update;
+    Writer out(&update);
+    out.put(static_cast<uint8_t>(TRANSFORM_ID));
+    out.putShortString(objectId);
+    out.put(nextNumber++);
+    history.push_back(Entry{nextSequence++, std::move(update)});
+  }
+  std::visit(overloaded {
+    [&](const command::SetPosition& c) { state->transform.position = c.position; },
+    [&](const command::SetRotation& c) { state->transform.rotation = c.rotation; },
+    [&](const command::SetScale& c) { state->transform.scale = c.scale; },
+    [](const auto& other) {},
+  }, command);
+  moved = true;
+}
+
+// Numbers are handed out in ascending order, transforms stay sorted.
+vector<TransformState>::iterator Replicator::transformOf(uint32_t number) {
+  return std::lower_bound(transforms.begin(), transforms.end(), number,
+    [](const TransformState& state, uint32_t number) { return state.id < number; });
+}
+
+// Numbers given before a peer was added never reached it: objects are
+// numbered anew as they move.
+void Replicator::forgetTransforms() {
+  if (numbers.empty())
+    return;
+  numbers.clear();
+  transforms.clear();
+  moved = true;
+  string update;
+  Writer out(&update);
+  out.put(static_cast<uint8_t>(FORGET_TRANSFORMS));
+  out.putShortString(string());
+  history.push_back(Entry{nextSequence++, std::move(update)});
+}
+
+void Replicator::poll(Clock::time_point now) {
+  CORE_PROFILE_SCOPE("replication poll");
+  while (transport->receive(&from, &incoming))
+    receive(from, incoming, now);
+
+  if (unsent < nextSequence) {
+    for (auto& peer : peers) {
+      if (peer.held)
+        continue;
+      if (peer.acked + 1 == unsent)
+        peer.lastProgress = now;
+      sendRange(&peer, unsent, nextSequence - 1);
+    }
+    stats.updatesSent += nextSequence - unsent;
+    unsent = nextSequence;
+  }
+
+  // Nothing tells a receiver about lost updates at the tail, nor the
+  // emitter about lost acks: resend what stays unacknowledged too long.
+  for (auto& peer : peers) {
+    if (!peer.held && peer.acked + 1 < nextSequence && now - peer.lastProgress >= options.retransmitAfter) {
+      auto to = std::min(nextSequence - 1, peer.acked + options.maxRetransmit);
+      stats.updatesRetransmitted += sendRange(&peer, peer.acked + 1, to);
+      peer.lastProgress = now;
+    }
+  }
+
+  // A frame after every poll with moves, and again when the last one
+  // stays unacknowledged too long.
+  for (auto& peer : peers) {
+    if (peer.held)
+      continue;
+    if (moved || (peer.frameAcked < peer.frame && now - peer.frameSent >= options.retransmitAfter))
+      sendFrame(&peer, now);
+  }
+  moved = false;
+
+  for (auto& [emitter, source] : sources) {
+    if (source.ackDue || (!source.held.empty() && now - source.lastAck >= options.ackInterval))
+      sendAck(emitter, &source, now);
+  }
+
+  trimHistory();
+  stats.history = history.size();
+}
+
+size_t Replicator::sendRange(Peer* peer, uint64_t from, uint64_t to) {
+  if (history.empty())
+    return 0;
+  auto oldest = history.front().sequence;
+  auto base = std::max(oldest, peer->first);
+  from = std::max(from, base);
+  to = std::min(to, nextSequence - 1);
+
+  auto first = from;
+  uint16_t count = 0;
+  outgoing.resize(HEADER_SIZE);
+  for (auto sequence = from; sequence <= to; sequence++) {
+    auto const& update = history[sequence - oldest].update;
+    if (count > 0 && (outgoing.size() + sizeof(uint32_t) + update.size() > options.maxDatagram || count == UINT16_MAX)) {
+      flush(peer->address, first, base, count);
+      first = sequence;
+      count = 0;
+      outgoing.resize(HEADER_SIZE);
+    }
+    Writer(&outgoing).putString(update);
+    count++;
+  }
+  if (count > 0)
+    flush(peer->address, first, base, count);
+  return from <= to ? to - from + 1 : 0;
+}
+
+void Replicator::flush(const string& to, uint64_t first, uint64_t base, uint16_t count) {
+  putHeader(&outgoing, UPDATES, count, emitterId, session, first, base);
+  transport->send(to, outgoing);
+  stats.datagramsSent++;
+}
+
+// Frames larger than a datagram go in parts, all needed to decode it.
+void Replicator::sendFrame(Peer* peer, Clock::time_point now) {
+  auto frame = peer->encoder.encode(++peer->frame, transforms);
+  lastFrame = std::max(lastFrame, peer->frame);
+  auto partSize = options.maxDatagram > HEADER_SIZE + sizeof(uint16_t)
+    ? options.maxDatagram - HEADER_SIZE - sizeof(uint16_t) : 1;
+  auto parts = std::max<size_t>((frame.size() + partSize - 1) / partSize, 1);
+  if (parts > UINT16_MAX) {
+    Log::error("Transform frame too large to replicate");
+    return;
+  }
+  for (size_t part = 0; part < parts; part++) {
+    outgoing.resize(HEADER_SIZE);
+    Writer(&outgoing).put(static_cast<uint16_t>(part));
+    outgoing.append(frame, part * partSize, partSize);
+    putHeader(&outgoing, TRANSFORMS, static_cast<uint16_t>(parts), emitterId, session, nextSequence - 1, peer->frame);
+    transport->send(peer->address, outgoing);
+    stats.datagramsSent++;
+  }
+  stats.framesSent++;
+  stats.frameBytes += frame.size();
+  peer->frameSent = now;
+}
+
+void Replicator::receive(const string& from, const string& datagram, Clock::time_point now) {
+  stats.datagramsReceived++;
+  try {
+    if (datagram.size() < HEADER_SIZE || memcmp(datagram.data(), MAGIC, sizeof(MAGIC)) != 0)
+      throw std::runtime_error("Not a replication datagram from " + from);
+    Reader in(datagram.data() + sizeof(MAGIC), HEADER_SIZE - sizeof(MAGIC));
+    if (in.get<uint8_t>() != VERSION)
+      throw std::runtime_error("Unsupported replication version from " + from);
+    auto kind = in.get<uint8_t>();
+    auto count = in.get<uint16_t>();
+    auto emitter = in.get<uint64_t>();
+    auto session = in.get<uint64_t>();
+    auto sequence = in.get<uint64_t>();
+    auto base = in.get<uint64_t>();
+    auto data = datagram.data() + HEADER_SIZE;
+    auto size = datagram.size() - HEADER_SIZE;
+
+    if (kind == UPDATES)
+      receiveUpdates(from, emitter, session, sequence, base, count, data, size);
+    else if (kind == TRANSFORMS)
+      receiveFrame(from, emitter, session, sequence, base, count, data, size);
+    else if (kind == ACK && emitter == emitterId && session == this->session)
+      receiveAck(from, sequence, base, count, data, size, now);
+    else if (kind != ACK)
+      throw std::runtime_error("Unknown replication datagram from " + from);
+  } catch (const std::exception& ex) {
+    stats.malformed++;
+  }
+}
+
+bool Replicator::isPeer(const string& address) const {
+  return std::any_of(peers.begin(), peers.end(), [&](const Peer& peer) { return peer.address == address; });
+}
+
+// An emitter moves to another address only once its first one is no
+// longer a peer. When full, sources of former peers make room.
+Replicator::Source* Replicator::sourceOf(const string& from, uint64_t emitter, bool create) {
+  if (!isPeer(from)) {
+    stats.refused++;
+    return nullptr;
+  }
+  auto found = sources.find(emitter);
+  if (found != sources.end()) {
+    if (found->second.address != from) {
+      if (isPeer(found->second.address)) {
+        stats.refused++;
+        return nullptr;
+      }
+      found->second.address = from;
+    }
+    return &found->second;
+  }
+  if (!create)
+    return nullptr;
+  if (sources.size() >= options.maxSources)
+    std::erase_if(sources, [&](const auto& entry) { return !isPeer(entry.second.address); });
+  if (sources.size() >= options.maxSources) {
+    stats.refused++;
+    return nullptr;
+  }
+  auto& source = sources[emitter];
+  source.address = from;
+  return &source;
+}
+
+void Replicator::receiveUpdates(const string& from, uint64_t emitter, uint64_t session, uint64_t first,
+    uint64_t base, uint16_t count, const char* data, size_t size) {
+  if (emitter == emitterId || base == 0)
+    return;
+  auto found = sourceOf(from, emitter, true);
+  if (found == nullptr)
+    return;
+  auto& source = *found;
+  // A restarted emitter starts over with a later session.
+  if (session < source.session)
+    return;
+  if (session > source.session) {
+    source = Source{};
+    source.address = from;
+    source.session = session;
+    source.contiguous = base - 1;
+    source.decoder = TransformDecoder(options.quantization);
+  }
+  source.ackDue = true;
+
+  // The emitter no longer has what we miss, our world was synced again
+  // past it: apply what we hold and move on.
+  if (source.contiguous + 1 < base) {
+    auto missing = base - 1 - source.contiguous;
+    while (!source.held.empty() && source.held.begin()->first < base) {
+      apply(&source, source.held.begin()->second);
+      source.held.erase(source.held.begin());
+      missing--;
+    }
+    stats.skipped += missing;
+    source.contiguous = base - 1;
+  }
+
+  Reader in(data, size);
+  for (uint64_t sequence = first; sequence < first + count; sequence++) {
+    auto update = in.getString();
+    if (sequence <= source.contiguous || source.held.count(sequence) > 0)
+      stats.duplicates++;
+    else if (source.held.size() < options.maxHistory)
+      source.held.emplace(sequence, std::move(update));
+  }
+  applyReady(&source);
+}
+
+// Frames past the last one are ignored, the receiver can't have them.
+void Replicator::receiveAck(const string& from, uint64_t contiguous, uint64_t frame, uint16_t count,
+    const char* data, size_t size, Clock::time_point now) {
+  auto peer = std::find_if(peers.begin(), peers.end(), [&](const Peer& p) { return p.address == from; });
+  if (peer == peers.end() || peer->held)
+    return;
+  if (frame > peer->frameAcked && frame <= peer->frame) {
+    peer->frameAcked = static_cast<uint32_t>(frame);
+    peer->encoder.acknowledge(peer->frameAcked);
+  }
+  contiguous = std::min(contiguous, nextSequence - 1);
+  if (contiguous > peer->acked) {
+    peer->acked = contiguous;
+    peer->lastProgress = now;
+  }
+
+  size_t budget = options.maxRetransmit;
+  Reader in(data, size);
+  for (uint16_t i = 0; i < count; i++) {
+    auto missingFrom = in.get<uint64_t>();
+    auto missingTo = in.get<uint64_t>();
+    if (missingFrom > missingTo || budget == 0)
+      continue;
+    auto sent = sendRange(&*peer, missingFrom, std::min(missingTo, missingFrom + budget - 1));
+    stats.updatesRetransmitted += sent;
+    budget -= std::min(budget, sent);
+  }
+}
+
+void Replicator::applyReady(Source* source) {
+  while (!source->held.empty() && source->held.begin()->first == source->contiguous + 1) {
+    apply(source, source->held.begin()->second);
+    source->held.erase(source->held.begin());
+    source->contiguous++;
+  }
+}
+
+// Frames are applied once complete, newer than the last one applied and
+// with every update sent before them applied: those number the objects
+// and create them. Others wait for the next frame.
+void Replicator::receiveFrame(const string& from, uint64_t emitter, uint64_t session, uint64_t sequence,
+    uint64_t frame, uint16_t parts, const char* data, size_t size) {
+  auto found = sourceOf(from, emitter, false);
+  if (found == nullptr || found->session != session || frame > UINT32_MAX || parts == 0)
+    return;
+  auto& source = *found;
+  auto number = static_cast<uint32_t>(frame);
+  if (number <= source.frame || number < source.partialFrame)
+    return;
+  if (number != source.partialFrame) {
+    source.partialFrame = number;
+    source.parts.assign(parts, string());
+    source.partsIn = 0;
+  }
+  Reader in(data, size);
+  auto part = in.get<uint16_t>();
+  if (part >= source.parts.size())
+    throw std::runtime_error("Invalid transform frame from " + from);
+  if (!source.parts[part].empty())
+    return;
+  source.parts[part].assign(data + sizeof(uint16_t), size - sizeof(uint16_t));
+  if (++source.partsIn < source.parts.size() || source.contiguous < sequence)
+    return;
+
+  string packet;
+  for (auto const& bytes : source.parts)
+    packet += bytes;
+  applyFrame(&source, source.decoder.decode(packet));
+  source.frame = number;
+  source.ackDue = true;
+  stats.framesApplied++;
+}
+
+// Objects whose transform is the same as in the last frame applied are
+// left alone. The others get the fields that changed since, or for objects
+// new to the frames the ones that differ from the world at this precision.
+void Replicator::applyFrame(Source* source, vector<TransformState> frame) {
+  auto const& quantization = options.quantization;
+  auto const& applied = source->applied;
+  size_t previous = 0;
+  for (auto const& state : frame) {
+    while (previous < applied.size() && applied[previous].id < state.id)
+      previous++;
+    auto known = previous < applied.size() && applied[previous].id == state.id;
+    if (known && applied[previous].transform == state.transform)
+      continue;
+    auto objectId = source->objectIds.find(state.id);
+    if (objectId == source->objectIds.end())
+      continue;
+    auto object = world->getObject(objectId->second);
+    if (object == nullptr)
+      continue;
+    auto before = known ? applied[previous].transform : dequantize(quantize(
+      t::transform<double>{object->getPosition(), object->getRotation(), object->getScale()}, quantization),
+      quantization);
+    auto const& after = state.transform;
+    if (after.position != before.position) {
+      object->setPosition(after.position);
+      stats.transformsApplied++;
+    }
+    if (after.rotation != before.rotation) {
+      object->setRotation(after.rotation);
+      stats.transformsApplied++;
+    }
+    if (after.scale != before.scale) {
+      object->setScale(t::scale{after.scale.x, after.scale.y, after.scale.z});
+      stats.transformsApplied++;
+    }
+  }
+  source->applied = std::move(frame);
+}
+
+void Replicator::apply(Source* source, const string& update) {
+  try {
+    Reader in(update.data(), update.size());
+    auto kind = in.get<uint8_t>();
+    auto objectId = in.getShortString();
+    auto object = world->getObject(objectId);
+    switch (kind) {
+      case CREATE_OBJECT: {
+        auto position = in.get<t::position>();
+        auto rotation = in.get<t::rotation>();
+        auto scale = in.get<t::scale>();
+        object = world->newObject(objectId);
+        object->setPosition(position);
+        object->setRotation(rotation);
+        object->setScale(scale);
+        auto plugins = in.get<uint16_t>();
+        for (uint16_t i = 0; i < plugins; i++) {
+          auto plugin = getPlugin(&in);
+          if (plugin != nullptr)
+            world->savePluginToObject(objectId, plugin);
+        }
+        break;
+      }
+      case DELETE_OBJECT: {
+        world->deleteObject(objectId);
+        auto number = source->numbers.find(objectId);
+        if (number != source->numbers.end()) {
+          source->objectIds.erase(number->second);
+          source->numbers.erase(number);
+        }
+        break;
+      }
+      case ATTACH_PLUGIN: {
+        auto plugin = getPlugin(&in);
+        if (plugin != nullptr)
+          world->savePluginToObject(objectId, plugin);
+        break;
+      }
+      case REMOVE_PLUGIN: {
+        auto pluginId = in.getShortString();
+        if (object != nullptr)
+          object->removePlugin(pluginId);
+        break;
+      }
+      case TRANSFORM_ID: {
+        auto number = in.get<uint32_t>();
+        auto& previous = source->numbers[objectId];
+        source->objectIds.erase(previous);
+        previous = number;
+        source->objectIds[number] = objectId;
+        break;
+      }
+      case FORGET_TRANSFORMS:
+        source->objectIds.clear();
+        source->numbers.clear();
+        break;
+      default:
+        throw std::runtime_error("Unknown replicated update");
+    }
+    stats.updatesApplied++;
+  } catch (const std::exception& ex) {
+    stats.malformed++;
+  }
+}
+
+void Replicator::sendAck(uint64_t emitter, Source* source, Clock::time_point now) {
+  outgoing.resize(HEADER_SIZE);
+  Writer out(&outgoing);
+  uint16_t ranges = 0;
+  auto previous = source->contiguous;
+  for (auto const& [sequence, update] : source->held) {
+    if (ranges == options.maxMissingRanges)
+      break;
+    if (sequence > previous + 1) {
+      out.put(previous + 1);
+      out.put(sequence - 1);
+      ranges++;
+    }
+    previous = sequence;
+  }
+  putHeader(&outgoing, ACK, ranges, emitter, source->session, source->contiguous, source->frame);
+  transport->send(source->address, outgoing);
+  stats.datagramsSent++;
+  source->ackDue = false;
+  source->lastAck = now;
+}
+
+// Updates every peer acknowledged are dropped. Past maxHistory the oldest
+// ones go anyway, and with them the peers still lacking them: skipping
+// updates would leave their world diverged for good.
+void Replicator::trimHistory() {
+  uint64_t acked = nextSequence - 1;
+  for (auto const& peer : peers)
+    acked = std::min(acked, peer.acked);
+  while (!history.empty() && history.front().sequence <= acked)
+    history.pop_front();
+  while (history.size() > options.maxHistory) {
+    auto sequence = history.front().sequence;
+    history.pop_front();
+    std::erase_if(peers, [&](const Peer& peer) {
+      if (peer.acked >= sequence)
+        return false;
+      Log::error("Replication peer " + peer.address + " fell too far behind, dropped");
+      lost.push_back(peer.address);
+      stats.lostPeers++;
+      return true;
+    });
+  }
+  if (peers.empty())
+    history.clear();
+}
+
+void Replicator::takeLostPeers(vector<string>* out) {
+  out->insert(out->end(), lost.begin(), lost.end());
+  lost.clear();
+}
+
+}  // namespace core
@@ -0,0 +1,330 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_REPLICATION_HPP_
+#define CORE_SRC_REPLICATION_HPP_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "core.hpp"
+#include "transform_codec.hpp"
+
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+namespace core {
+
+// Replication of world updates between cores over datagrams.
+//
+// Every command a world drains (see IWorld::addUpdateListener) gets the
+// next sequence number of its emitter, a random id plus a session stamp
+// taken at startup, and is sent to every peer in batches. Receivers apply
+// each emitter's updates in sequence order, hold back the ones past a gap
+// and drop duplicates, and reply with the last contiguous sequence plus
+// the missing ranges. The emitter resends only those ranges, or the
+// unacknowledged tail when acks stop coming, and forgets updates once
+// every peer has them. A peer so far behind that the emitter would have to
+// forget updates it lacks is dropped instead and reported, so that its
+// world is synced again (see WorldSyncServer) rather than left diverged.
+//
+// Moves (SetPosition, SetRotation, SetScale) stay out of that stream: only
+// the latest transform of each object counts. The emitter gives moved
+// objects a number, told through the stream, and after each poll sends
+// every peer a frame of the transforms encoded against the last frame that
+// peer acknowledged (see transform_codec.hpp). Receivers apply a frame once
+// they have the updates sent before it, and acknowledge the newest one in
+// their acks. Lost frames are not resent as such: the next frame, or a
+// new one after retransmitAfter, carries whatever the peer still lacks.
+// Adding a peer numbers the objects anew, so that it never gets numbers
+// it was not told about.
+//
+// All integers are in host (little endian) order:
+//
+//   Header    magic "VRRP", version u8, kind u8, count u16,
+//             emitter u64, session u64, sequence u64, base u64
+//   UPDATES   count times: size u32, update
+//             sequence is the first update's, base the oldest one the
+//             emitter still holds for this peer
+//   ACK       count times: from u64, to u64, missing ranges
+//             emitter/session are the acknowledged ones, sequence the
+//             last contiguous one received, base the newest frame applied
+//   TRANSFORMS  part u16 then that part of the encoded frame; count is
+//             the number of parts, sequence the last update sent before
+//             the frame, base the frame number
+//
+// An update is kind u8, object id (u16 size + chars), then the transform
+// doubles, plugins as id, type u8 and blob (u32 size + bytes), or the
+// object's number u32. FORGET_TRANSFORMS drops all numbers.
+//
+// Updates received from peers are applied straight to the world, not
+// through its queue, so they are never sent on again: every core has to
+// peer with every other one.
+namespace replication {
+
+constexpr char MAGIC[4] = {'V', 'R', 'R', 'P'};
+constexpr uint8_t VERSION = 2;
+constexpr size_t HEADER_SIZE = 40;
+// Updates larger than this (big scripts) cannot be replicated.
+constexpr size_t MAX_UPDATE = 60000;
+
+enum Kind : uint8_t { UPDATES, ACK, TRANSFORMS };
+enum UpdateKind : uint8_t {
+  CREATE_OBJECT, DELETE_OBJECT, ATTACH_PLUGIN, REMOVE_PLUGIN, TRANSFORM_ID, FORGET_TRANSFORMS
+};
+
+}  // namespace replication
+
+// Unreliable datagram delivery between string addresses.
+class Transport {
+ public:
+  virtual ~Transport() {}
+  virtual const string& getAddress() = 0;
+  virtual void send(const string& to, const string& datagram) = 0;
+  // Does not block, false when nothing is waiting.
+  virtual bool receive(string* from, string* datagram) = 0;
+};
+
+// UDP socket bound to "ip:port", port 0 picks a free one. Addresses of
+// peers and of received datagrams use the same numeric form.
+class UdpTransport : public Transport {
+ public:
+  explicit UdpTransport(const string& address = "0.0.0.0:0");
+  ~UdpTransport();
+  UdpTransport(const UdpTransport&) = delete;
+  UdpTransport& operator=(const UdpTransport&) = delete;
+
+  const string& getAddress() override { return address; }
+  void send(const string& to, const string& datagram) override;
+  bool receive(string* from, string* datagram) override;
+
+ private:
+  intptr_t socket;
+  string address;
+  vector<char> buffer;
+};
+
+// Faults applied to every datagram of a MemoryNetwork, as probabilities.
+struct LinkConditions {
+  double loss = 0;
+  double duplicate = 0;
+  // Delivered ahead of the datagrams already waiting.
+  double reorder = 0;
+  uint32_t seed = 1;
+};
+
+// In process network to run several cores in one process, with simulated
+// loss, duplication and reordering. Outlives the transports it opens.
+class MemoryNetwork {
+ public:
+  explicit MemoryNetwork(const LinkConditions& conditions = {}) : conditions{conditions}, random{conditions.seed} {}
+
+  shared_ptr<Transport> open(const string& address);
+  void setConditions(const LinkConditions& conditions);
+  uint64_t dropped();
+
+ private:
+  friend class MemoryTransport;
+  struct Datagram {
+    string from;
+    string data;
+  };
+  void deliver(const string& from, const string& to, const string& data);
+  bool take(const string& address, Datagram* datagram);
+
+  std::mutex lock;
+  LinkConditions conditions;
+  std::mt19937 random;
+  std::unordered_map<string, std::deque<Datagram>> inboxes;
+  uint64_t droppedCount = 0;
+};
+
+struct ReplicationOptions {
+  // Batches fill datagrams up to this size, single larger updates go alone.
+  size_t maxDatagram = 1200;
+  // While a gap is open, how often to ask again for the missing ranges.
+  std::chrono::milliseconds ackInterval{20};
+  // Resend the unacknowledged tail after this long without ack progress.
+  std::chrono::milliseconds retransmitAfter{100};
+  size_t maxRetransmit = 1024;
+  // Updates kept for peers that are behind, and held back past a gap.
+  // Peers further behind are dropped, see Replicator::takeLostPeers.
+  size_t maxHistory = 1 << 16;
+  size_t maxMissingRanges = 64;
+  // Emitters heard from at once. Updates are only taken from peers, and
+  // an emitter only from the first peer address it came from.
+  size_t maxSources = 256;
+  // Precision transforms are sent with, the same on every core.
+  Quantization quantization;
+};
+
+struct ReplicationStats {
+  uint64_t datagramsSent = 0;
+  uint64_t datagramsReceived = 0;
+  uint64_t updatesSent = 0;
+  uint64_t updatesRetransmitted = 0;
+  uint64_t updatesApplied = 0;
+  uint64_t duplicates = 0;
+  uint64_t skipped = 0;
+  uint64_t malformed = 0;
+  // Datagrams from addresses that are not peers, or for emitters bound to
+  // another one.
+  uint64_t refused = 0;
+  uint64_t lostPeers = 0;
+  size_t history = 0;
+  // Moves drained, and the frames and bytes that carried them.
+  uint64_t transformUpdates = 0;
+  uint64_t framesSent = 0;
+  uint64_t frameBytes = 0;
+  // Frames and transform fields applied here.
+  uint64_t framesApplied = 0;
+  uint64_t transformsApplied = 0;
+};
+
+// Replicates the updates of one world with the cores listed as peers.
+// Everything, including the world's update listener, runs on the thread
+// calling round() and poll().
+class Replicator {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  Replicator(shared_ptr<IWorld> world, shared_ptr<Transport> transport, const ReplicationOptions& options = {});
+  ~Replicator();
+  Replicator(const Replicator&) = delete;
+  Replicator& operator=(const Replicator&) = delete;
+
+  // The peer gets the updates drained from now on, a peer added before
+  // starts over from here. A held peer gets what was kept for it instead.
+  void addPeer(const string& address);
+  // Keeps the updates drained from now on for the peer without sending it
+  // any, until addPeer() or removePeer(). Lets a joiner be added from the
+  // point of its image once its address is proven. False, and nothing
+  // changes, when the peer already gets updates.
+  bool holdPeer(const string& address);
+  void removePeer(const string& address);
+  // Applies what arrived, sends what was drained since the last call, acks
+  // and retransmits. Call it after each round.
+  void poll() { poll(Clock::now()); }
+  void poll(Clock::time_point now);
+
+  // Appends the addresses of the peers dropped for falling more than
+  // maxHistory updates behind since the last call. They get nothing more
+  // until added again, once their world is synced again.
+  void takeLostPeers(vector<string>* out);
+
+  uint64_t getEmitterId() const { return emitterId; }
+  // Sequence of the next update drained, peers added now start there.
+  uint64_t getSequence() const { return nextSequence; }
+  const ReplicationStats& getStats() const { return stats; }
+
+ private:
+  struct Entry {
+    uint64_t sequence;
+    string update;
+  };
+  struct Peer {
+    string address;
+    uint64_t first;
+    uint64_t acked;
+    Clock::time_point lastProgress;
+    bool held = false;
+    TransformEncoder encoder{Quantization{}};
+    uint32_t frame = 0;
+    uint32_t frameAcked = 0;
+    Clock::time_point frameSent;
+  };
+  struct Source {
+    string address;
+    uint64_t session = 0;
+    uint64_t contiguous = 0;
+    std::map<uint64_t, string> held;
+    bool ackDue = false;
+    Clock::time_point lastAck;
+    // Object ids by number and back, the newest frame applied and the
+    // parts of the one coming in.
+    std::unordered_map<uint32_t, string> objectIds;
+    std::unordered_map<string, uint32_t> numbers;
+    TransformDecoder decoder{Quantization{}};
+    uint32_t frame = 0;
+    vector<TransformState> applied;
+    uint32_t partialFrame = 0;
+    vector<string> parts;
+    size_t partsIn = 0;
+  };
+
+  void record(const string& objectId, const UpdateCommand& command);
+  void recordMove(const string& objectId, const UpdateCommand& command);
+  vector<TransformState>::iterator transformOf(uint32_t number);
+  void forgetTransforms();
+  void sendFrame(Peer* peer, Clock::time_point now);
+  void receiveFrame(const string& from, uint64_t emitter, uint64_t session, uint64_t sequence, uint64_t frame,
+    uint16_t parts, const char* data, size_t size);
+  void applyFrame(Source* source, vector<TransformState> frame);
+  // Sends what history still holds of [from, to], returns how many.
+  size_t sendRange(Peer* peer, uint64_t from, uint64_t to);
+  void flush(const string& to, uint64_t first, uint64_t base, uint16_t count);
+  void receive(const string& from, const string& datagram, Clock::time_point now);
+  void receiveUpdates(const string& from, uint64_t emitter, uint64_t session, uint64_t first, uint64_t base,
+    uint16_t count, const char* data, size_t size);
+  void receiveAck(const string& from, uint64_t contiguous, uint64_t frame, uint16_t count, const char* data,
+    size_t size, Clock::time_point now);
+  // Nullptr, counted as refused, when the datagram must be ignored.
+  Source* sourceOf(const string& from, uint64_t emitter, bool create);
+  bool isPeer(const string& address) const;
+  void applyReady(Source* source);
+  void apply(Source* source, const string& update);
+  void sendAck(uint64_t emitter, Source* source, Clock::time_point now);
+  void trimHistory();
+
+  shared_ptr<IWorld> world;
+  shared_ptr<Transport> transport;
+  uint64_t listener;
+  ReplicationOptions options;
+  uint64_t emitterId;
+  uint64_t session;
+  uint64_t nextSequence = 1;
+  uint64_t unsent = 1;
+  std::deque<Entry> history;
+  vector<Peer> peers;
+  // Latest transform of the moved objects, by ascending number.
+  std::unordered_map<string, uint32_t> numbers;
+  vector<TransformState> transforms;
+  uint32_t nextNumber = 1;
+  bool moved = false;
+  // Newest frame sent to any peer, peers added later number theirs on
+  // from there so that receivers take them as newer.
+  uint32_t lastFrame = 0;
+  vector<string> lost;
+  std::unordered_map<uint64_t, Source> sources;
+  ReplicationStats stats;
+  string from;
+  string incoming;
+  string outgoing;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_REPLICATION_HPP_
@@ -0,0 +1,134 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "scheduler.hpp"
+
+using std::mutex;
+using std::unique_lock;
+using std::lock_guard;
+
+namespace core {
+
+WorkStealingPool::WorkStealingPool(size_t workers) {
+  if (workers == 0)
+    workers = 1;
+  for (size_t i = 0; i < workers; i++)
+    queues.push_back(std::make_unique<Queue>());
+  for (size_t i = 1; i < workers; i++)
+    threads.emplace_back([this, i]() { workerLoop(i); });
+}
+
+WorkStealingPool::~WorkStealingPool() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  wakeWorkers.notify_all();
+  for (auto& thread : threads)
+    thread.join();
+}
+
+void WorkStealingPool::run(size_t tasks, const function<void(size_t, size_t)>& task) {
+  if (tasks == 0)
+    return;
+  if (queues.size() == 1) {
+    for (size_t i = 0; i < tasks; i++)
+      task(i, 0);
+    return;
+  }
+
+  // Contiguous blocks keep neighbouring objects on the same worker,
+  // stealing evens out whatever imbalance the plugins cause.
+  auto perWorker = (tasks + queues.size() - 1) / queues.size();
+  for (size_t w = 0; w < queues.size(); w++) {
+    lock_guard<mutex> guard(queues[w]->lock);
+    for (size_t i = w * perWorker; i < tasks && i < (w + 1) * perWorker; i++)
+      queues[w]->tasks.push_back(i);
+  }
+
+  {
+    lock_guard<mutex> guard(lock);
+    remaining = tasks;
+    job = &task;
+    jobSerial++;
+  }
+  wakeWorkers.notify_all();
+
+  drain(0, task);
+
+  unique_lock<mutex> guard(lock);
+  jobDone.wait(guard, [this]() { return remaining == 0 && activeWorkers == 0; });
+  job = nullptr;
+}
+
+void WorkStealingPool::workerLoop(size_t worker) {
+  uint64_t seen = 0;
+  while (true) {
+    const function<void(size_t, size_t)>* current;
+    {
+      unique_lock<mutex> guard(lock);
+      wakeWorkers.wait(guard, [&]() { return stopping || (job != nullptr && jobSerial != seen); });
+      if (stopping)
+        return;
+      seen = jobSerial;
+      current = job;
+      activeWorkers++;
+    }
+    drain(worker, *current);
+    {
+      lock_guard<mutex> guard(lock);
+      activeWorkers--;
+    }
+    jobDone.notify_all();
+  }
+}
+
+void WorkStealingPool::drain(size_t worker, const function<void(size_t, size_t)>& task) {
+  size_t index;
+  while (pop(worker, &index) || steal(worker, &index)) {
+    task(index, worker);
+    if (remaining.fetch_sub(1) == 1) {
+      lock_guard<mutex> guard(lock);
+      jobDone.notify_all();
+    }
+  }
+}
+
+bool WorkStealingPool::pop(size_t worker, size_t* task) {
+  auto& queue = *queues[worker];
+  lock_guard<mutex> guard(queue.lock);
+  if (queue.tasks.empty())
+    return false;
+  *task = queue.tasks.back();
+  queue.tasks.pop_back();
+  return true;
+}
+
+bool WorkStealingPool::steal(size_t worker, size_t* task) {
+  for (size_t offset = 1; offset < queues.size(); offset++) {
+    auto& victim = *queues[(worker + offset) % queues.size()];
+    lock_guard<mutex> guard(victim.lock);
+    if (victim.tasks.empty())
+      continue;
+    *task = victim.tasks.front();
+    victim.tasks.pop_front();
+    return true;
+  }
+  return false;
+}
+
+}  // namespace core
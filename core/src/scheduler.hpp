@@ -0,0 +1,75 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_SCHEDULER_HPP_
+#define CORE_SRC_SCHEDULER_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using std::vector;
+using std::function;
+
+namespace core {
+
+// Fixed size pool where every worker owns a deque of task indexes.
+// Owners pop from the back of their own deque, idle workers steal from the
+// front of the others. The thread calling run() takes part as worker 0.
+class WorkStealingPool {
+ public:
+  explicit WorkStealingPool(size_t workers);
+  ~WorkStealingPool();
+
+  size_t workerCount() const { return queues.size(); }
+
+  // Calls task(index, worker) for every index in [0, tasks) and returns once
+  // all of them completed. Not reentrant.
+  void run(size_t tasks, const function<void(size_t, size_t)>& task);
+
+ private:
+  struct Queue {
+    std::mutex lock;
+    std::deque<size_t> tasks;
+  };
+
+  void workerLoop(size_t worker);
+  void drain(size_t worker, const function<void(size_t, size_t)>& task);
+  bool pop(size_t worker, size_t* task);
+  bool steal(size_t worker, size_t* task);
+
+  vector<std::unique_ptr<Queue>> queues;
+  vector<std::thread> threads;
+
+  std::mutex lock;
+  std::condition_variable wakeWorkers;
+  std::condition_variable jobDone;
+  const function<void(size_t, size_t)>* job = nullptr;
+  uint64_t jobSerial = 0;
+  size_t activeWorkers = 0;
+  std::atomic<size_t> remaining = 0;
+  bool stopping = false;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_SCHEDULER_HPP_
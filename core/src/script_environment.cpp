@@ -0,0 +1,807 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "script_environment.hpp"
+#include <algorithm>
+#include <chrono>
+#include <tuple>
+
+#include "core.hpp"
+
+using std::mutex;
+using std::unique_lock;
+using std::lock_guard;
+
+namespace core {
+
+const auto LUA_whitelistedFunctions = vector<string>{
+  "assert",
+  "error",
+  "ipairs",
+  "next",
+  "pairs",
+  "pcall",
+  "print",
+  "select",
+  "tonumber",
+  "tostring",
+  "type",
+  "unpack",
+  "_VERSION",
+  "xpcall",
+  "wait",
+  "sleep",
+  "waitFor",
+  "signal",
+  "subscribe",
+  "unsubscribe",
+  "eventDriven",
+  "emit",
+  "events",
+  "waitEvents"
+};
+
+const auto LUA_whitelistedLibraries = vector<string>{
+  "coroutine",
+  "table",
+  "string",
+  "math",
+  "utf8",
+};
+
+// Instructions between two calls of the budget hook.
+static constexpr int HOOK_INTERVAL = 1000;
+
+static double steadySeconds() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ScriptEnvironment::ScriptEnvironment(size_t index, BytecodeCache* bytecode) : index{index}, bytecode{bytecode} {
+  // Every thread of the state starts with a copy of this, so the hook
+  // finds the environment from script coroutines too.
+  *static_cast<ScriptEnvironment**>(lua_getextraspace(lua.lua_state())) = this;
+  env = sol::environment(lua, sol::create);
+  loadLibraries();
+  registerWaits();
+  registerEvents();
+  sandbox(LUA_whitelistedLibraries, LUA_whitelistedFunctions);
+  registerCustomTypes();
+}
+
+sol::protected_function& ScriptEnvironment::compiled(uint64_t scriptId, const string& source) {
+  auto found = scripts.find(scriptId);
+  if (found != scripts.end())
+    return found->second;
+
+  return scripts[scriptId] = compile(source);
+}
+
+void ScriptEnvironment::forget(uint64_t scriptId) {
+  scripts.erase(scriptId);
+  suspended.erase(suspended.lower_bound({scriptId, 0}), suspended.lower_bound({scriptId + 1, 0}));
+}
+
+// Only yields the coroutine the run started on: yielding one a script
+// created itself would look like a regular yield to that script.
+void ScriptEnvironment::budgetHook(lua_State* state, lua_Debug* debug) {
+  auto environment = *static_cast<ScriptEnvironment**>(lua_getextraspace(state));
+  auto run = environment->running;
+  if (run == nullptr)
+    return;
+  run->instructions += HOOK_INTERVAL;
+  auto now = run->deadline > 0 ? steadySeconds() : 0;
+  if ((run->limit == 0 || run->instructions < run->limit) && (run->deadline == 0 || now < run->deadline))
+    return;
+  if (state == run->thread && lua_isyieldable(state)) {
+    lua_yield(state, 0);
+    return;
+  }
+  if ((run->hardLimit > 0 && run->instructions >= run->hardLimit) || (run->hardDeadline > 0 && now >= run->hardDeadline)) {
+    run->aborted = true;
+    luaL_error(state, "script went over its budget");
+  }
+}
+
+// Waits yield the run like the budget hook does, the caller puts the
+// plugin to sleep and the next run resumes after the call. Arguments are
+// checked before anything is kept, lua errors do not unwind C++ frames.
+int ScriptEnvironment::yieldWait(lua_State* state, uint64_t rounds, double seconds, int signal) {
+  auto environment = *static_cast<ScriptEnvironment**>(lua_getextraspace(state));
+  auto run = environment->running;
+  if (run == nullptr || state != run->thread || !lua_isyieldable(state))
+    return luaL_error(state, "scripts can only wait from their own body, not from coroutines they create");
+  run->waiting = true;
+  run->wait.rounds = rounds;
+  run->wait.seconds = seconds;
+  if (signal != 0) {
+    size_t length;
+    auto name = lua_tolstring(state, signal, &length);
+    run->wait.signal.assign(name, length);
+  } else {
+    run->wait.signal.clear();
+  }
+  return lua_yield(state, 0);
+}
+
+// wait([rounds]): resumes that many rounds later, the next one by default.
+int ScriptEnvironment::waitRounds(lua_State* state) {
+  auto rounds = luaL_optinteger(state, 1, 1);
+  return yieldWait(state, rounds > 0 ? static_cast<uint64_t>(rounds) : 1, 0, 0);
+}
+
+// sleep(seconds): resumes with the first round starting after them.
+int ScriptEnvironment::waitSeconds(lua_State* state) {
+  auto seconds = luaL_checknumber(state, 1);
+  return yieldWait(state, seconds > 0 ? 0 : 1, seconds, 0);
+}
+
+// waitFor(signal[, seconds]): resumes with the round after the signal is
+// raised, or once the seconds passed when given.
+int ScriptEnvironment::waitSignal(lua_State* state) {
+  luaL_checkstring(state, 1);
+  auto seconds = luaL_optnumber(state, 2, 0);
+  return yieldWait(state, 0, seconds, 1);
+}
+
+// signal(name): wakes the scripts and plugins waiting for it next round.
+int ScriptEnvironment::raiseSignal(lua_State* state) {
+  size_t length;
+  auto name = luaL_checklstring(state, 1, &length);
+  auto environment = *static_cast<ScriptEnvironment**>(lua_getextraspace(state));
+  if (environment->running == nullptr || environment->running->world == nullptr)
+    return luaL_error(state, "signal raised outside of a run");
+  environment->running->world->signal(string(name, length));
+  return 0;
+}
+
+void ScriptEnvironment::registerWaits() {
+  lua["wait"] = &ScriptEnvironment::waitRounds;
+  lua["sleep"] = &ScriptEnvironment::waitSeconds;
+  lua["waitFor"] = &ScriptEnvironment::waitSignal;
+  lua["signal"] = &ScriptEnvironment::raiseSignal;
+}
+
+static const char* const EVENT_types[] = {"transform", "created", "deleted", "collision", "custom", nullptr};
+
+ScriptEnvironment::Run* ScriptEnvironment::current(lua_State* state) {
+  auto environment = *static_cast<ScriptEnvironment**>(lua_getextraspace(state));
+  auto run = environment->running;
+  if (run == nullptr || run->world == nullptr || run->object == nullptr)
+    luaL_error(state, "events are only available while a script runs on an object");
+  return run;
+}
+
+// Events become tables with the fields that apply to their type.
+int ScriptEnvironment::pushEvents(lua_State* state, const vector<Event>& events) {
+  lua_createtable(state, static_cast<int>(events.size()), 0);
+  for (size_t i = 0; i < events.size(); i++) {
+    auto const& event = events[i];
+    lua_createtable(state, 0, 4);
+    lua_pushstring(state, EVENT_types[event.type]);
+    lua_setfield(state, -2, "type");
+    lua_pushlstring(state, event.objectId.data(), event.objectId.size());
+    lua_setfield(state, -2, "object");
+    if (event.type == Event::COLLISION) {
+      lua_pushlstring(state, event.otherId.data(), event.otherId.size());
+      lua_setfield(state, -2, "other");
+      lua_pushnumber(state, event.point.x);
+      lua_setfield(state, -2, "x");
+      lua_pushnumber(state, event.point.y);
+      lua_setfield(state, -2, "y");
+      lua_pushnumber(state, event.point.z);
+      lua_setfield(state, -2, "z");
+      lua_pushnumber(state, event.normal.x);
+      lua_setfield(state, -2, "nx");
+      lua_pushnumber(state, event.normal.y);
+      lua_setfield(state, -2, "ny");
+      lua_pushnumber(state, event.normal.z);
+      lua_setfield(state, -2, "nz");
+      lua_pushnumber(state, event.depth);
+      lua_setfield(state, -2, "depth");
+      lua_pushnumber(state, event.speed);
+      lua_setfield(state, -2, "speed");
+    }
+    if (event.type == Event::CUSTOM) {
+      lua_pushlstring(state, event.name.data(), event.name.size());
+      lua_setfield(state, -2, "name");
+      lua_pushlstring(state, event.data.data(), event.data.size());
+      lua_setfield(state, -2, "data");
+    }
+    lua_rawseti(state, -2, static_cast<lua_Integer>(i + 1));
+  }
+  return 1;
+}
+
+// subscribe(type[, objectId[, name]]): type is one of EVENT_types, empty
+// or missing fields match anything.
+int ScriptEnvironment::subscribeEvents(lua_State* state) {
+  auto type = luaL_checkoption(state, 1, nullptr, EVENT_types);
+  auto objectId = luaL_optstring(state, 2, "");
+  auto name = luaL_optstring(state, 3, "");
+  auto run = current(state);
+  run->world->subscribe(run->object, run->plugin, EventFilter{static_cast<Event::Type>(type), objectId, name});
+  return 0;
+}
+
+int ScriptEnvironment::unsubscribeEvents(lua_State* state) {
+  auto run = current(state);
+  run->world->unsubscribe(run->object, run->plugin);
+  return 0;
+}
+
+// eventDriven(driven): the script only runs in rounds with events for it.
+int ScriptEnvironment::eventDriven(lua_State* state) {
+  auto driven = lua_isnone(state, 1) || lua_toboolean(state, 1);
+  auto run = current(state);
+  run->world->setEventDriven(run->object, run->plugin, driven);
+  return 0;
+}
+
+// emit(name[, objectId[, data]]): a custom event, about the script's own
+// object unless another id is given.
+int ScriptEnvironment::emitEvent(lua_State* state) {
+  size_t nameLength, idLength = 0, dataLength = 0;
+  auto name = luaL_checklstring(state, 1, &nameLength);
+  auto objectId = luaL_optlstring(state, 2, nullptr, &idLength);
+  auto data = luaL_optlstring(state, 3, "", &dataLength);
+  auto run = current(state);
+  Event event;
+  event.type = Event::CUSTOM;
+  event.name.assign(name, nameLength);
+  if (objectId != nullptr)
+    event.objectId.assign(objectId, idLength);
+  else
+    event.objectId = run->object->getId();
+  event.data.assign(data, dataLength);
+  run->world->emit(event);
+  return 0;
+}
+
+int ScriptEnvironment::takeEvents(lua_State* state) {
+  auto run = current(state);
+  return pushEvents(state, run->world->takeEvents(run->object, run->plugin));
+}
+
+// waitEvents([seconds]): returns the events that woke the script, an empty
+// table when the seconds ran out first.
+int ScriptEnvironment::waitEvents(lua_State* state) {
+  auto seconds = luaL_optnumber(state, 1, 0);
+  auto run = current(state);
+  if (state != run->thread || !lua_isyieldable(state))
+    return luaL_error(state, "scripts can only wait from their own body, not from coroutines they create");
+  run->waiting = true;
+  run->wait = Wait{0, seconds, string(), true};
+  return lua_yieldk(state, 0, 0, resumeEvents);
+}
+
+int ScriptEnvironment::resumeEvents(lua_State* state, int status, lua_KContext context) {
+  return takeEvents(state);
+}
+
+void ScriptEnvironment::registerEvents() {
+  lua["subscribe"] = &ScriptEnvironment::subscribeEvents;
+  lua["unsubscribe"] = &ScriptEnvironment::unsubscribeEvents;
+  lua["eventDriven"] = &ScriptEnvironment::eventDriven;
+  lua["emit"] = &ScriptEnvironment::emitEvent;
+  lua["events"] = &ScriptEnvironment::takeEvents;
+  lua["waitEvents"] = &ScriptEnvironment::waitEvents;
+}
+
+ScriptEnvironment::RunResult ScriptEnvironment::run(uint64_t scriptId, const string& source, uint64_t key,
+    const ScriptBudget& budget, IWorld* world, IObject* object, IPlugin* plugin, string* error, Wait* wait) {
+  auto maxRounds = std::max<uint32_t>(budget.maxRounds, 1);
+  sol::thread thread;
+  uint32_t rounds = 1;
+  int arguments = 0;
+  auto found = suspended.find({scriptId, key});
+  if (found != suspended.end()) {
+    thread = std::move(found->second.thread);
+    rounds = found->second.rounds + 1;
+    suspended.erase(found);
+  } else {
+    auto& script = compiled(scriptId, source);
+    if (!runner.valid()) {
+      runner = sol::thread::create(lua.lua_state());
+      lua_sethook(runner.thread_state(), budgetHook, LUA_MASKCOUNT, HOOK_INTERVAL);
+    }
+    thread = std::move(runner);
+    auto state = thread.thread_state();
+    script.push(state);
+    sol::stack::push(state, world);
+    sol::stack::push(state, object);
+    sol::stack::push(state, plugin);
+    arguments = 3;
+  }
+
+  auto state = thread.thread_state();
+  Run current;
+  current.thread = state;
+  current.world = world;
+  current.object = object;
+  current.plugin = plugin;
+  current.limit = budget.instructions;
+  current.hardLimit = budget.instructions * maxRounds;
+  if (budget.seconds > 0) {
+    auto start = steadySeconds();
+    current.deadline = start + budget.seconds;
+    current.hardDeadline = start + budget.seconds * maxRounds;
+  }
+  running = &current;
+  auto status = lua_resume(state, lua.lua_state(), arguments);
+  running = nullptr;
+
+  if (status == LUA_OK) {
+    lua_settop(state, 0);
+    runner = std::move(thread);
+    return RunResult::DONE;
+  }
+  if (status == LUA_YIELD) {
+    lua_settop(state, 0);
+    if (current.waiting) {
+      *wait = std::move(current.wait);
+      suspended.emplace(std::make_pair(scriptId, key), Suspended{std::move(thread), 0});
+      return RunResult::WAITING;
+    }
+    if (rounds >= maxRounds) {
+      *error = "script still running after " + std::to_string(rounds) + " rounds";
+      return RunResult::OVER_BUDGET;
+    }
+    suspended.emplace(std::make_pair(scriptId, key), Suspended{std::move(thread), rounds});
+    return RunResult::SUSPENDED;
+  }
+  auto message = lua_tostring(state, -1);
+  *error = message != nullptr ? message : "script error";
+  return current.aborted ? RunResult::OVER_BUDGET : RunResult::FAILED;
+}
+
+static int appendChunk(lua_State* state, const void* data, size_t size, void* out) {
+  static_cast<string*>(out)->append(static_cast<const char*>(data), size);
+  return 0;
+}
+
+sol::protected_function ScriptEnvironment::compile(const string& source) {
+  auto cached = bytecode->find(source);
+  if (cached != nullptr) {
+    sol::load_result loaded = lua.load(*cached, "=script", sol::load_mode::binary);
+    // Bytecode from another lua build is rejected, parse the source instead.
+    if (loaded.valid()) {
+      sol::protected_function script = loaded;
+      env.set_on(script);
+      return script;
+    }
+  }
+
+  // Sources come from worlds and the network: never take them as bytecode.
+  sol::load_result loaded = lua.load(source, "=script", sol::load_mode::text);
+  if (!loaded.valid()) {
+    sol::error error = loaded;
+    throw error;
+  }
+  sol::protected_function script = loaded;
+  env.set_on(script);
+
+  string chunk;
+  script.push();
+  auto dumped = lua_dump(lua.lua_state(), appendChunk, &chunk, 0);
+  lua_pop(lua.lua_state(), 1);
+  if (dumped == 0)
+    bytecode->store(source, chunk);
+  return script;
+}
+
+void ScriptEnvironment::loadLibraries() {
+  lua.open_libraries(sol::lib::base);
+  lua.open_libraries(sol::lib::coroutine);
+  lua.open_libraries(sol::lib::table);
+  lua.open_libraries(sol::lib::string);
+  lua.open_libraries(sol::lib::utf8);
+  lua.open_libraries(sol::lib::math);
+}
+
+void ScriptEnvironment::sandbox(const vector<string>& libraries, const vector<string>& functions) {
+  env["_G"] = env;
+
+  for (const auto &name : functions)
+    env[name] = lua[name];
+
+  for (const auto &name : libraries) {
+    sol::table copy(lua, sol::create);
+    sol::table original = lua[name];
+    for (auto const& [key, val] : original)
+      copy[key] = val;
+    env[name] = copy;
+  }
+
+  env["loadstring"] = sol::lua_nil;
+  env["loadfile"] = sol::lua_nil;
+  env["dofile"] = sol::lua_nil;
+}
+
+// Hot bindings are plain lua C functions: vectors go through the stack as
+// separate numbers and objects as integer handles, so calling them from a
+// script allocates nothing on either side.
+namespace bindings {
+
+template <typename T>
+static T* self(lua_State* L) {
+  auto value = sol::stack::check_get<T*>(L, 1);
+  if (!value || *value == nullptr)
+    luaL_argerror(L, 1, "expected self, call methods with ':'");
+  return *value;
+}
+
+// Index in the high bits, generation in the low ones.
+static void pushHandle(lua_State* L, ObjectHandle handle) {
+  lua_pushinteger(L, static_cast<lua_Integer>((static_cast<uint64_t>(handle.index) << 32) | handle.generation));
+}
+
+static ObjectHandle toHandle(lua_State* L, int index) {
+  auto packed = static_cast<uint64_t>(luaL_checkinteger(L, index));
+  return ObjectHandle{static_cast<uint32_t>(packed >> 32), static_cast<uint32_t>(packed)};
+}
+
+static t::double3 toDouble3(lua_State* L, int index) {
+  return t::double3{luaL_checknumber(L, index), luaL_checknumber(L, index + 1), luaL_checknumber(L, index + 2)};
+}
+
+static t::scale toScale(lua_State* L, int index) {
+  return t::scale{luaL_checknumber(L, index), luaL_checknumber(L, index + 1), luaL_checknumber(L, index + 2)};
+}
+
+static t::rotation toRotation(lua_State* L, int index) {
+  return t::rotation{
+    luaL_checknumber(L, index), luaL_checknumber(L, index + 1),
+    luaL_checknumber(L, index + 2), luaL_checknumber(L, index + 3)};
+}
+
+static int push(lua_State* L, const t::double3& v) {
+  lua_pushnumber(L, v.x);
+  lua_pushnumber(L, v.y);
+  lua_pushnumber(L, v.z);
+  return 3;
+}
+
+static int push(lua_State* L, const t::rotation& r) {
+  lua_pushnumber(L, r.x);
+  lua_pushnumber(L, r.y);
+  lua_pushnumber(L, r.z);
+  lua_pushnumber(L, r.w);
+  return 4;
+}
+
+// The table at index when the script passed one to reuse, a new one
+// otherwise. Entries past size are cleared. Leaves it on top of the stack.
+static void resultTable(lua_State* L, int index, size_t size) {
+  if (!lua_istable(L, index)) {
+    lua_createtable(L, static_cast<int>(size), 0);
+    return;
+  }
+  lua_pushvalue(L, index);
+  for (auto i = static_cast<lua_Integer>(luaL_len(L, -1)); i > static_cast<lua_Integer>(size); i--) {
+    lua_pushnil(L);
+    lua_rawseti(L, -2, i);
+  }
+}
+
+static int objectGetHandle(lua_State* L) {
+  pushHandle(L, self<IObject>(L)->getHandle());
+  return 1;
+}
+
+static int objectGetPosition(lua_State* L) { return push(L, self<IObject>(L)->getPosition()); }
+static int objectGetRotation(lua_State* L) { return push(L, self<IObject>(L)->getRotation()); }
+static int objectGetScale(lua_State* L) { return push(L, self<IObject>(L)->getScale()); }
+
+// Handle of the object with the given id, nil when there is none.
+static int worldFind(lua_State* L) {
+  auto world = self<IWorld>(L);
+  size_t length;
+  auto id = luaL_checklstring(L, 2, &length);
+  auto object = world->getObject(string(id, length));
+  if (object == nullptr)
+    return 0;
+  pushHandle(L, object->getHandle());
+  return 1;
+}
+
+// Getters on other objects return nothing once the object is deleted.
+static int worldGetPosition(lua_State* L) {
+  auto object = self<IWorld>(L)->resolve(toHandle(L, 2));
+  return object == nullptr ? 0 : push(L, object->getPosition());
+}
+
+static int worldGetRotation(lua_State* L) {
+  auto object = self<IWorld>(L)->resolve(toHandle(L, 2));
+  return object == nullptr ? 0 : push(L, object->getRotation());
+}
+
+static int worldGetScale(lua_State* L) {
+  auto object = self<IWorld>(L)->resolve(toHandle(L, 2));
+  return object == nullptr ? 0 : push(L, object->getScale());
+}
+
+// Other objects may be running their own plugins on another thread, so
+// writes to them go through the update queue and land at the end of the round.
+static int worldSetPosition(lua_State* L) {
+  self<IWorld>(L)->enqueue(command::SetPosition{toHandle(L, 2), toDouble3(L, 3)});
+  return 0;
+}
+
+static int worldSetRotation(lua_State* L) {
+  self<IWorld>(L)->enqueue(command::SetRotation{toHandle(L, 2), toRotation(L, 3)});
+  return 0;
+}
+
+static int worldSetScale(lua_State* L) {
+  self<IWorld>(L)->enqueue(command::SetScale{toHandle(L, 2), toScale(L, 3)});
+  return 0;
+}
+
+// world:getPositions(handles[, out]) fills out with x1, y1, z1, x2, ...
+// Deleted objects leave their three entries nil.
+static int worldGetPositions(lua_State* L) {
+  auto world = self<IWorld>(L);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  auto count = static_cast<size_t>(luaL_len(L, 2));
+  resultTable(L, 3, count * 3);
+  for (size_t i = 0; i < count; i++) {
+    lua_rawgeti(L, 2, static_cast<lua_Integer>(i + 1));
+    auto object = world->resolve(toHandle(L, -1));
+    lua_pop(L, 1);
+    auto base = static_cast<lua_Integer>(i * 3);
+    if (object == nullptr) {
+      for (int axis = 1; axis <= 3; axis++) {
+        lua_pushnil(L);
+        lua_rawseti(L, -2, base + axis);
+      }
+      continue;
+    }
+    auto position = object->getPosition();
+    lua_pushnumber(L, position.x);
+    lua_rawseti(L, -2, base + 1);
+    lua_pushnumber(L, position.y);
+    lua_rawseti(L, -2, base + 2);
+    lua_pushnumber(L, position.z);
+    lua_rawseti(L, -2, base + 3);
+  }
+  return 1;
+}
+
+// world:setPositions(handles, positions) with positions laid out as above.
+static int worldSetPositions(lua_State* L) {
+  auto world = self<IWorld>(L);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  luaL_checktype(L, 3, LUA_TTABLE);
+  auto count = static_cast<size_t>(luaL_len(L, 2));
+  for (size_t i = 0; i < count; i++) {
+    lua_rawgeti(L, 2, static_cast<lua_Integer>(i + 1));
+    auto base = static_cast<lua_Integer>(i * 3);
+    lua_rawgeti(L, 3, base + 1);
+    lua_rawgeti(L, 3, base + 2);
+    lua_rawgeti(L, 3, base + 3);
+    world->enqueue(command::SetPosition{toHandle(L, -4), toDouble3(L, -3)});
+    lua_pop(L, 4);
+  }
+  return 0;
+}
+
+// Spatial queries take plain numbers and an optional table to reuse for
+// the ids, which come back as an array.
+static int pushIds(lua_State* L, const vector<string>& ids, int out) {
+  resultTable(L, out, ids.size());
+  for (size_t i = 0; i < ids.size(); i++) {
+    lua_pushlstring(L, ids[i].data(), ids[i].size());
+    lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+  }
+  return 1;
+}
+
+static int worldQueryRadius(lua_State* L) {
+  auto world = self<IWorld>(L);
+  auto center = toDouble3(L, 2);
+  auto radius = luaL_checknumber(L, 5);
+  return pushIds(L, world->queryRadius(center, radius), 6);
+}
+
+static int worldQueryBox(lua_State* L) {
+  auto world = self<IWorld>(L);
+  auto min = toDouble3(L, 2);
+  auto max = toDouble3(L, 5);
+  return pushIds(L, world->queryBox(min, max), 8);
+}
+
+// Returns the ids and their distances, nearest first.
+static int worldQueryRay(lua_State* L) {
+  auto world = self<IWorld>(L);
+  auto origin = toDouble3(L, 2);
+  auto direction = toDouble3(L, 5);
+  auto maxDistance = luaL_checknumber(L, 8);
+  auto hits = world->queryRay(origin, direction, maxDistance);
+  resultTable(L, 9, hits.size());
+  resultTable(L, 10, hits.size());
+  for (size_t i = 0; i < hits.size(); i++) {
+    lua_pushlstring(L, hits[i].objectId.data(), hits[i].objectId.size());
+    lua_rawseti(L, -3, static_cast<lua_Integer>(i + 1));
+    lua_pushnumber(L, hits[i].distance);
+    lua_rawseti(L, -2, static_cast<lua_Integer>(i + 1));
+  }
+  return 2;
+}
+
+static int worldQueryNearest(lua_State* L) {
+  auto world = self<IWorld>(L);
+  auto point = toDouble3(L, 2);
+  auto count = luaL_checkinteger(L, 5);
+  return pushIds(L, world->queryNearest(point, count > 0 ? static_cast<size_t>(count) : 0), 6);
+}
+
+}  // namespace bindings
+
+// object:setPosition() and the others are world:setPosition() on the
+// object itself: they land when the round drains its commands, so update
+// listeners see them and other workers never read a half written move.
+IWorld* ScriptEnvironment::runningWorld(lua_State* state) {
+  auto environment = *static_cast<ScriptEnvironment**>(lua_getextraspace(state));
+  if (environment->running == nullptr || environment->running->world == nullptr)
+    luaL_error(state, "objects only move while a script runs");
+  return environment->running->world;
+}
+
+int ScriptEnvironment::objectSetPosition(lua_State* state) {
+  auto handle = bindings::self<IObject>(state)->getHandle();
+  runningWorld(state)->enqueue(command::SetPosition{handle, bindings::toDouble3(state, 2)});
+  return 0;
+}
+
+int ScriptEnvironment::objectSetRotation(lua_State* state) {
+  auto handle = bindings::self<IObject>(state)->getHandle();
+  runningWorld(state)->enqueue(command::SetRotation{handle, bindings::toRotation(state, 2)});
+  return 0;
+}
+
+int ScriptEnvironment::objectSetScale(lua_State* state) {
+  auto handle = bindings::self<IObject>(state)->getHandle();
+  runningWorld(state)->enqueue(command::SetScale{handle, bindings::toScale(state, 2)});
+  return 0;
+}
+
+void ScriptEnvironment::registerCustomTypes() {
+  sol::usertype<IWorld> c_iworld = lua.new_usertype<IWorld>("c_iworld");
+  c_iworld["getId"] = &IWorld::getId;
+  c_iworld["find"] = &bindings::worldFind;
+  c_iworld["getPosition"] = &bindings::worldGetPosition;
+  c_iworld["getRotation"] = &bindings::worldGetRotation;
+  c_iworld["getScale"] = &bindings::worldGetScale;
+  c_iworld["setPosition"] = &bindings::worldSetPosition;
+  c_iworld["setRotation"] = &bindings::worldSetRotation;
+  c_iworld["setScale"] = &bindings::worldSetScale;
+  c_iworld["getPositions"] = &bindings::worldGetPositions;
+  c_iworld["setPositions"] = &bindings::worldSetPositions;
+  c_iworld["queryRadius"] = &bindings::worldQueryRadius;
+  c_iworld["queryBox"] = &bindings::worldQueryBox;
+  c_iworld["queryRay"] = &bindings::worldQueryRay;
+  c_iworld["queryNearest"] = &bindings::worldQueryNearest;
+  sol::usertype<IObject> c_iobject = lua.new_usertype<IObject>("c_iobject");
+  c_iobject["getId"] = &IObject::getId;
+  c_iobject["getHandle"] = &bindings::objectGetHandle;
+  c_iobject["getPosition"] = &bindings::objectGetPosition;
+  c_iobject["getRotation"] = &bindings::objectGetRotation;
+  c_iobject["getScale"] = &bindings::objectGetScale;
+  c_iobject["setPosition"] = &ScriptEnvironment::objectSetPosition;
+  c_iobject["setRotation"] = &ScriptEnvironment::objectSetRotation;
+  c_iobject["setScale"] = &ScriptEnvironment::objectSetScale;
+  sol::usertype<IPlugin> c_iplugin = lua.new_usertype<IPlugin>("c_iplugin");
+  c_iplugin["getId"] = &IPlugin::getId;
+}
+
+ScriptEnvironmentPool::ScriptEnvironmentPool(size_t capacity) : capacity{capacity > 0 ? capacity : 1} {}
+
+ScriptEnvironmentPool::Lease ScriptEnvironmentPool::acquire() {
+  static thread_local ScriptEnvironmentPool* lastPool = nullptr;
+  static thread_local ScriptEnvironment* last = nullptr;
+
+  unique_lock<mutex> guard(lock);
+  while (true) {
+    ScriptEnvironment* environment = nullptr;
+    if (!idle.empty()) {
+      auto preferred = idle.end();
+      if (lastPool == this)
+        preferred = std::find(idle.begin(), idle.end(), last);
+      if (preferred == idle.end())
+        preferred = idle.end() - 1;
+      environment = *preferred;
+      idle.erase(preferred);
+    } else if (environments.size() < capacity) {
+      environments.push_back(std::make_unique<ScriptEnvironment>(environments.size(), &bytecodeCache));
+      environment = environments.back().get();
+      environment->retiredSeen = retiredBase + retired.size();
+    }
+
+    if (environment != nullptr) {
+      sweepRetired(environment);
+      lastPool = this;
+      last = environment;
+      return Lease(this, environment);
+    }
+    available.wait(guard);
+  }
+}
+
+ScriptEnvironmentPool::Lease ScriptEnvironmentPool::acquire(size_t index) {
+  unique_lock<mutex> guard(lock);
+  while (true) {
+    auto found = std::find_if(idle.begin(), idle.end(), [index](ScriptEnvironment* environment) {
+      return environment->getIndex() == index;
+    });
+    if (found != idle.end()) {
+      auto environment = *found;
+      idle.erase(found);
+      sweepRetired(environment);
+      return Lease(this, environment);
+    }
+    available.wait(guard);
+  }
+}
+
+// Everyone wakes up: some waiters only want a given environment.
+void ScriptEnvironmentPool::release(ScriptEnvironment* environment) {
+  {
+    lock_guard<mutex> guard(lock);
+    idle.push_back(environment);
+  }
+  available.notify_all();
+}
+
+void ScriptEnvironmentPool::setCapacity(size_t capacity) {
+  {
+    lock_guard<mutex> guard(lock);
+    this->capacity = capacity > 0 ? capacity : 1;
+  }
+  available.notify_all();
+}
+
+size_t ScriptEnvironmentPool::getCapacity() {
+  lock_guard<mutex> guard(lock);
+  return capacity;
+}
+
+size_t ScriptEnvironmentPool::environmentCount() {
+  lock_guard<mutex> guard(lock);
+  return environments.size();
+}
+
+void ScriptEnvironmentPool::retire(uint64_t scriptId) {
+  lock_guard<mutex> guard(lock);
+  retired.push_back(scriptId);
+
+  // Forget the prefix every environment already went through.
+  if (retired.size() < 1024)
+    return;
+  auto seen = retiredBase + retired.size();
+  for (auto const& environment : environments)
+    seen = std::min(seen, environment->retiredSeen);
+  retired.erase(retired.begin(), retired.begin() + (seen - retiredBase));
+  retiredBase = seen;
+}
+
+void ScriptEnvironmentPool::sweepRetired(ScriptEnvironment* environment) {
+  for (auto i = environment->retiredSeen; i < retiredBase + retired.size(); i++)
+    environment->forget(retired[i - retiredBase]);
+  environment->retiredSeen = retiredBase + retired.size();
+}
+
+}  // namespace core
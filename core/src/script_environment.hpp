@@ -0,0 +1,197 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_SCRIPT_ENVIRONMENT_HPP_
+#define CORE_SRC_SCRIPT_ENVIRONMENT_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define SOL_ALL_SAFETIES_ON 1
+#include <sol/sol.hpp>
+
+#include "bytecode_cache.hpp"
+#include "scripting.hpp"
+
+using std::string;
+using std::vector;
+using std::unordered_map;
+
+namespace core {
+
+// One sandboxed lua state. Compiled scripts see env as their globals:
+// copies of the whitelisted libraries and functions, and the globals they
+// set. Scripts are compiled lazily in every state they run on and the
+// compiled chunk is kept under the script id. Only the first state to meet
+// a source parses it, the others load the bytecode it left in the shared
+// cache.
+// Scripts run on a coroutine with a count hook enforcing their budget:
+// runs that use it up yield and stay suspended in this state, under the
+// script id and a key chosen by the caller, until run again. Scripts
+// suspend themselves the same way with wait(rounds), sleep(seconds) and
+// waitFor(signal[, seconds]), and raise signals with signal(name). Events
+// come through subscribe(type[, objectId[, name]]), events() and
+// waitEvents([seconds]), and go out with emit(name[, objectId[, data]]).
+class ScriptEnvironment {
+ public:
+  enum class RunResult { DONE, SUSPENDED, WAITING, FAILED, OVER_BUDGET };
+
+  sol::state lua;
+  sol::environment env;
+  ScriptEnvironment(size_t index, BytecodeCache* bytecode);
+  ~ScriptEnvironment() {}
+
+  size_t getIndex() const { return index; }
+  // Throws sol::error when the source does not compile.
+  sol::protected_function& compiled(uint64_t scriptId, const string& source);
+  // Starts the script, or resumes its run suspended under key. Error
+  // messages of failed and aborted runs go to error, what a waiting run
+  // waits for to wait. Waiting runs do not count towards maxRounds.
+  RunResult run(uint64_t scriptId, const string& source, uint64_t key, const ScriptBudget& budget,
+    IWorld* world, IObject* object, IPlugin* plugin, string* error, Wait* wait);
+  // Drops the compiled chunk and the suspended runs of the script.
+  void forget(uint64_t scriptId);
+  size_t compiledCount() const { return scripts.size(); }
+  size_t suspendedCount() const { return suspended.size(); }
+
+ private:
+  friend class ScriptEnvironmentPool;
+
+  // Budget of the run in progress, read by the hook.
+  struct Run {
+    lua_State* thread = nullptr;
+    uint64_t instructions = 0;
+    // Where the run yields, and where it is aborted when it cannot.
+    uint64_t limit = 0;
+    uint64_t hardLimit = 0;
+    double deadline = 0;
+    double hardDeadline = 0;
+    bool aborted = false;
+    IWorld* world = nullptr;
+    IObject* object = nullptr;
+    IPlugin* plugin = nullptr;
+    bool waiting = false;
+    Wait wait;
+  };
+  struct Suspended {
+    sol::thread thread;
+    uint32_t rounds;
+  };
+
+  static void budgetHook(lua_State* state, lua_Debug* debug);
+  static int yieldWait(lua_State* state, uint64_t rounds, double seconds, int signal);
+  static int waitRounds(lua_State* state);
+  static int waitSeconds(lua_State* state);
+  static int waitSignal(lua_State* state);
+  static int raiseSignal(lua_State* state);
+  static Run* current(lua_State* state);
+  static int pushEvents(lua_State* state, const vector<Event>& events);
+  static int subscribeEvents(lua_State* state);
+  static int unsubscribeEvents(lua_State* state);
+  static int eventDriven(lua_State* state);
+  static int emitEvent(lua_State* state);
+  static int takeEvents(lua_State* state);
+  static int waitEvents(lua_State* state);
+  static int resumeEvents(lua_State* state, int status, lua_KContext context);
+  static IWorld* runningWorld(lua_State* state);
+  static int objectSetPosition(lua_State* state);
+  static int objectSetRotation(lua_State* state);
+  static int objectSetScale(lua_State* state);
+
+  void loadLibraries();
+  void registerWaits();
+  void registerEvents();
+  void sandbox(const vector<string>& libraries, const vector<string>& functions);
+  void registerCustomTypes();
+
+  sol::protected_function compile(const string& source);
+
+  size_t index;
+  BytecodeCache* bytecode;
+  unordered_map<uint64_t, sol::protected_function> scripts;
+  // Coroutine reused by runs that finish, runs that fail leave it dead.
+  sol::thread runner;
+  std::map<std::pair<uint64_t, uint64_t>, Suspended> suspended;
+  Run* running = nullptr;
+  size_t retiredSeen = 0;
+};
+
+// Bounded set of environments handed out one thread at a time.
+// Environments are created on demand up to the capacity, after that
+// acquire() blocks until one is released. A thread gets back the
+// environment it used last when that one is idle, so scripts mostly keep
+// seeing the same globals.
+class ScriptEnvironmentPool {
+ public:
+  class Lease {
+   public:
+    Lease(ScriptEnvironmentPool* pool, ScriptEnvironment* environment) : pool{pool}, environment{environment} {}
+    Lease(Lease&& other) : pool{other.pool}, environment{other.environment} { other.environment = nullptr; }
+    Lease(const Lease&) = delete;
+    ~Lease() {
+      if (environment != nullptr)
+        pool->release(environment);
+    }
+    ScriptEnvironment* operator->() { return environment; }
+    ScriptEnvironment& operator*() { return *environment; }
+
+   private:
+    ScriptEnvironmentPool* pool;
+    ScriptEnvironment* environment;
+  };
+
+  explicit ScriptEnvironmentPool(size_t capacity);
+
+  Lease acquire();
+  // Waits for the environment with that index, the one holding a
+  // suspended run.
+  Lease acquire(size_t index);
+  // Lowering the capacity does not destroy environments already created.
+  void setCapacity(size_t capacity);
+  size_t getCapacity();
+  size_t environmentCount();
+
+  uint64_t newScriptId() { return ++scriptIds; }
+  BytecodeCache& bytecode() { return bytecodeCache; }
+  // Compiled chunks of a retired script are dropped from each environment
+  // the next time it is acquired.
+  void retire(uint64_t scriptId);
+
+ private:
+  void release(ScriptEnvironment* environment);
+  void sweepRetired(ScriptEnvironment* environment);
+
+  std::mutex lock;
+  std::condition_variable available;
+  vector<std::unique_ptr<ScriptEnvironment>> environments;
+  vector<ScriptEnvironment*> idle;
+  vector<uint64_t> retired;
+  size_t retiredBase = 0;
+  size_t capacity;
+  std::atomic<uint64_t> scriptIds = 0;
+  BytecodeCache bytecodeCache;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_SCRIPT_ENVIRONMENT_HPP_
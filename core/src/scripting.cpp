@@ -16,112 +16,99 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 #include "scripting.hpp"
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <mutex>
 #include <fstream>
-#include <vector>
-#include <algorithm>
+#include <optional>
+#include <thread>
+#include <unordered_map>
 
-#define SOL_ALL_SAFETIES_ON 1
-#include <sol/sol.hpp>
+#include "assets.hpp"
+#include "log.hpp"
+#include "profiler.hpp"
+#include "script_environment.hpp"
 
 using std::string;
-using std::vector;
 using std::ofstream;
 
 namespace core {
 
-const auto LUA_whitelistedFunctions = vector<string>{
-  "assert",
-  "error",
-  "ipairs",
-  "next",
-  "pairs",
-  "pcall",
-  "print",
-  "select",
-  "tonumber",
-  "tostring",
-  "type",
-  "unpack",
-  "_VERSION",
-  "xpcall"
-};
-
-const auto LUA_whitelistedLibraries = vector<string>{
-  "coroutine",
-  "table",
-  "string",
-  "math",
-  "utf8",
+static ScriptEnvironmentPool scriptEnvironments(std::max(1u, std::thread::hardware_concurrency()));
+
+// Default budget, read by every run on any thread.
+static struct {
+  std::atomic<uint64_t> instructions = ScriptBudget{}.instructions;
+  std::atomic<double> seconds = ScriptBudget{}.seconds;
+  std::atomic<uint32_t> maxRounds = ScriptBudget{}.maxRounds;
+  std::atomic<uint32_t> maxViolations = ScriptBudget{}.maxViolations;
+} defaultBudget;
+
+struct ScriptCounters {
+  std::atomic<uint64_t> runs = 0;
+  std::atomic<uint64_t> suspensions = 0;
+  std::atomic<uint64_t> waits = 0;
+  std::atomic<uint64_t> violations = 0;
+  std::atomic<uint64_t> disabled = 0;
 };
+static ScriptCounters totals;
 
-class ScriptEnvironment {
+class ScriptPlugin : public IPlugin {
  public:
-  sol::state lua;
-  sol::environment env;
-  ScriptEnvironment() {
-    env = sol::environment(lua, sol::create);
-    loadLibraries();
-    sandbox(LUA_whitelistedFunctions, LUA_whitelistedLibraries);
-    registerCustomTypes();
-  }
-  ~ScriptEnvironment() {}
+  ScriptPlugin(const string& id, ScriptEnvironmentPool* pool, const string& data, bool compileNow)
+    : id{id}, source{Assets::share(data)}, pool{pool}, scriptId{pool->newScriptId()} {
 
- private:
-  void loadLibraries() {
-    lua.open_libraries(sol::lib::base);
-    lua.open_libraries(sol::lib::coroutine);
-    lua.open_libraries(sol::lib::table);
-    lua.open_libraries(sol::lib::string);
-    lua.open_libraries(sol::lib::utf8);
-    lua.open_libraries(sol::lib::math);
-  }
-  void sandbox(const vector<string>& libraries, const vector<string>& functions) {
-    env["_G"] = env;
-
-    for (const auto &name : functions)
-      env[name] = lua[name];
-
-    for (const auto &name : libraries) {
-      sol::table copy(lua, sol::create);
-      sol::table original = lua[name].tbl;
-      for (auto const& [key, val] : original)
-        copy[key] = val;
-      env[name] = copy;
+    // Compile once right away so that syntax errors surface at load time.
+    if (compileNow) {
+      auto environment = pool->acquire();
+      environment->compiled(scriptId, *source);
     }
-
-    env["loadstring"] = NULL;
-    env["loadfile"] = NULL;
-    env["dofile"] = NULL;
-  }
-  void registerCustomTypes() {
-    sol::usertype<IWorld> c_iworld = lua.new_usertype<IWorld>("c_iworld");
-    c_iworld["getId"] = &IWorld::getId;
-    sol::usertype<IObject> c_iobject = lua.new_usertype<IObject>("c_iobject");
-    c_iobject["getId"] = &IObject::getId;
-    sol::usertype<IPlugin> c_iplugin = lua.new_usertype<IPlugin>("c_iplugin");
-    c_iplugin["getId"] = &IPlugin::getId;
   }
-};
-
-class ScriptPlugin : public IPlugin {
- public:
-  ScriptPlugin(const string& id, ScriptEnvironment* env, const string& data)
-    : id{id}, source{data} {
-
-    script = env->lua.load(data);
-    // env->env.set_on(script);
+  ~ScriptPlugin() {
+    if (counters.disabled)
+      totals.disabled--;
+    pool->retire(scriptId);
   }
-  ~ScriptPlugin() {}
   const string& getId() { return id; }
   Type getType() { return SCRIPT; }
-  const string& getSource() { return source; }
+  const string& getSource() { return *source; }
+  // Suspended runs are resumed on the environment holding them, the
+  // object's handle tells runs of a plugin shared by objects apart.
   bool execute(IWorld* world, IObject* object) {
+    if (counters.disabled)
+      return false;
+    auto key = objectKey(object);
+    auto environment = acquire(key);
     try {
-      script(world, object, reinterpret_cast<IPlugin*>(this));
-      return true;
+      string error;
+      Wait wait;
+      auto result = environment->run(scriptId, *source, key, getBudget(), world, object, this, &error, &wait);
+      count(&ScriptCounters::runs);
+      switch (result) {
+        case ScriptEnvironment::RunResult::DONE:
+          return true;
+        case ScriptEnvironment::RunResult::SUSPENDED:
+          count(&ScriptCounters::suspensions);
+          suspend(key, environment->getIndex());
+          return true;
+        case ScriptEnvironment::RunResult::WAITING:
+          count(&ScriptCounters::waits);
+          suspend(key, environment->getIndex());
+          world->sleep(object, this, wait);
+          return true;
+        case ScriptEnvironment::RunResult::FAILED:
+          CORE_PROFILE_MARK("script error");
+          Log::error(id + ": " + error);
+          return false;
+        case ScriptEnvironment::RunResult::OVER_BUDGET:
+          violate(error);
+          return false;
+      }
+      return false;
     } catch(const std::exception& ex) {
-      printf("%s\n", ex.what());
+      CORE_PROFILE_MARK("script error");
+      Log::error(id + ": " + ex.what());
       return false;
     } catch(...) {
       return false;
@@ -129,20 +116,133 @@ class ScriptPlugin : public IPlugin {
   }
   void saveToFile(const string& path) {
     ofstream scriptOut(path);
-    scriptOut << getSource();
+    saveTo(scriptOut);
     scriptOut.close();
   }
+  void saveTo(std::ostream& out) { out << getSource(); }
+
+  void setBudget(const ScriptBudget& budget) { this->budget = budget; }
+  ScriptBudget getBudget() {
+    if (budget)
+      return *budget;
+    return ScriptBudget{defaultBudget.instructions, defaultBudget.seconds, defaultBudget.maxRounds,
+      defaultBudget.maxViolations};
+  }
+  ScriptStats getStats() {
+    return ScriptStats{counters.runs, counters.suspensions, counters.waits, counters.violations, counters.disabled};
+  }
+  void enable() {
+    if (counters.disabled.exchange(0) != 0)
+      totals.disabled--;
+    counters.violations = 0;
+  }
 
  private:
+  static uint64_t objectKey(IObject* object) {
+    auto handle = object->getHandle();
+    return (static_cast<uint64_t>(handle.index) << 32) | handle.generation;
+  }
+
+  ScriptEnvironmentPool::Lease acquire(uint64_t key) {
+    if (suspendedCount > 0) {
+      std::unique_lock<std::mutex> guard(suspendedLock);
+      auto found = suspendedIn.find(key);
+      if (found != suspendedIn.end()) {
+        auto index = found->second;
+        suspendedIn.erase(found);
+        suspendedCount--;
+        guard.unlock();
+        return pool->acquire(index);
+      }
+    }
+    return pool->acquire();
+  }
+
+  void suspend(uint64_t key, size_t environment) {
+    std::lock_guard<std::mutex> guard(suspendedLock);
+    suspendedIn[key] = environment;
+    suspendedCount++;
+  }
+
+  void count(std::atomic<uint64_t> ScriptCounters::* counter) {
+    (counters.*counter)++;
+    (totals.*counter)++;
+  }
+
+  void violate(const string& error) {
+    count(&ScriptCounters::violations);
+    CORE_PROFILE_MARK("script over budget");
+    Log::error(id + ": " + error);
+    if (counters.violations < getBudget().maxViolations || counters.disabled.exchange(1) != 0)
+      return;
+    totals.disabled++;
+    CORE_PROFILE_MARK("script disabled");
+    Log::error(id + ": disabled after " + std::to_string(counters.violations.load()) + " violations");
+  }
+
   string id;
-  string source;
-  sol::function script;
+  // Shared with every script of the same source.
+  shared_ptr<const string> source;
+  ScriptEnvironmentPool* pool;
+  uint64_t scriptId;
+  std::optional<ScriptBudget> budget;
+  ScriptCounters counters;
+  // Environment holding the suspended run of each object.
+  std::mutex suspendedLock;
+  std::unordered_map<uint64_t, size_t> suspendedIn;
+  std::atomic<size_t> suspendedCount = 0;
 };
 
-static ScriptEnvironment scriptEnvironment;
-
 shared_ptr<IPlugin> Scripts::asPlugin(const string& id, const string& data) {
-  return make_shared<ScriptPlugin>(id, &scriptEnvironment, data);
+  return make_shared<ScriptPlugin>(id, &scriptEnvironments, data, true);
+}
+
+shared_ptr<IPlugin> Scripts::asDeferredPlugin(const string& id, const string& data) {
+  return make_shared<ScriptPlugin>(id, &scriptEnvironments, data, false);
+}
+
+void Scripts::setPoolSize(size_t size) {
+  scriptEnvironments.setCapacity(size);
+}
+
+size_t Scripts::getPoolSize() {
+  return scriptEnvironments.getCapacity();
+}
+
+BytecodeCacheStats Scripts::getBytecodeCacheStats() {
+  return scriptEnvironments.bytecode().stats();
+}
+
+void Scripts::setBudget(const ScriptBudget& budget) {
+  defaultBudget.instructions = budget.instructions;
+  defaultBudget.seconds = budget.seconds;
+  defaultBudget.maxRounds = budget.maxRounds;
+  defaultBudget.maxViolations = budget.maxViolations;
+}
+
+ScriptBudget Scripts::getBudget() {
+  return ScriptBudget{defaultBudget.instructions, defaultBudget.seconds, defaultBudget.maxRounds,
+    defaultBudget.maxViolations};
+}
+
+void Scripts::setBudget(const shared_ptr<IPlugin>& plugin, const ScriptBudget& budget) {
+  if (auto script = std::dynamic_pointer_cast<ScriptPlugin>(plugin))
+    script->setBudget(budget);
+}
+
+ScriptStats Scripts::getStats() {
+  return ScriptStats{totals.runs, totals.suspensions, totals.waits, totals.violations, totals.disabled};
+}
+
+ScriptStats Scripts::getStats(const shared_ptr<IPlugin>& plugin) {
+  if (auto script = std::dynamic_pointer_cast<ScriptPlugin>(plugin))
+    return script->getStats();
+  return ScriptStats{};
+}
+
+void Scripts::enable(const shared_ptr<IPlugin>& plugin) {
+  if (auto script = std::dynamic_pointer_cast<ScriptPlugin>(plugin))
+    script->enable();
 }
 
 }  // namespace core
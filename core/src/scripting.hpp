@@ -19,18 +19,68 @@
 #ifndef CORE_SRC_SCRIPTING_HPP_
 #define CORE_SRC_SCRIPTING_HPP_
 
+#include <cstdint>
 #include <memory>
 #include <string>
 
+#include "bytecode_cache.hpp"
 #include "core.hpp"
 
 using std::string;
 using std::shared_ptr;
 
 namespace core {
+
+// How much a script may run per round. A run that uses it up is suspended
+// and resumed where it stopped the next round, what it enqueued so far is
+// applied with the round it ran in.
+struct ScriptBudget {
+  // Lua instructions per round, 0 for no limit.
+  uint64_t instructions = 1000000;
+  // Seconds per round, 0 for no limit.
+  double seconds = 0;
+  // Rounds a run may span before it is aborted. Runs that cannot be
+  // suspended (inside a call from C or a script's own coroutine) are
+  // aborted once this many rounds of budget are used.
+  uint32_t maxRounds = 10;
+  // Aborted runs after which the script is disabled.
+  uint32_t maxViolations = 3;
+};
+
+struct ScriptStats {
+  uint64_t runs = 0;
+  // Runs that used up their budget and continue next round.
+  uint64_t suspensions = 0;
+  // Runs that stopped in wait(), sleep() or waitFor(), their plugin sleeps
+  // on the object until the wait is over.
+  uint64_t waits = 0;
+  // Runs aborted for going over budget.
+  uint64_t violations = 0;
+  // Scripts disabled, for a single script 1 when it is.
+  uint64_t disabled = 0;
+};
+
 class Scripts {
  public:
   static shared_ptr<IPlugin> asPlugin(const string& id, const string& data);
+  // Skips the compile asPlugin does up front: errors show when it first runs.
+  static shared_ptr<IPlugin> asDeferredPlugin(const string& id, const string& data);
+  // Maximum number of lua states scripts run on concurrently,
+  // defaults to the hardware concurrency.
+  static void setPoolSize(size_t size);
+  static size_t getPoolSize();
+  // Identical sources compile once, whatever the object or lua state.
+  static BytecodeCacheStats getBytecodeCacheStats();
+  // Budget of every script without one of its own.
+  static void setBudget(const ScriptBudget& budget);
+  static ScriptBudget getBudget();
+  // Between rounds only. Plugins that are not scripts are ignored.
+  static void setBudget(const shared_ptr<IPlugin>& plugin, const ScriptBudget& budget);
+  // Totals over all scripts, or the counters of one.
+  static ScriptStats getStats();
+  static ScriptStats getStats(const shared_ptr<IPlugin>& plugin);
+  // Runs a disabled script again, with its violations forgotten.
+  static void enable(const shared_ptr<IPlugin>& plugin);
 };
 }  // namespace core
 
@@ -0,0 +1,118 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "sleep.hpp"
+#include <algorithm>
+#include <functional>
+
+namespace core {
+
+uint64_t SleepSchedule::add(ObjectHandle object, IPlugin* plugin, const Wait& wait, uint64_t round, double now) {
+  if (wait.rounds == 0 && wait.seconds <= 0 && wait.signal.empty() && !wait.events)
+    return 0;
+  auto token = ++lastToken;
+  sleepers[token] = Entry{Sleeper{object, plugin, token}, wait.signal, wait.events};
+  if (wait.rounds > 0) {
+    byRound.push_back(Due<uint64_t>{round + wait.rounds, token});
+    std::push_heap(byRound.begin(), byRound.end(), std::greater<>());
+  }
+  if (wait.seconds > 0) {
+    byTime.push_back(Due<double>{now + wait.seconds, token});
+    std::push_heap(byTime.begin(), byTime.end(), std::greater<>());
+  }
+  if (!wait.signal.empty())
+    bySignal[wait.signal].insert(token);
+  return token;
+}
+
+void SleepSchedule::cancel(uint64_t token) {
+  wake(token, nullptr);
+  dropWoken();
+}
+
+void SleepSchedule::due(uint64_t round, double now, vector<Sleeper>* out) {
+  while (!byRound.empty() && byRound.front().when <= round) {
+    std::pop_heap(byRound.begin(), byRound.end(), std::greater<>());
+    wake(byRound.back().token, out);
+    byRound.pop_back();
+  }
+  while (!byTime.empty() && byTime.front().when <= now) {
+    std::pop_heap(byTime.begin(), byTime.end(), std::greater<>());
+    wake(byTime.back().token, out);
+    byTime.pop_back();
+  }
+  dropWoken();
+}
+
+void SleepSchedule::signal(const string& name, vector<Sleeper>* out) {
+  auto found = bySignal.find(name);
+  if (found == bySignal.end())
+    return;
+  auto tokens = std::move(found->second);
+  bySignal.erase(found);
+  // In sleep order, so plugins woken together resume in a stable order.
+  vector<uint64_t> ordered(tokens.begin(), tokens.end());
+  std::sort(ordered.begin(), ordered.end());
+  for (auto token : ordered)
+    wake(token, out);
+  dropWoken();
+}
+
+bool SleepSchedule::wakesOnEvents(uint64_t token) const {
+  auto found = sleepers.find(token);
+  return found != sleepers.end() && found->second.events;
+}
+
+void SleepSchedule::clear() {
+  sleepers.clear();
+  byRound.clear();
+  byTime.clear();
+  bySignal.clear();
+}
+
+// Plugins woken early every round, by events say, while waiting hours
+// would otherwise leave a heap entry per round until it comes up.
+void SleepSchedule::dropWoken() {
+  constexpr size_t SLACK = 64;
+  if (deadlines() <= 2 * sleepers.size() + SLACK)
+    return;
+  auto woken = [this](const auto& due) { return !sleepers.contains(due.token); };
+  std::erase_if(byRound, woken);
+  std::erase_if(byTime, woken);
+  std::make_heap(byRound.begin(), byRound.end(), std::greater<>());
+  std::make_heap(byTime.begin(), byTime.end(), std::greater<>());
+}
+
+void SleepSchedule::wake(uint64_t token, vector<Sleeper>* out) {
+  auto found = sleepers.find(token);
+  if (found == sleepers.end())
+    return;
+  auto& entry = found->second;
+  if (!entry.signal.empty()) {
+    auto waiting = bySignal.find(entry.signal);
+    if (waiting != bySignal.end()) {
+      waiting->second.erase(token);
+      if (waiting->second.empty())
+        bySignal.erase(waiting);
+    }
+  }
+  if (out != nullptr)
+    out->push_back(entry.sleeper);
+  sleepers.erase(found);
+}
+
+}  // namespace core
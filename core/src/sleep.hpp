@@ -0,0 +1,91 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORE_SRC_SLEEP_HPP_
+#define CORE_SRC_SLEEP_HPP_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "core.hpp"
+#include "store.hpp"
+
+using std::string;
+using std::vector;
+
+namespace core {
+
+// Plugins asleep on objects, and the rounds, times and signals waking
+// them. Each sleep gets a token: waking one way cancels the others, and
+// the owner of the sleeping plugins drops a token to cancel a sleep.
+// Not thread safe, the world only touches it between rounds.
+class SleepSchedule {
+ public:
+  struct Sleeper {
+    ObjectHandle object;
+    IPlugin* plugin = nullptr;
+    uint64_t token = 0;
+  };
+
+  // Times are in seconds on the caller's clock. Returns the token, 0 when
+  // the wait has nothing to wake it and the plugin should not sleep.
+  uint64_t add(ObjectHandle object, IPlugin* plugin, const Wait& wait, uint64_t round, double now);
+  void cancel(uint64_t token);
+  // Appends to out the sleepers due at round or by time now.
+  void due(uint64_t round, double now, vector<Sleeper>* out);
+  // Appends to out the sleepers waiting for the signal.
+  void signal(const string& name, vector<Sleeper>* out);
+  // Whether events wake the sleep, the owner wakes it by cancelling it.
+  bool wakesOnEvents(uint64_t token) const;
+  // Sleepers not woken yet.
+  size_t size() const { return sleepers.size(); }
+  // Rounds and times kept, including those of sleepers woken another way.
+  size_t deadlines() const { return byRound.size() + byTime.size(); }
+  void clear();
+
+ private:
+  struct Entry {
+    Sleeper sleeper;
+    string signal;
+    bool events;
+  };
+  template <typename T>
+  struct Due {
+    T when;
+    uint64_t token;
+    bool operator>(const Due& other) const { return when > other.when; }
+  };
+
+  void wake(uint64_t token, vector<Sleeper>* out);
+  void dropWoken();
+
+  uint64_t lastToken = 0;
+  std::unordered_map<uint64_t, Entry> sleepers;
+  // Min heaps. Tokens woken some other way stay until they come up, or
+  // until they outnumber the sleepers and the heaps are rebuilt.
+  vector<Due<uint64_t>> byRound;
+  vector<Due<double>> byTime;
+  std::unordered_map<string, std::unordered_set<uint64_t>> bySignal;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_SLEEP_HPP_
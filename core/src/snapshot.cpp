@@ -0,0 +1,241 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "snapshot.hpp"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::filesystem;
+using std::ofstream;
+using std::runtime_error;
+
+namespace core {
+
+static uint64_t align8(uint64_t offset) {
+  return (offset + 7) & ~uint64_t{7};
+}
+
+void SnapshotWriter::addObject(const string& id, const t::position& position, const t::rotation& rotation,
+    const t::scale& scale) {
+  snapshot::ObjectRecord record{};
+  record.id = intern(id);
+  record.firstPlugin = static_cast<uint32_t>(plugins.size());
+  objects.push_back(record);
+  positions.insert(positions.end(), {position.x, position.y, position.z});
+  rotations.insert(rotations.end(), {rotation.x, rotation.y, rotation.z, rotation.w});
+  scales.insert(scales.end(), {scale.x, scale.y, scale.z});
+}
+
+void SnapshotWriter::addPlugin(const string& id, IPlugin::Type type, const string& blob) {
+  snapshot::PluginRecord record{};
+  record.id = intern(id);
+  record.type = type;
+  // Objects sharing a script share its blob.
+  auto [stored, added] = blobOffsets.emplace(blob, blobs.size());
+  record.blobOffset = stored->second;
+  record.blobSize = blob.size();
+  plugins.push_back(record);
+  if (added)
+    blobs += blob;
+  objects.back().pluginCount++;
+}
+
+uint32_t SnapshotWriter::intern(const string& value) {
+  auto it = interned.find(value);
+  if (it != interned.end())
+    return it->second;
+  auto index = static_cast<uint32_t>(strings.size());
+  strings.push_back(snapshot::StringRecord{stringData.size(), value.size()});
+  stringData += value;
+  interned.emplace(value, index);
+  return index;
+}
+
+void SnapshotWriter::write(const string& file) {
+  snapshot::Header header{};
+  std::memcpy(header.magic, snapshot::MAGIC, sizeof(header.magic));
+  header.version = snapshot::VERSION;
+  header.objectCount = static_cast<uint32_t>(objects.size());
+  header.pluginCount = static_cast<uint32_t>(plugins.size());
+  header.stringCount = static_cast<uint32_t>(strings.size());
+  header.objectsOffset = align8(sizeof(header));
+  header.positionsOffset = align8(header.objectsOffset + objects.size() * sizeof(snapshot::ObjectRecord));
+  header.rotationsOffset = align8(header.positionsOffset + positions.size() * sizeof(double));
+  header.scalesOffset = align8(header.rotationsOffset + rotations.size() * sizeof(double));
+  header.pluginsOffset = align8(header.scalesOffset + scales.size() * sizeof(double));
+  header.stringsOffset = align8(header.pluginsOffset + plugins.size() * sizeof(snapshot::PluginRecord));
+  header.stringDataOffset = align8(header.stringsOffset + strings.size() * sizeof(snapshot::StringRecord));
+  header.blobsOffset = align8(header.stringDataOffset + stringData.size());
+  header.fileSize = header.blobsOffset + blobs.size();
+
+  string out(header.fileSize, '\0');
+  auto put = [&out](uint64_t offset, const void* source, size_t bytes) {
+    if (bytes > 0)
+      std::memcpy(&out[offset], source, bytes);
+  };
+  put(0, &header, sizeof(header));
+  put(header.objectsOffset, objects.data(), objects.size() * sizeof(snapshot::ObjectRecord));
+  put(header.positionsOffset, positions.data(), positions.size() * sizeof(double));
+  put(header.rotationsOffset, rotations.data(), rotations.size() * sizeof(double));
+  put(header.scalesOffset, scales.data(), scales.size() * sizeof(double));
+  put(header.pluginsOffset, plugins.data(), plugins.size() * sizeof(snapshot::PluginRecord));
+  put(header.stringsOffset, strings.data(), strings.size() * sizeof(snapshot::StringRecord));
+  put(header.stringDataOffset, stringData.data(), stringData.size());
+  put(header.blobsOffset, blobs.data(), blobs.size());
+
+  auto writing = file + snapshot::WRITING_SUFFIX;
+  ofstream snapshotOut(writing, std::ios::binary | std::ios::trunc);
+  snapshotOut.write(out.data(), out.size());
+  snapshotOut.close();
+  std::error_code error;
+  if (snapshotOut)
+    fs::rename(writing, file, error);
+  if (!snapshotOut || error) {
+    fs::remove(writing, error);
+    throw runtime_error("cannot write snapshot " + file);
+  }
+}
+
+Snapshot::Snapshot(const string& file) {
+#ifdef _WIN32
+  auto handle = CreateFileA(file.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+    FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (handle == INVALID_HANDLE_VALUE)
+    throw runtime_error("cannot open snapshot " + file);
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(handle, &fileSize)) {
+    CloseHandle(handle);
+    throw runtime_error("cannot stat snapshot " + file);
+  }
+  size = static_cast<size_t>(fileSize.QuadPart);
+  if (size > 0) {
+    mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping != nullptr)
+      data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+  }
+  CloseHandle(handle);
+#else
+  auto fd = open(file.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw runtime_error("cannot open snapshot " + file);
+  struct stat status;
+  if (fstat(fd, &status) != 0) {
+    close(fd);
+    throw runtime_error("cannot stat snapshot " + file);
+  }
+  size = static_cast<size_t>(status.st_size);
+  if (size > 0) {
+    auto address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address != MAP_FAILED)
+      data = static_cast<const char*>(address);
+  }
+  close(fd);
+#endif
+  if (data == nullptr) {
+    unmap();
+    throw runtime_error("cannot map snapshot " + file);
+  }
+  try {
+    validate(file);
+  } catch (...) {
+    unmap();
+    throw;
+  }
+}
+
+Snapshot::~Snapshot() {
+  unmap();
+}
+
+void Snapshot::unmap() {
+#ifdef _WIN32
+  if (data != nullptr)
+    UnmapViewOfFile(data);
+  if (mapping != nullptr)
+    CloseHandle(mapping);
+#else
+  if (data != nullptr)
+    munmap(const_cast<char*>(data), size);
+#endif
+  data = nullptr;
+  mapping = nullptr;
+}
+
+// Bounds are checked once here so that accessors can index blindly.
+void Snapshot::validate(const string& file) {
+  auto fail = [&file](const string& reason) { throw runtime_error("invalid snapshot " + file + ": " + reason); };
+  if (size < sizeof(snapshot::Header))
+    fail("truncated header");
+  header = reinterpret_cast<const snapshot::Header*>(data);
+  if (std::memcmp(header->magic, snapshot::MAGIC, sizeof(header->magic)) != 0)
+    fail("bad magic");
+  if (header->version != snapshot::VERSION)
+    fail("unsupported version " + std::to_string(header->version));
+  if (header->fileSize != size)
+    fail("size mismatch");
+
+  auto section = [&](uint64_t offset, uint64_t count, size_t element) {
+    if (offset % 8 != 0 || offset > size || count > (size - offset) / element)
+      fail("section out of bounds");
+    return data + offset;
+  };
+  uint64_t objectCount = header->objectCount;
+  objects = reinterpret_cast<const snapshot::ObjectRecord*>(
+    section(header->objectsOffset, objectCount, sizeof(snapshot::ObjectRecord)));
+  positions = reinterpret_cast<const double*>(section(header->positionsOffset, objectCount * 3, sizeof(double)));
+  rotations = reinterpret_cast<const double*>(section(header->rotationsOffset, objectCount * 4, sizeof(double)));
+  scales = reinterpret_cast<const double*>(section(header->scalesOffset, objectCount * 3, sizeof(double)));
+  plugins = reinterpret_cast<const snapshot::PluginRecord*>(
+    section(header->pluginsOffset, header->pluginCount, sizeof(snapshot::PluginRecord)));
+  strings = reinterpret_cast<const snapshot::StringRecord*>(
+    section(header->stringsOffset, header->stringCount, sizeof(snapshot::StringRecord)));
+  if (header->stringDataOffset > size || header->blobsOffset > size)
+    fail("section out of bounds");
+
+  auto stringDataSize = size - header->stringDataOffset;
+  auto blobsSize = size - header->blobsOffset;
+  for (uint32_t i = 0; i < header->stringCount; i++) {
+    if (strings[i].offset > stringDataSize || strings[i].size > stringDataSize - strings[i].offset)
+      fail("string out of bounds");
+  }
+  for (uint32_t i = 0; i < header->pluginCount; i++) {
+    if (plugins[i].id >= header->stringCount)
+      fail("bad plugin id");
+    if (plugins[i].blobOffset > blobsSize || plugins[i].blobSize > blobsSize - plugins[i].blobOffset)
+      fail("plugin blob out of bounds");
+  }
+  for (uint32_t i = 0; i < header->objectCount; i++) {
+    if (objects[i].id >= header->stringCount)
+      fail("bad object id");
+    if (objects[i].firstPlugin > header->pluginCount
+        || objects[i].pluginCount > header->pluginCount - objects[i].firstPlugin)
+      fail("plugins out of bounds");
+  }
+}
+
+}  // namespace core
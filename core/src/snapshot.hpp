@@ -0,0 +1,178 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_SNAPSHOT_HPP_
+#define CORE_SRC_SNAPSHOT_HPP_
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "core.hpp"
+#include "types.hpp"
+
+using std::string;
+using std::string_view;
+using std::unordered_map;
+using std::vector;
+
+namespace core {
+
+// Binary world snapshot, laid out so that a mapped file can be read in
+// place. All integers and doubles are stored in host (little endian) order
+// and every section starts 8 byte aligned:
+//
+//   Header
+//   ObjectRecord[objectCount]
+//   double[objectCount * 3]   positions
+//   double[objectCount * 4]   rotations
+//   double[objectCount * 3]   scales
+//   PluginRecord[pluginCount]
+//   StringRecord[stringCount] interned ids, referenced by index
+//   char[]                    string data
+//   char[]                    plugin blobs (script sources), each distinct
+//                             one once
+namespace snapshot {
+
+constexpr char MAGIC[8] = {'V', 'R', 'W', 'O', 'R', 'L', 'D', '\0'};
+constexpr uint32_t VERSION = 1;
+// Snapshots are written under this name and renamed over the file once
+// complete.
+constexpr char WRITING_SUFFIX[] = ".writing";
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t objectCount;
+  uint32_t pluginCount;
+  uint32_t stringCount;
+  uint64_t objectsOffset;
+  uint64_t positionsOffset;
+  uint64_t rotationsOffset;
+  uint64_t scalesOffset;
+  uint64_t pluginsOffset;
+  uint64_t stringsOffset;
+  uint64_t stringDataOffset;
+  uint64_t blobsOffset;
+  uint64_t fileSize;
+};
+
+struct ObjectRecord {
+  uint32_t id;
+  uint32_t firstPlugin;
+  uint32_t pluginCount;
+  uint32_t reserved;
+};
+
+struct PluginRecord {
+  uint32_t id;
+  uint32_t type;
+  uint64_t blobOffset;
+  uint64_t blobSize;
+};
+
+struct StringRecord {
+  uint64_t offset;
+  uint64_t size;
+};
+
+}  // namespace snapshot
+
+// Collects a world in memory and writes it out as a single snapshot file.
+// Plugins belong to the object added last. A failed write throws
+// std::runtime_error and leaves any previous file in place.
+class SnapshotWriter {
+ public:
+  void addObject(const string& id, const t::position& position, const t::rotation& rotation, const t::scale& scale);
+  void addPlugin(const string& id, IPlugin::Type type, const string& blob);
+  void write(const string& file);
+
+ private:
+  uint32_t intern(const string& value);
+
+  vector<snapshot::ObjectRecord> objects;
+  vector<double> positions;
+  vector<double> rotations;
+  vector<double> scales;
+  vector<snapshot::PluginRecord> plugins;
+  vector<snapshot::StringRecord> strings;
+  unordered_map<string, uint32_t> interned;
+  string stringData;
+  string blobs;
+  unordered_map<string, uint64_t> blobOffsets;
+};
+
+// Read only view over a mapped snapshot file. Throws std::runtime_error
+// when the file cannot be mapped or is not a snapshot of this version.
+// Returned views point into the mapping and live as long as the snapshot.
+class Snapshot {
+ public:
+  explicit Snapshot(const string& file);
+  ~Snapshot();
+  Snapshot(const Snapshot&) = delete;
+  Snapshot& operator=(const Snapshot&) = delete;
+
+  size_t objectCount() const { return header->objectCount; }
+  string_view objectId(size_t object) const { return text(objects[object].id); }
+  t::position position(size_t object) const {
+    auto p = &positions[object * 3];
+    return t::position{p[0], p[1], p[2]};
+  }
+  t::rotation rotation(size_t object) const {
+    auto r = &rotations[object * 4];
+    return t::rotation{r[0], r[1], r[2], r[3]};
+  }
+  t::scale scale(size_t object) const {
+    auto s = &scales[object * 3];
+    return t::scale{s[0], s[1], s[2]};
+  }
+
+  // Plugins of an object are the contiguous range [first, first + count).
+  size_t firstPlugin(size_t object) const { return objects[object].firstPlugin; }
+  size_t pluginCount(size_t object) const { return objects[object].pluginCount; }
+  string_view pluginId(size_t plugin) const { return text(plugins[plugin].id); }
+  IPlugin::Type pluginType(size_t plugin) const { return static_cast<IPlugin::Type>(plugins[plugin].type); }
+  string_view pluginBlob(size_t plugin) const {
+    return string_view(data + header->blobsOffset + plugins[plugin].blobOffset, plugins[plugin].blobSize);
+  }
+
+ private:
+  string_view text(uint32_t index) const {
+    auto const& record = strings[index];
+    return string_view(data + header->stringDataOffset + record.offset, record.size);
+  }
+  void validate(const string& file);
+  void unmap();
+
+  const char* data = nullptr;
+  size_t size = 0;
+  void* mapping = nullptr;
+
+  const snapshot::Header* header = nullptr;
+  const snapshot::ObjectRecord* objects = nullptr;
+  const double* positions = nullptr;
+  const double* rotations = nullptr;
+  const double* scales = nullptr;
+  const snapshot::PluginRecord* plugins = nullptr;
+  const snapshot::StringRecord* strings = nullptr;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_SNAPSHOT_HPP_
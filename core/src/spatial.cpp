@@ -0,0 +1,358 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "spatial.hpp"
+#include <algorithm>
+#include <cmath>
+#include <queue>
+
+namespace core {
+
+double Aabb::distanceSquared(const t::double3& point) const {
+  auto axis = [](double p, double low, double high) {
+    auto d = p < low ? low - p : p > high ? p - high : 0;
+    return d * d;
+  };
+  return axis(point.x, min.x, max.x) + axis(point.y, min.y, max.y) + axis(point.z, min.z, max.z);
+}
+
+Aabb merge(const Aabb& a, const Aabb& b) {
+  return Aabb{
+    t::double3{std::min(a.min.x, b.min.x), std::min(a.min.y, b.min.y), std::min(a.min.z, b.min.z)},
+    t::double3{std::max(a.max.x, b.max.x), std::max(a.max.y, b.max.y), std::max(a.max.z, b.max.z)}
+  };
+}
+
+// Half extent along each world axis of the rotated half size axes.
+Aabb objectBounds(const t::position& position, const t::rotation& rotation, const t::scale& scale) {
+  auto x = t::rotate(rotation, t::double3{scale.x / 2, 0, 0});
+  auto y = t::rotate(rotation, t::double3{0, scale.y / 2, 0});
+  auto z = t::rotate(rotation, t::double3{0, 0, scale.z / 2});
+  auto extent = t::double3{
+    std::abs(x.x) + std::abs(y.x) + std::abs(z.x),
+    std::abs(x.y) + std::abs(y.y) + std::abs(z.y),
+    std::abs(x.z) + std::abs(y.z) + std::abs(z.z)
+  };
+  return Aabb{position - extent, position + extent};
+}
+
+void SpatialIndex::set(uint32_t item, const Aabb& bounds) {
+  if (item >= leaves.size())
+    leaves.resize(item + 1, NIL);
+  auto leaf = leaves[item];
+  if (leaf != NIL && nodes[leaf].box.contains(bounds)) {
+    leafData[leaf].bounds = bounds;
+    return;
+  }
+  if (leaf != NIL) {
+    removeLeaf(leaf);
+  } else {
+    leaf = allocate();
+    leaves[item] = leaf;
+    count++;
+  }
+  auto grow = t::double3{margin, margin, margin};
+  auto& node = nodes[leaf];
+  node.box = Aabb{bounds.min - grow, bounds.max + grow};
+  node.height = 0;
+  leafData[leaf] = Leaf{bounds, item};
+  insertLeaf(leaf);
+}
+
+void SpatialIndex::remove(uint32_t item) {
+  if (!contains(item))
+    return;
+  auto leaf = leaves[item];
+  removeLeaf(leaf);
+  release(leaf);
+  leaves[item] = NIL;
+  count--;
+}
+
+void SpatialIndex::clear() {
+  nodes.clear();
+  leafData.clear();
+  leaves.clear();
+  root = NIL;
+  freeList = NIL;
+  count = 0;
+}
+
+int32_t SpatialIndex::allocate() {
+  if (freeList == NIL) {
+    nodes.push_back(Node{});
+    leafData.push_back(Leaf{});
+    return static_cast<int32_t>(nodes.size() - 1);
+  }
+  auto node = freeList;
+  freeList = nodes[node].parent;
+  nodes[node] = Node{};
+  return node;
+}
+
+void SpatialIndex::release(int32_t node) {
+  nodes[node].parent = freeList;
+  nodes[node].height = -1;
+  freeList = node;
+}
+
+// Walks down towards the cheapest sibling: the cost of a new parent
+// there against the growth it causes in the nodes above.
+void SpatialIndex::insertLeaf(int32_t leaf) {
+  if (root == NIL) {
+    root = leaf;
+    nodes[leaf].parent = NIL;
+    return;
+  }
+  auto box = nodes[leaf].box;
+  auto index = root;
+  while (!nodes[index].leaf()) {
+    auto const& node = nodes[index];
+    auto area = node.box.surface();
+    auto combined = merge(node.box, box).surface();
+    auto cost = 2 * combined;
+    auto inherited = 2 * (combined - area);
+    auto descend = [&](int32_t child) {
+      auto const& c = nodes[child];
+      auto grown = merge(box, c.box).surface();
+      return (c.leaf() ? grown : grown - c.box.surface()) + inherited;
+    };
+    auto left = descend(node.left);
+    auto right = descend(node.right);
+    if (cost < left && cost < right)
+      break;
+    index = left < right ? node.left : node.right;
+  }
+
+  auto sibling = index;
+  auto oldParent = nodes[sibling].parent;
+  auto parent = allocate();
+  auto& p = nodes[parent];
+  p.parent = oldParent;
+  p.box = merge(box, nodes[sibling].box);
+  p.height = nodes[sibling].height + 1;
+  p.left = sibling;
+  p.right = leaf;
+  if (oldParent == NIL)
+    root = parent;
+  else if (nodes[oldParent].left == sibling)
+    nodes[oldParent].left = parent;
+  else
+    nodes[oldParent].right = parent;
+  nodes[sibling].parent = parent;
+  nodes[leaf].parent = parent;
+  refit(nodes[leaf].parent);
+}
+
+void SpatialIndex::removeLeaf(int32_t leaf) {
+  if (leaf == root) {
+    root = NIL;
+    return;
+  }
+  auto parent = nodes[leaf].parent;
+  auto grandParent = nodes[parent].parent;
+  auto sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+  release(parent);
+  nodes[sibling].parent = grandParent;
+  if (grandParent == NIL) {
+    root = sibling;
+    return;
+  }
+  if (nodes[grandParent].left == parent)
+    nodes[grandParent].left = sibling;
+  else
+    nodes[grandParent].right = sibling;
+  refit(grandParent);
+}
+
+void SpatialIndex::refit(int32_t index) {
+  while (index != NIL) {
+    index = balance(index);
+    auto& node = nodes[index];
+    node.height = 1 + std::max(nodes[node.left].height, nodes[node.right].height);
+    node.box = merge(nodes[node.left].box, nodes[node.right].box);
+    index = node.parent;
+  }
+}
+
+// When one child of a is two levels taller than the other, its taller
+// grandchild stays below it and the child takes a's place.
+int32_t SpatialIndex::balance(int32_t a) {
+  auto& A = nodes[a];
+  if (A.leaf() || A.height < 2)
+    return a;
+  auto b = A.left;
+  auto c = A.right;
+  auto difference = nodes[c].height - nodes[b].height;
+  if (difference >= -1 && difference <= 1)
+    return a;
+
+  // Rotates up the taller child, up, whose other child is kept.
+  bool rightTaller = difference > 1;
+  auto up = rightTaller ? c : b;
+  auto kept = rightTaller ? b : c;
+  auto& U = nodes[up];
+  auto f = U.left;
+  auto g = U.right;
+
+  U.left = a;
+  U.parent = A.parent;
+  A.parent = up;
+  if (U.parent == NIL)
+    root = up;
+  else if (nodes[U.parent].left == a)
+    nodes[U.parent].left = up;
+  else
+    nodes[U.parent].right = up;
+
+  auto taller = nodes[f].height > nodes[g].height ? f : g;
+  auto shorter = taller == f ? g : f;
+  U.right = taller;
+  if (rightTaller)
+    A.right = shorter;
+  else
+    A.left = shorter;
+  nodes[shorter].parent = a;
+  A.box = merge(nodes[kept].box, nodes[shorter].box);
+  A.height = 1 + std::max(nodes[kept].height, nodes[shorter].height);
+  U.box = merge(A.box, nodes[taller].box);
+  U.height = 1 + std::max(A.height, nodes[taller].height);
+  return up;
+}
+
+void SpatialIndex::queryBox(const Aabb& box, vector<uint32_t>* out) const {
+  if (root == NIL)
+    return;
+  vector<int32_t> stack{root};
+  while (!stack.empty()) {
+    auto index = stack.back();
+    auto const& node = nodes[index];
+    stack.pop_back();
+    if (!node.box.overlaps(box))
+      continue;
+    if (!node.leaf()) {
+      stack.push_back(node.left);
+      stack.push_back(node.right);
+    } else if (leafData[index].bounds.overlaps(box)) {
+      out->push_back(leafData[index].item);
+    }
+  }
+}
+
+void SpatialIndex::querySphere(const t::double3& center, double radius, vector<uint32_t>* out) const {
+  if (root == NIL)
+    return;
+  auto r2 = radius * radius;
+  vector<int32_t> stack{root};
+  while (!stack.empty()) {
+    auto index = stack.back();
+    auto const& node = nodes[index];
+    stack.pop_back();
+    if (node.box.distanceSquared(center) > r2)
+      continue;
+    if (!node.leaf()) {
+      stack.push_back(node.left);
+      stack.push_back(node.right);
+    } else if (leafData[index].bounds.distanceSquared(center) <= r2) {
+      out->push_back(leafData[index].item);
+    }
+  }
+}
+
+// Slab test, entry is where the ray enters the box or 0 from inside.
+static bool rayEnters(const Aabb& box, const t::double3& origin, const t::double3& direction, double maxDistance, double* entry) {
+  double near = 0;
+  double far = maxDistance;
+  auto axis = [&](double o, double d, double low, double high) {
+    if (d == 0)
+      return low <= o && o <= high;
+    auto t1 = (low - o) / d;
+    auto t2 = (high - o) / d;
+    if (t1 > t2)
+      std::swap(t1, t2);
+    near = std::max(near, t1);
+    far = std::min(far, t2);
+    return near <= far;
+  };
+  if (!axis(origin.x, direction.x, box.min.x, box.max.x)
+      || !axis(origin.y, direction.y, box.min.y, box.max.y)
+      || !axis(origin.z, direction.z, box.min.z, box.max.z))
+    return false;
+  *entry = near;
+  return true;
+}
+
+void SpatialIndex::queryRay(const t::double3& origin, const t::double3& direction, double maxDistance, vector<Hit>* out) const {
+  if (root == NIL)
+    return;
+  auto first = out->size();
+  vector<int32_t> stack{root};
+  double entry;
+  while (!stack.empty()) {
+    auto index = stack.back();
+    auto const& node = nodes[index];
+    stack.pop_back();
+    if (!rayEnters(node.box, origin, direction, maxDistance, &entry))
+      continue;
+    if (!node.leaf()) {
+      stack.push_back(node.left);
+      stack.push_back(node.right);
+    } else if (rayEnters(leafData[index].bounds, origin, direction, maxDistance, &entry)) {
+      out->push_back(Hit{leafData[index].item, entry});
+    }
+  }
+  std::sort(out->begin() + first, out->end(), [](const Hit& a, const Hit& b) {
+    return a.distance < b.distance || (a.distance == b.distance && a.item < b.item);
+  });
+}
+
+// Best first: nodes come out of the queue by the distance to their box,
+// which never exceeds the distance to anything below them, and leaves go
+// back in with their exact distance.
+void SpatialIndex::queryNearest(const t::double3& point, size_t wanted, vector<Hit>* out) const {
+  if (root == NIL || wanted == 0)
+    return;
+  struct Entry {
+    double d2;
+    int32_t node;
+    bool exact;
+    bool operator>(const Entry& other) const {
+      if (d2 != other.d2)
+        return d2 > other.d2;
+      return node > other.node;
+    }
+  };
+  std::priority_queue<Entry, vector<Entry>, std::greater<Entry>> queue;
+  queue.push(Entry{nodes[root].box.distanceSquared(point), root, false});
+  size_t found = 0;
+  while (!queue.empty() && found < wanted) {
+    auto entry = queue.top();
+    queue.pop();
+    auto const& node = nodes[entry.node];
+    if (entry.exact) {
+      out->push_back(Hit{leafData[entry.node].item, std::sqrt(entry.d2)});
+      found++;
+    } else if (node.leaf()) {
+      queue.push(Entry{leafData[entry.node].bounds.distanceSquared(point), entry.node, true});
+    } else {
+      queue.push(Entry{nodes[node.left].box.distanceSquared(point), node.left, false});
+      queue.push(Entry{nodes[node.right].box.distanceSquared(point), node.right, false});
+    }
+  }
+}
+
+}  // namespace core
@@ -0,0 +1,133 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_SPATIAL_HPP_
+#define CORE_SRC_SPATIAL_HPP_
+
+#include <cstdint>
+#include <vector>
+
+#include "types.hpp"
+
+using std::vector;
+
+namespace core {
+
+struct Aabb {
+  t::double3 min;
+  t::double3 max;
+
+  bool overlaps(const Aabb& other) const {
+    return min.x <= other.max.x && other.min.x <= max.x
+      && min.y <= other.max.y && other.min.y <= max.y
+      && min.z <= other.max.z && other.min.z <= max.z;
+  }
+  bool contains(const Aabb& other) const {
+    return min.x <= other.min.x && min.y <= other.min.y && min.z <= other.min.z
+      && other.max.x <= max.x && other.max.y <= max.y && other.max.z <= max.z;
+  }
+  double surface() const {
+    auto d = max - min;
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+  // Squared distance from point to the box, 0 inside.
+  double distanceSquared(const t::double3& point) const;
+};
+
+Aabb merge(const Aabb& a, const Aabb& b);
+
+// Objects have no shape yet: they are the unit cube centered on their
+// position, scaled then rotated.
+Aabb objectBounds(const t::position& position, const t::rotation& rotation, const t::scale& scale);
+
+// Dynamic bounding volume tree over items (object slots). Leaves hold the
+// item's bounds grown by a margin, so small moves only update the exact
+// bounds kept next to them, larger ones reinsert the leaf. Insertion picks
+// the sibling by surface area and rotations keep the tree balanced.
+// Queries test the exact bounds and may run concurrently with each other,
+// not with set() or remove().
+class SpatialIndex {
+ public:
+  struct Hit {
+    uint32_t item;
+    double distance;
+  };
+
+  explicit SpatialIndex(double margin = 1.0) : margin{margin} {}
+
+  // Inserts the item or moves it to new bounds.
+  void set(uint32_t item, const Aabb& bounds);
+  void remove(uint32_t item);
+  bool contains(uint32_t item) const { return item < leaves.size() && leaves[item] != NIL; }
+  size_t size() const { return count; }
+  void clear();
+  // Longest path from the root, 0 when empty.
+  int32_t height() const { return root == NIL ? 0 : nodes[root].height + 1; }
+
+  // Queries append to out, in no particular order unless stated.
+  void queryBox(const Aabb& box, vector<uint32_t>* out) const;
+  void querySphere(const t::double3& center, double radius, vector<uint32_t>* out) const;
+  // Items hit by the ray within maxDistance, nearest first. Distances are
+  // in units of direction's length, 0 for items around the origin.
+  void queryRay(const t::double3& origin, const t::double3& direction, double maxDistance, vector<Hit>* out) const;
+  // The count items nearest to point, nearest first, by distance to their
+  // bounds.
+  void queryNearest(const t::double3& point, size_t count, vector<Hit>* out) const;
+
+ private:
+  static constexpr int32_t NIL = -1;
+
+  // One cache line, traversals only touch the leaf data of matches.
+  struct alignas(64) Node {
+    // Grown by the margin for leaves.
+    Aabb box;
+    // Next free node while in the free list.
+    int32_t parent = NIL;
+    int32_t left = NIL;
+    int32_t right = NIL;
+    // Leaves are 0.
+    int32_t height = 0;
+
+    bool leaf() const { return left == NIL; }
+  };
+  // Exact bounds and item of leaf nodes, by node.
+  struct Leaf {
+    Aabb bounds;
+    uint32_t item = 0;
+  };
+
+  int32_t allocate();
+  void release(int32_t node);
+  void insertLeaf(int32_t leaf);
+  void removeLeaf(int32_t leaf);
+  // Refits boxes and heights from node up to the root.
+  void refit(int32_t node);
+  int32_t balance(int32_t node);
+
+  double margin;
+  vector<Node> nodes;
+  vector<Leaf> leafData;
+  int32_t root = NIL;
+  int32_t freeList = NIL;
+  size_t count = 0;
+  // Leaf node of each item, NIL when absent.
+  vector<int32_t> leaves;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_SPATIAL_HPP_
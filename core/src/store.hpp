@@ -0,0 +1,234 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_STORE_HPP_
+#define CORE_SRC_STORE_HPP_
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "types.hpp"
+
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+namespace core {
+
+// Stable reference to an object slot. The generation is bumped every time
+// the slot is freed so that stale handles never resolve to a new object.
+struct ObjectHandle {
+  static constexpr uint32_t INVALID = UINT32_MAX;
+
+  uint32_t index = INVALID;
+  uint32_t generation = 0;
+
+  bool valid() const { return index != INVALID; }
+  bool operator==(const ObjectHandle& other) const {
+    return index == other.index && generation == other.generation;
+  }
+  bool operator!=(const ObjectHandle& other) const { return !(*this == other); }
+};
+
+// Bits of ObjectStore::dirty, telling what changed since the last save.
+enum Dirty : uint8_t {
+  CLEAN = 0,
+  DIRTY_TRANSFORM = 1,
+  DIRTY_PLUGINS = 2,
+  DIRTY_ALL = DIRTY_TRANSFORM | DIRTY_PLUGINS
+};
+
+// Structure of arrays holding every object of a world.
+// Transforms live in dense arrays so that a full pass over the world is a
+// linear scan, slots map stable handles to dense indexes and are recycled
+// through a free list, and the string index resolves ids to handles.
+// Removal swaps the last dense element into the hole: dense indexes and
+// references into the arrays are only valid until the next create/destroy.
+template <typename Payload>
+class ObjectStore {
+ public:
+  size_t size() const { return ids.size(); }
+  bool empty() const { return ids.empty(); }
+
+  void reserve(size_t count) {
+    ids.reserve(count);
+    handles.reserve(count);
+    positions.reserve(count);
+    rotations.reserve(count);
+    scales.reserve(count);
+    dirty.reserve(count);
+    moved.reserve(count);
+    dormant.reserve(count);
+    payloads.reserve(count);
+    slots.reserve(count);
+    index.reserve(count);
+  }
+
+  ObjectHandle create(const string& id, Payload payload) {
+    auto existing = find(id);
+    if (existing.valid())
+      destroy(existing);
+
+    ObjectHandle handle;
+    if (freeSlots.empty()) {
+      handle.index = static_cast<uint32_t>(slots.size());
+      slots.push_back(Slot{});
+    } else {
+      handle.index = freeSlots.back();
+      freeSlots.pop_back();
+    }
+    auto& slot = slots[handle.index];
+    handle.generation = slot.generation;
+    slot.dense = static_cast<uint32_t>(ids.size());
+
+    ids.push_back(id);
+    handles.push_back(handle);
+    positions.push_back(t::position{0, 0, 0});
+    rotations.push_back(t::rotation{0, 0, 0, 0});
+    scales.push_back(t::scale{1, 1, 1});
+    dirty.push_back(DIRTY_ALL);
+    moved.push_back(1);
+    dormant.push_back(0);
+    payloads.push_back(std::move(payload));
+    index[id] = handle;
+    return handle;
+  }
+
+  bool destroy(ObjectHandle handle) {
+    if (!contains(handle))
+      return false;
+    auto& slot = slots[handle.index];
+    auto hole = slot.dense;
+    auto last = static_cast<uint32_t>(ids.size() - 1);
+
+    index.erase(ids[hole]);
+    if (hole != last) {
+      ids[hole] = std::move(ids[last]);
+      handles[hole] = handles[last];
+      positions[hole] = positions[last];
+      rotations[hole] = rotations[last];
+      scales[hole] = scales[last];
+      dirty[hole] = dirty[last];
+      moved[hole] = moved[last];
+      dormant[hole] = dormant[last];
+      payloads[hole] = std::move(payloads[last]);
+      slots[handles[hole].index].dense = hole;
+    }
+    ids.pop_back();
+    handles.pop_back();
+    positions.pop_back();
+    rotations.pop_back();
+    scales.pop_back();
+    dirty.pop_back();
+    moved.pop_back();
+    dormant.pop_back();
+    payloads.pop_back();
+
+    slot.generation++;
+    slot.dense = Slot::FREE;
+    freeSlots.push_back(handle.index);
+    return true;
+  }
+
+  bool contains(ObjectHandle handle) const {
+    if (handle.index >= slots.size())
+      return false;
+    auto const& slot = slots[handle.index];
+    return slot.dense != Slot::FREE && slot.generation == handle.generation;
+  }
+
+  ObjectHandle find(const string& id) const {
+    auto it = index.find(id);
+    if (it == index.end())
+      return ObjectHandle{};
+    return it->second;
+  }
+
+  void clear() {
+    for (size_t i = 0; i < handles.size(); i++) {
+      auto& slot = slots[handles[i].index];
+      slot.generation++;
+      slot.dense = Slot::FREE;
+      freeSlots.push_back(handles[i].index);
+    }
+    ids.clear();
+    handles.clear();
+    positions.clear();
+    rotations.clear();
+    scales.clear();
+    dirty.clear();
+    moved.clear();
+    dormant.clear();
+    payloads.clear();
+    index.clear();
+  }
+
+  // Live handle of a slot index, invalid when the slot is free.
+  ObjectHandle slotHandle(uint32_t index) const {
+    if (index >= slots.size() || slots[index].dense == Slot::FREE)
+      return ObjectHandle{};
+    return ObjectHandle{index, slots[index].generation};
+  }
+
+  // Dense index of a live handle, for callers walking the arrays directly.
+  size_t denseIndex(ObjectHandle handle) const { return slots[handle.index].dense; }
+
+  const string& id(ObjectHandle handle) const { return ids[denseIndex(handle)]; }
+  t::position& position(ObjectHandle handle) { return positions[denseIndex(handle)]; }
+  t::rotation& rotation(ObjectHandle handle) { return rotations[denseIndex(handle)]; }
+  t::scale& scale(ObjectHandle handle) { return scales[denseIndex(handle)]; }
+  Payload& payload(ObjectHandle handle) { return payloads[denseIndex(handle)]; }
+  // Flags are one byte per object, so plugins running in parallel on
+  // different objects can mark them without synchronization.
+  void markDirty(ObjectHandle handle, uint8_t flags) {
+    auto i = denseIndex(handle);
+    dirty[i] |= flags;
+    if (flags & DIRTY_TRANSFORM)
+      moved[i] = 1;
+  }
+
+  // Dense columns, all of length size() and in the same order.
+  vector<string> ids;
+  vector<ObjectHandle> handles;
+  vector<t::position> positions;
+  vector<t::rotation> rotations;
+  vector<t::scale> scales;
+  vector<uint8_t> dirty;
+  // Set with DIRTY_TRANSFORM and on creation, but cleared by whoever keeps
+  // bounds of the objects (the spatial index) rather than by saves.
+  vector<uint8_t> moved;
+  // Set while every plugin of the object sleeps, round() skips the object.
+  vector<uint8_t> dormant;
+  vector<Payload> payloads;
+
+ private:
+  struct Slot {
+    static constexpr uint32_t FREE = UINT32_MAX;
+    uint32_t dense = FREE;
+    uint32_t generation = 0;
+  };
+
+  vector<Slot> slots;
+  vector<uint32_t> freeSlots;
+  unordered_map<string, ObjectHandle> index;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_STORE_HPP_
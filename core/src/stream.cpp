@@ -0,0 +1,377 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "stream.hpp"
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+
+#include "collision.hpp"
+#include "journal.hpp"
+#include "native.hpp"
+#include "physics.hpp"
+#include "scripting.hpp"
+#include "snapshot.hpp"
+
+using std::ifstream;
+using std::stringstream;
+using std::lock_guard;
+using std::mutex;
+using std::unique_lock;
+namespace fs = std::filesystem;
+
+namespace core {
+
+static shared_ptr<IPlugin> scriptPlugin(const string& id, const string& source, bool deferred) {
+  return deferred ? Scripts::asDeferredPlugin(id, source) : Scripts::asPlugin(id, source);
+}
+
+std::unordered_set<string> listScriptFiles(const string& path) {
+  std::unordered_set<string> files;
+  if (fs::is_directory(path + "/scripts")) {
+    for (auto const& entry : fs::directory_iterator(path + "/scripts"))
+      files.insert(entry.path().filename().string());
+  }
+  return files;
+}
+
+command::CreateObject objectFromYaml(const string& path, const YAML::Node& objectConf, bool deferScripts,
+    AssetStore* assets, const std::unordered_set<string>& scripts) {
+  command::CreateObject object;
+  object.id = objectConf["id"].as<string>();
+  object.position = t::position{
+    objectConf["position"]["x"].as<double>(),
+    objectConf["position"]["y"].as<double>(),
+    objectConf["position"]["z"].as<double>()
+  };
+  object.rotation = t::rotation{
+    objectConf["rotation"]["x"].as<double>(),
+    objectConf["rotation"]["y"].as<double>(),
+    objectConf["rotation"]["z"].as<double>(),
+    objectConf["rotation"]["w"].as<double>()
+  };
+  object.scale = t::scale{
+    objectConf["scale"]["x"].as<double>(),
+    objectConf["scale"]["y"].as<double>(),
+    objectConf["scale"]["z"].as<double>()
+  };
+  for (auto const& pluginConf : objectConf["plugins"]) {
+    auto pluginId = pluginConf["id"].as<string>();
+    auto type = pluginConf["type"].as<string>();
+    if (type == "physics") {
+      Body body;
+      body.mass = pluginConf["mass"].as<double>(body.mass);
+      if (auto velocity = pluginConf["velocity"])
+        body.velocity = t::double3{velocity["x"].as<double>(), velocity["y"].as<double>(), velocity["z"].as<double>()};
+      body.damping = pluginConf["damping"].as<double>(body.damping);
+      object.plugins.push_back(Physics::asPlugin(pluginId, body));
+      continue;
+    }
+    if (type == "collider") {
+      auto shape = assets->get(pluginConf["asset"].as<string>());
+      object.plugins.push_back(Collisions::asPlugin(pluginId, *shape));
+      continue;
+    }
+    if (type == "native") {
+      object.plugins.push_back(Natives::asPlugin(pluginId, NativeSpec{
+        Natives::libraryIn(path, pluginConf["library"].as<string>()),
+        pluginConf["behaviour"].as<string>(), pluginConf["config"].as<string>("")}));
+      continue;
+    }
+    if (type != "script")
+      continue;
+    if (pluginConf["asset"] && !scripts.contains(object.id + "_" + pluginId)) {
+      auto source = assets->get(pluginConf["asset"].as<string>());
+      object.plugins.push_back(scriptPlugin(pluginId, *source, deferScripts));
+      continue;
+    }
+    ifstream scriptFile(path + "/scripts/" + object.id + "_" + pluginId);
+    stringstream buffer;
+    buffer << scriptFile.rdbuf();
+    scriptFile.close();
+    object.plugins.push_back(scriptPlugin(pluginId, buffer.str(), deferScripts));
+  }
+  return object;
+}
+
+// yaml-cpp has no incremental parser: the document is read whole, objects
+// and their script files are then decoded one at a time.
+class YamlSource : public StreamSource {
+ public:
+  explicit YamlSource(const string& path) : path{path}, assets{path + "/assets"}, scripts{listScriptFiles(path)} {
+    objects = YAML::LoadFile(path + "/world.yaml")["objects"];
+  }
+
+  size_t total() override { return objects.size(); }
+
+  bool next(command::CreateObject* object) override {
+    if (position >= objects.size())
+      return false;
+    *object = objectFromYaml(path, objects[position++], true, &assets, scripts);
+    return true;
+  }
+
+ private:
+  string path;
+  AssetStore assets;
+  std::unordered_set<string> scripts;
+  YAML::Node objects;
+  size_t position = 0;
+};
+
+// The mapping is only paged in as objects are read. The journals next to
+// the snapshot are folded in first, by object id, so that each object
+// comes out in its latest state and before any round runs it: deleted
+// objects are skipped and objects created since the snapshot come last.
+class SnapshotSource : public StreamSource {
+ public:
+  explicit SnapshotSource(const string& file) : snapshot{file} {
+    fold(file + journal::COMPACTING_SUFFIX);
+    // The world takes the file over once streamed, saves append from here.
+    Journals::truncate(file + journal::SUFFIX, fold(file + journal::SUFFIX));
+    known = snapshot.objectCount();
+    if (changes.empty())
+      return;
+    for (size_t i = 0; i < snapshot.objectCount(); i++) {
+      auto found = changes.find(string(snapshot.objectId(i)));
+      if (found == changes.end())
+        continue;
+      found->second.inSnapshot = true;
+      if (found->second.deleted)
+        known--;
+    }
+    for (auto const& id : added) {
+      auto const& change = changes[id];
+      if (!change.inSnapshot && !change.deleted)
+        known++;
+    }
+  }
+
+  size_t total() override { return known; }
+
+  bool next(command::CreateObject* object) override {
+    while (position < snapshot.objectCount()) {
+      auto i = position++;
+      object->id = string(snapshot.objectId(i));
+      auto found = changes.find(object->id);
+      if (found != changes.end()) {
+        if (found->second.deleted)
+          continue;
+        if (found->second.replaced) {
+          fromChange(found->second, object);
+          return true;
+        }
+      }
+      object->position = snapshot.position(i);
+      object->rotation = snapshot.rotation(i);
+      object->scale = snapshot.scale(i);
+      object->plugins.clear();
+      auto first = snapshot.firstPlugin(i);
+      for (auto p = first; p < first + snapshot.pluginCount(i); p++) {
+        auto plugin = Plugins::fromBlob(string(snapshot.pluginId(p)), snapshot.pluginType(p),
+          string(snapshot.pluginBlob(p)), true);
+        if (plugin != nullptr)
+          object->plugins.push_back(plugin);
+      }
+      if (found != changes.end() && found->second.moved) {
+        object->position = found->second.position;
+        object->rotation = found->second.rotation;
+        object->scale = found->second.scale;
+      }
+      return true;
+    }
+    while (addedPosition < added.size()) {
+      auto const& id = added[addedPosition++];
+      auto const& change = changes[id];
+      if (change.inSnapshot || change.deleted)
+        continue;
+      object->id = id;
+      fromChange(change, object);
+      return true;
+    }
+    return false;
+  }
+
+ private:
+  struct Plugin {
+    string id;
+    IPlugin::Type type;
+    string blob;
+  };
+  // Latest state of an object in the journals. Replaced objects have the
+  // journal's plugin list, moved ones only the journal's transforms.
+  struct Change {
+    bool deleted = false;
+    bool replaced = false;
+    bool moved = false;
+    bool inSnapshot = false;
+    t::position position;
+    t::rotation rotation;
+    t::scale scale;
+    vector<Plugin> plugins;
+  };
+
+  // Same outcome as World::replayJournal on top of the snapshot.
+  uint64_t fold(const string& file) {
+    return Journals::replay(file, [this](const JournalEntry& entry) {
+      auto id = string(entry.id);
+      auto [found, created] = changes.try_emplace(id);
+      if (created)
+        added.push_back(id);
+      auto& change = found->second;
+      if (entry.kind == journal::DELETE) {
+        change = Change{true};
+        return;
+      }
+      // Moving an object deleted earlier creates it without plugins.
+      if (change.deleted)
+        change = Change{false, true};
+      change.moved = true;
+      change.position = entry.position;
+      change.rotation = entry.rotation;
+      change.scale = entry.scale;
+      if (entry.kind != journal::OBJECT)
+        return;
+      change.replaced = true;
+      change.plugins.clear();
+      for (auto const& plugin : entry.plugins)
+        change.plugins.push_back(Plugin{string(plugin.id), plugin.type, string(plugin.blob)});
+    });
+  }
+
+  static void fromChange(const Change& change, command::CreateObject* object) {
+    object->position = change.position;
+    object->rotation = change.rotation;
+    object->scale = change.scale;
+    object->plugins.clear();
+    for (auto const& plugin : change.plugins) {
+      if (auto loaded = Plugins::fromBlob(plugin.id, plugin.type, plugin.blob, true))
+        object->plugins.push_back(loaded);
+    }
+  }
+
+  Snapshot snapshot;
+  size_t position = 0;
+  std::unordered_map<string, Change> changes;
+  // Ids in the order the journals first name them.
+  vector<string> added;
+  size_t addedPosition = 0;
+  size_t known = 0;
+};
+
+static std::unique_ptr<StreamSource> openSource(const string& path) {
+  if (fs::is_directory(path))
+    return std::make_unique<YamlSource>(path);
+  return std::make_unique<SnapshotSource>(path);
+}
+
+WorldStream::WorldStream(const string& path, const StreamOptions& options) : options{options}, path{path} {
+  if (this->options.chunkSize == 0)
+    this->options.chunkSize = 1;
+  if (this->options.maxBuffered < this->options.chunkSize)
+    this->options.maxBuffered = this->options.chunkSize;
+  if (!fs::is_directory(path))
+    snapshotFile = path;
+
+  if (options.background) {
+    decoder = std::thread([this]() { decodeLoop(); });
+  } else {
+    source = openSource(path);
+    knownTotal = source->total();
+  }
+}
+
+WorldStream::~WorldStream() {
+  {
+    lock_guard<mutex> guard(lock);
+    stopping = true;
+  }
+  changed.notify_all();
+  if (decoder.joinable())
+    decoder.join();
+}
+
+void WorldStream::decodeLoop() {
+  try {
+    source = openSource(path);
+    {
+      lock_guard<mutex> guard(lock);
+      knownTotal = source->total();
+    }
+    command::CreateObject object;
+    while (source->next(&object)) {
+      unique_lock<mutex> guard(lock);
+      changed.wait(guard, [this]() { return stopping || buffered.size() < options.maxBuffered; });
+      if (stopping)
+        return;
+      buffered.push_back(std::move(object));
+      changed.notify_all();
+    }
+  } catch (const std::exception& ex) {
+    lock_guard<mutex> guard(lock);
+    failure = ex.what();
+  }
+  lock_guard<mutex> guard(lock);
+  sourceDone = true;
+  changed.notify_all();
+}
+
+void WorldStream::take(vector<command::CreateObject>* out, bool wait) {
+  if (!options.background) {
+    command::CreateObject object;
+    try {
+      while (out->size() < options.chunkSize && !sourceDone) {
+        if (source->next(&object))
+          out->push_back(std::move(object));
+        else
+          sourceDone = true;
+      }
+    } catch (const std::exception& ex) {
+      failure = ex.what();
+      sourceDone = true;
+    }
+    return;
+  }
+
+  unique_lock<mutex> guard(lock);
+  if (wait)
+    changed.wait(guard, [this]() { return sourceDone || !buffered.empty(); });
+  while (out->size() < options.chunkSize && !buffered.empty()) {
+    out->push_back(std::move(buffered.front()));
+    buffered.pop_front();
+  }
+  changed.notify_all();
+}
+
+bool WorldStream::exhausted() {
+  lock_guard<mutex> guard(lock);
+  return sourceDone && buffered.empty();
+}
+
+string WorldStream::error() {
+  lock_guard<mutex> guard(lock);
+  return failure;
+}
+
+size_t WorldStream::total() {
+  lock_guard<mutex> guard(lock);
+  return knownTotal;
+}
+
+}  // namespace core
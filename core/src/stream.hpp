@@ -0,0 +1,101 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_STREAM_HPP_
+#define CORE_SRC_STREAM_HPP_
+
+#include <yaml-cpp/yaml.h>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "assets.hpp"
+#include "core.hpp"
+#include "update_queue.hpp"
+
+using std::string;
+using std::vector;
+
+namespace core {
+
+// Names of the editable script files of the world.yaml directory path,
+// see IWorld::watchScripts.
+std::unordered_set<string> listScriptFiles(const string& path);
+
+// Decodes one entry of world.yaml, reading its scripts from the assets of
+// path unless scripts lists an editable file for them, which is read
+// instead. Worlds saved before assets only have the files. Deferred
+// scripts compile the first time they run instead of right away.
+command::CreateObject objectFromYaml(const string& path, const YAML::Node& objectConf, bool deferScripts,
+  AssetStore* assets, const std::unordered_set<string>& scripts);
+
+// Where streamed objects come from: a world.yaml directory or a snapshot.
+class StreamSource {
+ public:
+  virtual ~StreamSource() {}
+  // Objects in the whole source, 0 while still unknown.
+  virtual size_t total() = 0;
+  // False once every object has been handed out.
+  virtual bool next(command::CreateObject* object) = 0;
+};
+
+// Objects of a world being loaded, handed to it a chunk at a time. In
+// background mode a thread decodes ahead, at most maxBuffered objects,
+// so that memory stays bounded whatever the size of the world.
+class WorldStream {
+ public:
+  WorldStream(const string& path, const StreamOptions& options);
+  ~WorldStream();
+
+  // Moves up to chunkSize objects to out. In background mode only what is
+  // already decoded, possibly nothing, so that rounds never wait on it,
+  // unless asked to wait for at least one object or the end.
+  void take(vector<command::CreateObject>* out, bool wait = false);
+  bool exhausted();
+  size_t total();
+  // What stopped decoding before the end of the source, if anything.
+  string error();
+  // Set when streaming a snapshot. Its journals are folded into the
+  // objects handed out, see SnapshotSource.
+  const string& getSnapshotFile() const { return snapshotFile; }
+
+ private:
+  void decodeLoop();
+
+  StreamOptions options;
+  string path;
+  string snapshotFile;
+  std::unique_ptr<StreamSource> source;
+
+  std::mutex lock;
+  std::condition_variable changed;
+  std::deque<command::CreateObject> buffered;
+  size_t knownTotal = 0;
+  bool sourceDone = false;
+  string failure;
+  bool stopping = false;
+  std::thread decoder;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_STREAM_HPP_
@@ -0,0 +1,109 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "tick.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+#include "profiler.hpp"
+
+namespace core {
+
+double TickScheduler::steadySeconds() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+TickScheduler::TickScheduler(shared_ptr<IWorld> world, const TickOptions& options, Clock clock)
+    : world{world}, options{options}, clock{clock} {
+  period = 1 / std::max(options.rate, 1e-3);
+  budget = options.budget > 0 ? options.budget : period;
+  this->options.maxSpread = std::max<size_t>(options.maxSpread, 1);
+  this->options.maxCatchUp = std::max<size_t>(options.maxCatchUp, 1);
+  world->setLowPrioritySpread(1);
+}
+
+double TickScheduler::advance() {
+  auto now = clock();
+  if (!started) {
+    started = true;
+    next = now;
+  }
+  size_t ran = 0;
+  while (next <= now && ran < options.maxCatchUp) {
+    runRound(next);
+    next += period;
+    ran++;
+    now = clock();
+  }
+  if (next <= now) {
+    auto missed = std::floor((now - next) / period) + 1;
+    stats.dropped += static_cast<uint64_t>(missed);
+    next += missed * period;
+  }
+  return next;
+}
+
+void TickScheduler::run() {
+  running = true;
+  while (running) {
+    auto wait = advance() - clock();
+    if (wait > 0 && running)
+      std::this_thread::sleep_for(std::chrono::duration<double>(wait));
+  }
+}
+
+void TickScheduler::runRound(double scheduled) {
+  auto start = clock();
+  world->round();
+  auto seconds = clock() - start;
+
+  auto jitter = std::max(start - scheduled, 0.0);
+  stats.rounds++;
+  stats.lastRound = seconds;
+  stats.meanRound += (seconds - stats.meanRound) / stats.rounds;
+  stats.maxRound = std::max(stats.maxRound, seconds);
+  stats.meanJitter += (jitter - stats.meanJitter) / stats.rounds;
+  stats.maxJitter = std::max(stats.maxJitter, jitter);
+  adapt(seconds);
+  if (roundListener)
+    roundListener(stats);
+}
+
+void TickScheduler::adapt(double seconds) {
+  auto spread = stats.spread;
+  if (seconds > budget) {
+    stats.overruns++;
+    calmRounds = 0;
+    spread = std::min(spread * 2, options.maxSpread);
+  } else if (seconds < budget / 2 && spread > 1) {
+    if (++calmRounds >= options.recoverRounds) {
+      calmRounds = 0;
+      spread /= 2;
+    }
+  } else {
+    calmRounds = 0;
+  }
+  if (spread == stats.spread)
+    return;
+  stats.spread = spread;
+  world->setLowPrioritySpread(spread);
+  CORE_PROFILE_COUNTER("low priority spread", spread);
+}
+
+}  // namespace core
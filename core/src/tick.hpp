@@ -0,0 +1,105 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_TICK_HPP_
+#define CORE_SRC_TICK_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "core.hpp"
+
+using std::function;
+using std::shared_ptr;
+
+namespace core {
+
+struct TickOptions {
+  // Rounds per second.
+  double rate = 30;
+  // Seconds a round may take, 0 for the whole tick period.
+  double budget = 0;
+  // Largest spread of low priority plugins, see IWorld::setLowPrioritySpread.
+  size_t maxSpread = 8;
+  // Consecutive rounds under half the budget before the spread is halved.
+  size_t recoverRounds = 32;
+  // Late ticks run back to back up to this many, the ones still behind
+  // after that are dropped.
+  size_t maxCatchUp = 4;
+};
+
+// Times in seconds.
+struct TickStats {
+  uint64_t rounds = 0;
+  // Rounds over budget.
+  uint64_t overruns = 0;
+  // Ticks never run because rounds fell too far behind.
+  uint64_t dropped = 0;
+  double lastRound = 0;
+  double meanRound = 0;
+  double maxRound = 0;
+  // How late rounds started against their tick.
+  double meanJitter = 0;
+  double maxJitter = 0;
+  size_t spread = 1;
+};
+
+// Drives IWorld::round() at a fixed rate. Each round is measured against
+// the budget: over it, low priority plugins are spread over twice as many
+// rounds, up to maxSpread, and gathered back once rounds are well within
+// it again. The clock is injectable for tests.
+class TickScheduler {
+ public:
+  using Clock = function<double()>;
+  static double steadySeconds();
+
+  explicit TickScheduler(shared_ptr<IWorld> world, const TickOptions& options = {}, Clock clock = steadySeconds);
+
+  // Runs the rounds due by now and returns when the next one is due, for
+  // callers running their own loop.
+  double advance();
+  // Runs rounds until stop(), sleeping in between.
+  void run();
+  // Safe from other threads and signal handlers.
+  void stop() { running = false; }
+  // Called after every round, on the thread running them.
+  void setRoundListener(function<void(const TickStats&)> listener) { roundListener = std::move(listener); }
+  const TickStats& getStats() const { return stats; }
+  double getPeriod() const { return period; }
+
+ private:
+  void runRound(double scheduled);
+  void adapt(double seconds);
+
+  shared_ptr<IWorld> world;
+  TickOptions options;
+  Clock clock;
+  double period;
+  double budget;
+  bool started = false;
+  double next = 0;
+  size_t calmRounds = 0;
+  std::atomic<bool> running = false;
+  function<void(const TickStats&)> roundListener;
+  TickStats stats;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_TICK_HPP_
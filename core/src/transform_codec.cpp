@@ -0,0 +1,393 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "transform_codec.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <stdexcept>
+
+namespace core {
+
+namespace {
+
+constexpr double SQRT1_2 = 0.70710678118654752440;
+constexpr unsigned WIDTH_BITS = 7;
+
+uint64_t zigzag(int64_t value) {
+  return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+int64_t unzigzag(uint64_t value) {
+  return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+bool same(const int64_t* a, const int64_t* b) {
+  return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+void writeDeltas(BitWriter* out, const int64_t* value, const int64_t* base) {
+  uint64_t deltas[3];
+  uint64_t all = 0;
+  for (int i = 0; i < 3; i++) {
+    deltas[i] = zigzag(value[i] - base[i]);
+    all |= deltas[i];
+  }
+  auto width = static_cast<unsigned>(std::bit_width(all));
+  out->write(width, WIDTH_BITS);
+  for (int i = 0; i < 3; i++)
+    out->write(deltas[i], width);
+}
+
+void readDeltas(BitReader* in, int64_t* value, const int64_t* base) {
+  auto width = in->read(WIDTH_BITS);
+  if (width > 64)
+    throw std::runtime_error("Invalid transform frame");
+  for (int i = 0; i < 3; i++)
+    value[i] = base[i] + unzigzag(in->read(static_cast<unsigned>(width)));
+}
+
+// Smallest three: the sign is chosen so that the largest component is
+// positive, q and -q being the same rotation. Components map to
+// [0, 2 * half] with zero exactly at half, so identity round trips.
+uint64_t packRotation(const t::quatd& rotation, unsigned bits) {
+  auto unit = t::normalize(rotation);
+  if (t::dot(unit, unit) == 0)
+    unit = t::quatd{};
+  double components[4] = {unit.x, unit.y, unit.z, unit.w};
+  unsigned largest = 0;
+  for (unsigned i = 1; i < 4; i++)
+    if (std::abs(components[i]) > std::abs(components[largest]))
+      largest = i;
+  double sign = components[largest] < 0 ? -1 : 1;
+
+  auto half = (int64_t{1} << (bits - 1)) - 1;
+  uint64_t packed = largest;
+  unsigned shift = 2;
+  for (unsigned i = 0; i < 4; i++) {
+    if (i == largest)
+      continue;
+    auto value = std::clamp(components[i] * sign, -SQRT1_2, SQRT1_2);
+    packed |= static_cast<uint64_t>(std::llround(value / SQRT1_2 * half) + half) << shift;
+    shift += bits;
+  }
+  return packed;
+}
+
+t::quatd unpackRotation(uint64_t packed, unsigned bits) {
+  auto largest = packed & 3;
+  auto mask = (uint64_t{1} << bits) - 1;
+  auto half = (int64_t{1} << (bits - 1)) - 1;
+  double components[4];
+  double sum = 0;
+  unsigned shift = 2;
+  for (unsigned i = 0; i < 4; i++) {
+    if (i == largest)
+      continue;
+    auto quantized = static_cast<int64_t>((packed >> shift) & mask) - half;
+    auto value = std::clamp(static_cast<double>(quantized) / half, -1.0, 1.0) * SQRT1_2;
+    components[i] = value;
+    sum += value * value;
+    shift += bits;
+  }
+  components[largest] = std::sqrt(std::max(0.0, 1 - sum));
+  return t::normalize(t::quatd{components[0], components[1], components[2], components[3]});
+}
+
+void checkQuantization(const Quantization& quantization) {
+  if (quantization.rotationBits < 2 || quantization.rotationBits > 20)
+    throw std::runtime_error("Rotation bits must be between 2 and 20");
+  if (!(quantization.positionStep > 0) || !(quantization.scaleStep > 0))
+    throw std::runtime_error("Quantization steps must be positive");
+}
+
+const QuantizedTransform* findObject(const QuantizedFrame& frame, uint32_t id) {
+  auto found = std::lower_bound(frame.begin(), frame.end(), id,
+    [](const std::pair<uint32_t, QuantizedTransform>& entry, uint32_t id) { return entry.first < id; });
+  if (found == frame.end() || found->first != id)
+    return nullptr;
+  return &found->second;
+}
+
+// Walks both frames by id: changed(id, base or nullptr, object) for new or
+// different objects, removed(id) for the ones gone from current.
+template<typename Changed, typename Removed>
+void diff(const QuantizedFrame& base, const QuantizedFrame& current, Changed&& changed, Removed&& removed) {
+  size_t b = 0;
+  size_t c = 0;
+  while (b < base.size() || c < current.size()) {
+    if (c == current.size() || (b < base.size() && base[b].first < current[c].first)) {
+      removed(base[b].first);
+      b++;
+    } else if (b == base.size() || current[c].first < base[b].first) {
+      changed(current[c].first, nullptr, current[c].second);
+      c++;
+    } else {
+      if (!(base[b].second == current[c].second))
+        changed(current[c].first, &base[b].second, current[c].second);
+      b++;
+      c++;
+    }
+  }
+}
+
+}  // namespace
+
+QuantizedTransform quantize(const t::transform<double>& transform, const Quantization& quantization) {
+  checkQuantization(quantization);
+  QuantizedTransform result;
+  double position[3] = {transform.position.x, transform.position.y, transform.position.z};
+  double scale[3] = {transform.scale.x, transform.scale.y, transform.scale.z};
+  for (int i = 0; i < 3; i++) {
+    result.position[i] = std::llround(position[i] / quantization.positionStep);
+    result.scale[i] = std::llround(scale[i] / quantization.scaleStep);
+  }
+  result.rotation = packRotation(transform.rotation, quantization.rotationBits);
+  return result;
+}
+
+t::transform<double> dequantize(const QuantizedTransform& transform, const Quantization& quantization) {
+  t::transform<double> result;
+  auto step = quantization.positionStep;
+  result.position = t::double3{transform.position[0] * step, transform.position[1] * step, transform.position[2] * step};
+  result.rotation = unpackRotation(transform.rotation, quantization.rotationBits);
+  step = quantization.scaleStep;
+  result.scale = t::double3{transform.scale[0] * step, transform.scale[1] * step, transform.scale[2] * step};
+  return result;
+}
+
+// Bits
+
+void BitWriter::write(uint64_t value, unsigned bits) {
+  if (bits < 64)
+    value &= (uint64_t{1} << bits) - 1;
+  while (bits > 0) {
+    auto take = std::min(bits, 64 - pendingBits);
+    auto chunk = take == 64 ? value : value & ((uint64_t{1} << take) - 1);
+    pending |= chunk << pendingBits;
+    pendingBits += take;
+    value = take == 64 ? 0 : value >> take;
+    bits -= take;
+    while (pendingBits >= 8) {
+      bytes.push_back(static_cast<char>(pending & 0xff));
+      pending >>= 8;
+      pendingBits -= 8;
+    }
+  }
+}
+
+void BitWriter::writeVariable(uint64_t value) {
+  auto width = static_cast<unsigned>(std::bit_width(value));
+  write(width, WIDTH_BITS);
+  write(value, width);
+}
+
+string BitWriter::finish() {
+  if (pendingBits > 0)
+    bytes.push_back(static_cast<char>(pending & 0xff));
+  pending = 0;
+  pendingBits = 0;
+  return std::move(bytes);
+}
+
+uint64_t BitReader::read(unsigned bits) {
+  if (bits > 64 || position + bits > size * 8)
+    throw std::runtime_error("Truncated transform frame");
+  uint64_t result = 0;
+  unsigned done = 0;
+  while (done < bits) {
+    auto offset = static_cast<unsigned>(position % 8);
+    auto take = std::min(8 - offset, bits - done);
+    uint64_t chunk = (data[position / 8] >> offset) & ((1u << take) - 1);
+    result |= chunk << done;
+    done += take;
+    position += take;
+  }
+  return result;
+}
+
+uint64_t BitReader::readVariable() {
+  auto width = read(WIDTH_BITS);
+  if (width > 64)
+    throw std::runtime_error("Invalid transform frame");
+  return read(static_cast<unsigned>(width));
+}
+
+// Frames
+
+string TransformEncoder::encode(uint32_t frame, const vector<TransformState>& states) {
+  checkQuantization(quantization);
+  current.clear();
+  current.reserve(states.size());
+  for (auto const& state : states)
+    current.emplace_back(state.id, quantize(state.transform, quantization));
+  auto byId = [](const auto& a, const auto& b) { return a.first < b.first; };
+  if (!std::is_sorted(current.begin(), current.end(), byId))
+    std::sort(current.begin(), current.end(), byId);
+
+  static const QuantizedFrame none;
+  auto base = &none;
+  for (auto const& s : sent)
+    if (s.frame == baseline)
+      base = &s.objects;
+  auto baselineFrame = base == &none ? 0 : baseline;
+
+  uint64_t changedCount = 0;
+  uint64_t removedCount = 0;
+  diff(*base, current,
+    [&](uint32_t, const QuantizedTransform*, const QuantizedTransform&) { changedCount++; },
+    [&](uint32_t) { removedCount++; });
+
+  auto identity = quantize(t::transform<double>{}, quantization);
+  auto rotationBits = 2 + 3 * quantization.rotationBits;
+  BitWriter out;
+  out.write(frame, 32);
+  out.write(baselineFrame, 32);
+  out.writeVariable(changedCount);
+  out.writeVariable(removedCount);
+  uint64_t next = 0;
+  diff(*base, current,
+    [&](uint32_t id, const QuantizedTransform* previous, const QuantizedTransform& object) {
+      auto const& from = previous != nullptr ? *previous : identity;
+      out.writeVariable(id - next);
+      next = uint64_t{id} + 1;
+      bool position = !same(object.position, from.position);
+      bool rotation = object.rotation != from.rotation;
+      bool scale = !same(object.scale, from.scale);
+      out.write(position | rotation << 1 | scale << 2, 3);
+      if (position)
+        writeDeltas(&out, object.position, from.position);
+      if (rotation)
+        out.write(object.rotation, rotationBits);
+      if (scale)
+        writeDeltas(&out, object.scale, from.scale);
+    },
+    [](uint32_t) {});
+  next = 0;
+  diff(*base, current,
+    [](uint32_t, const QuantizedTransform*, const QuantizedTransform&) {},
+    [&](uint32_t id) {
+      out.writeVariable(id - next);
+      next = uint64_t{id} + 1;
+    });
+
+  sent.push_back(Sent{frame, std::move(current)});
+  current = QuantizedFrame();
+  while (sent.size() > MAX_FRAMES) {
+    if (sent.front().frame == baseline)
+      baseline = 0;
+    sent.pop_front();
+  }
+  return out.finish();
+}
+
+void TransformEncoder::acknowledge(uint32_t frame) {
+  if (frame <= baseline)
+    return;
+  auto kept = std::find_if(sent.begin(), sent.end(), [frame](const Sent& s) { return s.frame == frame; });
+  if (kept == sent.end())
+    return;
+  baseline = frame;
+  sent.erase(sent.begin(), kept);
+}
+
+vector<TransformState> TransformDecoder::decode(const string& packet) {
+  checkQuantization(quantization);
+  BitReader in(packet);
+  auto frame = static_cast<uint32_t>(in.read(32));
+  auto baselineFrame = static_cast<uint32_t>(in.read(32));
+
+  static const QuantizedFrame none;
+  auto base = &none;
+  if (baselineFrame != 0) {
+    auto found = std::find_if(received.begin(), received.end(),
+      [baselineFrame](const Received& r) { return r.frame == baselineFrame; });
+    if (found == received.end())
+      throw std::runtime_error("Unknown baseline frame " + std::to_string(baselineFrame));
+    base = &found->objects;
+  }
+
+  auto changedCount = in.readVariable();
+  auto removedCount = in.readVariable();
+  if (changedCount + removedCount > packet.size() * 8)
+    throw std::runtime_error("Invalid transform frame");
+
+  auto identity = quantize(t::transform<double>{}, quantization);
+  auto rotationBits = 2 + 3 * quantization.rotationBits;
+  QuantizedFrame changed;
+  changed.reserve(changedCount);
+  uint64_t next = 0;
+  for (uint64_t i = 0; i < changedCount; i++) {
+    auto id = next + in.readVariable();
+    if (id > UINT32_MAX)
+      throw std::runtime_error("Invalid transform frame");
+    next = id + 1;
+    auto previous = findObject(*base, static_cast<uint32_t>(id));
+    auto object = previous != nullptr ? *previous : identity;
+    auto fields = in.read(3);
+    if (fields & 1)
+      readDeltas(&in, object.position, object.position);
+    if (fields & 2)
+      object.rotation = in.read(rotationBits);
+    if (fields & 4)
+      readDeltas(&in, object.scale, object.scale);
+    changed.emplace_back(static_cast<uint32_t>(id), object);
+  }
+  vector<uint32_t> removed;
+  next = 0;
+  for (uint64_t i = 0; i < removedCount; i++) {
+    auto id = next + in.readVariable();
+    if (id > UINT32_MAX)
+      throw std::runtime_error("Invalid transform frame");
+    removed.push_back(static_cast<uint32_t>(id));
+    next = id + 1;
+  }
+
+  // Baseline, minus removed, with changed replaced or added.
+  QuantizedFrame objects;
+  objects.reserve(base->size() + changed.size());
+  size_t c = 0;
+  size_t r = 0;
+  for (auto const& entry : *base) {
+    while (c < changed.size() && changed[c].first < entry.first)
+      objects.push_back(changed[c++]);
+    while (r < removed.size() && removed[r] < entry.first)
+      r++;
+    if (c < changed.size() && changed[c].first == entry.first)
+      objects.push_back(changed[c++]);
+    else if (r == removed.size() || removed[r] != entry.first)
+      objects.push_back(entry);
+  }
+  while (c < changed.size())
+    objects.push_back(changed[c++]);
+
+  vector<TransformState> result;
+  result.reserve(objects.size());
+  for (auto const& [id, object] : objects)
+    result.push_back(TransformState{id, dequantize(object, quantization)});
+
+  // The sender only ever goes forward from the baseline it used.
+  while (!received.empty() && received.front().frame < baselineFrame)
+    received.pop_front();
+  received.push_back(Received{frame, std::move(objects)});
+  while (received.size() > MAX_FRAMES)
+    received.pop_front();
+  return result;
+}
+
+}  // namespace core
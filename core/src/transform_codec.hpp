@@ -0,0 +1,162 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_TRANSFORM_CODEC_HPP_
+#define CORE_SRC_TRANSFORM_CODEC_HPP_
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "types.hpp"
+
+using std::string;
+using std::vector;
+
+namespace core {
+
+// Lossy, bit packed encoding of object transforms, each frame relative to
+// the last frame the receiver acknowledged, so that only moved objects and
+// only their changed fields cost anything.
+//
+// Positions and scales become fixed point integers of a configurable
+// step, rotations are normalized then stored as their three smallest
+// components (the largest one follows from unit length) of rotationBits
+// each. Deltas of a field share one bit width: 7 bits of width, then
+// three zigzag values of that width.
+//
+// Frame layout, little endian bit order:
+//
+//   frame u32, baseline frame u32 (0 for none)
+//   changed count, removed count        (7 bit width + value)
+//   per changed object, by ascending id:
+//     id gap from the previous one      (7 bit width + value)
+//     changed fields: position, rotation, scale (1 bit each)
+//     position and scale deltas, rotation as 2 bit index + 3 components
+//   per removed object: id gap
+//
+// Objects missing from the baseline are encoded against the identity
+// transform.
+struct Quantization {
+  double positionStep = 1.0 / 1024;
+  double scaleStep = 1.0 / 1024;
+  // Bits per smallest-three component, 2 to 20.
+  unsigned rotationBits = 12;
+};
+
+struct TransformState {
+  uint32_t id;
+  t::transform<double> transform;
+};
+
+struct QuantizedTransform {
+  int64_t position[3] = {0, 0, 0};
+  uint64_t rotation = 0;
+  int64_t scale[3] = {0, 0, 0};
+
+  bool operator==(const QuantizedTransform&) const = default;
+};
+
+QuantizedTransform quantize(const t::transform<double>& transform, const Quantization& quantization);
+t::transform<double> dequantize(const QuantizedTransform& transform, const Quantization& quantization);
+
+class BitWriter {
+ public:
+  // Writes the low bits of value, at most 64.
+  void write(uint64_t value, unsigned bits);
+  // Value of any size as its bit width then its bits.
+  void writeVariable(uint64_t value);
+  // Pads the last byte with zeros and hands out the bytes.
+  string finish();
+  size_t bitCount() const { return bytes.size() * 8 + pendingBits; }
+
+ private:
+  string bytes;
+  uint64_t pending = 0;
+  unsigned pendingBits = 0;
+};
+
+class BitReader {
+ public:
+  BitReader(const char* data, size_t size) : data{reinterpret_cast<const uint8_t*>(data)}, size{size} {}
+  explicit BitReader(const string& data) : BitReader(data.data(), data.size()) {}
+
+  // Throws std::runtime_error past the end.
+  uint64_t read(unsigned bits);
+  uint64_t readVariable();
+
+ private:
+  const uint8_t* data;
+  size_t size;
+  size_t position = 0;
+};
+
+using QuantizedFrame = vector<std::pair<uint32_t, QuantizedTransform>>;
+
+// Sender side: keeps the frames not acknowledged yet, at most MAX_FRAMES.
+class TransformEncoder {
+ public:
+  static constexpr size_t MAX_FRAMES = 64;
+
+  explicit TransformEncoder(const Quantization& quantization = {}) : quantization{quantization} {}
+
+  // Frame numbers start at 1 and increase. states hold the whole set of
+  // objects, in any order, with unique ids.
+  string encode(uint32_t frame, const vector<TransformState>& states);
+  // Later frames are encoded against this one, unless a newer one was
+  // acknowledged already or it is no longer kept.
+  void acknowledge(uint32_t frame);
+  uint32_t getBaseline() const { return baseline; }
+
+ private:
+  struct Sent {
+    uint32_t frame;
+    QuantizedFrame objects;
+  };
+
+  Quantization quantization;
+  std::deque<Sent> sent;
+  uint32_t baseline = 0;
+  QuantizedFrame current;
+};
+
+// Receiver side: keeps the decoded frames a later one may refer to.
+class TransformDecoder {
+ public:
+  static constexpr size_t MAX_FRAMES = 64;
+
+  explicit TransformDecoder(const Quantization& quantization = {}) : quantization{quantization} {}
+
+  // The whole set of objects of the frame, by ascending id. Throws
+  // std::runtime_error if the baseline is unknown here, the sender then
+  // has to start over from a frame without one.
+  vector<TransformState> decode(const string& packet);
+
+ private:
+  struct Received {
+    uint32_t frame;
+    QuantizedFrame objects;
+  };
+
+  Quantization quantization;
+  std::deque<Received> received;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_TRANSFORM_CODEC_HPP_
@@ -18,106 +18,234 @@
 #ifndef CORE_SRC_TYPES_HPP_
 #define CORE_SRC_TYPES_HPP_
 
+#include <cmath>
+#include <type_traits>
+
+// Plain vector math types. Everything here is an aggregate of floats or
+// doubles: trivially copyable, usable in constexpr code and safe to copy
+// around in bulk. Four wide types are aligned to their full size so that
+// they load into a single SIMD register (or a pair, for doubles).
+// Batch kernels over arrays of them live in math.hpp.
 namespace t {
 
-class double2 {
- public:
-  explicit double2(double x = 0, double y = 0) : x{x}, y{y} {}
-  ~double2() {}
+template <typename T>
+struct vec2 {
+  T x = 0;
+  T y = 0;
 
-  double x, y;
+  constexpr bool operator==(const vec2&) const = default;
 };
 
-class double3 : public double2 {
- public:
-  explicit double3(double x = 0, double y = 0, double z = 0) : double2(x, y), z{z} {}
-  virtual ~double3() {}
-
-  double z;
+template <typename T>
+struct vec3 {
+  T x = 0;
+  T y = 0;
+  T z = 0;
+
+  constexpr bool operator==(const vec3&) const = default;
+  constexpr vec3 operator+(const vec3& o) const { return vec3{x + o.x, y + o.y, z + o.z}; }
+  constexpr vec3 operator-(const vec3& o) const { return vec3{x - o.x, y - o.y, z - o.z}; }
+  // Component wise, as needed to apply a scale.
+  constexpr vec3 operator*(const vec3& o) const { return vec3{x * o.x, y * o.y, z * o.z}; }
+  constexpr vec3 operator*(T s) const { return vec3{x * s, y * s, z * s}; }
 };
 
-class double4 : public double3 {
- public:
-  explicit double4(double x = 0, double y = 0, double z = 0, double w = 0) : double3(x, y, z), w{w} {}
-  virtual ~double4() {}
+template <typename T>
+struct alignas(4 * sizeof(T)) vec4 {
+  T x = 0;
+  T y = 0;
+  T z = 0;
+  T w = 0;
 
-  double w;
+  constexpr bool operator==(const vec4&) const = default;
 };
 
-class position : public double3 {
- public:
-  explicit position(double x = 0, double y = 0, double z = 0) : double3(x, y, z) {}
-  ~position() {}
-
-  bool operator==(const double3& other) const {
-    if (this->x != other.x)
-      return false;
-    if (this->y != other.y)
-      return false;
-    return this->z == other.z;
+// Stored x, y, z (vector part) then w (scalar part).
+template <typename T>
+struct alignas(4 * sizeof(T)) quat {
+  T x = 0;
+  T y = 0;
+  T z = 0;
+  T w = 1;
+
+  constexpr bool operator==(const quat&) const = default;
+  // Kept from the old rotation type: takes the vector part, zeroes w.
+  constexpr quat& operator=(const vec3<T>& v) {
+    x = v.x;
+    y = v.y;
+    z = v.z;
+    w = 0;
+    return *this;
   }
-
-  position& operator=(double3 other) {
-    this->x = other.x;
-    this->y = other.y;
-    this->z = other.z;
+  constexpr quat& operator=(const vec4<T>& v) {
+    x = v.x;
+    y = v.y;
+    z = v.z;
+    w = v.w;
     return *this;
   }
 };
 
-class rotation : public double4 {
- public:
-  explicit rotation(double x = 0, double y = 0, double z = 0, double w = 0) : double4(x, y, z, w) {}
-  ~rotation() {}
-
-  bool operator==(const double4& other) const {
-    if (this->x != other.x)
-      return false;
-    if (this->y != other.y)
-      return false;
-    if (this->z != other.z)
-      return false;
-    return this->w == other.w;
-  }
-
-  rotation& operator=(double3 other) {
-    this->x = other.x;
-    this->y = other.y;
-    this->z = other.z;
-    this->w = 0;
-    return *this;
-  }
+// Column major, m[column * 4 + row], as OpenGL expects it.
+template <typename T>
+struct alignas(4 * sizeof(T)) mat4 {
+  T m[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
 
-  rotation& operator=(double4 other) {
-    this->x = other.x;
-    this->y = other.y;
-    this->z = other.z;
-    this->w = other.w;
-    return *this;
-  }
+  constexpr bool operator==(const mat4&) const = default;
+  constexpr T& operator()(int row, int column) { return m[column * 4 + row]; }
+  constexpr T operator()(int row, int column) const { return m[column * 4 + row]; }
 };
 
-class scale : public double3 {
- public:
-  explicit scale(double x = 1, double y = 1, double z = 1) : double3(x, y, z) {}
-  ~scale() {}
-
-  bool operator==(const double3& other) const {
-    if (this->x != other.x)
-      return false;
-    if (this->y != other.y)
-      return false;
-    return this->z == other.z;
-  }
+// Scale first, then rotation, then translation.
+template <typename T>
+struct transform {
+  vec3<T> position;
+  quat<T> rotation;
+  vec3<T> scale = vec3<T>{1, 1, 1};
 
-  scale& operator=(double3 other) {
-    this->x = other.x;
-    this->y = other.y;
-    this->z = other.z;
+  constexpr bool operator==(const transform&) const = default;
+};
+
+using float2 = vec2<float>;
+using float3 = vec3<float>;
+using float4 = vec4<float>;
+using double2 = vec2<double>;
+using double3 = vec3<double>;
+using double4 = vec4<double>;
+using quatf = quat<float>;
+using quatd = quat<double>;
+using mat4f = mat4<float>;
+using mat4d = mat4<double>;
+
+// Object transform components. Rotations default to the identity, so a
+// missing w is 1: t::rotation{} is {0, 0, 0, 1}. Objects themselves still
+// start from the zero quaternion, see ObjectStore.
+using position = double3;
+using rotation = quatd;
+
+// Every component defaults to 1: t::scale{} is {1, 1, 1} and t::scale{2}
+// is {2, 1, 1}. Converts to double3 for the math.
+struct scale {
+  double x = 1;
+  double y = 1;
+  double z = 1;
+
+  constexpr bool operator==(const scale&) const = default;
+  constexpr scale& operator=(const double3& v) {
+    x = v.x;
+    y = v.y;
+    z = v.z;
     return *this;
   }
+  constexpr operator double3() const { return double3{x, y, z}; }
 };
 
+template <typename T>
+constexpr T dot(const vec3<T>& a, const vec3<T>& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+template <typename T>
+constexpr vec3<T> cross(const vec3<T>& a, const vec3<T>& b) {
+  return vec3<T>{a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x};
+}
+
+template <typename T>
+T length(const vec3<T>& v) { return std::sqrt(dot(v, v)); }
+
+template <typename T>
+constexpr T dot(const quat<T>& a, const quat<T>& b) { return a.x * b.x + a.y * b.y + a.z * b.z + a.w * b.w; }
+
+template <typename T>
+constexpr quat<T> conjugate(const quat<T>& q) { return quat<T>{-q.x, -q.y, -q.z, q.w}; }
+
+// Hamilton product: rotating by the result rotates by b, then by a.
+template <typename T>
+constexpr quat<T> operator*(const quat<T>& a, const quat<T>& b) {
+  return quat<T>{
+    a.w * b.x + a.x * b.w + a.y * b.z - a.z * b.y,
+    a.w * b.y - a.x * b.z + a.y * b.w + a.z * b.x,
+    a.w * b.z + a.x * b.y - a.y * b.x + a.z * b.w,
+    a.w * b.w - a.x * b.x - a.y * b.y - a.z * b.z
+  };
+}
+
+// Zero quaternions are returned unchanged.
+template <typename T>
+quat<T> normalize(const quat<T>& q) {
+  auto squared = dot(q, q);
+  if (squared == 0)
+    return q;
+  auto inverse = 1 / std::sqrt(squared);
+  return quat<T>{q.x * inverse, q.y * inverse, q.z * inverse, q.w * inverse};
+}
+
+// Expects a unit quaternion.
+template <typename T>
+constexpr vec3<T> rotate(const quat<T>& q, const vec3<T>& v) {
+  auto u = vec3<T>{q.x, q.y, q.z};
+  auto t = cross(u, v) * 2;
+  return v + t * q.w + cross(u, t);
+}
+
+// Transform of child expressed in the parent's space.
+template <typename T>
+constexpr transform<T> compose(const transform<T>& parent, const transform<T>& child) {
+  return transform<T>{
+    parent.position + rotate(parent.rotation, parent.scale * child.position),
+    parent.rotation * child.rotation,
+    parent.scale * child.scale
+  };
+}
+
+template <typename T>
+constexpr mat4<T> toMatrix(const transform<T>& tr) {
+  auto const& q = tr.rotation;
+  auto const& s = tr.scale;
+  mat4<T> r;
+  r(0, 0) = (1 - 2 * (q.y * q.y + q.z * q.z)) * s.x;
+  r(1, 0) = (2 * (q.x * q.y + q.z * q.w)) * s.x;
+  r(2, 0) = (2 * (q.x * q.z - q.y * q.w)) * s.x;
+  r(0, 1) = (2 * (q.x * q.y - q.z * q.w)) * s.y;
+  r(1, 1) = (1 - 2 * (q.x * q.x + q.z * q.z)) * s.y;
+  r(2, 1) = (2 * (q.y * q.z + q.x * q.w)) * s.y;
+  r(0, 2) = (2 * (q.x * q.z + q.y * q.w)) * s.z;
+  r(1, 2) = (2 * (q.y * q.z - q.x * q.w)) * s.z;
+  r(2, 2) = (1 - 2 * (q.x * q.x + q.y * q.y)) * s.z;
+  r(0, 3) = tr.position.x;
+  r(1, 3) = tr.position.y;
+  r(2, 3) = tr.position.z;
+  return r;
+}
+
+template <typename T>
+constexpr mat4<T> operator*(const mat4<T>& a, const mat4<T>& b) {
+  mat4<T> r;
+  for (int row = 0; row < 4; row++) {
+    for (int column = 0; column < 4; column++) {
+      T sum = 0;
+      for (int k = 0; k < 4; k++)
+        sum += a(row, k) * b(k, column);
+      r(row, column) = sum;
+    }
+  }
+  return r;
+}
+
+template <typename T>
+constexpr vec3<T> transformPoint(const mat4<T>& m, const vec3<T>& p) {
+  return vec3<T>{
+    m(0, 0) * p.x + m(0, 1) * p.y + m(0, 2) * p.z + m(0, 3),
+    m(1, 0) * p.x + m(1, 1) * p.y + m(1, 2) * p.z + m(1, 3),
+    m(2, 0) * p.x + m(2, 1) * p.y + m(2, 2) * p.z + m(2, 3)
+  };
+}
+
+static_assert(std::is_trivially_copyable_v<double3> && std::is_standard_layout_v<double3>);
+static_assert(std::is_trivially_copyable_v<quatd> && sizeof(quatd) == 32 && alignof(quatd) == 32);
+static_assert(std::is_trivially_copyable_v<quatf> && sizeof(quatf) == 16 && alignof(quatf) == 16);
+static_assert(std::is_trivially_copyable_v<mat4d> && sizeof(mat4d) == 128);
+static_assert(sizeof(double3) == 24 && sizeof(float3) == 12);
+static_assert(std::is_trivially_copyable_v<scale> && sizeof(scale) == 24);
+
 }  // namespace t
 
 #endif  // CORE_SRC_TYPES_HPP_
@@ -0,0 +1,253 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#ifndef CORE_SRC_UPDATE_QUEUE_HPP_
+#define CORE_SRC_UPDATE_QUEUE_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+
+#include "store.hpp"
+#include "types.hpp"
+
+using std::string;
+using std::vector;
+using std::shared_ptr;
+
+namespace core {
+
+class IPlugin;
+
+// Commands are plain values: transform updates carry everything inline so
+// that queueing them never touches the heap. Structural commands (create,
+// plugins) own strings or pointers and are expected to be rare.
+namespace command {
+
+struct SetPosition {
+  ObjectHandle object;
+  t::position position;
+};
+
+struct SetRotation {
+  ObjectHandle object;
+  t::rotation rotation;
+};
+
+struct SetScale {
+  ObjectHandle object;
+  t::scale scale;
+};
+
+struct CreateObject {
+  string id;
+  t::position position = t::position{0, 0, 0};
+  t::rotation rotation = t::rotation{0, 0, 0, 0};
+  t::scale scale = t::scale{1, 1, 1};
+  vector<shared_ptr<IPlugin>> plugins;
+};
+
+struct DeleteObject {
+  ObjectHandle object;
+};
+
+// Adds the plugin, replacing any plugin with the same id.
+struct AttachPlugin {
+  ObjectHandle object;
+  shared_ptr<IPlugin> plugin;
+};
+
+struct RemovePlugin {
+  ObjectHandle object;
+  string pluginId;
+};
+
+}  // namespace command
+
+using UpdateCommand = std::variant<
+  command::SetPosition,
+  command::SetRotation,
+  command::SetScale,
+  command::CreateObject,
+  command::DeleteObject,
+  command::AttachPlugin,
+  command::RemovePlugin>;
+
+// Bounded multi producer single consumer ring buffer (Vyukov style).
+// Every cell carries a sequence number telling producers and the consumer
+// whose turn it is, so a push is a single CAS on the write cursor.
+template <typename T>
+class RingBuffer {
+ public:
+  // Capacity is rounded up to a power of two.
+  explicit RingBuffer(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity)
+      size <<= 1;
+    cells = vector<Cell>(size);
+    mask = size - 1;
+    for (size_t i = 0; i < size; i++)
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  size_t capacity() const { return cells.size(); }
+
+  // Any thread. Returns false when the buffer is full.
+  bool tryPush(T&& value) {
+    auto pos = writePos.load(std::memory_order_relaxed);
+    Cell* cell;
+    while (true) {
+      cell = &cells[pos & mask];
+      auto sequence = cell->sequence.load(std::memory_order_acquire);
+      auto diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (writePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = writePos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = std::move(value);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer thread only.
+  bool tryPop(T* value) {
+    auto pos = readPos.load(std::memory_order_relaxed);
+    auto& cell = cells[pos & mask];
+    auto sequence = cell.sequence.load(std::memory_order_acquire);
+    if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1) < 0)
+      return false;
+    *value = std::move(cell.value);
+    // Drop whatever the moved-from value still owns.
+    cell.value = T{};
+    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+    readPos.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Positions handed out to producers so far, published or not.
+  size_t claimed() const { return writePos.load(std::memory_order_seq_cst); }
+  size_t consumed() const { return readPos.load(std::memory_order_relaxed); }
+
+  // Approximate while producers are active.
+  size_t size() const {
+    auto write = writePos.load(std::memory_order_acquire);
+    auto read = readPos.load(std::memory_order_relaxed);
+    return write > read ? write - read : 0;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  vector<Cell> cells;
+  size_t mask;
+  alignas(64) std::atomic<size_t> writePos = 0;
+  alignas(64) std::atomic<size_t> readPos = 0;
+};
+
+// Commands waiting to be applied to the world. Enqueue is lock free from
+// any thread while the ring has room; when it fills up commands spill to a
+// locked overflow list, and keep going there until the consumer catches up
+// so that each producer's commands stay in order.
+class UpdateQueue {
+ public:
+  // Every cell holds a whole command, a few hundred kilobytes per world.
+  // Larger bursts spill to the overflow list, which grows as needed.
+  static constexpr size_t DEFAULT_CAPACITY = 1 << 10;
+
+  explicit UpdateQueue(size_t capacity = DEFAULT_CAPACITY) : ring{capacity} {}
+
+  void enqueue(UpdateCommand command) {
+    if (!overflowing.load(std::memory_order_seq_cst) && ring.tryPush(std::move(command)))
+      return;
+    std::lock_guard<std::mutex> guard(overflowLock);
+    overflow.push_back(std::move(command));
+    overflowing.store(true, std::memory_order_seq_cst);
+    overflowSize.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Lock free, approximate while producers are active.
+  bool empty() const { return size() == 0; }
+  size_t size() const { return ring.size() + overflowSize.load(std::memory_order_relaxed); }
+
+  // Consumer thread only. Hands commands to the handler in enqueue order
+  // and returns how many were processed. The limit applies to the ring,
+  // once spilled commands are reached they are flushed all together.
+  template <typename Handler>
+  size_t drain(Handler&& handler, size_t max = SIZE_MAX) {
+    size_t processed = 0;
+    while (processed < max && ring.tryPop(&current)) {
+      handler(current);
+      processed++;
+    }
+    current = UpdateCommand{};
+    if (processed == max || !overflowing.load(std::memory_order_acquire))
+      return processed;
+
+    size_t claimedBeforeSpill;
+    {
+      std::lock_guard<std::mutex> guard(overflowLock);
+      spilled.swap(overflow);
+      overflowing.store(false, std::memory_order_seq_cst);
+      claimedBeforeSpill = ring.claimed();
+    }
+    // Ring slots claimed before the flag was cleared may precede spilled
+    // commands of the same producer: they go first, waiting for producers
+    // that claimed a slot but did not publish it yet.
+    while (ring.consumed() < claimedBeforeSpill) {
+      if (ring.tryPop(&current)) {
+        handler(current);
+        processed++;
+      } else {
+        std::this_thread::yield();
+      }
+    }
+    current = UpdateCommand{};
+    for (auto& command : spilled) {
+      handler(command);
+      processed++;
+    }
+    overflowSize.fetch_sub(spilled.size(), std::memory_order_relaxed);
+    spilled.clear();
+    return processed;
+  }
+
+ private:
+  RingBuffer<UpdateCommand> ring;
+  UpdateCommand current;
+  std::atomic<bool> overflowing = false;
+  std::atomic<size_t> overflowSize = 0;
+  std::mutex overflowLock;
+  vector<UpdateCommand> overflow;
+  vector<UpdateCommand> spilled;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_UPDATE_QUEUE_HPP_
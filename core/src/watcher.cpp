@@ -0,0 +1,191 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "watcher.hpp"
+#include <chrono>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "log.hpp"
+#include "scripting.hpp"
+
+using std::ifstream;
+using std::stringstream;
+namespace fs = std::filesystem;
+
+namespace core {
+
+#ifdef __linux__
+
+FileWatcher::FileWatcher(const string& directory) : directory{directory} {
+  fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd >= 0 && inotify_add_watch(fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    close(fd);
+    fd = -1;
+  }
+}
+
+FileWatcher::~FileWatcher() {
+  if (fd >= 0)
+    close(fd);
+}
+
+bool FileWatcher::valid() const { return fd >= 0; }
+
+bool FileWatcher::wait(double timeout, vector<string>* out) {
+  if (fd < 0) {
+    std::this_thread::sleep_for(std::chrono::duration<double>(timeout));
+    return false;
+  }
+  pollfd ready{fd, POLLIN, 0};
+  if (poll(&ready, 1, static_cast<int>(timeout * 1000)) <= 0)
+    return false;
+
+  auto found = false;
+  alignas(inotify_event) char buffer[4096];
+  ssize_t length;
+  while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+    for (char* at = buffer; at < buffer + length;) {
+      auto event = reinterpret_cast<const inotify_event*>(at);
+      if (event->len > 0 && !(event->mask & IN_ISDIR)) {
+        out->push_back(event->name);
+        found = true;
+      }
+      at += sizeof(inotify_event) + event->len;
+    }
+  }
+  return found;
+}
+
+#else
+
+FileWatcher::FileWatcher(const string& directory) : directory{directory} {}
+
+FileWatcher::~FileWatcher() {}
+
+bool FileWatcher::valid() const { return fs::is_directory(directory); }
+
+bool FileWatcher::wait(double timeout, vector<string>* out) {
+  auto size = out->size();
+  if (!scanned) {
+    scan(nullptr);
+    scanned = true;
+  }
+  std::this_thread::sleep_for(std::chrono::duration<double>(timeout));
+  scan(out);
+  return out->size() > size;
+}
+
+void FileWatcher::scan(vector<string>* out) {
+  std::error_code error;
+  for (auto const& entry : fs::directory_iterator(directory, error)) {
+    if (!entry.is_regular_file(error))
+      continue;
+    auto name = entry.path().filename().string();
+    auto time = entry.last_write_time(error);
+    auto& known = times[name];
+    if (known != time && out != nullptr)
+      out->push_back(name);
+    known = time;
+  }
+}
+
+#endif
+
+static bool readFile(const string& path, string* content) {
+  ifstream file(path);
+  if (!file)
+    return false;
+  stringstream buffer;
+  buffer << file.rdbuf();
+  *content = buffer.str();
+  return true;
+}
+
+ScriptReloader::ScriptReloader(const string& directory, Check check)
+  : directory{directory}, check{std::move(check)}, watcher{directory} {
+  if (this->check == nullptr)
+    this->check = [](const string& file, const string& source) { Scripts::asPlugin(file, source); };
+  if (!watcher.valid())
+    Log::error("Cannot watch " + directory + ", scripts will not reload");
+  // What is there now counts as loaded already.
+  std::error_code error;
+  for (auto const& entry : fs::directory_iterator(directory, error)) {
+    if (entry.is_regular_file(error))
+      readFile(entry.path().string(), &sources[entry.path().filename().string()]);
+  }
+  thread = std::thread([this] { run(); });
+}
+
+ScriptReloader::~ScriptReloader() {
+  stopping = true;
+  thread.join();
+}
+
+void ScriptReloader::take(vector<ScriptReload>* out) {
+  std::lock_guard<std::mutex> guard(lock);
+  for (auto& reload : ready)
+    out->push_back(std::move(reload));
+  ready.clear();
+}
+
+ReloadStats ScriptReloader::getStats() const {
+  return ReloadStats{reloaded, failed};
+}
+
+void ScriptReloader::run() {
+  vector<string> changed;
+  while (!stopping) {
+    if (!watcher.wait(POLL_SECONDS, &changed))
+      continue;
+    while (!stopping && watcher.wait(QUIET_SECONDS, &changed)) {}
+    for (auto const& file : std::set<string>(changed.begin(), changed.end()))
+      reload(file);
+    changed.clear();
+  }
+}
+
+// Compile errors are reported and otherwise ignored, the file reloads
+// again once it is fixed.
+void ScriptReloader::reload(const string& file) {
+  string source;
+  if (!readFile(directory + "/" + file, &source))
+    return;
+  auto known = sources.find(file);
+  if (known != sources.end() && known->second == source)
+    return;
+  sources[file] = source;
+  try {
+    check(file, source);
+  } catch (const std::exception& e) {
+    Log::error("Script " + file + " not reloaded: " + e.what());
+    failed++;
+    return;
+  }
+  reloaded++;
+  std::lock_guard<std::mutex> guard(lock);
+  ready.push_back(ScriptReload{file, std::move(source)});
+}
+
+}  // namespace core
@@ -0,0 +1,119 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORE_SRC_WATCHER_HPP_
+#define CORE_SRC_WATCHER_HPP_
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+namespace core {
+
+// Files written to a directory, not recursive. Uses inotify on Linux and
+// compares modification times on each poll elsewhere. Files are reported
+// once closed after writing or moved in, so editors saving through a
+// temporary file show up as the file they replace.
+class FileWatcher {
+ public:
+  explicit FileWatcher(const string& directory);
+  ~FileWatcher();
+  FileWatcher(const FileWatcher&) = delete;
+  FileWatcher& operator=(const FileWatcher&) = delete;
+
+  // Waits up to timeout seconds for changes and appends the names of the
+  // changed files to out. Returns whether there were any.
+  bool wait(double timeout, vector<string>* out);
+  // False when the directory could not be watched, wait() then only sleeps.
+  bool valid() const;
+
+ private:
+  string directory;
+#ifdef __linux__
+  int fd = -1;
+#else
+  void scan(vector<string>* out);
+  std::map<string, std::filesystem::file_time_type> times;
+  bool scanned = false;
+#endif
+};
+
+// A script file changed on disk and compiled fine.
+struct ScriptReload {
+  // Name of the file, <object id>_<plugin id>.
+  string file;
+  string source;
+};
+
+struct ReloadStats {
+  uint64_t reloaded = 0;
+  // Changes left out for not compiling, their previous version stays.
+  uint64_t failed = 0;
+};
+
+// Compiles the scripts of a directory on a background thread as they
+// change, and hands over the ones that compile. Changes are collected
+// until the directory is quiet for a moment, so a file written in several
+// steps compiles once. Files written with the content already seen are
+// skipped.
+class ScriptReloader {
+ public:
+  // Throws when the source does not compile.
+  using Check = std::function<void(const string& file, const string& source)>;
+
+  // Without a check sources compile as scripts, which also leaves their
+  // bytecode in the cache for when they first run.
+  explicit ScriptReloader(const string& directory, Check check = nullptr);
+  ~ScriptReloader();
+
+  // Appends to out the reloads ready since the last call. Safe from any thread.
+  void take(vector<ScriptReload>* out);
+  ReloadStats getStats() const;
+
+ private:
+  static constexpr double POLL_SECONDS = 0.1;
+  static constexpr double QUIET_SECONDS = 0.05;
+
+  void run();
+  void reload(const string& file);
+
+  string directory;
+  Check check;
+  FileWatcher watcher;
+  // Last content seen of each file, only touched by the thread.
+  std::map<string, string> sources;
+  std::mutex lock;
+  vector<ScriptReload> ready;
+  std::atomic<uint64_t> reloaded = 0;
+  std::atomic<uint64_t> failed = 0;
+  std::atomic<bool> stopping = false;
+  std::thread thread;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_WATCHER_HPP_
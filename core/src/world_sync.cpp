@@ -0,0 +1,502 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "world_sync.hpp"
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+#include "compress.hpp"
+#include "journal.hpp"
+#include "profiler.hpp"
+
+namespace core {
+
+using namespace world_sync;
+
+namespace {
+
+template<typename T>
+void put(string* out, T value) { out->append(reinterpret_cast<const char*>(&value), sizeof(T)); }
+
+class Reader {
+ public:
+  Reader(const char* data, size_t size) : data{data}, size{size} {}
+
+  template<typename T>
+  T get() {
+    T value;
+    memcpy(&value, take(sizeof(T)), sizeof(T));
+    return value;
+  }
+  string getShortString() {
+    auto length = get<uint16_t>();
+    return string(take(length), length);
+  }
+
+ private:
+  const char* take(size_t bytes) {
+    if (size - position < bytes)
+      throw std::runtime_error("Truncated sync datagram");
+    auto result = data + position;
+    position += bytes;
+    return result;
+  }
+
+  const char* data;
+  size_t size;
+  size_t position = 0;
+};
+
+void putHeader(string* datagram, Kind kind, uint16_t count, uint64_t session) {
+  datagram->assign(MAGIC, sizeof(MAGIC));
+  put(datagram, VERSION);
+  put(datagram, static_cast<uint8_t>(kind));
+  put(datagram, count);
+  put(datagram, session);
+}
+
+struct Header {
+  Kind kind;
+  uint16_t count;
+  uint64_t session;
+};
+
+Header getHeader(const string& datagram, const string& from) {
+  if (datagram.size() < HEADER_SIZE || memcmp(datagram.data(), MAGIC, sizeof(MAGIC)) != 0)
+    throw std::runtime_error("Not a sync datagram from " + from);
+  Reader in(datagram.data() + sizeof(MAGIC), HEADER_SIZE - sizeof(MAGIC));
+  if (in.get<uint8_t>() != VERSION)
+    throw std::runtime_error("Unsupported sync version from " + from);
+  Header header;
+  header.kind = static_cast<Kind>(in.get<uint8_t>());
+  header.count = in.get<uint16_t>();
+  header.session = in.get<uint64_t>();
+  return header;
+}
+
+}  // namespace
+
+// Server
+
+WorldSyncServer::WorldSyncServer(shared_ptr<IWorld> world, shared_ptr<Transport> transport, Replicator* replicator,
+    const SyncOptions& options)
+  : world{world}, transport{transport}, replicator{replicator}, options{options} {}
+
+void WorldSyncServer::poll(Clock::time_point now) {
+  CORE_PROFILE_SCOPE("sync server poll");
+  latest.reset();
+  while (transport->receive(&from, &incoming))
+    receive(from, incoming, now);
+  for (auto join = joins.begin(); join != joins.end();) {
+    auto const& session = join->second;
+    auto expired = now - session.lastUsed >= options.sessionTimeout
+      || (!session.proven && now - session.started >= options.handshakeTimeout);
+    auto next = std::next(join);
+    if (expired)
+      end(join->first);
+    join = next;
+  }
+  if (replicator != nullptr)
+    tellLost(now);
+}
+
+size_t WorldSyncServer::images() const {
+  std::unordered_set<const Image*> held;
+  for (auto const& [session, join] : joins)
+    held.insert(join.image.get());
+  return held.size();
+}
+
+// Until they join again, over and over as datagrams get lost. Joiners lost
+// while loading start over too: their session goes.
+void WorldSyncServer::tellLost(Clock::time_point now) {
+  lostPeers.clear();
+  replicator->takeLostPeers(&lostPeers);
+  for (auto const& address : lostPeers) {
+    std::erase_if(joins, [&](const auto& entry) { return entry.second.replicationAddress == address; });
+    auto joiner = joiners.find(address);
+    if (joiner != joiners.end())
+      joiner->second.lost = true;
+  }
+  for (auto& [address, joiner] : joiners) {
+    if (!joiner.lost || now - joiner.lastTold < options.retryAfter)
+      continue;
+    putHeader(&outgoing, UNKNOWN, 0, joiner.session);
+    send(joiner.address, outgoing);
+    joiner.lastTold = now;
+  }
+}
+
+void WorldSyncServer::receive(const string& from, const string& datagram, Clock::time_point now) {
+  stats.datagramsReceived++;
+  try {
+    auto header = getHeader(datagram, from);
+    Reader in(datagram.data() + HEADER_SIZE, datagram.size() - HEADER_SIZE);
+    if (header.kind == JOIN) {
+      join(from, in.getShortString(), now);
+      return;
+    }
+    if (header.kind != REQUEST && header.kind != DONE)
+      throw std::runtime_error("Unexpected sync datagram from " + from);
+
+    auto join = joins.find(header.session);
+    if (join == joins.end()) {
+      putHeader(&outgoing, UNKNOWN, 0, header.session);
+      send(from, outgoing);
+      return;
+    }
+    if (join->second.address != from)
+      throw std::runtime_error("Sync session of another joiner from " + from);
+    prove(header.session, &join->second);
+    if (header.kind == DONE) {
+      joins.erase(join);
+      return;
+    }
+    join->second.lastUsed = now;
+    auto const& chunks = join->second.image->chunks;
+    for (uint16_t i = 0; i < header.count; i++) {
+      auto chunk = in.get<uint32_t>();
+      if (chunk >= chunks.size())
+        throw std::runtime_error("Request for a missing chunk from " + from);
+      for (auto const& part : chunks[chunk]) {
+        outgoing = part;
+        memcpy(outgoing.data() + HEADER_SIZE - sizeof(uint64_t), &header.session, sizeof(uint64_t));
+        send(from, outgoing);
+      }
+      stats.chunksSent++;
+    }
+  } catch (const std::exception&) {
+    stats.malformed++;
+  }
+}
+
+// Joins repeated while the manifest is on its way get the same session.
+void WorldSyncServer::join(const string& from, const string& replicationAddress, Clock::time_point now) {
+  for (auto& [session, join] : joins) {
+    if (join.address == from) {
+      join.lastUsed = now;
+      sendManifest(session, join);
+      return;
+    }
+  }
+
+  auto sequence = replicator != nullptr ? replicator->getSequence() : 0;
+  auto shared = latest != nullptr && latest->sequence == sequence;
+  if (joins.size() >= options.maxJoiners || (!shared && images() >= options.maxImages)) {
+    stats.joinsDeferred++;
+    return;
+  }
+  if (!shared)
+    latest = takeImage();
+
+  std::random_device device;
+  uint64_t session;
+  do {
+    session = (static_cast<uint64_t>(device()) << 32) | device();
+  } while (session == 0 || joins.contains(session));
+
+  auto& join = joins[session];
+  join.address = from;
+  join.image = latest;
+  join.started = now;
+  join.lastUsed = now;
+  // Taken between rounds, the image holds every update before this point.
+  if (replicator != nullptr && !replicationAddress.empty()) {
+    join.replicationAddress = replicationAddress;
+    join.held = replicator->holdPeer(replicationAddress);
+  }
+  sendManifest(session, join);
+}
+
+shared_ptr<const WorldSyncServer::Image> WorldSyncServer::takeImage() {
+  CORE_PROFILE_SCOPE("sync image");
+  auto image = std::make_shared<Image>();
+  auto batches = world->saveBatches(options.chunkBytes);
+  image->objects = static_cast<uint32_t>(world->objectCount());
+  image->sequence = replicator != nullptr ? replicator->getSequence() : 0;
+  string compressed;
+  auto partSize = options.maxDatagram > HEADER_SIZE + CHUNK_HEADER_SIZE
+    ? options.maxDatagram - HEADER_SIZE - CHUNK_HEADER_SIZE : 1;
+  for (uint32_t chunk = 0; chunk < batches.size(); chunk++) {
+    auto const& batch = batches[chunk];
+    compressed.clear();
+    compress(batch, &compressed);
+    stats.bytesRaw += batch.size();
+    stats.bytesCompressed += compressed.size();
+
+    auto parts = std::max<size_t>((compressed.size() + partSize - 1) / partSize, 1);
+    if (parts > UINT16_MAX)
+      throw std::runtime_error("Chunk too large to sync, lower chunkBytes or raise maxDatagram");
+    auto checksum = Journals::checksum(batch);
+    auto& datagrams = image->chunks.emplace_back();
+    for (size_t part = 0; part < parts; part++) {
+      auto& datagram = datagrams.emplace_back();
+      putHeader(&datagram, CHUNK, 0, 0);
+      put(&datagram, chunk);
+      put(&datagram, static_cast<uint16_t>(part));
+      put(&datagram, static_cast<uint16_t>(parts));
+      put(&datagram, static_cast<uint32_t>(batch.size()));
+      put(&datagram, checksum);
+      datagram.append(compressed, part * partSize, partSize);
+    }
+  }
+  stats.images++;
+  return image;
+}
+
+// The joiner got the manifest at the address it joined from: replication
+// can start sending to it.
+void WorldSyncServer::prove(uint64_t session, Session* join) {
+  if (join->proven)
+    return;
+  join->proven = true;
+  if (join->replicationAddress.empty())
+    return;
+  joiners[join->replicationAddress] = Joiner{join->address, session};
+  if (join->held)
+    replicator->addPeer(join->replicationAddress);
+}
+
+// Sessions that go without being proven take their held peer along.
+void WorldSyncServer::end(uint64_t session) {
+  auto join = joins.find(session);
+  if (!join->second.proven && join->second.held)
+    replicator->removePeer(join->second.replicationAddress);
+  joins.erase(join);
+}
+
+void WorldSyncServer::sendManifest(uint64_t session, const Session& join) {
+  auto replicated = !join.replicationAddress.empty();
+  putHeader(&outgoing, MANIFEST, 0, session);
+  put(&outgoing, static_cast<uint32_t>(join.image->chunks.size()));
+  put(&outgoing, join.image->objects);
+  put(&outgoing, replicated ? replicator->getEmitterId() : uint64_t{0});
+  put(&outgoing, replicated ? join.image->sequence : uint64_t{0});
+  send(join.address, outgoing);
+}
+
+void WorldSyncServer::send(const string& to, const string& datagram) {
+  transport->send(to, datagram);
+  stats.datagramsSent++;
+}
+
+// Client
+
+WorldSyncClient::WorldSyncClient(shared_ptr<IWorld> world, shared_ptr<Transport> transport, const string& server,
+    const string& replicationAddress, const SyncOptions& options)
+  : world{world}, transport{transport}, server{server}, replicationAddress{replicationAddress}, options{options} {}
+
+void WorldSyncClient::poll(Clock::time_point now) {
+  CORE_PROFILE_SCOPE("sync client poll");
+  while (transport->receive(&from, &incoming)) {
+    stats.datagramsReceived++;
+    if (from != server)
+      continue;
+    try {
+      receive(incoming);
+    } catch (const std::exception&) {
+      stats.malformed++;
+    }
+  }
+  if (!progress.done)
+    request(now);
+}
+
+void WorldSyncClient::receive(const string& datagram) {
+  auto header = getHeader(datagram, server);
+  auto data = datagram.data() + HEADER_SIZE;
+  auto size = datagram.size() - HEADER_SIZE;
+  if (header.kind == MANIFEST)
+    receiveManifest(header.session, data, size);
+  else if (header.session != session || session == 0)
+    return;
+  else if (header.kind == CHUNK)
+    receiveChunk(data, size);
+  else if (header.kind == UNKNOWN)
+    rejoin();
+  else
+    throw std::runtime_error("Unexpected sync datagram from " + server);
+}
+
+// A new session after the old one was lost starts over, chunks already
+// loaded are overwritten by the new image.
+void WorldSyncClient::receiveManifest(uint64_t session, const char* data, size_t size) {
+  if (session == this->session || this->session != 0)
+    return;
+  Reader in(data, size);
+  auto chunks = in.get<uint32_t>();
+  auto objects = in.get<uint32_t>();
+  progress.emitter = in.get<uint64_t>();
+  progress.sequence = in.get<uint64_t>();
+  progress.chunks = 0;
+  progress.totalChunks = chunks;
+  progress.objects = 0;
+  progress.totalObjects = objects;
+  this->session = session;
+  loaded.assign(chunks, 0);
+  requested.assign(chunks, Clock::time_point{});
+  firstMissing = 0;
+  partial.clear();
+}
+
+void WorldSyncClient::receiveChunk(const char* data, size_t size) {
+  Reader in(data, size);
+  auto index = in.get<uint32_t>();
+  auto part = in.get<uint16_t>();
+  auto parts = in.get<uint16_t>();
+  auto rawSize = in.get<uint32_t>();
+  auto checksum = in.get<uint64_t>();
+  if (index >= loaded.size() || part >= parts)
+    throw std::runtime_error("Invalid chunk from " + server);
+  if (loaded[index])
+    return;
+
+  auto payload = string(data + CHUNK_HEADER_SIZE, size - CHUNK_HEADER_SIZE);
+  if (parts == 1) {
+    load(index, payload, rawSize, checksum);
+    return;
+  }
+  auto& pending = partial[index];
+  if (pending.parts.size() != parts)
+    pending = Partial{vector<string>(parts), 0};
+  if (pending.parts[part].empty() && !payload.empty())
+    pending.received++;
+  pending.parts[part] = std::move(payload);
+  if (pending.received < parts)
+    return;
+  block.clear();
+  for (auto const& piece : pending.parts)
+    block += piece;
+  partial.erase(index);
+  load(index, block, rawSize, checksum);
+}
+
+// Corrupt chunks are dropped and asked for again.
+void WorldSyncClient::load(uint32_t index, const string& block, uint32_t size, uint64_t checksum) {
+  CORE_PROFILE_SCOPE("sync load chunk");
+  chunk.clear();
+  try {
+    decompress(block, size, &chunk);
+  } catch (const std::exception&) {
+    chunk.clear();
+  }
+  if (chunk.size() != size || Journals::checksum(chunk) != checksum) {
+    stats.corrupt++;
+    requested[index] = Clock::time_point{};
+    return;
+  }
+
+  Journals::read(chunk, [this](const JournalEntry& entry) {
+    auto id = string(entry.id);
+    if (entry.kind == journal::DELETE) {
+      world->deleteObject(id);
+      return;
+    }
+    auto object = entry.kind == journal::OBJECT ? world->newObject(id) : world->getObject(id);
+    if (object == nullptr)
+      return;
+    if (rejoining)
+      synced.insert(id);
+    object->setPosition(entry.position);
+    object->setRotation(entry.rotation);
+    object->setScale(entry.scale);
+    for (auto const& plugin : entry.plugins) {
+      auto pluginId = string(plugin.id);
+      if (auto loaded = Plugins::fromNetwork(pluginId, plugin.type, string(plugin.blob), true))
+        world->savePluginToObject(id, loaded);
+    }
+    progress.objects++;
+  });
+  loaded[index] = 1;
+  progress.chunks++;
+  stats.chunksLoaded++;
+}
+
+// A session lost while loading goes on with the next one. A finished one
+// is lost when the server dropped our replication: the world has to be
+// loaded again, and whatever the new image lacks was deleted meanwhile.
+void WorldSyncClient::rejoin() {
+  session = 0;
+  if (!progress.done)
+    return;
+  progress.done = false;
+  rejoining = true;
+  synced.clear();
+  stats.rejoins++;
+}
+
+void WorldSyncClient::request(Clock::time_point now) {
+  if (session == 0) {
+    if (lastJoin == Clock::time_point{} || now - lastJoin >= options.retryAfter) {
+      putHeader(&outgoing, JOIN, 0, 0);
+      put(&outgoing, static_cast<uint16_t>(replicationAddress.size()));
+      outgoing += replicationAddress;
+      send(outgoing);
+      lastJoin = now;
+    }
+    return;
+  }
+
+  while (firstMissing < loaded.size() && loaded[firstMissing])
+    firstMissing++;
+  if (firstMissing == loaded.size()) {
+    putHeader(&outgoing, DONE, 0, session);
+    send(outgoing);
+    progress.done = true;
+    if (rejoining) {
+      for (auto const& id : world->listObjectIds()) {
+        if (!synced.contains(id))
+          world->deleteObject(id);
+      }
+      rejoining = false;
+      synced.clear();
+    }
+    return;
+  }
+
+  // Chunks asked for recently count against the window until they arrive.
+  asked.clear();
+  uint16_t count = 0;
+  size_t waiting = 0;
+  for (size_t i = firstMissing; i < loaded.size() && waiting < options.window && count < UINT16_MAX; i++) {
+    if (loaded[i])
+      continue;
+    waiting++;
+    auto before = requested[i] != Clock::time_point{};
+    if (before && now - requested[i] < options.retryAfter)
+      continue;
+    if (before)
+      stats.chunksRetried++;
+    requested[i] = now;
+    put(&asked, static_cast<uint32_t>(i));
+    count++;
+  }
+  if (count == 0)
+    return;
+  putHeader(&outgoing, REQUEST, count, session);
+  outgoing += asked;
+  send(outgoing);
+}
+
+void WorldSyncClient::send(const string& datagram) {
+  transport->send(server, datagram);
+  stats.datagramsSent++;
+}
+
+}  // namespace core
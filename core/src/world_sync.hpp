@@ -0,0 +1,275 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef CORE_SRC_WORLD_SYNC_HPP_
+#define CORE_SRC_WORLD_SYNC_HPP_
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "core.hpp"
+#include "replication.hpp"
+
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+namespace core {
+
+// Initial transfer of a whole world to a joining core or terminal, over
+// the same datagram transports as replication.
+//
+// On JOIN the server takes an image of its world between two rounds: the
+// objects, transforms and plugin blobs as journal batches (see journal.hpp)
+// of about chunkBytes each, every one compressed (see compress.hpp) and
+// checksummed. Joins in the same poll() share one image, and joins past
+// maxImages or maxJoiners wait for their retry. The joiner's replication
+// address is held as a peer of the server's Replicator from that very
+// point, so replication carries on from the first update the image does
+// not hold, and the manifest tells that sequence. Nothing goes to that
+// address, and no chunk to the joiner, before its REQUEST or DONE echoes
+// the session from the address it joined from: a spoofed JOIN costs a
+// manifest and a session dropped after handshakeTimeout.
+//
+// The joiner pulls the chunks, a window at a time, and asks again for the
+// ones that do not show up, so a lost datagram or a dropped link costs a
+// retry and not the transfer. Each chunk is loaded into the world as it
+// arrives: rounds run on what is there while the rest comes in.
+//
+// A joiner whose replication falls too far behind (see
+// Replicator::takeLostPeers) gets UNKNOWN for its finished session until
+// it joins again, and then drops the objects the new image lacks.
+//
+// All integers are in host (little endian) order:
+//
+//   Header    magic "VRWS", version u8, kind u8, count u16, session u64
+//   JOIN      replication address (u16 size + chars), session 0
+//   MANIFEST  chunks u32, objects u32, emitter u64, sequence u64
+//   REQUEST   count times: chunk u32
+//   CHUNK     chunk u32, part u16, parts u16, size u32, checksum u64,
+//             part of the compressed chunk; size and checksum (FNV-1a)
+//             are of the chunk before compression
+//   DONE      the joiner has every chunk, the image can go
+//   UNKNOWN   the server no longer holds the session or the joiner's
+//             replication is lost, join again
+namespace world_sync {
+
+constexpr char MAGIC[4] = {'V', 'R', 'W', 'S'};
+constexpr uint8_t VERSION = 1;
+constexpr size_t HEADER_SIZE = 16;
+constexpr size_t CHUNK_HEADER_SIZE = 20;
+
+enum Kind : uint8_t { JOIN, MANIFEST, REQUEST, CHUNK, DONE, UNKNOWN };
+
+}  // namespace world_sync
+
+struct SyncOptions {
+  // Objects are packed into chunks of about this size before compression.
+  size_t chunkBytes = 16384;
+  // Compressed chunks are sent in parts filling datagrams up to this size.
+  size_t maxDatagram = 1200;
+  // Chunks a joiner waits for at once.
+  size_t window = 16;
+  // Joins and chunks that get no answer are asked again after this long.
+  std::chrono::milliseconds retryAfter{200};
+  // Servers drop images not asked for in this long.
+  std::chrono::milliseconds sessionTimeout{30000};
+  // And sessions whose joiner never answered the manifest after this long.
+  std::chrono::milliseconds handshakeTimeout{2000};
+  // Images and joiners a server holds at once.
+  size_t maxImages = 4;
+  size_t maxJoiners = 64;
+};
+
+struct SyncStats {
+  uint64_t datagramsSent = 0;
+  uint64_t datagramsReceived = 0;
+  // Server: images taken and their size before and after compression.
+  uint64_t images = 0;
+  uint64_t bytesRaw = 0;
+  uint64_t bytesCompressed = 0;
+  uint64_t chunksSent = 0;
+  // Server: joins left for later past maxImages or maxJoiners.
+  uint64_t joinsDeferred = 0;
+  // Joiner: chunks loaded, asked again, and failing their checksum.
+  uint64_t chunksLoaded = 0;
+  uint64_t chunksRetried = 0;
+  // Joiner: syncs started over after the sync was done.
+  uint64_t rejoins = 0;
+  uint64_t corrupt = 0;
+  uint64_t malformed = 0;
+};
+
+// Hands images of a world to joiners. Everything runs on the thread
+// calling poll(), which must not overlap with round().
+class WorldSyncServer {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // Joiners giving a replication address become peers of the replicator.
+  WorldSyncServer(shared_ptr<IWorld> world, shared_ptr<Transport> transport, Replicator* replicator = nullptr,
+    const SyncOptions& options = {});
+  WorldSyncServer(const WorldSyncServer&) = delete;
+  WorldSyncServer& operator=(const WorldSyncServer&) = delete;
+
+  // Answers what arrived. Call it between rounds.
+  void poll() { poll(Clock::now()); }
+  void poll(Clock::time_point now);
+
+  // Joiners still loading, and the images they share.
+  size_t sessions() const { return joins.size(); }
+  size_t images() const;
+  const SyncStats& getStats() const { return stats; }
+
+ private:
+  struct Image {
+    // Chunks as the CHUNK datagrams of their parts, sent with the session
+    // of each joiner in place of 0.
+    vector<vector<string>> chunks;
+    uint32_t objects;
+    uint64_t sequence;
+  };
+  struct Session {
+    string address;
+    string replicationAddress;
+    shared_ptr<const Image> image;
+    // Once the joiner echoed the session from its address.
+    bool proven = false;
+    bool held = false;
+    Clock::time_point started;
+    Clock::time_point lastUsed;
+  };
+  // Joiner by replication address, told to join again once lost.
+  struct Joiner {
+    string address;
+    uint64_t session;
+    bool lost = false;
+    Clock::time_point lastTold;
+  };
+
+  void receive(const string& from, const string& datagram, Clock::time_point now);
+  void tellLost(Clock::time_point now);
+  void join(const string& from, const string& replicationAddress, Clock::time_point now);
+  shared_ptr<const Image> takeImage();
+  void prove(uint64_t session, Session* join);
+  void end(uint64_t session);
+  void sendManifest(uint64_t session, const Session& join);
+  void send(const string& to, const string& datagram);
+
+  shared_ptr<IWorld> world;
+  shared_ptr<Transport> transport;
+  Replicator* replicator;
+  SyncOptions options;
+  std::unordered_map<uint64_t, Session> joins;
+  // Image taken in this poll, for the next joins to share.
+  shared_ptr<const Image> latest;
+  std::unordered_map<string, Joiner> joiners;
+  vector<string> lostPeers;
+  SyncStats stats;
+  string from;
+  string incoming;
+  string outgoing;
+};
+
+struct SyncProgress {
+  // Zero totals until the server answered the join.
+  size_t chunks = 0;
+  size_t totalChunks = 0;
+  size_t objects = 0;
+  size_t totalObjects = 0;
+  bool done = false;
+  // Replication point of the image: the emitter of the server and the
+  // sequence of the first update the image does not hold.
+  uint64_t emitter = 0;
+  uint64_t sequence = 0;
+};
+
+// Loads the world of a server into a local one. Everything runs on the
+// thread calling poll(), which must not overlap with round().
+//
+// Replication from the server should be polled only once the sync is
+// done: updates applied to objects whose chunk is still on its way would
+// be undone by the chunk. The server keeps them for the replicator until
+// then, as for any peer that is behind.
+class WorldSyncClient {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // replicationAddress is where this side's Replicator listens, empty
+  // when the world is not replicated further.
+  WorldSyncClient(shared_ptr<IWorld> world, shared_ptr<Transport> transport, const string& server,
+    const string& replicationAddress = "", const SyncOptions& options = {});
+  WorldSyncClient(const WorldSyncClient&) = delete;
+  WorldSyncClient& operator=(const WorldSyncClient&) = delete;
+
+  // Loads what arrived and asks for what is missing. Call it between rounds.
+  void poll() { poll(Clock::now()); }
+  void poll(Clock::time_point now);
+
+  bool done() const { return progress.done; }
+  const SyncProgress& getProgress() const { return progress; }
+  const SyncStats& getStats() const { return stats; }
+
+ private:
+  struct Partial {
+    vector<string> parts;
+    size_t received = 0;
+  };
+
+  void receive(const string& datagram);
+  void receiveManifest(uint64_t session, const char* data, size_t size);
+  void receiveChunk(const char* data, size_t size);
+  void load(uint32_t chunk, const string& block, uint32_t size, uint64_t checksum);
+  void request(Clock::time_point now);
+  void rejoin();
+  void send(const string& datagram);
+
+  shared_ptr<IWorld> world;
+  shared_ptr<Transport> transport;
+  string server;
+  string replicationAddress;
+  SyncOptions options;
+  uint64_t session = 0;
+  Clock::time_point lastJoin;
+  // Per chunk: loaded, and when it was last asked for.
+  vector<uint8_t> loaded;
+  vector<Clock::time_point> requested;
+  // Chunks below this one are all loaded.
+  size_t firstMissing = 0;
+  // Syncing again: the ids of the new image, the other objects go once done.
+  bool rejoining = false;
+  std::unordered_set<string> synced;
+  std::unordered_map<uint32_t, Partial> partial;
+  SyncProgress progress;
+  SyncStats stats;
+  string from;
+  string incoming;
+  string outgoing;
+  string asked;
+  string block;
+  string chunk;
+};
+
+}  // namespace core
+
+#endif  // CORE_SRC_WORLD_SYNC_HPP_
@@ -0,0 +1,74 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+// Module loaded by the native plugin tests and benches, built on its own
+// against the C interface only.
+#include <cstdio>
+#include <string>
+
+#include "../src/native_abi.h"
+
+#ifndef TEST_NATIVE_ABI_VERSION
+#define TEST_NATIVE_ABI_VERSION CORE_NATIVE_ABI_VERSION
+#endif
+
+namespace {
+
+struct Velocity {
+  double x = 0, y = 0, z = 0;
+};
+
+// Config "x y z", in meters per second.
+void* createMover(const char* config, size_t length) {
+  auto velocity = new Velocity();
+  std::string text(config, length);
+  std::sscanf(text.c_str(), "%lf %lf %lf", &velocity->x, &velocity->y, &velocity->z);
+  return velocity;
+}
+
+void destroyMover(void* state) {
+  delete static_cast<Velocity*>(state);
+}
+
+void updateMover(CoreNativeBatch* batch) {
+  for (size_t i = 0; i < batch->count; i++) {
+    auto velocity = static_cast<const Velocity*>(batch->states[i]);
+    batch->x[i] += velocity->x * batch->seconds;
+    batch->y[i] += velocity->y * batch->seconds;
+    batch->z[i] += velocity->z * batch->seconds;
+    batch->changed[i] = 1;
+  }
+}
+
+// Emits "batch" about its first object, with the size of the batch.
+void updateCounter(CoreNativeBatch* batch) {
+  auto count = std::to_string(batch->count);
+  batch->host->emit(batch->host->context, batch->ids[0], "batch", count.c_str());
+}
+
+const CoreNativeBehaviour behaviours[] = {
+  {"mover", createMover, destroyMover, updateMover},
+  {"counter", nullptr, nullptr, updateCounter},
+};
+
+const CoreNativeModule module = {TEST_NATIVE_ABI_VERSION, 2, behaviours};
+
+}  // namespace
+
+extern "C" CORE_NATIVE_EXPORT const CoreNativeModule* core_native_module() {
+  return &module;
+}
@@ -0,0 +1,139 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include "test.hpp"
+#include "../src/assets.hpp"
+#include "../src/core.hpp"
+
+using std::string;
+using core::AssetStore;
+using core::Assets;
+namespace fs = std::filesystem;
+
+TEST_CASE("Asset hashes are SHA-256") {
+  REQUIRE(Assets::hash("") == "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  REQUIRE(Assets::hash("abc") == "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+  REQUIRE(Assets::hash("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq")
+    == "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+  REQUIRE(Assets::hash(string(1000000, 'a')) == "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0");
+}
+
+TEST_CASE("Shared assets are one copy in memory") {
+  auto count = Assets::sharedCount();
+  auto a = Assets::share("local x = 1");
+  auto b = Assets::share(string("local x = ") + "1");
+  REQUIRE(a.get() == b.get());
+  REQUIRE(Assets::share("local x = 2").get() != a.get());
+  REQUIRE(Assets::sharedCount() == count + 1);
+  a.reset();
+  b.reset();
+  REQUIRE(Assets::sharedCount() == count);
+}
+
+TEST_CASE("Asset store keeps each blob once") {
+  fs::remove_all("test_assets");
+  {
+    AssetStore store("test_assets");
+    auto hash = store.put("print('hello')");
+    REQUIRE(store.put("print('hello')") == hash);
+    store.put("print('other')");
+    REQUIRE(store.has(hash));
+    REQUIRE(store.list().size() == 2);
+    REQUIRE(store.missing({hash, Assets::hash("print('new')")}) == vector<string>{Assets::hash("print('new')")});
+  }
+
+  AssetStore store("test_assets");
+  auto hash = Assets::hash("print('hello')");
+  REQUIRE(store.list().size() == 2);
+  REQUIRE(*store.get(hash) == "print('hello')");
+  REQUIRE(store.get(hash).get() == Assets::share("print('hello')").get());
+  REQUIRE_THROWS_AS(store.get(Assets::hash("print('new')")), std::runtime_error);
+
+  REQUIRE(store.prune({hash}) == 1);
+  REQUIRE(store.list() == vector<string>{hash});
+  REQUIRE(AssetStore("test_assets").list() == vector<string>{hash});
+  fs::remove_all("test_assets");
+}
+
+TEST_CASE("Corrupt assets are rejected") {
+  fs::remove_all("test_assets");
+  auto hash = AssetStore("test_assets").put("print('hello')");
+  std::ofstream("test_assets/" + hash) << "print('tampered')";
+  REQUIRE_THROWS_AS(AssetStore("test_assets").get(hash), std::runtime_error);
+  fs::remove_all("test_assets");
+}
+
+TEST_CASE("Saved worlds store shared scripts once") {
+  fs::remove_all("test_assets_world");
+  auto world = core::Worlds::createNew("id");
+  for (int i = 0; i < 100; i++) {
+    auto id = "object-" + std::to_string(i);
+    world->newObject(id);
+    world->saveScriptToObject(id, "script", "local x = " + std::to_string(i % 3));
+  }
+  world->save("test_assets_world");
+  REQUIRE(AssetStore("test_assets_world/assets").list().size() == 3);
+  REQUIRE(!fs::exists("test_assets_world/scripts"));
+
+  // Blobs no script uses any more go with the next save.
+  world->deleteObject("object-2");
+  for (int i = 5; i < 100; i += 3)
+    world->deleteObject("object-" + std::to_string(i));
+  world->save("test_assets_world");
+  REQUIRE(AssetStore("test_assets_world/assets").list().size() == 2);
+
+  auto loaded = core::Worlds::load("id", "test_assets_world");
+  REQUIRE(loaded->listObjectIds() == world->listObjectIds());
+  REQUIRE(loaded->getObject("object-1")->listPluginIds() == vector<string>{"script"});
+  fs::remove_all("test_assets_world");
+}
+
+TEST_CASE("Saving only removes files the world itself wrote") {
+  fs::remove_all("test_assets_world");
+  fs::create_directories("test_assets_world/scripts");
+  auto foreign = AssetStore("test_assets_world/assets").put("someone else's blob");
+  std::ofstream("test_assets_world/scripts/notes.txt") << "not a script";
+  std::ofstream("test_assets_world/scripts/a_script") << "local x = 1";
+  std::ofstream("test_assets_world/scripts/b_script") << "local x = 2";
+
+  auto world = core::Worlds::createNew("id");
+  world->newObject("a");
+  world->saveScriptToObject("a", "script", "local x = 1");
+  world->newObject("b");
+  world->saveScriptToObject("b", "script", "local x = 3");
+  world->save("test_assets_world");
+  // Migrated into the assets: the file had the source saved.
+  REQUIRE(!fs::exists("test_assets_world/scripts/a_script"));
+  // Edited since, or not a script of the world at all.
+  REQUIRE(fs::exists("test_assets_world/scripts/b_script"));
+  REQUIRE(fs::exists("test_assets_world/scripts/notes.txt"));
+
+  world->getObject("a")->removePlugin("script");
+  world->save("test_assets_world");
+  auto left = AssetStore("test_assets_world/assets").list();
+  std::sort(left.begin(), left.end());
+  auto expected = vector<string>{foreign, core::Assets::hash("local x = 3")};
+  std::sort(expected.begin(), expected.end());
+  REQUIRE(left == expected);
+  fs::remove_all("test_assets_world");
+}
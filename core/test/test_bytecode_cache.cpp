@@ -0,0 +1,60 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include "test.hpp"
+#include "../src/bytecode_cache.hpp"
+
+using core::BytecodeCache;
+
+TEST_CASE("Bytecode cache hits and misses") {
+  BytecodeCache cache;
+  REQUIRE(cache.find("return 1") == nullptr);
+  cache.store("return 1", "bytecode 1");
+
+  auto found = cache.find("return 1");
+  REQUIRE(found != nullptr);
+  REQUIRE(*found == "bytecode 1");
+  REQUIRE(cache.find("return 2") == nullptr);
+
+  auto stats = cache.stats();
+  REQUIRE(stats.hits == 1);
+  REQUIRE(stats.misses == 2);
+  REQUIRE(stats.entries == 1);
+}
+
+TEST_CASE("Bytecode cache drops the least recently used past its size") {
+  BytecodeCache cache;
+  cache.setMaxBytes(60);
+  cache.store("return 1", "bytecode 1");
+  cache.store("return 2", "bytecode 2");
+  cache.store("return 3", "bytecode 3");
+  REQUIRE(cache.stats().bytes == 54);
+
+  cache.find("return 1");
+  cache.store("return 4", "bytecode 4");
+  REQUIRE(cache.find("return 2") == nullptr);
+  REQUIRE(cache.find("return 1") != nullptr);
+  REQUIRE(cache.find("return 4") != nullptr);
+  auto stats = cache.stats();
+  REQUIRE(stats.entries == 3);
+  REQUIRE(stats.bytes == 54);
+  REQUIRE(stats.evictions == 1);
+
+  cache.setMaxBytes(18);
+  REQUIRE(cache.stats().entries == 1);
+  REQUIRE(cache.find("return 4") != nullptr);
+}
@@ -0,0 +1,282 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <random>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "test.hpp"
+#include "../src/collision.hpp"
+#include "../src/core.hpp"
+#include "../src/physics.hpp"
+
+using std::string;
+using std::vector;
+using core::Collisions;
+using core::Colliders;
+using core::Contact;
+using core::Shape;
+namespace fs = std::filesystem;
+
+namespace {
+
+using Transform = t::transform<double>;
+
+Transform at(const t::position& position, const t::scale& scale = t::scale{1, 1, 1}) {
+  return Transform{position, t::rotation{}, scale};
+}
+
+// Places the shapes on objects 0 and 1 and returns whether they touch.
+bool touch(const Shape& a, const Transform& ta, const Shape& b, const Transform& tb, Contact* contact) {
+  Colliders colliders;
+  auto pluginA = Collisions::asPlugin("a", a);
+  auto pluginB = Collisions::asPlugin("b", b);
+  colliders.attach(core::ObjectHandle{0, 0}, pluginA.get());
+  colliders.attach(core::ObjectHandle{1, 0}, pluginB.get());
+  colliders.place(0, ta);
+  colliders.place(1, tb);
+  vector<Colliders::Pair> pairs;
+  colliders.findPairs(&pairs);
+  vector<Contact> contacts;
+  colliders.collide(pairs, 0, pairs.size(), 1, &contacts);
+  if (contacts.empty())
+    return false;
+  *contact = contacts[0];
+  // Pairs come with a < b, report them as asked.
+  if (contact->a == 1)
+    contact->normal = contact->normal * -1;
+  return true;
+}
+
+// Two triangles covering [-size, size] on x and z at height 0.
+Shape ground(double size) {
+  return Shape::mesh({
+    t::double3{-size, 0, -size}, t::double3{size, 0, -size}, t::double3{size, 0, size},
+    t::double3{-size, 0, -size}, t::double3{size, 0, size}, t::double3{-size, 0, size}
+  });
+}
+
+bool near(const t::double3& a, const t::double3& b) {
+  return std::abs(a.x - b.x) < 1e-9 && std::abs(a.y - b.y) < 1e-9 && std::abs(a.z - b.z) < 1e-9;
+}
+
+}  // namespace
+
+TEST_CASE("Spheres and boxes touch where they overlap") {
+  Contact contact;
+  REQUIRE(touch(Shape::sphere(1), at({0, 0, 0}), Shape::sphere(1), at({1.5, 0, 0}), &contact));
+  REQUIRE(near(contact.normal, t::double3{1, 0, 0}));
+  REQUIRE(contact.depth == Approx(0.5));
+  REQUIRE(near(contact.point, t::double3{0.75, 0, 0}));
+  REQUIRE_FALSE(touch(Shape::sphere(1), at({0, 0, 0}), Shape::sphere(1), at({2.5, 0, 0}), &contact));
+  // The radius grows with the largest scale.
+  REQUIRE(touch(Shape::sphere(1), at({0, 0, 0}, {1, 2, 1}), Shape::sphere(1), at({2.5, 0, 0}), &contact));
+
+  auto box = Shape::box(t::double3{1, 1, 1});
+  REQUIRE(touch(Shape::sphere(0.5), at({0, 1.25, 0}), box, at({0, 0, 0}), &contact));
+  REQUIRE(near(contact.normal, t::double3{0, -1, 0}));
+  REQUIRE(contact.depth == Approx(0.25));
+  REQUIRE(near(contact.point, t::double3{0, 1, 0}));
+  // From the box side the normal turns around.
+  REQUIRE(touch(box, at({0, 0, 0}), Shape::sphere(0.5), at({0, 1.25, 0}), &contact));
+  REQUIRE(near(contact.normal, t::double3{0, 1, 0}));
+  // Inside, the sphere leaves through the nearest face.
+  REQUIRE(touch(Shape::sphere(0.5), at({0.75, 0, 0}), box, at({0, 0, 0}), &contact));
+  REQUIRE(near(contact.normal, t::double3{-1, 0, 0}));
+  REQUIRE(contact.depth == Approx(0.75));
+  // Near the corner of the box but outside it.
+  REQUIRE_FALSE(touch(Shape::sphere(0.5), at({1.4, 1.4, 0}), box, at({0, 0, 0}), &contact));
+
+  REQUIRE(touch(box, at({0, 0, 0}), Shape::box(t::double3{0.5, 0.5, 0.5}), at({0, 1.25, 0}), &contact));
+  REQUIRE(near(contact.normal, t::double3{0, 1, 0}));
+  REQUIRE(contact.depth == Approx(0.25));
+  // The corners of the small box inside the big one.
+  REQUIRE(near(contact.point, t::double3{0, 0.75, 0}));
+}
+
+TEST_CASE("Rotated boxes are tested on their own axes") {
+  auto box = Shape::box(t::double3{1, 1, 1});
+  // A quarter turn around z: the diamond's bounds overlap the other box,
+  // its sides do not.
+  auto turn = t::rotation{0, 0, std::sin(M_PI / 8), std::cos(M_PI / 8)};
+  Contact contact;
+  REQUIRE_FALSE(touch(box, Transform{t::double3{0, 0, 0}, turn, t::scale{1, 1, 1}}, box, at({2.2, 2.2, 0}), &contact));
+  REQUIRE(touch(box, Transform{t::double3{0, 0, 0}, turn, t::scale{1, 1, 1}}, box, at({2.3, 0, 0}), &contact));
+  REQUIRE(near(contact.normal, t::double3{1, 0, 0}));
+  REQUIRE(contact.depth == Approx(std::sqrt(2.0) + 1 - 2.3));
+}
+
+TEST_CASE("Meshes collide with spheres and boxes") {
+  Contact contact;
+  REQUIRE(touch(Shape::sphere(1), at({0.5, 0.75, 0.5}), ground(10), at({0, 0, 0}), &contact));
+  REQUIRE(near(contact.normal, t::double3{0, -1, 0}));
+  REQUIRE(contact.depth == Approx(0.25));
+  REQUIRE(near(contact.point, t::double3{0.5, 0, 0.5}));
+  REQUIRE_FALSE(touch(Shape::sphere(1), at({0.5, 1.5, 0.5}), ground(10), at({0, 0, 0}), &contact));
+  // Meshes move and scale with their object.
+  REQUIRE(touch(Shape::sphere(1), at({15, 1.5, 0}), ground(10), at({0, 1, 0}, {2, 1, 2}), &contact));
+  REQUIRE(contact.depth == Approx(0.5));
+
+  REQUIRE(touch(ground(10), at({0, 0, 0}), Shape::box(t::double3{1, 1, 1}), at({3, 0.9, 3}), &contact));
+  REQUIRE(near(contact.normal, t::double3{0, 1, 0}));
+  REQUIRE(contact.depth == Approx(0.1));
+  REQUIRE(near(contact.point, t::double3{3, 0, 3}));
+  REQUIRE_FALSE(touch(Shape::box(t::double3{1, 1, 1}), at({3, 1.1, 3}), ground(10), at({0, 0, 0}), &contact));
+
+  // Static geometry does not collide with itself.
+  REQUIRE_FALSE(touch(ground(10), at({0, 0, 0}), ground(10), at({0, 0, 0}), &contact));
+}
+
+TEST_CASE("Sweep and prune finds every overlapping pair") {
+  std::mt19937 random{7};
+  std::uniform_real_distribution<double> place(0, 40);
+  std::uniform_real_distribution<double> step(-1, 1);
+  Colliders colliders;
+  vector<std::shared_ptr<core::IPlugin>> plugins;
+  vector<t::position> positions;
+  for (uint32_t i = 0; i < 300; i++) {
+    plugins.push_back(Collisions::asPlugin("c", i % 2 ? Shape::sphere(1) : Shape::box(t::double3{1, 0.5, 1})));
+    colliders.attach(core::ObjectHandle{i, 0}, plugins.back().get());
+    positions.push_back(t::position{place(random), place(random) / 4, place(random)});
+  }
+
+  for (int round = 0; round < 20; round++) {
+    // Halfway through the colliders spread along y, the sweep follows.
+    for (size_t i = 0; i < positions.size(); i++) {
+      positions[i] = positions[i] + t::double3{step(random), round == 10 ? place(random) * 4 : step(random), step(random)};
+      colliders.place(i, at(positions[i]));
+    }
+    if (round == 5)
+      colliders.detach(core::ObjectHandle{17, 0});
+    std::set<std::pair<uint32_t, uint32_t>> expected;
+    for (uint32_t a = 0; a < colliders.size(); a++) {
+      for (uint32_t b = a + 1; b < colliders.size(); b++) {
+        if (colliders.bounds[a].overlaps(colliders.bounds[b]))
+          expected.insert({a, b});
+      }
+    }
+    vector<Colliders::Pair> pairs;
+    colliders.findPairs(&pairs);
+    std::set<std::pair<uint32_t, uint32_t>> found;
+    for (auto const& pair : pairs)
+      found.insert({pair.a, pair.b});
+    REQUIRE(found.size() == pairs.size());
+    REQUIRE(found == expected);
+  }
+}
+
+TEST_CASE("Collisions reach the plugins of both objects") {
+  auto world = core::Worlds::createNew("id");
+  world->setPhysics(core::PhysicsOptions{0.5});
+  auto ball = world->newObject("ball");
+  ball->setPosition(t::position{0, 3, 0});
+  world->savePluginToObject("ball", Collisions::asPlugin("shape", Shape::sphere(1)));
+  world->savePluginToObject("ball", core::Physics::asPlugin("body", core::Body{1, t::double3{0, -2, 0}}));
+  world->newObject("floor");
+  world->savePluginToObject("floor", Collisions::asPlugin("shape", ground(10)));
+  auto far = world->newObject("far");
+  far->setPosition(t::position{50, 0, 0});
+  world->savePluginToObject("far", Collisions::asPlugin("shape", Shape::box(t::double3{1, 1, 1})));
+
+  auto listener = Collisions::asPlugin("listener", Shape{});
+  auto floor = world->getObject("floor");
+  world->subscribe(ball.get(), listener.get(), core::EventFilter{core::Event::COLLISION, "ball"});
+  world->subscribe(floor.get(), listener.get(), core::EventFilter{core::Event::COLLISION, "floor"});
+
+  // The ball falls one unit per round and touches the floor at 1.
+  for (int round = 0; round < 3; round++)
+    world->round();
+  REQUIRE(ball->getPosition() == t::position{0, 0, 0});
+  auto events = world->takeEvents(ball.get(), listener.get());
+  REQUIRE(events.size() == 1);
+  REQUIRE(events[0].otherId == "floor");
+  REQUIRE(near(events[0].normal, t::double3{0, -1, 0}));
+  REQUIRE(events[0].depth == Approx(0));
+  REQUIRE(events[0].speed == Approx(2));
+  world->round();
+  events = world->takeEvents(floor.get(), listener.get());
+  REQUIRE(events.size() == 2);
+  REQUIRE(events[0].otherId == "ball");
+  REQUIRE(near(events[0].normal, t::double3{0, 1, 0}));
+  REQUIRE(events[1].depth == Approx(1));
+
+  // Colliders go with their plugin.
+  ball->removePlugin("shape");
+  world->round();
+  world->takeEvents(floor.get(), listener.get());
+  world->round();
+  REQUIRE(world->takeEvents(floor.get(), listener.get()).empty());
+}
+
+TEST_CASE("Objects keep one body and one collider") {
+  auto world = core::Worlds::createNew("id");
+  world->setPhysics(core::PhysicsOptions{1});
+  auto ball = world->newObject("ball");
+  world->savePluginToObject("ball", core::Physics::asPlugin("first", core::Body{1, t::double3{1, 0, 0}}));
+  world->savePluginToObject("ball", Collisions::asPlugin("small", Shape::sphere(1)));
+  world->savePluginToObject("ball", core::Physics::asPlugin("second", core::Body{1, t::double3{0, 1, 0}}));
+  world->savePluginToObject("ball", Collisions::asPlugin("large", Shape::sphere(5)));
+  REQUIRE(ball->listPluginIds() == vector<string>{"large", "second"});
+  world->round();
+  REQUIRE(ball->getPosition() == t::position{0, 1, 0});
+
+  // The larger sphere is the one tested.
+  auto other = world->newObject("other");
+  other->setPosition(t::position{4, 1, 0});
+  world->savePluginToObject("other", Collisions::asPlugin("shape", Shape::sphere(1)));
+  auto listener = Collisions::asPlugin("listener", Shape{});
+  world->subscribe(other.get(), listener.get(), core::EventFilter{core::Event::COLLISION, "other"});
+  world->round();
+  world->round();
+  REQUIRE(!world->takeEvents(other.get(), listener.get()).empty());
+}
+
+TEST_CASE("Colliders survive saving and loading") {
+  auto world = core::Worlds::createNew("id");
+  world->newObject("floor");
+  world->savePluginToObject("floor", Collisions::asPlugin("shape", ground(5)));
+  world->newObject("crate");
+  world->savePluginToObject("crate", Collisions::asPlugin("shape", Shape::box(t::double3{1, 2, 3})));
+  world->save("test_collision_world");
+  world->saveSnapshot("test_collision.bin");
+
+  for (auto const& loaded : {core::Worlds::load("yaml", "test_collision_world"),
+      core::Worlds::loadSnapshot("snapshot", "test_collision.bin")}) {
+    REQUIRE(loaded->getObject("crate")->listPluginIds() == vector<string>{"shape"});
+    auto listener = Collisions::asPlugin("listener", Shape{});
+    auto crate = loaded->getObject("crate");
+    loaded->subscribe(crate.get(), listener.get(), core::EventFilter{core::Event::COLLISION, "crate"});
+    loaded->round();
+    loaded->round();
+    auto events = loaded->takeEvents(crate.get(), listener.get());
+    REQUIRE(events.size() == 1);
+    REQUIRE(events[0].depth == Approx(2));
+  }
+
+  auto sphere = Collisions::getShape(Collisions::asPlugin("shape", Shape::sphere(3)));
+  REQUIRE(sphere.kind == Shape::SPHERE);
+  REQUIRE(sphere.radius == 3);
+  REQUIRE_THROWS_AS(Collisions::asPlugin("shape", string("\x02short", 6)), std::runtime_error);
+  fs::remove_all("test_collision_world");
+  fs::remove("test_collision.bin");
+}
@@ -0,0 +1,72 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <random>
+#include <stdexcept>
+#include <string>
+
+#include "test.hpp"
+#include "../src/compress.hpp"
+
+using std::string;
+
+static string roundTrip(const string& input) {
+  string block;
+  core::compress(input, &block);
+  string output;
+  core::decompress(block, input.size(), &output);
+  return output;
+}
+
+TEST_CASE("Compression round trips") {
+  REQUIRE(roundTrip("").empty());
+  REQUIRE(roundTrip("abc") == "abc");
+  string repeated;
+  for (int i = 0; i < 1000; i++)
+    repeated += "object-" + std::to_string(i) + " local x = 1\n";
+  REQUIRE(roundTrip(repeated) == repeated);
+  // Long runs overlap their own match, and lengths past 15 take extra bytes.
+  REQUIRE(roundTrip(string(100000, 'a')) == string(100000, 'a'));
+
+  std::mt19937 random(1);
+  string noise;
+  for (int i = 0; i < 70000; i++)
+    noise.push_back(static_cast<char>(random()));
+  REQUIRE(roundTrip(noise) == noise);
+}
+
+TEST_CASE("Compression shrinks repeated content") {
+  string script;
+  for (int i = 0; i < 100; i++)
+    script += "local world, object = ...\nobject:setPosition(object:getPosition())\n";
+  string block;
+  core::compress(script, &block);
+  REQUIRE(block.size() < script.size() / 10);
+}
+
+TEST_CASE("Corrupt compressed blocks are rejected") {
+  string input(1000, 'x');
+  string block;
+  core::compress(input, &block);
+  string output;
+  REQUIRE_THROWS_AS(core::decompress(block, input.size() + 1, &output), std::runtime_error);
+  output.clear();
+  REQUIRE_THROWS_AS(core::decompress(block.substr(0, block.size() - 1), input.size(), &output), std::runtime_error);
+  output.clear();
+  // An offset pointing before the start of the output.
+  REQUIRE_THROWS_AS(core::decompress(string("\x00\xff\xff", 3), 4, &output), std::runtime_error);
+}
@@ -17,12 +17,16 @@
 */
 
 #include <yaml-cpp/yaml.h>
+#include <algorithm>
 #include <iostream>
 #include <map>
 #include <filesystem>
 #include <fstream>
+#include <memory>
+#include <vector>
 
 #include "test.hpp"
+#include "../src/assets.hpp"
 #include "../src/core.hpp"
 
 using std::string;
@@ -158,8 +162,10 @@ TEST_CASE("Save world") {
   REQUIRE(yaml["objects"][0]["plugins"].size() == 1);
   REQUIRE(yaml["objects"][0]["plugins"][0]["id"].as<string>() == "hello-world");
   REQUIRE(yaml["objects"][0]["plugins"][0]["type"].as<string>() == "script");
+  auto asset = yaml["objects"][0]["plugins"][0]["asset"].as<string>();
+  REQUIRE(asset == core::Assets::hash("print(\"Hello VR\")\n"));
 
-  ifstream scriptFile("sample_world_saved/scripts/id_hello-world");
+  ifstream scriptFile("sample_world_saved/assets/" + asset);
   stringstream buffer;
   buffer << scriptFile.rdbuf();
   scriptFile.close();
@@ -167,3 +173,129 @@ TEST_CASE("Save world") {
 
   fs::remove_all(path);
 }
+
+TEST_CASE("Get non existent object") {
+  auto world = core::Worlds::createNew("id");
+
+  REQUIRE(world->getObject("missing") == nullptr);
+  REQUIRE(world->objectCount() == 0);
+}
+
+TEST_CASE("Deleted object keeps its transforms") {
+  auto world = core::Worlds::createNew("id");
+  auto first = world->newObject("first");
+  auto second = world->newObject("second");
+  first->setPosition(t::position{1, 2, 3});
+  second->setPosition(t::position{4, 5, 6});
+
+  world->deleteObject("first");
+
+  REQUIRE(world->objectCount() == 1);
+  REQUIRE(first->getPosition() == t::position{1, 2, 3});
+  REQUIRE(second->getPosition() == t::position{4, 5, 6});
+  REQUIRE(world->getObject("second")->getPosition() == t::position{4, 5, 6});
+}
+
+// Every object claims the shared target, the last command applied wins.
+class ClaimPlugin : public core::IPlugin {
+ public:
+  ClaimPlugin(core::ObjectHandle target, double value) : target{target}, value{value} {}
+  const string& getId() override { return id; }
+  Type getType() override { return SCRIPT; }
+  void saveToFile(const string& path) override {}
+  void saveTo(std::ostream& out) override {}
+  bool execute(core::IWorld* world, core::IObject* object) override {
+    world->enqueue(core::command::SetPosition{target, t::position{value, 0, 0}});
+    world->enqueue(core::command::SetPosition{object->getHandle(), t::position{value, value, 0}});
+    return true;
+  }
+
+ private:
+  string id = "claim";
+  core::ObjectHandle target;
+  double value;
+};
+
+static shared_ptr<core::IWorld> claimWorld(size_t workers) {
+  auto world = core::Worlds::createNew("id");
+  world->setWorkers(workers);
+  auto target = world->newObject("target")->getHandle();
+  for (int i = 0; i < 2000; i++) {
+    auto id = std::to_string(i);
+    world->newObject(id);
+    world->savePluginToObject(id, std::make_shared<ClaimPlugin>(target, i));
+  }
+  world->round();
+  return world;
+}
+
+TEST_CASE("Parallel round is deterministic") {
+  for (size_t workers : {1, 2, 3, 8}) {
+    auto world = claimWorld(workers);
+    REQUIRE(world->getObject("target")->getPosition() == t::position{1999, 0, 0});
+    REQUIRE(world->getObject("1000")->getPosition() == t::position{1000, 1000, 0});
+  }
+}
+
+// Deletes an earlier object and creates a later one while the round runs.
+class ChurnPlugin : public core::IPlugin, public std::enable_shared_from_this<ChurnPlugin> {
+ public:
+  explicit ChurnPlugin(vector<string>* runs) : runs{runs} {}
+  const string& getId() override { return id; }
+  Type getType() override { return SCRIPT; }
+  void saveToFile(const string& path) override {}
+  void saveTo(std::ostream& out) override {}
+  bool execute(core::IWorld* world, core::IObject* object) override {
+    runs->push_back(object->getId());
+    if (object->getId() == "1" && world->getObject("0") != nullptr) {
+      world->deleteObject("0");
+      world->newObject("new");
+      world->savePluginToObject("new", shared_from_this());
+    }
+    return true;
+  }
+
+ private:
+  string id = "churn";
+  vector<string>* runs;
+};
+
+TEST_CASE("Serial rounds run each object once while plugins create and delete") {
+  auto world = core::Worlds::createNew("id");
+  vector<string> runs;
+  auto plugin = std::make_shared<ChurnPlugin>(&runs);
+  for (int i = 0; i < 4; i++) {
+    auto id = std::to_string(i);
+    world->newObject(id);
+    world->savePluginToObject(id, plugin);
+  }
+
+  world->round();
+  REQUIRE(runs == vector<string>{"0", "1", "2", "3"});
+  runs.clear();
+  world->round();
+  REQUIRE(runs.size() == 4);
+  REQUIRE(std::count(runs.begin(), runs.end(), "new") == 1);
+}
+
+TEST_CASE("Commands are applied at the end of the round") {
+  auto world = core::Worlds::createNew("id");
+  auto object = world->newObject("id");
+
+  world->enqueue(core::command::SetPosition{object->getHandle(), t::position{1, 2, 3}});
+  world->enqueue(core::command::SetScale{object->getHandle(), t::scale{2, 2, 2}});
+  world->enqueue(core::command::CreateObject{"created", t::position{4, 5, 6}});
+  REQUIRE(object->getPosition() == t::position{0, 0, 0});
+  REQUIRE(world->objectCount() == 1);
+
+  world->round();
+  REQUIRE(object->getPosition() == t::position{1, 2, 3});
+  REQUIRE(object->getScale() == t::scale{2, 2, 2});
+  REQUIRE(world->getObject("created")->getPosition() == t::position{4, 5, 6});
+
+  world->enqueue(core::command::DeleteObject{object->getHandle()});
+  world->enqueue(core::command::SetPosition{object->getHandle(), t::position{7, 8, 9}});
+  world->round();
+  REQUIRE(world->getObject("id") == nullptr);
+  REQUIRE(object->getPosition() == t::position{1, 2, 3});
+}
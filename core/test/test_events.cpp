@@ -0,0 +1,196 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "test.hpp"
+#include "../src/core.hpp"
+#include "../src/events.hpp"
+
+using std::string;
+using std::shared_ptr;
+using std::vector;
+using core::Event;
+using core::EventBus;
+using core::EventFilter;
+
+namespace {
+
+// Records the events it gets, optionally event driven.
+class ListenerPlugin : public core::IPlugin {
+ public:
+  ListenerPlugin(const string& id, vector<EventFilter> filters, bool driven)
+    : id{id}, filters{std::move(filters)}, driven{driven} {}
+  const string& getId() override { return id; }
+  Type getType() override { return SCRIPT; }
+  void saveToFile(const string& path) override {}
+  void saveTo(std::ostream& out) override {}
+  bool execute(core::IWorld* world, core::IObject* object) override {
+    if (runs++ == 0) {
+      for (auto const& filter : filters)
+        world->subscribe(object, this, filter);
+      world->setEventDriven(object, this, driven);
+    }
+    for (auto& event : world->takeEvents(object, this))
+      received.push_back(event);
+    return true;
+  }
+
+  int runs = 0;
+  vector<Event> received;
+
+ private:
+  string id;
+  vector<EventFilter> filters;
+  bool driven;
+};
+
+core::IPlugin* plugin(int n) {
+  return reinterpret_cast<core::IPlugin*>(static_cast<uintptr_t>(n) * 16);
+}
+
+}  // namespace
+
+TEST_CASE("Events reach the subscriptions they match, once each") {
+  EventBus bus;
+  core::ObjectHandle object{0, 0};
+  bus.subscribe(object, plugin(1), EventFilter{Event::CUSTOM, "", "open"});
+  bus.subscribe(object, plugin(1), EventFilter{Event::CUSTOM, "door", ""});
+  bus.subscribe(object, plugin(2), EventFilter{Event::TRANSFORM_CHANGED, "door"});
+  REQUIRE(bus.wants(Event::TRANSFORM_CHANGED, "door"));
+  REQUIRE_FALSE(bus.wants(Event::TRANSFORM_CHANGED, "wall"));
+  REQUIRE_FALSE(bus.wants(Event::OBJECT_CREATED));
+
+  bus.emit(Event{Event::CUSTOM, "door", "", "open"});
+  bus.emit(Event{Event::CUSTOM, "wall", "", "close"});
+  bus.emit(Event{Event::CUSTOM, "wall", "", "open"});
+  // Nothing before dispatch.
+  REQUIRE(bus.take(object, plugin(1)).empty());
+  vector<EventBus::Receiver> received;
+  bus.dispatch(&received);
+  REQUIRE(received.size() == 1);
+  REQUIRE(received[0].plugin == plugin(1));
+
+  auto events = bus.take(object, plugin(1));
+  REQUIRE(events.size() == 2);
+  REQUIRE(events[0].objectId == "door");
+  REQUIRE(events[1].objectId == "wall");
+  REQUIRE(bus.take(object, plugin(1)).empty());
+  REQUIRE(bus.take(object, plugin(2)).empty());
+}
+
+TEST_CASE("Unsubscribing drops subscriptions and queued events") {
+  EventBus bus;
+  core::ObjectHandle first{0, 0};
+  core::ObjectHandle second{1, 0};
+  bus.subscribe(first, plugin(1), EventFilter{Event::OBJECT_CREATED});
+  bus.subscribe(first, plugin(2), EventFilter{Event::OBJECT_CREATED});
+  bus.subscribe(second, plugin(1), EventFilter{Event::OBJECT_CREATED});
+  bus.emit(Event{Event::OBJECT_CREATED, "a"});
+  vector<EventBus::Receiver> received;
+  bus.dispatch(&received);
+  REQUIRE(received.size() == 3);
+
+  bus.unsubscribe(first);
+  REQUIRE(bus.take(first, plugin(1)).empty());
+  REQUIRE(bus.take(second, plugin(1)).size() == 1);
+  bus.unsubscribe(second, plugin(1));
+  REQUIRE_FALSE(bus.wants(Event::OBJECT_CREATED));
+}
+
+TEST_CASE("Event driven receivers go idle once their queue is empty") {
+  EventBus bus;
+  core::ObjectHandle object{0, 0};
+  bus.subscribe(object, plugin(1), EventFilter{Event::CUSTOM});
+  bus.setEventDriven(object, plugin(1), true);
+  vector<EventBus::Receiver> idle;
+  bus.idle(&idle);
+  REQUIRE(idle.size() == 1);
+  idle.clear();
+  bus.idle(&idle);
+  REQUIRE(idle.empty());
+
+  bus.emit(Event{Event::CUSTOM, "", "", "ping"});
+  vector<EventBus::Receiver> received;
+  bus.dispatch(&received);
+  bus.idle(&idle);
+  REQUIRE(idle.empty());
+  bus.take(object, plugin(1));
+  bus.idle(&idle);
+  REQUIRE(idle.size() == 1);
+}
+
+TEST_CASE("Full queues drop events") {
+  EventBus bus;
+  core::ObjectHandle object{0, 0};
+  bus.subscribe(object, plugin(1), EventFilter{Event::CUSTOM});
+  for (size_t i = 0; i < EventBus::MAX_QUEUED + 10; i++)
+    bus.emit(Event{Event::CUSTOM, "", "", "ping"});
+  vector<EventBus::Receiver> received;
+  bus.dispatch(&received);
+  REQUIRE(bus.take(object, plugin(1)).size() == EventBus::MAX_QUEUED);
+  REQUIRE(bus.dropped() == 10);
+}
+
+TEST_CASE("World raises transform and object events") {
+  auto world = core::Worlds::createNew("world");
+  auto listener = std::make_shared<ListenerPlugin>("listener", vector<EventFilter>{
+    EventFilter{Event::TRANSFORM_CHANGED, "mover"},
+    EventFilter{Event::OBJECT_CREATED},
+    EventFilter{Event::OBJECT_DELETED}}, false);
+  world->newObject("listener");
+  world->savePluginToObject("listener", listener);
+  auto mover = world->newObject("mover");
+  world->newObject("still");
+  world->round();
+
+  mover->setPosition(t::position{1, 0, 0});
+  world->newObject("created");
+  world->deleteObject("still");
+  world->round();
+  REQUIRE(listener->received.size() == 3);
+  REQUIRE(listener->received[0].type == Event::OBJECT_CREATED);
+  REQUIRE(listener->received[0].objectId == "created");
+  REQUIRE(listener->received[1].type == Event::OBJECT_DELETED);
+  REQUIRE(listener->received[2].type == Event::TRANSFORM_CHANGED);
+  REQUIRE(listener->received[2].objectId == "mover");
+
+  world->round();
+  REQUIRE(listener->received.size() == 3);
+}
+
+TEST_CASE("Event driven plugins only run with events") {
+  auto world = core::Worlds::createNew("world");
+  auto listener = std::make_shared<ListenerPlugin>("listener",
+    vector<EventFilter>{EventFilter{Event::CUSTOM, "", "ping"}}, true);
+  world->newObject("listener");
+  world->savePluginToObject("listener", listener);
+  world->setWorkers(2);
+  for (int i = 0; i < 5; i++)
+    world->round();
+  REQUIRE(listener->runs == 1);
+
+  world->emit(Event{Event::CUSTOM, "someone", "", "ping"});
+  world->emit(Event{Event::CUSTOM, "someone", "", "pong"});
+  for (int i = 0; i < 5; i++)
+    world->round();
+  REQUIRE(listener->runs == 2);
+  REQUIRE(listener->received.size() == 1);
+  REQUIRE(listener->received[0].objectId == "someone");
+}
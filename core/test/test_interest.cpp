@@ -0,0 +1,194 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "test.hpp"
+#include "../src/core.hpp"
+#include "../src/interest.hpp"
+
+using std::string;
+using std::shared_ptr;
+
+class RecordingSink : public core::InterestSink {
+ public:
+  void update(const string& objectId, const core::UpdateCommand& command) override {
+    updates.push_back(objectId);
+    if (auto c = std::get_if<core::command::SetPosition>(&command))
+      lastX[objectId] = c->position.x;
+  }
+  void transform(core::IObject* object, bool entered) override {
+    (entered ? entered_ : refreshed).push_back(object->getId());
+    lastX[object->getId()] = object->getPosition().x;
+  }
+  void leave(const string& objectId) override { left.push_back(objectId); }
+
+  void clear() {
+    updates.clear();
+    entered_.clear();
+    refreshed.clear();
+    left.clear();
+  }
+
+  vector<string> updates;
+  vector<string> entered_;
+  vector<string> refreshed;
+  vector<string> left;
+  std::map<string, double> lastX;
+};
+
+static void moveTo(shared_ptr<core::IWorld> world, const string& id, double x) {
+  world->enqueue(core::command::SetPosition{world->getObject(id)->getHandle(), t::position{x, 0, 0}});
+}
+
+TEST_CASE("Interest only forwards updates inside the area") {
+  auto world = core::Worlds::createNew("id");
+  world->newObject("near")->setPosition(t::position{5, 0, 0});
+  world->newObject("far")->setPosition(t::position{500, 0, 0});
+  core::InterestManager interest(world);
+  auto sink = std::make_shared<RecordingSink>();
+  core::Interest area;
+  area.radius = 100;
+  area.fullRateRadius = 100;
+  interest.subscribe(area, sink);
+
+  interest.flush();
+  REQUIRE(sink->entered_ == vector<string>{"near"});
+  sink->clear();
+
+  moveTo(world, "near", 6);
+  moveTo(world, "far", 501);
+  world->round();
+  interest.flush();
+  REQUIRE(sink->updates == vector<string>{"near"});
+
+  // Crossing the border: leave right away, enter once applied.
+  sink->clear();
+  moveTo(world, "near", 200);
+  moveTo(world, "far", 50);
+  world->round();
+  interest.flush();
+  REQUIRE(sink->left == vector<string>{"near"});
+  REQUIRE(sink->entered_ == vector<string>{"far"});
+  REQUIRE(sink->updates.empty());
+
+  sink->clear();
+  world->enqueue(core::command::DeleteObject{world->getObject("far")->getHandle()});
+  core::command::CreateObject create;
+  create.id = "new";
+  create.position = t::position{1, 1, 1};
+  world->enqueue(create);
+  world->round();
+  interest.flush();
+  REQUIRE(sink->left == vector<string>{"far"});
+  REQUIRE(sink->entered_ == vector<string>{"new"});
+  REQUIRE(interest.getStats().dropped > 0);
+}
+
+TEST_CASE("Interest reuses the slots of deleted objects") {
+  auto world = core::Worlds::createNew("id");
+  core::InterestManager interest(world);
+  auto sink = std::make_shared<RecordingSink>();
+  interest.subscribe(core::Interest{}, sink);
+
+  for (int i = 0; i < 100; i++) {
+    auto id = "object-" + std::to_string(i);
+    core::command::CreateObject create;
+    create.id = id;
+    world->enqueue(create);
+    world->round();
+    interest.flush();
+    REQUIRE(sink->entered_ == vector<string>{id});
+    moveTo(world, id, 1);
+    world->enqueue(core::command::DeleteObject{world->getObject(id)->getHandle()});
+    world->round();
+    interest.flush();
+    REQUIRE(sink->updates == vector<string>{id});
+    REQUIRE(sink->left == vector<string>{id});
+    sink->clear();
+  }
+  REQUIRE(interest.getStats().slots == 0);
+}
+
+TEST_CASE("Interest throttles far objects") {
+  auto world = core::Worlds::createNew("id");
+  world->newObject("near")->setPosition(t::position{1, 0, 0});
+  world->newObject("far")->setPosition(t::position{99, 0, 0});
+  core::InterestManager interest(world);
+  auto sink = std::make_shared<RecordingSink>();
+  core::Interest area;
+  area.radius = 100;
+  area.fullRateRadius = 10;
+  area.maxInterval = 8;
+  interest.subscribe(area, sink);
+  interest.flush();
+  sink->clear();
+
+  for (int i = 0; i < 32; i++) {
+    moveTo(world, "near", 1 + i * 0.01);
+    moveTo(world, "far", 99 - i * 0.01);
+    world->round();
+    interest.flush();
+  }
+  auto nearCount = std::count(sink->updates.begin(), sink->updates.end(), "near");
+  auto farCount = std::count(sink->updates.begin(), sink->updates.end(), "far") + sink->refreshed.size();
+  REQUIRE(nearCount == 32);
+  REQUIRE(farCount >= 3);
+  REQUIRE(farCount <= 5);
+  REQUIRE(interest.getStats().throttled > 0);
+
+  // The last position still gets through once due.
+  for (int i = 0; i < 8; i++) {
+    world->round();
+    interest.flush();
+  }
+  REQUIRE(sink->lastX["far"] == Approx(99 - 31 * 0.01));
+}
+
+TEST_CASE("Interest follows an object") {
+  auto world = core::Worlds::createNew("id");
+  world->newObject("avatar");
+  for (int i = 1; i <= 10; i++)
+    world->newObject("object-" + std::to_string(i))->setPosition(t::position{i * 100.0, 0, 0});
+  core::InterestManager interest(world);
+  auto sink = std::make_shared<RecordingSink>();
+  core::Interest area;
+  area.follow = "avatar";
+  area.radius = 60;
+  auto subscriber = interest.subscribe(area, sink);
+  interest.flush();
+  REQUIRE(sink->entered_ == vector<string>{"avatar"});
+
+  // Objects that did not move come into view as the area moves.
+  sink->clear();
+  moveTo(world, "avatar", 480);
+  world->round();
+  interest.flush();
+  REQUIRE(sink->entered_ == vector<string>{"object-5"});
+  REQUIRE(sink->left.empty());
+  REQUIRE(interest.getStats().scans == 2);
+
+  sink->clear();
+  interest.unsubscribe(subscriber);
+  moveTo(world, "avatar", 490);
+  world->round();
+  interest.flush();
+  REQUIRE(sink->updates.empty());
+}
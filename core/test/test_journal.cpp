@@ -0,0 +1,232 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <filesystem>
+#include <fstream>
+
+#include "test.hpp"
+#include "../src/core.hpp"
+#include "../src/journal.hpp"
+#include "../src/snapshot.hpp"
+
+using std::string;
+namespace fs = std::filesystem;
+
+static void removeSnapshot(const string& file) {
+  fs::remove(file);
+  fs::remove(file + core::journal::SUFFIX);
+  fs::remove(file + core::journal::COMPACTING_SUFFIX);
+}
+
+TEST_CASE("Incremental save writes only changes") {
+  auto file = string("test_incremental.bin");
+  removeSnapshot(file);
+  auto world = core::Worlds::createNew("id");
+  world->newObject("moved");
+  world->newObject("deleted");
+  world->newObject("scripted");
+  world->saveIncremental(file);
+  REQUIRE(fs::exists(file));
+  REQUIRE(!fs::exists(file + core::journal::SUFFIX));
+
+  world->saveIncremental(file);
+  REQUIRE(!fs::exists(file + core::journal::SUFFIX));
+
+  world->getObject("moved")->setPosition(t::position{1, 2, 3});
+  world->deleteObject("deleted");
+  world->saveScriptToObject("scripted", "hello", "print('hello')");
+  world->newObject("created")->setScale(t::scale{2, 2, 2});
+  world->saveIncremental(file);
+  REQUIRE(fs::exists(file + core::journal::SUFFIX));
+
+  size_t entries = 0;
+  auto journalFile = file + core::journal::SUFFIX;
+  REQUIRE(core::Journals::replay(journalFile, [&](const core::JournalEntry& e) { entries++; })
+    == fs::file_size(journalFile));
+  REQUIRE(entries == 4);
+
+  auto loaded = core::Worlds::loadSnapshot("id", file);
+  REQUIRE(loaded->listObjectIds() == vector<string>{"created", "moved", "scripted"});
+  REQUIRE(loaded->getObject("moved")->getPosition() == t::position{1, 2, 3});
+  REQUIRE(loaded->getObject("created")->getScale() == t::scale{2, 2, 2});
+  REQUIRE(loaded->getObject("scripted")->listPluginIds() == vector<string>{"hello"});
+
+  // Loading takes the file over: further saves keep appending to it.
+  loaded->getObject("moved")->setPosition(t::position{4, 5, 6});
+  loaded->saveIncremental(file);
+  REQUIRE(core::Worlds::loadSnapshot("id", file)->getObject("moved")->getPosition() == t::position{4, 5, 6});
+
+  removeSnapshot(file);
+}
+
+TEST_CASE("Journal batches cut short are ignored") {
+  auto file = string("test_incremental.bin");
+  removeSnapshot(file);
+  auto world = core::Worlds::createNew("id");
+  auto object = world->newObject("id");
+  world->saveIncremental(file);
+  object->setPosition(t::position{1, 1, 1});
+  world->saveIncremental(file);
+  object->setPosition(t::position{2, 2, 2});
+  world->saveIncremental(file);
+
+  auto journalFile = file + core::journal::SUFFIX;
+  fs::resize_file(journalFile, fs::file_size(journalFile) - 1);
+  REQUIRE(core::Worlds::loadSnapshot("id", file)->getObject("id")->getPosition() == t::position{1, 1, 1});
+
+  removeSnapshot(file);
+}
+
+TEST_CASE("Journals are cut at a torn batch before appending") {
+  auto file = string("test_incremental.bin");
+  removeSnapshot(file);
+  auto world = core::Worlds::createNew("id");
+  auto object = world->newObject("id");
+  world->saveIncremental(file);
+  object->setPosition(t::position{1, 1, 1});
+  world->saveIncremental(file);
+  auto journalFile = file + core::journal::SUFFIX;
+  auto good = fs::file_size(journalFile);
+  object->setPosition(t::position{2, 2, 2});
+  world->saveIncremental(file);
+  fs::resize_file(journalFile, fs::file_size(journalFile) - 1);
+
+  auto loaded = core::Worlds::loadSnapshot("id", file);
+  REQUIRE(fs::file_size(journalFile) == good);
+  loaded->getObject("id")->setPosition(t::position{3, 3, 3});
+  loaded->saveIncremental(file);
+  REQUIRE(core::Worlds::loadSnapshot("id", file)->getObject("id")->getPosition() == t::position{3, 3, 3});
+
+  // Streamed in, the world takes the file over just the same.
+  fs::resize_file(journalFile, fs::file_size(journalFile) - 1);
+  auto streamed = core::Worlds::stream("id", file);
+  streamed->round();
+  REQUIRE(fs::file_size(journalFile) == good);
+  REQUIRE(streamed->getObject("id")->getPosition() == t::position{1, 1, 1});
+
+  // Torn within the header of a first batch.
+  removeSnapshot(file);
+  world->saveIncremental(file);
+  std::ofstream(journalFile, std::ios::binary).write(core::journal::MAGIC, 3);
+  REQUIRE(core::Worlds::loadSnapshot("id", file)->getObject("id")->getPosition() == t::position{2, 2, 2});
+  REQUIRE(fs::file_size(journalFile) == 0);
+
+  removeSnapshot(file);
+}
+
+TEST_CASE("Failed snapshots keep the previous file and its journal") {
+  auto file = string("test_incremental.bin");
+  removeSnapshot(file);
+  auto world = core::Worlds::createNew("id");
+  world->newObject("moved");
+  world->saveIncremental(file);
+  world->getObject("moved")->setPosition(t::position{1, 2, 3});
+  world->saveIncremental(file);
+  REQUIRE(fs::exists(file + core::journal::SUFFIX));
+
+  // A directory in the way makes the new file impossible to write.
+  auto writing = file + core::snapshot::WRITING_SUFFIX;
+  fs::create_directory(writing);
+  world->getObject("moved")->setPosition(t::position{4, 5, 6});
+  REQUIRE_THROWS_AS(world->saveSnapshot(file), std::runtime_error);
+  REQUIRE(fs::exists(file + core::journal::SUFFIX));
+  REQUIRE(core::Worlds::loadSnapshot("id", file)->getObject("moved")->getPosition() == t::position{1, 2, 3});
+
+  fs::remove(writing);
+  world->saveSnapshot(file);
+  REQUIRE(!fs::exists(writing));
+  REQUIRE(!fs::exists(file + core::journal::SUFFIX));
+  REQUIRE(core::Worlds::loadSnapshot("id", file)->getObject("moved")->getPosition() == t::position{4, 5, 6});
+
+  removeSnapshot(file);
+}
+
+TEST_CASE("World batches hold every object once") {
+  auto world = core::Worlds::createNew("id");
+  for (int i = 0; i < 100; i++)
+    world->newObject(std::to_string(i))->setPosition(t::position{1.0 * i, 0, 0});
+  world->saveScriptToObject("7", "script", "local x = 1");
+
+  auto batches = world->saveBatches(512);
+  REQUIRE(batches.size() > 1);
+  size_t objects = 0;
+  for (auto const& batch : batches) {
+    core::Journals::read(batch, [&](const core::JournalEntry& entry) {
+      REQUIRE(entry.kind == core::journal::OBJECT);
+      REQUIRE(entry.position.x == std::stod(string(entry.id)));
+      REQUIRE(entry.plugins.size() == (entry.id == "7" ? 1 : 0));
+      objects++;
+    });
+  }
+  REQUIRE(objects == 100);
+}
+
+TEST_CASE("Journal compaction") {
+  auto snapshotFile = string("test_incremental.bin");
+  auto journalFile = snapshotFile + core::journal::SUFFIX;
+  removeSnapshot(snapshotFile);
+  auto world = core::Worlds::createNew("id");
+  world->newObject("a");
+  world->newObject("b");
+  world->saveIncremental(snapshotFile);
+
+  world->deleteObject("a");
+  world->newObject("a")->setPosition(t::position{1, 2, 3});
+  world->getObject("b")->setRotation(t::rotation{0, 0, 0, 1});
+  world->newObject("c");
+  world->saveScriptToObject("c", "hello", "print('hello')");
+  world->saveIncremental(snapshotFile);
+
+  core::Journals::compact(snapshotFile, journalFile);
+  fs::remove(journalFile);
+
+  auto loaded = core::Worlds::loadSnapshot("id", snapshotFile);
+  REQUIRE(loaded->listObjectIds() == vector<string>{"a", "b", "c"});
+  REQUIRE(loaded->getObject("a")->getPosition() == t::position{1, 2, 3});
+  REQUIRE(loaded->getObject("b")->getRotation() == t::rotation{0, 0, 0, 1});
+  REQUIRE(loaded->getObject("c")->listPluginIds() == vector<string>{"hello"});
+
+  removeSnapshot(snapshotFile);
+}
+
+TEST_CASE("Large journals are compacted in the background") {
+  auto file = string("test_incremental.bin");
+  removeSnapshot(file);
+  {
+    auto world = core::Worlds::createNew("id");
+    for (int i = 0; i < 20000; i++)
+      world->newObject(std::to_string(i));
+    world->saveIncremental(file);
+    // Each round of changes journals more than half the snapshot size.
+    for (int round = 1; round <= 3; round++) {
+      for (int i = 0; i < 20000; i++)
+        world->getObject(std::to_string(i))->setPosition(t::position{1.0 * round, 0, 0});
+      world->saveIncremental(file);
+    }
+  }
+  REQUIRE(!fs::exists(file + core::journal::COMPACTING_SUFFIX));
+  {
+    // At least the first round has been folded into the snapshot.
+    core::Snapshot snapshot(file);
+    REQUIRE(snapshot.position(123).x >= 1);
+  }
+  auto loaded = core::Worlds::loadSnapshot("id", file);
+  REQUIRE(loaded->objectCount() == 20000);
+  REQUIRE(loaded->getObject("123")->getPosition() == t::position{3, 0, 0});
+
+  removeSnapshot(file);
+}
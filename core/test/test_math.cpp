@@ -0,0 +1,93 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include "test.hpp"
+#include "../src/math.hpp"
+
+using std::vector;
+
+template <typename T>
+static vector<t::quat<T>> randomQuats(size_t count, uint32_t seed) {
+  std::mt19937 random(seed);
+  std::uniform_real_distribution<T> value(-1, 1);
+  vector<t::quat<T>> result(count);
+  for (auto& q : result)
+    q = t::quat<T>{value(random), value(random), value(random), value(random)};
+  return result;
+}
+
+template <typename T>
+static void requireNear(const t::quat<T>& a, const t::quat<T>& b, T epsilon) {
+  REQUIRE(std::abs(a.x - b.x) < epsilon);
+  REQUIRE(std::abs(a.y - b.y) < epsilon);
+  REQUIRE(std::abs(a.z - b.z) < epsilon);
+  REQUIRE(std::abs(a.w - b.w) < epsilon);
+}
+
+TEMPLATE_TEST_CASE("Batch quaternion multiply and normalize", "", float, double) {
+  auto a = randomQuats<TestType>(100, 1);
+  auto b = randomQuats<TestType>(100, 2);
+  vector<t::quat<TestType>> out(100);
+
+  t::batch::multiply(a.data(), b.data(), out.data(), out.size());
+  for (size_t i = 0; i < out.size(); i++)
+    requireNear(out[i], a[i] * b[i], TestType(1e-5));
+
+  auto normalized = a;
+  normalized.push_back(t::quat<TestType>{0, 0, 0, 0});
+  t::batch::normalize(normalized.data(), normalized.size());
+  for (size_t i = 0; i < a.size(); i++)
+    requireNear(normalized[i], t::normalize(a[i]), TestType(1e-5));
+  REQUIRE(normalized.back() == t::quat<TestType>{0, 0, 0, 0});
+}
+
+TEMPLATE_TEST_CASE("Batch transform points and compose", "", float, double) {
+  using T = TestType;
+  auto rotations = randomQuats<T>(64, 3);
+  t::batch::normalize(rotations.data(), rotations.size());
+  vector<t::transform<T>> parents, children, composed(64);
+  vector<t::vec3<T>> points, transformed(64);
+  for (size_t i = 0; i < 64; i++) {
+    T v = T(i) / 8;
+    parents.push_back(t::transform<T>{t::vec3<T>{v, 1, -v}, rotations[i], t::vec3<T>{2, 1, 0.5}});
+    children.push_back(t::transform<T>{t::vec3<T>{1, v, 0}, rotations[63 - i], t::vec3<T>{1, 3, 1}});
+    points.push_back(t::vec3<T>{v, -v, 1});
+  }
+
+  auto matrix = t::toMatrix(parents[5]);
+  t::batch::transformPoints(matrix, points.data(), transformed.data(), points.size());
+  for (size_t i = 0; i < points.size(); i++) {
+    auto expected = t::transformPoint(matrix, points[i]);
+    REQUIRE(transformed[i].x == Approx(expected.x));
+    REQUIRE(transformed[i].y == Approx(expected.y));
+    REQUIRE(transformed[i].z == Approx(expected.z));
+  }
+
+  t::batch::compose(parents.data(), children.data(), composed.data(), parents.size());
+  for (size_t i = 0; i < parents.size(); i++) {
+    auto expected = t::compose(parents[i], children[i]);
+    REQUIRE(composed[i].position.x == Approx(expected.position.x));
+    REQUIRE(composed[i].position.y == Approx(expected.position.y));
+    REQUIRE(composed[i].position.z == Approx(expected.position.z));
+    requireNear(composed[i].rotation, expected.rotation, T(1e-5));
+    REQUIRE(composed[i].scale == expected.scale);
+  }
+}
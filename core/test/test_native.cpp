@@ -0,0 +1,166 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <yaml-cpp/yaml.h>
+#include <filesystem>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "test.hpp"
+#include "../src/core.hpp"
+#include "../src/native.hpp"
+
+using std::string;
+using std::vector;
+using core::NativeSpec;
+using core::Natives;
+namespace fs = std::filesystem;
+
+// Built next to the tests from test/native_plugin.cpp, see CMakeLists.txt.
+static const string MODULE = TEST_NATIVE_MODULE;
+
+TEST_CASE("Native plugins update all their objects in one batch") {
+  auto world = core::Worlds::createNew("id");
+  world->setPhysics(core::PhysicsOptions{0.5});
+  for (int i = 0; i < 5; i++) {
+    auto id = std::to_string(i);
+    world->newObject(id)->setPosition(t::position{double(i), 0, 0});
+    world->savePluginToObject(id, Natives::asPlugin("move", NativeSpec{MODULE, "mover", "2 0 " + id}));
+    world->savePluginToObject(id, Natives::asPlugin("count", NativeSpec{MODULE, "counter"}));
+  }
+  vector<string> moved;
+  world->addUpdateListener([&](const string& id, const core::UpdateCommand& command) {
+    if (std::holds_alternative<core::command::SetPosition>(command))
+      moved.push_back(id);
+  });
+  auto listener = Natives::asPlugin("listener", NativeSpec{MODULE, "counter"});
+  auto first = world->getObject("0");
+  world->subscribe(first.get(), listener.get(), core::EventFilter{core::Event::CUSTOM, "", "batch"});
+
+  world->round();
+  world->round();
+  REQUIRE(world->getObject("0")->getPosition() == t::position{2, 0, 0});
+  REQUIRE(world->getObject("3")->getPosition() == t::position{5, 0, 3});
+  REQUIRE(moved.size() == 10);
+  auto events = world->takeEvents(first.get(), listener.get());
+  // Events reach subscribers the round after they are emitted.
+  REQUIRE(events.size() == 1);
+  REQUIRE(events[0].data == "5");
+  // Moved objects are where the spatial index and the saves see them.
+  REQUIRE(world->queryRadius(t::position{5, 0, 3}, 0.1) == vector<string>{"3"});
+
+  world->getObject("3")->removePlugin("move");
+  world->deleteObject("1");
+  world->round();
+  REQUIRE(world->getObject("3")->getPosition() == t::position{5, 0, 3});
+  REQUIRE(world->getObject("4")->getPosition() == t::position{7, 0, 6});
+  world->round();
+  REQUIRE(world->takeEvents(first.get(), listener.get()).back().data == "4");
+}
+
+TEST_CASE("Native plugins run on their own outside of worlds") {
+  auto world = core::Worlds::createNew("id");
+  auto object = world->newObject("a");
+  auto plugin = Natives::asPlugin("move", NativeSpec{MODULE, "mover", "3 0 0"});
+  plugin->execute(world.get(), object.get());
+  REQUIRE(object->getPosition().x == Approx(3 * core::PhysicsOptions{}.timeStep));
+}
+
+TEST_CASE("Native modules are checked when loaded") {
+  REQUIRE_THROWS_AS(Natives::asPlugin("p", NativeSpec{"missing_module.so", "mover"}), std::runtime_error);
+  REQUIRE_THROWS_AS(Natives::asPlugin("p", NativeSpec{MODULE, "missing"}), std::runtime_error);
+  REQUIRE_THROWS_WITH(Natives::asPlugin("p", NativeSpec{TEST_NATIVE_FUTURE_MODULE, "mover"}),
+    Catch::Contains("ABI version 2"));
+  REQUIRE_THROWS_AS(Natives::asPlugin("p", string("\x40\0\0\0short", 9)), std::runtime_error);
+}
+
+TEST_CASE("Native plugins from the network need an allowed module") {
+  std::ostringstream blob;
+  Natives::asPlugin("move", NativeSpec{MODULE, "mover", "1 0 0"})->saveTo(blob);
+  std::ostringstream missing;
+  missing << string("\x0a\0\0\0", 4) << "missing.so" << string("\x05\0\0\0", 4) << "mover";
+
+  // Refused before anything is loaded, a missing module does not throw.
+  REQUIRE(core::Plugins::fromNetwork("p", core::IPlugin::NATIVE, missing.str()) == nullptr);
+  REQUIRE(core::Plugins::fromNetwork("p", core::IPlugin::NATIVE, blob.str()) == nullptr);
+  REQUIRE(core::Plugins::fromNetwork("p", core::IPlugin::NATIVE, "junk") == nullptr);
+  Natives::allowFromNetwork(MODULE);
+  auto plugin = core::Plugins::fromNetwork("p", core::IPlugin::NATIVE, blob.str());
+  REQUIRE(plugin != nullptr);
+  REQUIRE(Natives::getSpec(plugin).config == "1 0 0");
+}
+
+TEST_CASE("Native plugins survive saving and loading") {
+  auto world = core::Worlds::createNew("id");
+  world->setPhysics(core::PhysicsOptions{1});
+  world->newObject("crate");
+  world->savePluginToObject("crate", Natives::asPlugin("move", NativeSpec{MODULE, "mover", "1 2 3"}));
+  world->save("test_native_world");
+  world->saveSnapshot("test_native.bin");
+
+  auto fromYaml = core::Worlds::load("yaml", "test_native_world");
+  auto fromSnapshot = core::Worlds::loadSnapshot("snapshot", "test_native.bin");
+  for (auto const& loaded : {fromYaml, fromSnapshot}) {
+    loaded->setPhysics(core::PhysicsOptions{1});
+    auto crate = loaded->getObject("crate");
+    REQUIRE(crate->listPluginIds() == vector<string>{"move"});
+    loaded->round();
+    REQUIRE(crate->getPosition() == t::position{1, 2, 3});
+  }
+  // Nothing goes to the assets, the module is referred to by path.
+  REQUIRE(Natives::getSpec(nullptr).library.empty());
+  auto yaml = YAML::LoadFile("test_native_world/world.yaml")["objects"][0]["plugins"][0];
+  REQUIRE(yaml["type"].as<string>() == "native");
+  REQUIRE(fs::equivalent("test_native_world" / fs::path(yaml["library"].as<string>()), MODULE));
+  REQUIRE(yaml["behaviour"].as<string>() == "mover");
+  REQUIRE(yaml["config"].as<string>() == "1 2 3");
+  fs::remove_all("test_native_world");
+  fs::remove("test_native.bin");
+}
+
+TEST_CASE("Native libraries move with their world") {
+  fs::remove_all("test_native_moved");
+  fs::create_directories("test_native_world/modules");
+  fs::copy_file(MODULE, "test_native_world/modules/mover.so");
+  {
+    auto world = core::Worlds::createNew("id");
+    world->newObject("crate");
+    world->savePluginToObject("crate", Natives::asPlugin("move", NativeSpec{"test_native_world/modules/mover.so",
+      "mover", "1 2 3"}));
+    world->save("test_native_world");
+  }
+  auto yaml = YAML::LoadFile("test_native_world/world.yaml")["objects"][0]["plugins"][0];
+  REQUIRE(yaml["library"].as<string>() == "modules/mover.so");
+
+  fs::rename("test_native_world", "test_native_moved");
+  auto world = core::Worlds::load("moved", "test_native_moved");
+  world->setPhysics(core::PhysicsOptions{1});
+  world->round();
+  REQUIRE(world->getObject("crate")->getPosition() == t::position{1, 2, 3});
+  world->save("test_native_moved");
+  yaml = YAML::LoadFile("test_native_moved/world.yaml")["objects"][0]["plugins"][0];
+  REQUIRE(yaml["library"].as<string>() == "modules/mover.so");
+
+  auto library = Natives::libraryIn("test_native_moved", "modules/mover.so");
+  REQUIRE(library == (fs::absolute("test_native_moved") / "modules/mover.so").string());
+  REQUIRE(Natives::libraryFor("test_native_moved/modules", library) == "./mover.so");
+  REQUIRE(Natives::libraryIn("test_native_moved", "mover.so") == "mover.so");
+  REQUIRE(Natives::libraryFor("test_native_moved", "mover.so") == "mover.so");
+  fs::remove_all("test_native_moved");
+}
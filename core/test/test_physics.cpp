@@ -0,0 +1,174 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "test.hpp"
+#include "../src/core.hpp"
+#include "../src/physics.hpp"
+
+using std::string;
+using std::vector;
+using core::Body;
+using core::Physics;
+namespace fs = std::filesystem;
+
+TEST_CASE("Bodies integrate forces, gravity and damping") {
+  core::PhysicsBodies bodies;
+  // Three bodies: a vector pair and the scalar tail.
+  auto falling = Physics::asPlugin("a", Body{2, t::double3{1, 0, 0}});
+  auto damped = Physics::asPlugin("b", Body{1, t::double3{0, 0, 4}, 1});
+  auto kinematic = Physics::asPlugin("c", Body{0, t::double3{0, 1, 0}});
+  bodies.attach(core::ObjectHandle{0, 0}, falling.get());
+  bodies.attach(core::ObjectHandle{1, 0}, damped.get());
+  bodies.attach(core::ObjectHandle{2, 0}, kinematic.get());
+  REQUIRE(bodies.size() == 3);
+
+  Physics::applyForce(falling, t::double3{0, 0, 8});
+  Physics::applyForce(kinematic, t::double3{100, 0, 0});
+  bodies.integrate(0, bodies.size(), 0.5, t::double3{0, -10, 0});
+
+  // Velocity first, the position moves with the new velocity.
+  REQUIRE(Physics::getBody(falling).velocity == t::double3{1, -5, 2});
+  REQUIRE(bodies.x[0] == 0.5);
+  REQUIRE(bodies.y[0] == -2.5);
+  REQUIRE(bodies.z[0] == 1);
+  REQUIRE(Physics::getBody(damped).velocity.y == Approx(-5 / 1.5));
+  REQUIRE(Physics::getBody(damped).velocity.z == Approx(4 / 1.5));
+  REQUIRE(Physics::getBody(kinematic).velocity == t::double3{0, 1, 0});
+  REQUIRE(bodies.y[2] == 0.5);
+  REQUIRE(bodies.fx[2] == 0);
+  REQUIRE(bodies.fz[0] == 0);
+}
+
+TEST_CASE("Detached bodies keep their state") {
+  core::PhysicsBodies bodies;
+  auto first = Physics::asPlugin("a", Body{1, t::double3{1, 0, 0}});
+  auto second = Physics::asPlugin("b", Body{4, t::double3{2, 0, 0}});
+  bodies.attach(core::ObjectHandle{0, 0}, first.get());
+  bodies.attach(core::ObjectHandle{1, 0}, second.get());
+  Physics::setVelocity(first, t::double3{3, 0, 0});
+  Physics::applyImpulse(second, t::double3{0, 8, 0});
+
+  bodies.detach(core::ObjectHandle{0, 0});
+  REQUIRE(bodies.size() == 1);
+  REQUIRE(Physics::getBody(first).velocity == t::double3{3, 0, 0});
+  REQUIRE(Physics::getBody(second).velocity == t::double3{2, 2, 0});
+  // Stale handles do not detach the body now in the slot.
+  bodies.detach(core::ObjectHandle{1, 1});
+  REQUIRE(bodies.size() == 1);
+
+  // Attaching to another object moves the body there.
+  bodies.attach(core::ObjectHandle{2, 0}, second.get());
+  REQUIRE(bodies.size() == 1);
+  REQUIRE(bodies.objects[0] == core::ObjectHandle{2, 0});
+  REQUIRE(Physics::getBody(second).mass == 4);
+}
+
+TEST_CASE("Physics plugins move their objects every round") {
+  auto world = core::Worlds::createNew("id");
+  world->setPhysics(core::PhysicsOptions{0.5, t::double3{0, -2, 0}});
+  auto object = world->newObject("ball");
+  object->setPosition(t::position{0, 10, 0});
+  auto body = Physics::asPlugin("body", Body{1, t::double3{2, 0, 0}});
+  world->savePluginToObject("ball", body);
+  world->newObject("still");
+  world->savePluginToObject("still", Physics::asPlugin("body", Body{0}));
+  // Moves reach the update listeners, as replication needs them to.
+  vector<std::pair<string, t::position>> moves;
+  world->addUpdateListener([&](const string& id, const core::UpdateCommand& command) {
+    if (auto move = std::get_if<core::command::SetPosition>(&command))
+      moves.emplace_back(id, move->position);
+  });
+
+  world->round();
+  REQUIRE(object->getPosition() == t::position{1, 9.5, 0});
+  REQUIRE(moves == vector<std::pair<string, t::position>>{{"ball", t::position{1, 9.5, 0}}});
+  world->round();
+  REQUIRE(object->getPosition() == t::position{2, 8.5, 0});
+  REQUIRE(Physics::getBody(body).velocity == t::double3{2, -2, 0});
+  // Kinematic bodies at rest stay where they are.
+  REQUIRE(world->getObject("still")->getPosition() == t::position{0, 0, 0});
+  world->setPhysics(core::PhysicsOptions{0.5});
+  world->round();
+
+  object->removePlugin("body");
+  world->round();
+  REQUIRE(object->getPosition() == t::position{3, 7.5, 0});
+  world->round();
+  REQUIRE(object->getPosition() == t::position{3, 7.5, 0});
+  REQUIRE(Physics::getBody(body).velocity == t::double3{2, -2, 0});
+
+  world->savePluginToObject("ball", body);
+  world->deleteObject("ball");
+  world->round();
+  REQUIRE(Physics::getBody(body).velocity == t::double3{2, -2, 0});
+}
+
+TEST_CASE("Parallel physics matches serial physics") {
+  auto build = [](size_t workers) {
+    auto world = core::Worlds::createNew("id");
+    world->setWorkers(workers);
+    world->setPhysics(core::PhysicsOptions{1.0 / 90, t::double3{0, -9.81, 0}, 64});
+    for (int i = 0; i < 1000; i++) {
+      auto id = std::to_string(i);
+      world->newObject(id)->setPosition(t::position{double(i), 0, 0});
+      world->savePluginToObject(id, Physics::asPlugin("body", Body{1.0 + i % 3, t::double3{0, 0, double(i % 7)}, 0.1}));
+    }
+    for (int round = 0; round < 10; round++)
+      world->round();
+    return world;
+  };
+  auto serial = build(1);
+  auto parallel = build(4);
+  for (int i = 0; i < 1000; i += 37) {
+    auto id = std::to_string(i);
+    REQUIRE(parallel->getObject(id)->getPosition() == serial->getObject(id)->getPosition());
+  }
+  REQUIRE(serial->getObject("5")->getPosition().y < 0);
+}
+
+TEST_CASE("Bodies survive saving and loading") {
+  auto world = core::Worlds::createNew("id");
+  world->setPhysics(core::PhysicsOptions{1});
+  world->newObject("ball");
+  world->savePluginToObject("ball", Physics::asPlugin("body", Body{3, t::double3{1, 2, 3}, 0.5}));
+  world->saveScriptToObject("ball", "script", "local x = 1");
+  world->save("test_physics_world");
+  world->saveSnapshot("test_physics.bin");
+
+  auto fromYaml = core::Worlds::load("yaml", "test_physics_world");
+  auto fromSnapshot = core::Worlds::loadSnapshot("snapshot", "test_physics.bin");
+  // The body is written in place, only the script is an asset.
+  REQUIRE(vector<fs::directory_entry>(fs::directory_iterator("test_physics_world/assets"), {}).size() == 1);
+  for (auto const& loaded : {fromYaml, fromSnapshot}) {
+    loaded->setPhysics(core::PhysicsOptions{1});
+    REQUIRE(loaded->getObject("ball")->listPluginIds() == vector<string>{"body", "script"});
+    loaded->round();
+    auto moved = loaded->getObject("ball")->getPosition();
+    REQUIRE(moved.x == Approx(1 / 1.5));
+    REQUIRE(moved.z == Approx(3 / 1.5));
+  }
+
+  REQUIRE_THROWS_AS(Physics::asPlugin("body", string("short")), std::runtime_error);
+  fs::remove_all("test_physics_world");
+  fs::remove("test_physics.bin");
+}
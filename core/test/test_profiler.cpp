@@ -0,0 +1,161 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#include "test.hpp"
+#include "../src/core.hpp"
+#include "../src/profiler.hpp"
+
+using std::string;
+
+class SpinPlugin : public core::IPlugin {
+ public:
+  const string& getId() override { return id; }
+  Type getType() override { return SCRIPT; }
+  void saveToFile(const string& path) override {}
+  void saveTo(std::ostream& out) override {}
+  bool execute(core::IWorld* world, core::IObject* object) override {
+    auto pos = object->getPosition();
+    pos.x += 1;
+    object->setPosition(pos);
+    return true;
+  }
+
+ private:
+  string id = "spin";
+};
+
+// The profiler is global: every test starts from a clean, enabled one.
+struct ProfilerFixture {
+  ProfilerFixture() {
+    core::Profiler::reset();
+    core::Profiler::setEnabled(true);
+  }
+  ~ProfilerFixture() {
+    core::Profiler::setEnabled(false);
+    core::Profiler::reset();
+  }
+};
+
+static const core::ProfileStats* findStats(const vector<core::ProfileStats>& stats, const string& name) {
+  for (auto const& s : stats)
+    if (s.name == name)
+      return &s;
+  return nullptr;
+}
+
+TEST_CASE("Profiler disabled records nothing") {
+  core::Profiler::reset();
+  {
+    core::ProfileScope scope(core::Profiler::intern("disabled"));
+  }
+  REQUIRE(core::Profiler::collect().events.empty());
+  REQUIRE(core::Profiler::stats().empty());
+}
+
+TEST_CASE_METHOD(ProfilerFixture, "Profiler scopes and histograms") {
+  auto name = core::Profiler::intern("work");
+  REQUIRE(core::Profiler::intern("work") == name);
+  for (int i = 0; i < 10; i++)
+    core::ProfileScope scope(name);
+  core::Profiler::counter(core::Profiler::intern("depth"), 42);
+  core::Profiler::mark(core::Profiler::intern("oops"));
+
+  auto stats = core::Profiler::stats();
+  auto work = findStats(stats, "work");
+  REQUIRE(work != nullptr);
+  REQUIRE(work->count == 10);
+  REQUIRE(work->maxNanos >= work->p50Nanos);
+  REQUIRE(work->totalNanos >= work->maxNanos);
+  REQUIRE(findStats(stats, "depth") == nullptr);
+
+  auto log = core::Profiler::collect();
+  REQUIRE(log.events.size() == 12);
+  REQUIRE(log.names[log.events[10].name] == "depth");
+  REQUIRE(log.events[10].kind == core::ProfileEvent::COUNTER);
+  REQUIRE(log.events[10].value == 42);
+  REQUIRE(log.events[11].kind == core::ProfileEvent::MARK);
+}
+
+TEST_CASE_METHOD(ProfilerFixture, "Profiler keeps the last events of each thread") {
+  auto name = core::Profiler::intern("wrap");
+  for (size_t i = 0; i < core::Profiler::EVENTS_PER_THREAD + 10; i++)
+    core::Profiler::counter(name, i);
+  std::thread other([]() { core::Profiler::counter(core::Profiler::intern("other"), -1); });
+  other.join();
+
+  auto log = core::Profiler::collect();
+  REQUIRE(log.events.size() == core::Profiler::EVENTS_PER_THREAD + 1);
+  REQUIRE(log.events.front().value == 10);
+  REQUIRE(log.events[log.events.size() - 2].value == core::Profiler::EVENTS_PER_THREAD + 9);
+  REQUIRE(log.events.back().value == -1);
+  REQUIRE(log.events.back().thread != log.events.front().thread);
+}
+
+TEST_CASE_METHOD(ProfilerFixture, "Profiler exports") {
+  core::Profiler::counter(core::Profiler::intern("quote \" name"), 7);
+  {
+    core::ProfileScope scope(core::Profiler::intern("scope"));
+  }
+
+  std::stringstream trace;
+  core::Profiler::writeChromeTrace(trace);
+  auto json = trace.str();
+  REQUIRE(json.find("\"traceEvents\"") != string::npos);
+  REQUIRE(json.find("\"name\":\"quote \\\" name\"") != string::npos);
+  REQUIRE(json.find("\"ph\":\"C\",\"args\":{\"value\":7}") != string::npos);
+  REQUIRE(json.find("\"name\":\"scope\"") != string::npos);
+  REQUIRE(json.find("\"ph\":\"X\"") != string::npos);
+
+  std::stringstream binary;
+  core::Profiler::writeBinary(binary);
+  auto expected = core::Profiler::collect();
+  auto loaded = core::Profiler::readBinary(binary);
+  REQUIRE(loaded.names == expected.names);
+  REQUIRE(loaded.events.size() == 2);
+  REQUIRE(loaded.names[loaded.events[0].name] == "quote \" name");
+  REQUIRE(loaded.events[1].value == expected.events[1].value);
+
+  std::stringstream garbage("not a profile");
+  REQUIRE_THROWS_AS(core::Profiler::readBinary(garbage), std::runtime_error);
+}
+
+#ifdef CORE_PROFILE
+TEST_CASE_METHOD(ProfilerFixture, "Profiler instruments rounds") {
+  auto world = core::Worlds::createNew("id");
+  for (int i = 0; i < 1000; i++) {
+    auto id = std::to_string(i);
+    world->newObject(id);
+    world->savePluginToObject(id, std::make_shared<SpinPlugin>());
+  }
+  for (size_t workers : {1, 4}) {
+    world->setWorkers(workers);
+    world->round();
+  }
+
+  auto stats = core::Profiler::stats();
+  REQUIRE(findStats(stats, "round")->count == 2);
+  REQUIRE(findStats(stats, "plugins")->count == 2);
+  REQUIRE(findStats(stats, "spin")->count == 2000);
+  REQUIRE(findStats(stats, "round chunk")->count == 4);
+  REQUIRE(stats.front().name == "round");
+}
+#endif
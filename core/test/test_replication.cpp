@@ -0,0 +1,368 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "test.hpp"
+#include "../src/core.hpp"
+#include "../src/replication.hpp"
+#include "../src/scripting.hpp"
+
+using std::string;
+using std::shared_ptr;
+using core::Replicator;
+using namespace std::chrono_literals;
+
+// Cores peered with each other over one in process network.
+struct Cluster {
+  explicit Cluster(size_t count, const core::LinkConditions& conditions = {},
+      const core::ReplicationOptions& options = {}) : network{conditions} {
+    for (size_t i = 0; i < count; i++) {
+      auto address = "core-" + std::to_string(i);
+      worlds.push_back(core::Worlds::createNew(address));
+      replicators.push_back(std::make_unique<Replicator>(worlds[i], network.open(address), options));
+    }
+    for (size_t i = 0; i < count; i++)
+      for (size_t j = 0; j < count; j++)
+        if (i != j)
+          replicators[i]->addPeer("core-" + std::to_string(j));
+  }
+
+  // Every core runs a round then polls, with time moving on so that
+  // acks and retransmissions kick in.
+  void step(std::chrono::milliseconds elapsed = 10ms) {
+    now += elapsed;
+    for (auto const& world : worlds)
+      world->round();
+    for (auto const& replicator : replicators)
+      replicator->poll(now);
+  }
+
+  core::MemoryNetwork network;
+  vector<shared_ptr<core::IWorld>> worlds;
+  vector<std::unique_ptr<Replicator>> replicators;
+  Replicator::Clock::time_point now = Replicator::Clock::now();
+};
+
+static void moveTo(shared_ptr<core::IWorld> world, const string& id, double x) {
+  auto handle = world->getObject(id)->getHandle();
+  world->enqueue(core::command::SetPosition{handle, t::position{x, 0, 0}});
+}
+
+static void create(shared_ptr<core::IWorld> world, const string& id, double x = 0) {
+  core::command::CreateObject create;
+  create.id = id;
+  create.position = t::position{x, 0, 0};
+  world->enqueue(create);
+}
+
+TEST_CASE("Replicate updates between two cores") {
+  Cluster cluster(2);
+  auto a = cluster.worlds[0];
+  auto b = cluster.worlds[1];
+
+  core::command::CreateObject create;
+  create.id = "cube";
+  create.position = t::position{1, 2, 3};
+  create.plugins.push_back(core::Scripts::asPlugin("script", "local x = 1"));
+  a->enqueue(create);
+  cluster.step();
+  cluster.step();
+  REQUIRE(b->getObject("cube")->getPosition() == t::position{1, 2, 3});
+  REQUIRE(b->getObject("cube")->listPluginIds() == vector<string>{"script"});
+
+  auto handle = a->getObject("cube")->getHandle();
+  a->enqueue(core::command::SetRotation{handle, t::rotation{0, 0, 1, 0}});
+  a->enqueue(core::command::SetScale{handle, t::scale{2, 2, 2}});
+  a->enqueue(core::command::RemovePlugin{handle, "script"});
+  cluster.step();
+  auto cube = b->getObject("cube");
+  REQUIRE(cube->getRotation() == t::rotation{0, 0, 1, 0});
+  REQUIRE(cube->getScale() == t::scale{2, 2, 2});
+  REQUIRE(cube->listPluginIds().empty());
+
+  // Updates flow both ways, and applied remote ones are not sent back.
+  moveTo(b, "cube", 5);
+  cluster.step();
+  cluster.step();
+  REQUIRE(a->getObject("cube")->getPosition() == t::position{5, 0, 0});
+  REQUIRE(cluster.replicators[1]->getStats().updatesSent == 1);
+
+  a->enqueue(core::command::DeleteObject{handle});
+  cluster.step();
+  REQUIRE(b->objectCount() == 0);
+  cluster.step();
+  REQUIRE(cluster.replicators[0]->getStats().history == 0);
+  REQUIRE(cluster.replicators[1]->getStats().history == 0);
+}
+
+TEST_CASE("Replication drops duplicates and keeps emitter order") {
+  core::LinkConditions conditions;
+  conditions.duplicate = 0.5;
+  conditions.reorder = 0.5;
+  core::ReplicationOptions options;
+  options.maxDatagram = 100;
+  Cluster cluster(2, conditions, options);
+  auto a = cluster.worlds[0];
+  a->newObject("cube");
+  cluster.worlds[1]->newObject("cube");
+
+  // The same object created over and over, the last one wins.
+  for (int i = 1; i <= 100; i++)
+    create(a, "cube", i);
+  cluster.step();
+  for (int i = 0; i < 10; i++)
+    cluster.step();
+
+  REQUIRE(cluster.worlds[1]->getObject("cube")->getPosition().x == 100);
+  auto const& stats = cluster.replicators[1]->getStats();
+  REQUIRE(stats.updatesApplied == 100);
+  REQUIRE(stats.duplicates > 0);
+  REQUIRE(cluster.replicators[0]->getStats().datagramsSent > 10);
+}
+
+TEST_CASE("Replication recovers from loss") {
+  core::LinkConditions conditions;
+  conditions.loss = 0.3;
+  conditions.duplicate = 0.1;
+  conditions.reorder = 0.2;
+  Cluster cluster(3, conditions);
+  for (auto const& world : cluster.worlds)
+    for (int i = 0; i < 3; i++)
+      world->newObject("object-" + std::to_string(i));
+
+  for (int round = 1; round <= 50; round++) {
+    for (int i = 0; i < 3; i++) {
+      create(cluster.worlds[i], "made-" + std::to_string(i) + "-" + std::to_string(round));
+      moveTo(cluster.worlds[i], "object-" + std::to_string(i), round * 10 + i);
+    }
+    cluster.step();
+  }
+  cluster.network.setConditions(core::LinkConditions{});
+  for (int i = 0; i < 20; i++)
+    cluster.step(50ms);
+
+  for (auto const& world : cluster.worlds) {
+    REQUIRE(world->objectCount() == 153);
+    for (int i = 0; i < 3; i++)
+      REQUIRE(world->getObject("object-" + std::to_string(i))->getPosition().x == 500 + i);
+  }
+  REQUIRE(cluster.network.dropped() > 0);
+  uint64_t retransmitted = 0;
+  for (auto const& replicator : cluster.replicators) {
+    retransmitted += replicator->getStats().updatesRetransmitted;
+    // From each of the two others, 50 objects and the number of the moved one.
+    REQUIRE(replicator->getStats().updatesApplied == 102);
+    REQUIRE(replicator->getStats().history == 0);
+  }
+  REQUIRE(retransmitted > 0);
+}
+
+TEST_CASE("Replication drops peers that fall past the history") {
+  core::ReplicationOptions options;
+  options.maxHistory = 8;
+  Cluster cluster(2, {}, options);
+  auto a = cluster.worlds[0];
+  auto b = cluster.worlds[1];
+  a->newObject("cube");
+  b->newObject("cube");
+  moveTo(a, "cube", 1);
+  cluster.step();
+  cluster.step();
+
+  core::LinkConditions lossy;
+  lossy.loss = 1;
+  cluster.network.setConditions(lossy);
+  for (int i = 2; i <= 21; i++) {
+    create(a, "object-" + std::to_string(i));
+    moveTo(a, "cube", i);
+    cluster.step();
+  }
+  cluster.network.setConditions(core::LinkConditions{});
+  moveTo(a, "cube", 22);
+  cluster.step();
+  cluster.step();
+
+  REQUIRE(cluster.replicators[0]->getStats().lostPeers == 1);
+  vector<string> lost;
+  cluster.replicators[0]->takeLostPeers(&lost);
+  REQUIRE(lost == vector<string>{"core-1"});
+  REQUIRE(b->getObject("cube")->getPosition().x == 1);
+  REQUIRE(b->objectCount() == 1);
+
+  // Synced again, it gets updates from there on.
+  cluster.replicators[0]->addPeer("core-1");
+  moveTo(a, "cube", 23);
+  cluster.step();
+  cluster.step();
+  REQUIRE(b->getObject("cube")->getPosition().x == 23);
+  lost.clear();
+  cluster.replicators[0]->takeLostPeers(&lost);
+  REQUIRE(lost.empty());
+}
+
+TEST_CASE("Replication sends moves as frames against the last acknowledged") {
+  core::LinkConditions conditions;
+  conditions.loss = 0.3;
+  conditions.duplicate = 0.1;
+  conditions.reorder = 0.2;
+  Cluster cluster(2, conditions);
+  auto a = cluster.worlds[0];
+  auto b = cluster.worlds[1];
+  for (int i = 0; i < 50; i++)
+    create(a, "object-" + std::to_string(i));
+  for (int i = 0; i < 20; i++)
+    cluster.step();
+
+  // Every object moves, then only a few: the frames shrink to them.
+  for (int round = 1; round <= 50; round++) {
+    for (int i = 0; i < (round <= 10 ? 50 : 2); i++)
+      moveTo(a, "object-" + std::to_string(i), round + i / 1024.0);
+    cluster.step();
+  }
+  cluster.network.setConditions(core::LinkConditions{});
+  for (int i = 0; i < 10; i++)
+    cluster.step(50ms);
+
+  for (int i = 0; i < 50; i++)
+    REQUIRE(b->getObject("object-" + std::to_string(i))->getPosition().x == (i < 2 ? 50 : 10) + i / 1024.0);
+  auto const& sent = cluster.replicators[0]->getStats();
+  auto const& received = cluster.replicators[1]->getStats();
+  REQUIRE(sent.transformUpdates == 10 * 50 + 40 * 2);
+  REQUIRE(received.framesApplied > 0);
+  REQUIRE(received.framesApplied <= sent.framesSent);
+  REQUIRE(received.transformsApplied <= sent.transformUpdates);
+  // A SetPosition update took a kind, an id and three doubles.
+  REQUIRE(sent.frameBytes < sent.transformUpdates * (2 + 9 + 3 * sizeof(double)) / 4);
+
+  // Once acknowledged, an unchanged world costs a few bytes a frame.
+  auto bytes = sent.frameBytes;
+  auto frames = sent.framesSent;
+  moveTo(a, "object-0", 0);
+  cluster.step();
+  cluster.step();
+  REQUIRE(b->getObject("object-0")->getPosition().x == 0);
+  REQUIRE(sent.framesSent == frames + 1);
+  REQUIRE(sent.frameBytes - bytes < 32);
+}
+
+// UPDATES datagram deleting the object, as the emitter would send it.
+static string deleteUpdate(uint64_t emitter, uint64_t sequence, const string& objectId) {
+  auto put = [](string* out, auto value) { out->append(reinterpret_cast<const char*>(&value), sizeof(value)); };
+  string update;
+  put(&update, static_cast<uint8_t>(core::replication::DELETE_OBJECT));
+  put(&update, static_cast<uint16_t>(objectId.size()));
+  update += objectId;
+  string datagram(core::replication::MAGIC, 4);
+  put(&datagram, core::replication::VERSION);
+  put(&datagram, static_cast<uint8_t>(core::replication::UPDATES));
+  put(&datagram, static_cast<uint16_t>(1));
+  put(&datagram, emitter);
+  put(&datagram, UINT64_MAX);
+  put(&datagram, sequence);
+  put(&datagram, sequence);
+  put(&datagram, static_cast<uint32_t>(update.size()));
+  return datagram + update;
+}
+
+TEST_CASE("Replication only takes updates from peers") {
+  Cluster cluster(2);
+  create(cluster.worlds[1], "cube");
+  cluster.step();
+  cluster.step();
+  REQUIRE(cluster.worlds[0]->getObject("cube") != nullptr);
+
+  auto world = core::Worlds::createNew("stranger");
+  Replicator stranger(world, cluster.network.open("stranger"));
+  stranger.addPeer("core-0");
+  create(world, "intruder");
+  world->round();
+  stranger.poll(cluster.now);
+  cluster.step();
+  REQUIRE(cluster.worlds[0]->getObject("intruder") == nullptr);
+  REQUIRE(cluster.replicators[0]->getStats().refused == 1);
+
+  // Even a peer can't speak for an emitter first heard from another.
+  cluster.replicators[0]->addPeer("stranger");
+  auto emitter = cluster.replicators[1]->getEmitterId();
+  cluster.network.open("stranger")->send("core-0", deleteUpdate(emitter, 1000, "cube"));
+  cluster.step();
+  REQUIRE(cluster.worlds[0]->getObject("cube") != nullptr);
+  REQUIRE(cluster.replicators[0]->getStats().refused == 2);
+}
+
+TEST_CASE("Replication bounds the emitters it hears from") {
+  core::ReplicationOptions options;
+  options.maxSources = 1;
+  Cluster cluster(3, {}, options);
+  auto a = cluster.worlds[0];
+  create(cluster.worlds[1], "one");
+  cluster.step();
+  create(cluster.worlds[2], "two");
+  cluster.step();
+  cluster.step();
+  REQUIRE(a->getObject("one") != nullptr);
+  REQUIRE(a->getObject("two") == nullptr);
+  REQUIRE(cluster.replicators[0]->getStats().refused > 0);
+
+  // The emitter of a former peer makes room.
+  cluster.replicators[0]->removePeer("core-1");
+  for (int i = 0; i < 5; i++)
+    cluster.step(50ms);
+  REQUIRE(a->getObject("two") != nullptr);
+}
+
+TEST_CASE("Replication ignores malformed datagrams") {
+  Cluster cluster(1);
+  auto stranger = cluster.network.open("stranger");
+  stranger->send("core-0", "garbage");
+  stranger->send("core-0", string(core::replication::MAGIC, 4) + string(36, '\xff'));
+  cluster.step();
+  REQUIRE(cluster.replicators[0]->getStats().malformed == 2);
+}
+
+TEST_CASE("Replication over UDP loopback") {
+  auto a = core::Worlds::createNew("a");
+  auto b = core::Worlds::createNew("b");
+  auto transportA = std::make_shared<core::UdpTransport>("127.0.0.1:0");
+  auto transportB = std::make_shared<core::UdpTransport>("127.0.0.1:0");
+  Replicator ra(a, transportA);
+  Replicator rb(b, transportB);
+  ra.addPeer(transportB->getAddress());
+  rb.addPeer(transportA->getAddress());
+
+  core::command::CreateObject create;
+  create.id = "cube";
+  create.position = t::position{1, 2, 3};
+  a->enqueue(create);
+  a->round();
+  for (int i = 0; i < 1000 && b->objectCount() == 0; i++) {
+    ra.poll();
+    rb.poll();
+    std::this_thread::sleep_for(1ms);
+  }
+  REQUIRE(b->getObject("cube")->getPosition() == t::position{1, 2, 3});
+  for (int i = 0; i < 1000 && ra.getStats().history > 0; i++) {
+    ra.poll();
+    rb.poll();
+    std::this_thread::sleep_for(1ms);
+  }
+  REQUIRE(ra.getStats().history == 0);
+}
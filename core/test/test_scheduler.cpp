@@ -0,0 +1,64 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <atomic>
+#include <vector>
+
+#include "test.hpp"
+#include "../src/scheduler.hpp"
+
+using core::WorkStealingPool;
+
+TEST_CASE("Pool runs every task once") {
+  for (size_t workers : {1, 2, 4, 8}) {
+    WorkStealingPool pool(workers);
+    REQUIRE(pool.workerCount() == workers);
+
+    std::vector<std::atomic<int>> hits(1000);
+    std::atomic<bool> workerInRange = true;
+    pool.run(hits.size(), [&](size_t task, size_t worker) {
+      if (worker >= workers)
+        workerInRange = false;
+      hits[task]++;
+    });
+    REQUIRE(workerInRange);
+    for (auto& hit : hits)
+      REQUIRE(hit == 1);
+  }
+}
+
+TEST_CASE("Pool can be reused across runs") {
+  WorkStealingPool pool(4);
+  std::atomic<size_t> total = 0;
+  for (int run = 0; run < 100; run++)
+    pool.run(run, [&](size_t task, size_t worker) { total++; });
+
+  REQUIRE(total == 99 * 100 / 2);
+}
+
+TEST_CASE("Pool balances uneven tasks") {
+  WorkStealingPool pool(4);
+  std::atomic<size_t> total = 0;
+  pool.run(64, [&](size_t task, size_t worker) {
+    // All the heavy work is at the start, in the first worker's block.
+    volatile size_t spin = task < 16 ? 200000 : 10;
+    for (size_t i = 0; i < spin; i++) {}
+    total++;
+  });
+
+  REQUIRE(total == 64);
+}
@@ -0,0 +1,128 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "test.hpp"
+#include "../src/script_environment.hpp"
+
+using core::ScriptEnvironmentPool;
+
+TEST_CASE("Pool environments do not share globals") {
+  ScriptEnvironmentPool pool(2);
+  auto first = pool.acquire();
+  auto second = pool.acquire();
+
+  REQUIRE(first->getIndex() != second->getIndex());
+  REQUIRE(pool.environmentCount() == 2);
+
+  first->lua.script("shared = 'first'");
+  REQUIRE(first->lua["shared"].get<string>() == "first");
+  REQUIRE(!second->lua["shared"].valid());
+}
+
+TEST_CASE("Compiled scripts only see the sandbox") {
+  ScriptEnvironmentPool pool(2);
+  auto environment = pool.acquire();
+  auto& script = environment->compiled(pool.newScriptId(),
+    "string.leak = true kept = 1 "
+    "return os == nil and io == nil and load == nil and require == nil and debug == nil "
+    "and string.format ~= nil and wait ~= nil and _G.kept == 1");
+  REQUIRE(script().get<bool>());
+  REQUIRE(!environment->lua["kept"].valid());
+  REQUIRE(!environment->lua["string"]["leak"].valid());
+
+  // Loaded from the shared bytecode, the sandbox applies all the same.
+  auto id = pool.newScriptId();
+  environment->compiled(id, "return os == nil");
+  auto second = pool.acquire();
+  auto& cached = second->compiled(id, "return os == nil");
+  REQUIRE(pool.bytecode().stats().hits == 1);
+  REQUIRE(cached().get<bool>());
+}
+
+TEST_CASE("Pool compiles a script once per environment") {
+  ScriptEnvironmentPool pool(1);
+  auto id = pool.newScriptId();
+  {
+    auto environment = pool.acquire();
+    environment->compiled(id, "return 1");
+    environment->compiled(id, "return 1");
+    REQUIRE(environment->compiledCount() == 1);
+  }
+
+  pool.retire(id);
+  auto environment = pool.acquire();
+  REQUIRE(environment->compiledCount() == 0);
+}
+
+TEST_CASE("Pool rejects scripts with compile errors") {
+  ScriptEnvironmentPool pool(1);
+  auto environment = pool.acquire();
+  REQUIRE_THROWS(environment->compiled(pool.newScriptId(), "a == 2"));
+  // Bytecode is not verified by lua: sources that are bytecode never load.
+  string dumped = environment->lua.script("return string.dump(function() return 1 end)");
+  REQUIRE_THROWS(environment->compiled(pool.newScriptId(), dumped));
+}
+
+TEST_CASE("Pool environments are leased to one thread at a time") {
+  const size_t threads = 8;
+  const size_t iterations = 500;
+  ScriptEnvironmentPool pool(3);
+  auto id = pool.newScriptId();
+
+  // Each environment counts its runs in its own globals, the shadow counts
+  // are only touched while holding the lease so they must agree with lua.
+  std::vector<long> shadow(3, 0);
+  std::atomic<bool> consistent = true;
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back([&]() {
+      for (size_t i = 0; i < iterations; i++) {
+        auto environment = pool.acquire();
+        auto& script = environment->compiled(id, "count = (count or 0) + 1 return count");
+        long count = script().get<long>();
+        if (count != ++shadow[environment->getIndex()])
+          consistent = false;
+      }
+    });
+  }
+  for (auto& worker : workers)
+    worker.join();
+
+  REQUIRE(consistent);
+  REQUIRE(pool.environmentCount() <= 3);
+  REQUIRE(shadow[0] + shadow[1] + shadow[2] == threads * iterations);
+}
+
+TEST_CASE("Environments share compiled bytecode") {
+  ScriptEnvironmentPool pool(2);
+  auto first = pool.acquire();
+  auto second = pool.acquire();
+
+  first->compiled(pool.newScriptId(), "return 41 + 1");
+  auto stats = pool.bytecode().stats();
+  REQUIRE(stats.misses == 1);
+  REQUIRE(stats.entries == 1);
+
+  auto& script = second->compiled(pool.newScriptId(), "return 41 + 1");
+  REQUIRE(pool.bytecode().stats().hits == 1);
+  int result = script();
+  REQUIRE(result == 42);
+}
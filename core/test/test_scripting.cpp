@@ -34,11 +34,38 @@ class MockWorld: public IWorld {
     size_t objectCount() override { return 0; };
     shared_ptr<IObject> newObject(const string& id) { return NULL; }
     shared_ptr<IObject> getObject(const string& id) { return NULL; }
+    core::IObject* resolve(core::ObjectHandle handle) { return nullptr; }
     vector<string> listObjectIds() { return vector<string>(); }
     void deleteObject(const string& key) {}
+    vector<string> queryRadius(const t::position& center, double radius) { return vector<string>(); }
+    vector<string> queryBox(const t::position& min, const t::position& max) { return vector<string>(); }
+    vector<core::RayHit> queryRay(const t::position& origin, const t::double3& direction, double maxDistance) {
+      return vector<core::RayHit>();
+    }
+    vector<string> queryNearest(const t::position& point, size_t count) { return vector<string>(); }
     void saveScriptToObject(const string& objectId, const string& pluginId, const string& code) {}
+    void savePluginToObject(const string& objectId, shared_ptr<core::IPlugin> plugin) {}
+    void enqueue(core::UpdateCommand command) {}
+    uint64_t addUpdateListener(core::UpdateListener listener) { return 0; }
+    void removeUpdateListener(uint64_t id) {}
+    void sleep(core::IObject* object, core::IPlugin* plugin, const core::Wait& wait) {}
+    void signal(const string& name) {}
+    void subscribe(core::IObject* object, core::IPlugin* plugin, const core::EventFilter& filter) {}
+    void unsubscribe(core::IObject* object, core::IPlugin* plugin) {}
+    void setEventDriven(core::IObject* object, core::IPlugin* plugin, bool driven) {}
+    void emit(const core::Event& event) {}
+    vector<core::Event> takeEvents(core::IObject* object, core::IPlugin* plugin) { return vector<core::Event>(); }
+    void watchScripts(const string& path) {}
+    void setWorkers(size_t workers) {}
+    void setLowPriority(const string& pluginId, bool low) {}
+    void setLowPrioritySpread(size_t spread) {}
+    void setPhysics(const core::PhysicsOptions& options) {}
     void round() {}
+    core::LoadProgress getLoadProgress() { return core::LoadProgress{}; }
     void save(const string& path) {}
+    void saveSnapshot(const string& file) {}
+    void saveIncremental(const string& file) {}
+    vector<string> saveBatches(size_t batchBytes) { return vector<string>(); }
 
  private:
     string id;
@@ -48,13 +75,15 @@ class MockObject: public IObject {
  public:
     explicit MockObject(const string& id) : id{id} {}
     const string& getId() override { return id; };
+    core::ObjectHandle getHandle() { return core::ObjectHandle{}; }
     void setPosition(const t::position& pos) {}
-    const t::position& getPosition() { return position; }
+    t::position getPosition() { return position; }
     void setRotation(const t::rotation& pos) {}
-    const t::rotation& getRotation() { return rotation; }
+    t::rotation getRotation() { return rotation; }
     void setScale(const t::scale& pos) {}
-    const t::scale& getScale() { return scale; }
+    t::scale getScale() { return scale; }
     vector<string> listPluginIds() { return vector<string>(); }
+    void removePlugin(const string& pluginId) {}
 
  private:
     string id;
@@ -113,3 +142,186 @@ TEST_CASE("Check included library: utf8") {
   bool success = runScript("if utf8 ~= nil then print('utf8 OK') end");
   REQUIRE(success);
 }
+
+TEST_CASE("Scripts run spatial queries on the world") {
+  auto world = core::Worlds::createNew("world");
+  for (int i = 0; i < 10; i++)
+    world->newObject("object-" + std::to_string(i))->setPosition(t::position{i * 10.0, 0, 0});
+  auto self = world->getObject("object-0");
+
+  auto plugin = Scripts::asPlugin("plugin", R"script(
+local world, object, plugin = ...
+assert(#world:queryRadius(0, 0, 0, 15) == 2)
+assert(#world:queryBox(25, -1, -1, 55, 1, 1) == 3)
+local ids, distances = world:queryRay(-10, 0, 0, 1, 0, 0, 100)
+assert(ids[1] == 'object-0' and distances[1] == 9.5)
+local nearest = world:queryNearest(41, 0, 0, 2)
+assert(nearest[1] == 'object-4' and nearest[2] == 'object-5')
+  )script");
+  REQUIRE(plugin->execute(world.get(), self.get()));
+}
+
+TEST_CASE("Scripts read and write transforms through plain numbers") {
+  auto world = core::Worlds::createNew("world");
+  auto self = world->newObject("self");
+  auto other = world->newObject("other");
+  other->setPosition(t::position{1, 2, 3});
+  other->setRotation(t::rotation{0, 0, 0, 1});
+  auto plugin = Scripts::asPlugin("plugin", R"script(
+local world, object, plugin = ...
+object:setPosition(4, 5, 6)
+local x, y, z = object:getPosition()
+assert(x == 0 and y == 0 and z == 0)
+object:setScale(2, 2, 2)
+assert(select('#', object:getRotation()) == 4)
+local handle = world:find('other')
+assert(math.type(handle) == 'integer')
+assert(world:find('missing') == nil)
+x, y, z = world:getPosition(handle)
+assert(x == 1 and y == 2 and z == 3)
+world:setPosition(handle, 7, 8, 9)
+x = world:getPosition(handle)
+assert(x == 1)
+local handles = {handle, object:getHandle()}
+local out = {}
+assert(world:getPositions(handles, out) == out)
+assert(#out == 6 and out[3] == 3 and out[4] == 0)
+world:setPositions({object:getHandle()}, {10, 11, 12})
+local ids = {'stale', 'stale', 'stale'}
+assert(world:queryRadius(1, 2, 3, 0.5, ids) == ids and #ids == 1 and ids[1] == 'other')
+  )script");
+  REQUIRE(plugin->execute(world.get(), self.get()));
+  REQUIRE(self->getScale() == t::scale{1, 1, 1});
+  REQUIRE(other->getPosition() == t::position{1, 2, 3});
+  world->round();
+  REQUIRE(self->getScale() == t::scale{2, 2, 2});
+  REQUIRE(other->getPosition() == t::position{7, 8, 9});
+  REQUIRE(self->getPosition() == t::position{10, 11, 12});
+}
+
+TEST_CASE("Scripts wait for rounds and signals without running") {
+  auto world = core::Worlds::createNew("world");
+  auto object = world->newObject("waiter");
+  world->saveScriptToObject("waiter", "waiter", R"script(
+local world, object = ...
+object:setPosition(1, 0, 0)
+wait(2)
+object:setPosition(2, 0, 0)
+waitFor('go')
+object:setPosition(3, 0, 0)
+  )script");
+  world->newObject("signaller");
+  world->saveScriptToObject("signaller", "signaller", R"script(
+local world, object = ...
+waitFor('ready')
+signal('go')
+  )script");
+
+  world->round();
+  world->round();
+  REQUIRE(object->getPosition().x == 1);
+  world->round();
+  world->round();
+  REQUIRE(object->getPosition().x == 2);
+  world->signal("ready");
+  world->round();
+  REQUIRE(object->getPosition().x == 2);
+  world->round();
+  REQUIRE(object->getPosition().x == 3);
+}
+
+TEST_CASE("Scripts subscribe to events and wait for them") {
+  auto world = core::Worlds::createNew("world");
+  auto listener = world->newObject("listener");
+  world->saveScriptToObject("listener", "listener", R"script(
+local world, object = ...
+subscribe('custom', '', 'open')
+local events = waitEvents()
+assert(events[1].type == 'custom' and events[1].name == 'open')
+assert(events[1].object == 'door' and events[1].data == 'wide')
+object:setPosition(#events, 0, 0)
+  )script");
+  world->newObject("opener");
+  world->saveScriptToObject("opener", "opener", R"script(
+emit('open', 'door', 'wide')
+emit('close', 'door')
+waitFor('never')
+  )script");
+
+  world->round();
+  REQUIRE(listener->getPosition().x == 0);
+  world->round();
+  REQUIRE(listener->getPosition().x == 1);
+}
+
+TEST_CASE("Scripts cannot wait from their own coroutines") {
+  auto world = core::Worlds::createNew("world");
+  world->newObject("object");
+  auto plugin = Scripts::asPlugin("plugin", "coroutine.wrap(function() wait(1) end)()");
+  REQUIRE_FALSE(plugin->execute(world.get(), world->getObject("object").get()));
+}
+
+TEST_CASE("Runaway scripts are suspended, aborted then disabled") {
+  MockWorld world("world");
+  MockObject object("object");
+  auto plugin = Scripts::asPlugin("plugin", "while true do end");
+  Scripts::setBudget(plugin, core::ScriptBudget{10000, 0, 3, 2});
+
+  // Suspended twice, aborted the third round.
+  REQUIRE(plugin->execute(&world, &object));
+  REQUIRE(plugin->execute(&world, &object));
+  REQUIRE_FALSE(plugin->execute(&world, &object));
+  auto stats = Scripts::getStats(plugin);
+  REQUIRE(stats.suspensions == 2);
+  REQUIRE(stats.violations == 1);
+  REQUIRE(stats.disabled == 0);
+
+  for (int i = 0; i < 3; i++)
+    plugin->execute(&world, &object);
+  stats = Scripts::getStats(plugin);
+  REQUIRE(stats.violations == 2);
+  REQUIRE(stats.disabled == 1);
+  REQUIRE_FALSE(plugin->execute(&world, &object));
+  REQUIRE(Scripts::getStats(plugin).runs == stats.runs);
+
+  Scripts::enable(plugin);
+  REQUIRE(plugin->execute(&world, &object));
+  REQUIRE(Scripts::getStats(plugin).disabled == 0);
+}
+
+TEST_CASE("Suspended scripts resume where they stopped") {
+  MockWorld world("world");
+  MockObject object("object");
+  auto plugin = Scripts::asPlugin("plugin", R"script(
+local n = 0
+for i = 1, 100000 do n = n + 1 end
+assert(n == 100000)
+error('done')
+  )script");
+  Scripts::setBudget(plugin, core::ScriptBudget{100000, 0, 20, 3});
+
+  int rounds = 1;
+  while (plugin->execute(&world, &object))
+    rounds++;
+  REQUIRE(rounds > 2);
+  REQUIRE(rounds < 20);
+  REQUIRE(Scripts::getStats(plugin).suspensions == uint64_t(rounds - 1));
+  REQUIRE(Scripts::getStats(plugin).violations == 0);
+}
+
+TEST_CASE("Scripts that cannot be suspended are aborted") {
+  MockWorld world("world");
+  MockObject object("object");
+  // The comparator runs inside table.sort, a call from C.
+  auto plugin = Scripts::asPlugin("plugin", R"script(
+table.sort({3, 2, 1}, function(a, b) while true do end end)
+  )script");
+  Scripts::setBudget(plugin, core::ScriptBudget{10000, 0, 4, 3});
+  REQUIRE_FALSE(plugin->execute(&world, &object));
+  REQUIRE(Scripts::getStats(plugin).violations == 1);
+
+  auto timed = Scripts::asPlugin("timed", "while true do end");
+  Scripts::setBudget(timed, core::ScriptBudget{0, 0.005, 2, 3});
+  REQUIRE(timed->execute(&world, &object));
+  REQUIRE(Scripts::getStats(timed).suspensions == 1);
+}
@@ -0,0 +1,195 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "test.hpp"
+#include "../src/core.hpp"
+#include "../src/sleep.hpp"
+
+using std::string;
+using std::shared_ptr;
+using std::vector;
+using core::SleepSchedule;
+using core::Wait;
+
+namespace {
+
+// Counts its runs and sleeps with the same wait after each one.
+class SleepyPlugin : public core::IPlugin {
+ public:
+  SleepyPlugin(const string& id, const Wait& wait) : id{id}, wait{wait} {}
+  const string& getId() override { return id; }
+  Type getType() override { return SCRIPT; }
+  void saveToFile(const string& path) override {}
+  void saveTo(std::ostream& out) override {}
+  bool execute(core::IWorld* world, core::IObject* object) override {
+    runs++;
+    world->sleep(object, this, wait);
+    return true;
+  }
+
+  int runs = 0;
+
+ private:
+  string id;
+  Wait wait;
+};
+
+vector<uint64_t> tokens(const vector<SleepSchedule::Sleeper>& sleepers) {
+  vector<uint64_t> result;
+  for (auto const& sleeper : sleepers)
+    result.push_back(sleeper.token);
+  return result;
+}
+
+}  // namespace
+
+TEST_CASE("Sleepers wake by round, time or signal, whichever comes first") {
+  SleepSchedule schedule;
+  vector<SleepSchedule::Sleeper> woken;
+  REQUIRE(schedule.add(core::ObjectHandle{0, 0}, nullptr, Wait{}, 1, 0) == 0);
+
+  auto byRound = schedule.add(core::ObjectHandle{0, 0}, nullptr, Wait{2}, 1, 0);
+  auto byTime = schedule.add(core::ObjectHandle{1, 0}, nullptr, Wait{0, 0.5}, 1, 0);
+  auto bySignal = schedule.add(core::ObjectHandle{2, 0}, nullptr, Wait{0, 10, "door"}, 1, 0);
+  REQUIRE(schedule.size() == 3);
+
+  schedule.due(2, 0.4, &woken);
+  REQUIRE(woken.empty());
+  schedule.due(3, 0.4, &woken);
+  REQUIRE(tokens(woken) == vector<uint64_t>{byRound});
+  schedule.due(4, 0.5, &woken);
+  REQUIRE(tokens(woken) == vector<uint64_t>{byRound, byTime});
+
+  woken.clear();
+  schedule.signal("window", &woken);
+  REQUIRE(woken.empty());
+  schedule.signal("door", &woken);
+  REQUIRE(tokens(woken) == vector<uint64_t>{bySignal});
+  REQUIRE(woken[0].object == core::ObjectHandle{2, 0});
+  // Its timeout comes up later and is ignored.
+  schedule.due(5, 11, &woken);
+  REQUIRE(woken.size() == 1);
+  REQUIRE(schedule.size() == 0);
+}
+
+TEST_CASE("Cancelled sleepers never wake") {
+  SleepSchedule schedule;
+  vector<SleepSchedule::Sleeper> woken;
+  auto first = schedule.add(core::ObjectHandle{0, 0}, nullptr, Wait{0, 0, "go"}, 0, 0);
+  auto second = schedule.add(core::ObjectHandle{1, 0}, nullptr, Wait{0, 0, "go"}, 0, 0);
+  schedule.cancel(first);
+  schedule.signal("go", &woken);
+  REQUIRE(tokens(woken) == vector<uint64_t>{second});
+  // Nobody waits anymore.
+  woken.clear();
+  schedule.signal("go", &woken);
+  REQUIRE(woken.empty());
+}
+
+TEST_CASE("Sleepers woken early do not pile up") {
+  SleepSchedule schedule;
+  vector<SleepSchedule::Sleeper> woken;
+  Wait wait{1000, 3600};
+  wait.events = true;
+  auto lasting = schedule.add(core::ObjectHandle{1, 0}, nullptr, Wait{20000}, 0, 0);
+  for (uint64_t round = 0; round < 10000; round++) {
+    schedule.cancel(schedule.add(core::ObjectHandle{0, 0}, nullptr, wait, round, round * 0.01));
+    schedule.due(round, round * 0.01, &woken);
+    REQUIRE(schedule.deadlines() <= 128);
+  }
+  REQUIRE(woken.empty());
+  REQUIRE(schedule.size() == 1);
+  schedule.due(20000, 0, &woken);
+  REQUIRE(tokens(woken) == vector<uint64_t>{lasting});
+}
+
+TEST_CASE("Sleeping plugins are skipped until their wait is over") {
+  auto world = core::Worlds::createNew("world");
+  auto plugin = std::make_shared<SleepyPlugin>("sleepy", Wait{3});
+  world->newObject("object");
+  world->savePluginToObject("object", plugin);
+
+  for (int i = 0; i < 7; i++)
+    world->round();
+  // Rounds 1, 4 and 7.
+  REQUIRE(plugin->runs == 3);
+}
+
+TEST_CASE("Signals wake plugins the round after they are raised") {
+  auto world = core::Worlds::createNew("world");
+  auto waiting = std::make_shared<SleepyPlugin>("waiting", Wait{0, 0, "go"});
+  auto other = std::make_shared<SleepyPlugin>("other", Wait{0, 0, "stop"});
+  world->newObject("a");
+  world->newObject("b");
+  world->savePluginToObject("a", waiting);
+  world->savePluginToObject("b", other);
+
+  world->round();
+  world->round();
+  REQUIRE(waiting->runs == 1);
+  REQUIRE(other->runs == 1);
+
+  world->signal("go");
+  world->round();
+  world->round();
+  REQUIRE(waiting->runs == 2);
+  REQUIRE(other->runs == 1);
+}
+
+TEST_CASE("Replacing or deleting sleeping plugins drops their sleep") {
+  auto world = core::Worlds::createNew("world");
+  auto sleeping = std::make_shared<SleepyPlugin>("plugin", Wait{0, 0, "never"});
+  auto replacement = std::make_shared<SleepyPlugin>("plugin", Wait{1});
+  world->newObject("object");
+  world->newObject("deleted");
+  world->savePluginToObject("object", sleeping);
+  world->savePluginToObject("deleted", std::make_shared<SleepyPlugin>("plugin", Wait{0, 0, "never"}));
+  world->round();
+  REQUIRE(sleeping->runs == 1);
+
+  world->savePluginToObject("object", replacement);
+  world->deleteObject("deleted");
+  world->round();
+  world->round();
+  REQUIRE(replacement->runs == 2);
+  REQUIRE(sleeping->runs == 1);
+
+  // The id is free again: a new object with it starts awake.
+  world->newObject("deleted");
+  auto fresh = std::make_shared<SleepyPlugin>("plugin", Wait{1});
+  world->savePluginToObject("deleted", fresh);
+  world->round();
+  REQUIRE(fresh->runs == 1);
+}
+
+TEST_CASE("Objects sleep only when all their plugins do") {
+  auto world = core::Worlds::createNew("world");
+  auto sleeping = std::make_shared<SleepyPlugin>("sleeping", Wait{0, 0, "never"});
+  auto awake = std::make_shared<SleepyPlugin>("awake", Wait{});
+  auto object = world->newObject("object");
+  world->savePluginToObject("object", sleeping);
+  world->savePluginToObject("object", awake);
+  world->setWorkers(4);
+  for (int i = 0; i < 3; i++)
+    world->round();
+  REQUIRE(sleeping->runs == 1);
+  REQUIRE(awake->runs == 3);
+}
@@ -0,0 +1,126 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#include "test.hpp"
+#include "../src/assets.hpp"
+#include "../src/core.hpp"
+#include "../src/snapshot.hpp"
+
+using std::string;
+using std::ifstream;
+using std::ofstream;
+using std::stringstream;
+namespace fs = std::filesystem;
+
+static string readFile(const string& path) {
+  ifstream in(path, std::ios::binary);
+  stringstream buffer;
+  buffer << in.rdbuf();
+  return buffer.str();
+}
+
+TEST_CASE("Snapshot round trip") {
+  auto world = core::Worlds::createNew("id");
+  auto first = world->newObject("first");
+  first->setPosition(t::position{1, 2, 3});
+  first->setRotation(t::rotation{4, 5, 6, 7});
+  first->setScale(t::scale{8, 9, 10});
+  world->saveScriptToObject("first", "hello", "print('first')");
+  world->newObject("second");
+  world->saveScriptToObject("second", "hello", "print('second')");
+  world->saveScriptToObject("second", "other", "print('other')");
+
+  world->saveSnapshot("test_snapshot.bin");
+  auto loaded = core::Worlds::loadSnapshot("loaded", "test_snapshot.bin");
+
+  REQUIRE(loaded->getId() == "loaded");
+  REQUIRE(loaded->listObjectIds() == vector<string>{"first", "second"});
+  auto object = loaded->getObject("first");
+  REQUIRE(object->getPosition() == t::position{1, 2, 3});
+  REQUIRE(object->getRotation() == t::rotation{4, 5, 6, 7});
+  REQUIRE(object->getScale() == t::scale{8, 9, 10});
+  REQUIRE(object->listPluginIds() == vector<string>{"hello"});
+  REQUIRE(loaded->getObject("second")->getScale() == t::scale{1, 1, 1});
+  REQUIRE(loaded->getObject("second")->listPluginIds() == vector<string>{"hello", "other"});
+  loaded->round();
+
+  loaded->saveSnapshot("test_snapshot_again.bin");
+  REQUIRE(readFile("test_snapshot.bin") == readFile("test_snapshot_again.bin"));
+
+  fs::remove("test_snapshot.bin");
+  fs::remove("test_snapshot_again.bin");
+}
+
+TEST_CASE("Snapshot interns repeated ids") {
+  core::SnapshotWriter writer;
+  writer.addObject("a", t::position{}, t::rotation{}, t::scale{});
+  writer.addPlugin("script", core::IPlugin::SCRIPT, "x");
+  writer.addObject("b", t::position{}, t::rotation{}, t::scale{});
+  writer.addPlugin("script", core::IPlugin::SCRIPT, "y");
+  writer.write("test_snapshot.bin");
+
+  {
+    core::Snapshot snapshot("test_snapshot.bin");
+    REQUIRE(snapshot.objectCount() == 2);
+    REQUIRE(snapshot.objectId(1) == "b");
+    REQUIRE(snapshot.firstPlugin(1) == 1);
+    REQUIRE(snapshot.pluginCount(1) == 1);
+    REQUIRE(snapshot.pluginId(1) == "script");
+    REQUIRE(snapshot.pluginBlob(1) == "y");
+  }
+  fs::remove("test_snapshot.bin");
+}
+
+TEST_CASE("Snapshot rejects invalid files") {
+  REQUIRE_THROWS_AS(core::Snapshot("missing_snapshot.bin"), std::runtime_error);
+
+  ofstream out("test_snapshot.bin", std::ios::binary);
+  out << "VRWORLD but not really a snapshot";
+  out.close();
+  REQUIRE_THROWS_AS(core::Snapshot("test_snapshot.bin"), std::runtime_error);
+
+  core::SnapshotWriter writer;
+  writer.addObject("a", t::position{}, t::rotation{}, t::scale{});
+  writer.write("test_snapshot.bin");
+  auto bytes = readFile("test_snapshot.bin");
+  out.open("test_snapshot.bin", std::ios::binary | std::ios::trunc);
+  out << bytes.substr(0, bytes.size() - 1);
+  out.close();
+  REQUIRE_THROWS_AS(core::Snapshot("test_snapshot.bin"), std::runtime_error);
+
+  fs::remove("test_snapshot.bin");
+}
+
+TEST_CASE("Convert between yaml and snapshot") {
+  core::Worlds::convertToSnapshot("sample_worlds/simple_case", "test_snapshot.bin");
+  core::Worlds::convertToYaml("test_snapshot.bin", "sample_world_converted");
+
+  auto world = core::Worlds::load("id", "sample_world_converted");
+  auto object = world->getObject("id");
+  REQUIRE(object->getPosition() == t::position{1, 2, 3});
+  REQUIRE(object->getRotation() == t::rotation{4, 5, 6, 7});
+  REQUIRE(object->getScale() == t::scale{8, 9, 10});
+  auto source = string("print(\"Hello VR\")\n");
+  REQUIRE(readFile("sample_world_converted/assets/" + core::Assets::hash(source)) == source);
+
+  fs::remove("test_snapshot.bin");
+  fs::remove_all("sample_world_converted");
+}
@@ -0,0 +1,187 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "test.hpp"
+#include "../src/core.hpp"
+#include "../src/spatial.hpp"
+
+using std::string;
+using std::vector;
+using core::Aabb;
+using core::SpatialIndex;
+
+namespace {
+
+// Random boxes kept next to an index, queries are checked against a scan.
+struct Scene {
+  void place(uint32_t item) {
+    std::uniform_real_distribution<double> coordinate(-100, 100);
+    std::uniform_real_distribution<double> size(0.1, 4);
+    auto min = t::double3{coordinate(random), coordinate(random), coordinate(random)};
+    boxes[item] = Aabb{min, min + t::double3{size(random), size(random), size(random)}};
+    present[item] = true;
+    index.set(item, boxes[item]);
+  }
+
+  void nudge(uint32_t item) {
+    if (!present[item])
+      return;
+    std::uniform_real_distribution<double> step(-0.4, 0.4);
+    auto offset = t::double3{step(random), step(random), step(random)};
+    boxes[item] = Aabb{boxes[item].min + offset, boxes[item].max + offset};
+    index.set(item, boxes[item]);
+  }
+
+  vector<uint32_t> scan(const std::function<bool(const Aabb&)>& match) {
+    vector<uint32_t> result;
+    for (uint32_t i = 0; i < boxes.size(); i++)
+      if (present[i] && match(boxes[i]))
+        result.push_back(i);
+    return result;
+  }
+
+  std::mt19937 random{7};
+  SpatialIndex index{0.5};
+  vector<Aabb> boxes = vector<Aabb>(500);
+  vector<bool> present = vector<bool>(500);
+};
+
+vector<uint32_t> sorted(vector<uint32_t> items) {
+  std::sort(items.begin(), items.end());
+  return items;
+}
+
+}  // namespace
+
+TEST_CASE("Spatial index queries match a scan while objects move") {
+  Scene scene;
+  for (uint32_t i = 0; i < scene.boxes.size(); i++)
+    scene.place(i);
+  std::uniform_int_distribution<uint32_t> pick(0, 499);
+  std::uniform_real_distribution<double> coordinate(-100, 100);
+
+  for (int round = 0; round < 20; round++) {
+    for (int i = 0; i < 200; i++)
+      scene.nudge(pick(scene.random));
+    for (int i = 0; i < 10; i++) {
+      auto item = pick(scene.random);
+      if (scene.present[item]) {
+        scene.index.remove(item);
+        scene.present[item] = false;
+      } else {
+        scene.place(item);
+      }
+    }
+    REQUIRE(scene.index.size() == size_t(std::count(scene.present.begin(), scene.present.end(), true)));
+    // Balanced: well under the 500 levels a degenerate tree could reach.
+    REQUIRE(scene.index.height() < 30);
+
+    auto center = t::double3{coordinate(scene.random), coordinate(scene.random), coordinate(scene.random)};
+    vector<uint32_t> found;
+    scene.index.querySphere(center, 30, &found);
+    REQUIRE(sorted(found) == scene.scan([&](const Aabb& box) { return box.distanceSquared(center) <= 900; }));
+
+    auto area = Aabb{center, center + t::double3{40, 20, 60}};
+    found.clear();
+    scene.index.queryBox(area, &found);
+    REQUIRE(sorted(found) == scene.scan([&](const Aabb& box) { return box.overlaps(area); }));
+
+    vector<SpatialIndex::Hit> nearest;
+    scene.index.queryNearest(center, 5, &nearest);
+    auto all = scene.scan([](const Aabb&) { return true; });
+    std::sort(all.begin(), all.end(), [&](uint32_t a, uint32_t b) {
+      return scene.boxes[a].distanceSquared(center) < scene.boxes[b].distanceSquared(center);
+    });
+    REQUIRE(nearest.size() == 5);
+    for (size_t i = 0; i < 5; i++)
+      REQUIRE(nearest[i].distance == Approx(std::sqrt(scene.boxes[all[i]].distanceSquared(center))));
+  }
+}
+
+TEST_CASE("Spatial index rays hit nearest first") {
+  SpatialIndex index;
+  for (uint32_t i = 0; i < 10; i++)
+    index.set(i, Aabb{t::double3{i * 10.0, -1, -1}, t::double3{i * 10.0 + 2, 1, 1}});
+  index.set(10, Aabb{t::double3{50, 5, -1}, t::double3{52, 7, 1}});
+
+  vector<SpatialIndex::Hit> hits;
+  index.queryRay(t::double3{-5, 0, 0}, t::double3{1, 0, 0}, 40, &hits);
+  REQUIRE(hits.size() == 4);
+  for (uint32_t i = 0; i < 4; i++) {
+    REQUIRE(hits[i].item == i);
+    REQUIRE(hits[i].distance == Approx(5 + i * 10.0));
+  }
+
+  // Starting inside a box hits it at 0, off axis rays miss the row.
+  hits.clear();
+  index.queryRay(t::double3{51, 6, 0}, t::double3{0, 1, 0}, 100, &hits);
+  REQUIRE(hits.size() == 1);
+  REQUIRE(hits[0].item == 10);
+  REQUIRE(hits[0].distance == 0);
+}
+
+TEST_CASE("Object bounds follow scale and rotation") {
+  auto bounds = core::objectBounds(t::position{1, 2, 3}, t::rotation{0, 0, 0, 1}, t::scale{2, 4, 6});
+  REQUIRE(bounds.min == t::double3{0, 0, 0});
+  REQUIRE(bounds.max == t::double3{2, 4, 6});
+
+  // A quarter turn around y swaps the x and z extents.
+  auto half = std::sqrt(0.5);
+  bounds = core::objectBounds(t::position{0, 0, 0}, t::rotation{0, half, 0, half}, t::scale{2, 4, 6});
+  REQUIRE(bounds.max.x == Approx(3));
+  REQUIRE(bounds.max.y == Approx(2));
+  REQUIRE(bounds.max.z == Approx(1));
+}
+
+TEST_CASE("World spatial queries follow objects") {
+  auto world = core::Worlds::createNew("world");
+  for (int i = 0; i < 100; i++)
+    world->newObject("object-" + std::to_string(i))->setPosition(t::position{double(i), 0, 0});
+
+  auto around = [&](double x) {
+    auto ids = world->queryRadius(t::position{x, 0, 0}, 0.7);
+    std::sort(ids.begin(), ids.end());
+    return ids;
+  };
+  REQUIRE(around(50) == vector<string>{"object-49", "object-50", "object-51"});
+
+  // Direct moves, commands and deletes all show up in the next query.
+  world->getObject("object-10")->setPosition(t::position{50, 0, 0.5});
+  world->enqueue(core::command::SetPosition{world->getObject("object-20")->getHandle(), t::position{50, 0, -0.5}});
+  world->round();
+  world->deleteObject("object-51");
+  world->getObject("object-49")->setScale(t::scale{0.1, 0.1, 0.1});
+  REQUIRE(around(50) == vector<string>{"object-10", "object-20", "object-50"});
+  REQUIRE(around(10).size() == 2);
+
+  auto box = world->queryBox(t::position{70.6, -1, -1}, t::position{73.4, 1, 1});
+  REQUIRE(box.size() == 3);
+
+  auto hits = world->queryRay(t::position{200, 0, 0}, t::double3{-2, 0, 0}, 101.8);
+  REQUIRE(hits.size() == 2);
+  REQUIRE(hits[0].objectId == "object-99");
+  REQUIRE(hits[0].distance == Approx(100.5));
+
+  REQUIRE(world->queryNearest(t::position{-10, 0, 0}, 2) == vector<string>{"object-0", "object-1"});
+}
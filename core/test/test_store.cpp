@@ -0,0 +1,106 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <algorithm>
+
+#include "test.hpp"
+#include "../src/store.hpp"
+
+using core::ObjectStore;
+using core::ObjectHandle;
+
+TEST_CASE("Store create and find") {
+  ObjectStore<int> store;
+  auto handle = store.create("a", 1);
+
+  REQUIRE(handle.valid());
+  REQUIRE(store.size() == 1);
+  REQUIRE(store.find("a") == handle);
+  REQUIRE(store.id(handle) == "a");
+  REQUIRE(store.payload(handle) == 1);
+  REQUIRE(store.position(handle) == t::position{0, 0, 0});
+  REQUIRE(store.scale(handle) == t::scale{1, 1, 1});
+  REQUIRE(!store.find("b").valid());
+}
+
+TEST_CASE("Store destroy keeps arrays dense") {
+  ObjectStore<int> store;
+  auto a = store.create("a", 1);
+  auto b = store.create("b", 2);
+  auto c = store.create("c", 3);
+  store.position(c) = t::position{7, 8, 9};
+
+  REQUIRE(store.destroy(a));
+  REQUIRE(store.size() == 2);
+  REQUIRE(!store.contains(a));
+  REQUIRE(store.contains(b));
+  REQUIRE(store.contains(c));
+  REQUIRE(store.payload(b) == 2);
+  REQUIRE(store.payload(c) == 3);
+  REQUIRE(store.position(c) == t::position{7, 8, 9});
+  REQUIRE(store.positions.size() == 2);
+  REQUIRE(!store.destroy(a));
+}
+
+TEST_CASE("Store stale handles do not resolve to recycled slots") {
+  ObjectStore<int> store;
+  auto a = store.create("a", 1);
+  store.destroy(a);
+  auto b = store.create("b", 2);
+
+  REQUIRE(b.index == a.index);
+  REQUIRE(b != a);
+  REQUIRE(!store.contains(a));
+  REQUIRE(store.contains(b));
+}
+
+TEST_CASE("Store create with same id replaces") {
+  ObjectStore<int> store;
+  auto first = store.create("a", 1);
+  auto second = store.create("a", 2);
+
+  REQUIRE(store.size() == 1);
+  REQUIRE(!store.contains(first));
+  REQUIRE(store.payload(second) == 2);
+}
+
+TEST_CASE("Store clear") {
+  ObjectStore<int> store;
+  auto a = store.create("a", 1);
+  store.create("b", 2);
+  store.clear();
+
+  REQUIRE(store.empty());
+  REQUIRE(!store.contains(a));
+  REQUIRE(!store.find("b").valid());
+}
+
+TEST_CASE("Store dirty flags follow objects") {
+  ObjectStore<int> store;
+  auto a = store.create("a", 1);
+  auto b = store.create("b", 2);
+  REQUIRE(store.dirty == vector<uint8_t>{core::DIRTY_ALL, core::DIRTY_ALL});
+
+  std::fill(store.dirty.begin(), store.dirty.end(), core::CLEAN);
+  std::fill(store.moved.begin(), store.moved.end(), 0);
+  store.markDirty(a, core::DIRTY_PLUGINS);
+  store.markDirty(b, core::DIRTY_TRANSFORM);
+  REQUIRE(store.moved == vector<uint8_t>{0, 1});
+  store.destroy(a);
+  REQUIRE(store.dirty == vector<uint8_t>{core::DIRTY_TRANSFORM});
+  REQUIRE(store.moved == vector<uint8_t>{1});
+}
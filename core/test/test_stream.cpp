@@ -0,0 +1,194 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+
+#include "test.hpp"
+#include "../src/core.hpp"
+
+using std::string;
+namespace fs = std::filesystem;
+
+static void writeWorld(size_t count, const string& file) {
+  auto world = core::Worlds::createNew("id");
+  for (size_t i = 0; i < count; i++) {
+    auto id = "object-" + std::to_string(i);
+    world->newObject(id)->setPosition(t::position{1.0 * i, 0, 0});
+  }
+  world->saveSnapshot(file);
+}
+
+TEST_CASE("Streaming a yaml world") {
+  auto world = core::Worlds::stream("id", "sample_worlds/simple_case");
+  REQUIRE(world->objectCount() == 0);
+  REQUIRE(!world->getLoadProgress().done);
+
+  world->round();
+  auto progress = world->getLoadProgress();
+  REQUIRE(progress.done);
+  REQUIRE(progress.loaded == 1);
+  REQUIRE(progress.total == 1);
+  REQUIRE(progress.firstRoundSeconds >= 0);
+  REQUIRE(progress.loadedSeconds >= 0);
+  auto object = world->getObject("id");
+  REQUIRE(object->getPosition() == t::position{1, 2, 3});
+  REQUIRE(object->listPluginIds() == vector<string>{"hello-world"});
+}
+
+TEST_CASE("Streaming a snapshot a chunk per round") {
+  writeWorld(10, "test_stream.bin");
+  core::StreamOptions options;
+  options.chunkSize = 4;
+  auto world = core::Worlds::stream("id", "test_stream.bin", options);
+  REQUIRE(world->getLoadProgress().total == 10);
+
+  world->round();
+  REQUIRE(world->objectCount() == 4);
+  REQUIRE(world->getLoadProgress().loaded == 4);
+  REQUIRE(!world->getLoadProgress().done);
+  world->round();
+  REQUIRE(world->objectCount() == 8);
+  world->round();
+  REQUIRE(world->objectCount() == 10);
+  REQUIRE(world->getLoadProgress().done);
+  REQUIRE(world->getObject("object-9")->getPosition() == t::position{9, 0, 0});
+
+  fs::remove("test_stream.bin");
+}
+
+TEST_CASE("Streaming a snapshot replays its journal") {
+  writeWorld(3, "test_stream.bin");
+  {
+    auto world = core::Worlds::loadSnapshot("id", "test_stream.bin");
+    world->getObject("object-1")->setPosition(t::position{5, 5, 5});
+    world->deleteObject("object-2");
+    world->saveIncremental("test_stream.bin");
+  }
+
+  auto world = core::Worlds::stream("id", "test_stream.bin");
+  world->round();
+  REQUIRE(world->listObjectIds() == vector<string>{"object-0", "object-1"});
+  REQUIRE(world->getObject("object-1")->getPosition() == t::position{5, 5, 5});
+
+  fs::remove("test_stream.bin");
+  fs::remove("test_stream.bin.journal");
+}
+
+TEST_CASE("Changes made while a snapshot streams in are saved") {
+  writeWorld(6, "test_stream.bin");
+  {
+    auto world = core::Worlds::loadSnapshot("id", "test_stream.bin");
+    world->getObject("object-0")->setPosition(t::position{5, 5, 5});
+    world->deleteObject("object-4");
+    world->newObject("added")->setPosition(t::position{7, 0, 0});
+    world->saveIncremental("test_stream.bin");
+  }
+
+  core::StreamOptions options;
+  options.chunkSize = 2;
+  auto world = core::Worlds::stream("id", "test_stream.bin", options);
+  REQUIRE(world->getLoadProgress().total == 6);
+  world->round();
+  // Journal entries apply as their object comes in, not after the load.
+  REQUIRE(world->getObject("object-0")->getPosition() == t::position{5, 5, 5});
+  world->getObject("object-0")->setPosition(t::position{6, 6, 6});
+  world->deleteObject("object-1");
+  while (!world->getLoadProgress().done)
+    world->round();
+  REQUIRE(world->listObjectIds() == vector<string>{"added", "object-0", "object-2", "object-3", "object-5"});
+  world->saveIncremental("test_stream.bin");
+
+  auto loaded = core::Worlds::loadSnapshot("id", "test_stream.bin");
+  REQUIRE(loaded->listObjectIds() == vector<string>{"added", "object-0", "object-2", "object-3", "object-5"});
+  REQUIRE(loaded->getObject("object-0")->getPosition() == t::position{6, 6, 6});
+  REQUIRE(loaded->getObject("added")->getPosition() == t::position{7, 0, 0});
+
+  fs::remove("test_stream.bin");
+  fs::remove("test_stream.bin.journal");
+}
+
+TEST_CASE("Worlds whose load failed are not saved") {
+  fs::create_directories("test_stream_broken");
+  std::ofstream("test_stream_broken/world.yaml") <<
+    "objects:\n"
+    "  - id: a\n"
+    "    position: {x: 1, y: 2, z: 3}\n"
+    "    rotation: {x: 0, y: 0, z: 0, w: 1}\n"
+    "    scale: {x: 1, y: 1, z: 1}\n"
+    "    plugins: []\n"
+    "  - id: b\n"
+    "    position: {x: nope}\n";
+  for (auto background : {false, true}) {
+    core::StreamOptions options;
+    options.background = background;
+    auto world = core::Worlds::stream("id", "test_stream_broken", options);
+    for (int i = 0; i < 100000 && !world->getLoadProgress().done; i++)
+      world->round();
+    auto progress = world->getLoadProgress();
+    REQUIRE(progress.done);
+    REQUIRE(!progress.error.empty());
+    REQUIRE(world->objectCount() == 1);
+    REQUIRE_THROWS_AS(world->save("test_stream_broken"), std::runtime_error);
+    REQUIRE_THROWS_AS(world->saveSnapshot("test_stream_broken.bin"), std::runtime_error);
+    REQUIRE_THROWS_AS(world->saveIncremental("test_stream_broken.bin"), std::runtime_error);
+  }
+  REQUIRE(!fs::exists("test_stream_broken.bin"));
+  REQUIRE(!fs::exists("test_stream_broken/assets"));
+
+  fs::remove_all("test_stream_broken");
+}
+
+TEST_CASE("Streaming in background") {
+  writeWorld(1000, "test_stream.bin");
+  core::StreamOptions options;
+  options.chunkSize = 100;
+  options.background = true;
+  options.maxBuffered = 150;
+  auto world = core::Worlds::stream("id", "test_stream.bin", options);
+
+  size_t previous = 0;
+  for (int i = 0; i < 100000 && !world->getLoadProgress().done; i++) {
+    world->round();
+    REQUIRE(world->objectCount() >= previous);
+    REQUIRE(world->objectCount() - previous <= 100);
+    previous = world->objectCount();
+  }
+  REQUIRE(world->getLoadProgress().done);
+  REQUIRE(world->objectCount() == 1000);
+
+  fs::remove("test_stream.bin");
+}
+
+TEST_CASE("Saving a streamed world finishes loading it") {
+  writeWorld(100, "test_stream.bin");
+  core::StreamOptions options;
+  options.chunkSize = 10;
+  options.background = true;
+  auto world = core::Worlds::stream("id", "test_stream.bin", options);
+  world->round();
+
+  world->saveSnapshot("test_stream_again.bin");
+  REQUIRE(world->getLoadProgress().done);
+  REQUIRE(world->objectCount() == 100);
+  REQUIRE(core::Worlds::loadSnapshot("id", "test_stream_again.bin")->objectCount() == 100);
+
+  fs::remove("test_stream.bin");
+  fs::remove("test_stream_again.bin");
+}
@@ -0,0 +1,139 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <memory>
+#include <string>
+
+#include "test.hpp"
+#include "../src/core.hpp"
+#include "../src/tick.hpp"
+
+using std::string;
+using std::shared_ptr;
+
+namespace {
+
+// Counts its runs, each one costing time on a fake clock.
+class CostPlugin : public core::IPlugin {
+ public:
+  CostPlugin(const string& id, double* clock, double cost) : id{id}, clock{clock}, cost{cost} {}
+  const string& getId() override { return id; }
+  Type getType() override { return SCRIPT; }
+  void saveToFile(const string& path) override {}
+  void saveTo(std::ostream& out) override {}
+  bool execute(core::IWorld* world, core::IObject* object) override {
+    *clock += cost;
+    runs++;
+    return true;
+  }
+
+  string id;
+  double* clock;
+  double cost;
+  int runs = 0;
+};
+
+}  // namespace
+
+TEST_CASE("Tick scheduler runs rounds at a fixed rate") {
+  double now = 100;
+  auto world = core::Worlds::createNew("world");
+  auto plugin = std::make_shared<CostPlugin>("work", &now, 0.001);
+  world->newObject("object");
+  world->savePluginToObject("object", plugin);
+
+  core::TickOptions options;
+  options.rate = 10;
+  core::TickScheduler ticks(world, options, [&]() { return now; });
+  REQUIRE(ticks.advance() == Approx(100.1));
+  REQUIRE(plugin->runs == 1);
+
+  // Nothing is due before the next tick, then one round per tick.
+  now = 100.05;
+  REQUIRE(ticks.advance() == Approx(100.1));
+  REQUIRE(plugin->runs == 1);
+  for (int i = 1; i <= 5; i++) {
+    now = 100 + i * 0.1 + 0.02;
+    REQUIRE(ticks.advance() == Approx(100 + (i + 1) * 0.1));
+  }
+  REQUIRE(plugin->runs == 6);
+  REQUIRE(ticks.getStats().rounds == 6);
+  REQUIRE(ticks.getStats().maxJitter == Approx(0.02));
+  REQUIRE(ticks.getStats().meanRound == Approx(0.001));
+  REQUIRE(ticks.getStats().overruns == 0);
+}
+
+TEST_CASE("Tick scheduler catches up then drops ticks") {
+  double now = 0;
+  auto world = core::Worlds::createNew("world");
+  core::TickOptions options;
+  options.rate = 10;
+  options.maxCatchUp = 4;
+  core::TickScheduler ticks(world, options, [&]() { return now; });
+  ticks.advance();
+
+  // Ticks at 0.1 to 1.0 are due: four run, the six left are dropped.
+  now = 1.05;
+  REQUIRE(ticks.advance() == Approx(1.1));
+  REQUIRE(ticks.getStats().rounds == 5);
+  REQUIRE(ticks.getStats().dropped == 6);
+}
+
+TEST_CASE("Tick scheduler spreads low priority plugins when over budget") {
+  double now = 0;
+  auto world = core::Worlds::createNew("world");
+  auto fast = std::make_shared<CostPlugin>("fast", &now, 0);
+  auto slow = std::make_shared<CostPlugin>("slow", &now, 0.0015);
+  for (int i = 0; i < 40; i++) {
+    auto id = "object-" + std::to_string(i);
+    world->newObject(id);
+    world->savePluginToObject(id, fast);
+    world->savePluginToObject(id, slow);
+  }
+  world->setLowPriority("slow", true);
+
+  // 60ms of slow work per round against a 10ms budget.
+  core::TickOptions options;
+  options.rate = 50;
+  options.budget = 0.01;
+  options.maxSpread = 8;
+  options.recoverRounds = 4;
+  core::TickScheduler ticks(world, options, [&]() { return now; });
+  for (int i = 0; i < 3; i++) {
+    ticks.advance();
+    now += 0.02;
+  }
+  REQUIRE(ticks.getStats().overruns == 3);
+  REQUIRE(ticks.getStats().spread == 8);
+
+  // Spread over 8 rounds, every object runs its slow plugin once.
+  now = ticks.advance();
+  fast->runs = 0;
+  slow->runs = 0;
+  for (int i = 0; i < 8; i++) {
+    now = ticks.advance();
+    REQUIRE(ticks.getStats().lastRound == Approx(0.0075));
+  }
+  REQUIRE(fast->runs == 320);
+  REQUIRE(slow->runs == 40);
+
+  // Within half the budget long enough, the spread comes back down.
+  slow->cost = 0;
+  for (int i = 0; i < 12; i++)
+    now = ticks.advance();
+  REQUIRE(ticks.getStats().spread == 1);
+}
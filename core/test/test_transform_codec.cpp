@@ -0,0 +1,169 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+#include "test.hpp"
+#include "../src/transform_codec.hpp"
+
+using std::string;
+
+static t::transform<double> at(double x, double y, double z) {
+  t::transform<double> result;
+  result.position = t::double3{x, y, z};
+  return result;
+}
+
+// Angle between two rotations, q and -q being the same one.
+static double angle(const t::quatd& a, const t::quatd& b) {
+  return 2 * std::acos(std::min(1.0, std::abs(t::dot(a, b))));
+}
+
+TEST_CASE("Bit packing round trip") {
+  core::BitWriter out;
+  out.write(5, 3);
+  out.write(0, 0);
+  out.write(UINT64_MAX, 64);
+  out.write(0x1234, 13);
+  out.writeVariable(0);
+  out.writeVariable(1000000);
+  REQUIRE(out.bitCount() == 3 + 64 + 13 + 7 + 7 + 20);
+  auto bytes = out.finish();
+  REQUIRE(bytes.size() == 15);
+
+  core::BitReader in(bytes);
+  REQUIRE(in.read(3) == 5);
+  REQUIRE(in.read(0) == 0);
+  REQUIRE(in.read(64) == UINT64_MAX);
+  REQUIRE(in.read(13) == (0x1234 & 0x1fff));
+  REQUIRE(in.readVariable() == 0);
+  REQUIRE(in.readVariable() == 1000000);
+  REQUIRE_THROWS_AS(in.read(8), std::runtime_error);
+}
+
+TEST_CASE("Quantization precision") {
+  core::Quantization quantization;
+  t::transform<double> transform;
+  transform.position = t::double3{1.2345, -1000.001, 0.0004};
+  transform.rotation = t::normalize(t::quatd{0.1, -0.7, 0.3, -0.5});
+  transform.scale = t::double3{2, 0.5, 1.001};
+
+  auto result = core::dequantize(core::quantize(transform, quantization), quantization);
+  REQUIRE(std::abs(result.position.x - transform.position.x) <= quantization.positionStep / 2);
+  REQUIRE(std::abs(result.position.y - transform.position.y) <= quantization.positionStep / 2);
+  REQUIRE(std::abs(result.position.z - transform.position.z) <= quantization.positionStep / 2);
+  REQUIRE(std::abs(result.scale.z - transform.scale.z) <= quantization.scaleStep / 2);
+  REQUIRE(angle(result.rotation, transform.rotation) < 0.002);
+  REQUIRE(std::abs(t::dot(result.rotation, result.rotation) - 1) < 1e-12);
+
+  // Same rotation, opposite sign: same encoding.
+  auto negated = transform;
+  negated.rotation = t::quatd{-transform.rotation.x, -transform.rotation.y, -transform.rotation.z, -transform.rotation.w};
+  REQUIRE(core::quantize(negated, quantization) == core::quantize(transform, quantization));
+
+  quantization.rotationBits = 1;
+  REQUIRE_THROWS_AS(core::quantize(transform, quantization), std::runtime_error);
+}
+
+TEST_CASE("Transform frames without baseline") {
+  core::TransformEncoder encoder;
+  core::TransformDecoder decoder;
+  vector<core::TransformState> states = {{7, at(1, 2, 3)}, {3, at(-4, 5, 6)}, {1000, t::transform<double>{}}};
+
+  auto decoded = decoder.decode(encoder.encode(1, states));
+  REQUIRE(decoded.size() == 3);
+  REQUIRE(decoded[0].id == 3);
+  REQUIRE(decoded[0].transform.position == t::double3{-4, 5, 6});
+  REQUIRE(decoded[1].id == 7);
+  REQUIRE(decoded[1].transform.position == t::double3{1, 2, 3});
+  REQUIRE(decoded[2].id == 1000);
+  REQUIRE(decoded[2].transform == t::transform<double>{});
+
+  // Nothing acknowledged: the next frame is complete again.
+  REQUIRE(decoder.decode(encoder.encode(2, states)).size() == 3);
+}
+
+TEST_CASE("Transform frames only carry changes since the acknowledged one") {
+  core::TransformEncoder encoder;
+  core::TransformDecoder decoder;
+  vector<core::TransformState> states;
+  for (uint32_t id = 0; id < 1000; id++)
+    states.push_back({id, at(id, 0, 0)});
+  auto full = encoder.encode(1, states);
+  decoder.decode(full);
+  encoder.acknowledge(1);
+  REQUIRE(encoder.getBaseline() == 1);
+
+  auto unchanged = encoder.encode(2, states);
+  REQUIRE(unchanged.size() < 16);
+  REQUIRE(decoder.decode(unchanged).size() == 1000);
+
+  states[10].transform.position.y = 0.5;
+  states[20].transform.rotation = t::normalize(t::quatd{0, 0, 1, 1});
+  states.erase(states.begin() + 500);
+  states.push_back({5000, at(1, 1, 1)});
+  auto delta = encoder.encode(3, states);
+  REQUIRE(delta.size() < 40);
+
+  auto decoded = decoder.decode(delta);
+  REQUIRE(decoded.size() == 1000);
+  REQUIRE(decoded[10].transform.position == t::double3{10, 0.5, 0});
+  REQUIRE(angle(decoded[20].transform.rotation, states[20].transform.rotation) < 0.002);
+  REQUIRE(decoded[499].id == 499);
+  REQUIRE(decoded[500].id == 501);
+  REQUIRE(decoded.back().id == 5000);
+  REQUIRE(decoded.back().transform.position == t::double3{1, 1, 1});
+}
+
+TEST_CASE("Transform decoder needs the baseline") {
+  core::TransformEncoder encoder;
+  core::TransformDecoder decoder;
+  vector<core::TransformState> states = {{1, at(1, 0, 0)}};
+  encoder.encode(1, states);
+  encoder.acknowledge(1);
+  REQUIRE_THROWS_AS(decoder.decode(encoder.encode(2, states)), std::runtime_error);
+
+  // Acknowledging a frame no longer kept keeps the previous baseline, and
+  // losing it falls back to complete frames.
+  encoder.acknowledge(500);
+  REQUIRE(encoder.getBaseline() == 1);
+  for (uint32_t frame = 3; frame < 3 + core::TransformEncoder::MAX_FRAMES; frame++)
+    encoder.encode(frame, states);
+  REQUIRE(encoder.getBaseline() == 0);
+  REQUIRE(core::TransformDecoder().decode(encoder.encode(100, states)).size() == 1);
+}
+
+TEST_CASE("Coarser quantization takes fewer bits") {
+  vector<core::TransformState> states;
+  for (uint32_t id = 0; id < 100; id++) {
+    t::transform<double> transform = at(id * 1.1, id * 0.3, 1);
+    transform.rotation = t::normalize(t::quatd{0.1 * id, 1, 0, 1});
+    states.push_back({id, transform});
+  }
+  core::Quantization fine;
+  core::Quantization coarse;
+  coarse.positionStep = 1.0 / 16;
+  coarse.rotationBits = 6;
+  auto fineSize = core::TransformEncoder(fine).encode(1, states).size();
+  auto coarseSize = core::TransformEncoder(coarse).encode(1, states).size();
+  REQUIRE(coarseSize < fineSize);
+
+  auto decoded = core::TransformDecoder(coarse).decode(core::TransformEncoder(coarse).encode(1, states));
+  REQUIRE(std::abs(decoded[42].transform.position.x - 42 * 1.1) <= coarse.positionStep / 2);
+}
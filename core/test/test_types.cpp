@@ -15,8 +15,13 @@
     You should have received a copy of the GNU Affero General Public License
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
+#include <cmath>
+#include <type_traits>
+
 #include "test.hpp"
+#include "../src/journal.hpp"
 #include "../src/types.hpp"
+#include "../src/update_queue.hpp"
 
 TEST_CASE("Position equality", "") {
   auto pos = t::position{0, 0, 0};
@@ -83,3 +88,71 @@ TEST_CASE("Scale assignment", "") {
   s = t::scale{1, 2, 3};
   REQUIRE(s == t::scale{1, 2, 3});
 }
+
+TEST_CASE("Scale components default to one", "") {
+  REQUIRE(t::scale{} == t::scale{1, 1, 1});
+  REQUIRE(t::scale{2} == t::scale{2, 1, 1});
+  REQUIRE(t::scale{2, 3} == t::scale{2, 3, 1});
+  REQUIRE(core::JournalEntry{}.scale == t::scale{1, 1, 1});
+  REQUIRE(core::command::SetScale{}.scale == t::scale{1, 1, 1});
+
+  auto s = t::scale{};
+  s = t::double3{4, 5, 6};
+  REQUIRE(s == t::double3{4, 5, 6});
+  REQUIRE(t::transform<double>{t::position{}, t::rotation{}, s}.scale == t::double3{4, 5, 6});
+}
+
+TEST_CASE("Rotations default to the identity", "") {
+  REQUIRE(t::rotation{1, 2, 3} == t::rotation{1, 2, 3, 1});
+
+  auto rot = t::rotation{};
+  rot = t::double4{1, 2, 3, 4};
+  REQUIRE(rot == t::rotation{1, 2, 3, 4});
+  rot = t::double3{1, 2, 3};
+  REQUIRE(rot == t::rotation{1, 2, 3, 0});
+}
+
+TEST_CASE("Types are plain values", "") {
+  constexpr auto pos = t::position{1, 2, 3};
+  static_assert(pos.y == 2);
+  static_assert(std::is_trivially_copyable_v<t::rotation>);
+  REQUIRE(t::rotation{} == t::rotation{0, 0, 0, 1});
+  REQUIRE(t::transform<double>{}.scale == t::scale{1, 1, 1});
+}
+
+TEST_CASE("Quaternion rotation", "") {
+  // Quarter turn around z.
+  auto half = std::sqrt(0.5);
+  auto q = t::quatd{0, 0, half, half};
+  auto v = t::rotate(q, t::double3{1, 0, 0});
+  REQUIRE(v.x == Approx(0).margin(1e-12));
+  REQUIRE(v.y == Approx(1));
+
+  auto twice = t::rotate(q * q, t::double3{1, 0, 0});
+  REQUIRE(twice.x == Approx(-1));
+  REQUIRE(twice.y == Approx(0).margin(1e-12));
+
+  REQUIRE(t::normalize(t::quatd{0, 0, 0, 2}) == t::quatd{0, 0, 0, 1});
+  REQUIRE(t::normalize(t::quatd{0, 0, 0, 0}) == t::quatd{0, 0, 0, 0});
+}
+
+TEST_CASE("Transform matrix matches composition", "") {
+  auto half = std::sqrt(0.5);
+  auto parent = t::transform<double>{t::double3{1, 2, 3}, t::quatd{0, half, 0, half}, t::double3{2, 2, 2}};
+  auto child = t::transform<double>{t::double3{1, 0, 0}, t::quatd{}, t::double3{1, 1, 1}};
+
+  auto composed = t::compose(parent, child);
+  auto point = t::transformPoint(t::toMatrix(parent), child.position);
+  REQUIRE(composed.position.x == Approx(point.x));
+  REQUIRE(composed.position.y == Approx(point.y));
+  REQUIRE(composed.position.z == Approx(point.z));
+  REQUIRE(composed.position.x == Approx(1));
+  REQUIRE(composed.position.z == Approx(1));
+
+  auto both = t::toMatrix(parent) * t::toMatrix(child);
+  auto direct = t::transformPoint(t::toMatrix(composed), t::double3{0, 1, 0});
+  auto chained = t::transformPoint(both, t::double3{0, 1, 0});
+  REQUIRE(direct.x == Approx(chained.x));
+  REQUIRE(direct.y == Approx(chained.y));
+  REQUIRE(direct.z == Approx(chained.z));
+}
@@ -0,0 +1,127 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "test.hpp"
+#include "../src/update_queue.hpp"
+
+using core::RingBuffer;
+using core::UpdateQueue;
+using core::UpdateCommand;
+using core::ObjectHandle;
+namespace command = core::command;
+
+static UpdateCommand moveTo(uint32_t producer, double value) {
+  return command::SetPosition{ObjectHandle{producer, 0}, t::position{value, 0, 0}};
+}
+
+TEST_CASE("Ring buffer push and pop") {
+  RingBuffer<int> ring(3);
+  REQUIRE(ring.capacity() == 4);
+
+  int value;
+  REQUIRE(!ring.tryPop(&value));
+  for (int i = 0; i < 4; i++)
+    REQUIRE(ring.tryPush(int{i}));
+  REQUIRE(!ring.tryPush(5));
+  REQUIRE(ring.size() == 4);
+
+  for (int i = 0; i < 4; i++) {
+    REQUIRE(ring.tryPop(&value));
+    REQUIRE(value == i);
+  }
+  REQUIRE(!ring.tryPop(&value));
+  REQUIRE(ring.tryPush(6));
+}
+
+TEST_CASE("Queue drains in order") {
+  UpdateQueue queue(4);
+  for (int i = 0; i < 3; i++)
+    queue.enqueue(moveTo(0, i));
+  REQUIRE(queue.size() == 3);
+
+  vector<double> drained;
+  queue.drain([&](UpdateCommand& c) { drained.push_back(std::get<command::SetPosition>(c).position.x); });
+  REQUIRE(drained == vector<double>{0, 1, 2});
+  REQUIRE(queue.empty());
+}
+
+TEST_CASE("Queue keeps order when spilling over capacity") {
+  UpdateQueue queue(4);
+  for (int i = 0; i < 10; i++)
+    queue.enqueue(moveTo(0, i));
+  REQUIRE(queue.size() == 10);
+
+  vector<double> drained;
+  queue.drain([&](UpdateCommand& c) { drained.push_back(std::get<command::SetPosition>(c).position.x); });
+  REQUIRE(drained == vector<double>{0, 1, 2, 3, 4, 5, 6, 7, 8, 9});
+  REQUIRE(queue.empty());
+
+  queue.enqueue(moveTo(0, 10));
+  drained.clear();
+  queue.drain([&](UpdateCommand& c) { drained.push_back(std::get<command::SetPosition>(c).position.x); });
+  REQUIRE(drained == vector<double>{10});
+}
+
+TEST_CASE("Queue drain limit") {
+  UpdateQueue queue(16);
+  for (int i = 0; i < 10; i++)
+    queue.enqueue(moveTo(0, i));
+
+  REQUIRE(queue.drain([](UpdateCommand& c) {}, 4) == 4);
+  REQUIRE(queue.size() == 6);
+  REQUIRE(queue.drain([](UpdateCommand& c) {}) == 6);
+}
+
+TEST_CASE("Queue with concurrent producers") {
+  const uint32_t producers = 4;
+  const int perProducer = 50000;
+  UpdateQueue queue(1024);
+
+  std::atomic<int> running = producers;
+  vector<std::thread> threads;
+  for (uint32_t p = 0; p < producers; p++) {
+    threads.emplace_back([&, p]() {
+      for (int i = 0; i < perProducer; i++)
+        queue.enqueue(moveTo(p, i));
+      running--;
+    });
+  }
+
+  // Each producer's commands must come out in the order they went in.
+  vector<double> last(producers, -1);
+  bool ordered = true;
+  size_t total = 0;
+  auto check = [&](UpdateCommand& c) {
+    auto& set = std::get<command::SetPosition>(c);
+    if (set.position.x != last[set.object.index] + 1)
+      ordered = false;
+    last[set.object.index] = set.position.x;
+    total++;
+  };
+  while (running > 0)
+    queue.drain(check);
+  for (auto& thread : threads)
+    thread.join();
+  queue.drain(check);
+
+  REQUIRE(ordered);
+  REQUIRE(total == producers * perProducer);
+}
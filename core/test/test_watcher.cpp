@@ -0,0 +1,154 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "test.hpp"
+#include "../src/assets.hpp"
+#include "../src/core.hpp"
+#include "../src/log.hpp"
+#include "../src/watcher.hpp"
+
+using std::string;
+using std::vector;
+using core::ScriptReload;
+using core::ScriptReloader;
+namespace fs = std::filesystem;
+
+static void writeFile(const string& path, const string& content) {
+  std::ofstream file(path);
+  file << content;
+}
+
+static string readFile(const string& path) {
+  std::ifstream file(path);
+  std::stringstream buffer;
+  buffer << file.rdbuf();
+  return buffer.str();
+}
+
+// Polls until done() or a few seconds passed.
+template <typename F>
+static bool eventually(F done) {
+  for (int i = 0; i < 200; i++) {
+    if (done())
+      return true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  return done();
+}
+
+TEST_CASE("Watching a directory reports written files") {
+  fs::remove_all("test_watcher");
+  fs::create_directories("test_watcher");
+  core::FileWatcher watcher("test_watcher");
+  REQUIRE(watcher.valid());
+
+  vector<string> changed;
+  REQUIRE(!watcher.wait(0.01, &changed));
+  writeFile("test_watcher/a", "1");
+  REQUIRE(eventually([&] { watcher.wait(0.01, &changed); return !changed.empty(); }));
+  REQUIRE(changed[0] == "a");
+  fs::remove_all("test_watcher");
+}
+
+TEST_CASE("Reloading changed scripts only") {
+  fs::remove_all("test_watcher");
+  fs::create_directories("test_watcher");
+  writeFile("test_watcher/a", "same");
+  writeFile("test_watcher/b", "old");
+  ScriptReloader reloader("test_watcher", [](const string& file, const string& source) {
+    if (source == "broken")
+      throw std::runtime_error("does not compile");
+  });
+
+  writeFile("test_watcher/a", "same");
+  writeFile("test_watcher/b", "new");
+  vector<ScriptReload> reloads;
+  REQUIRE(eventually([&] { reloader.take(&reloads); return !reloads.empty(); }));
+  REQUIRE(reloads.size() == 1);
+  REQUIRE(reloads[0].file == "b");
+  REQUIRE(reloads[0].source == "new");
+
+  std::mutex lock;
+  vector<string> logged;
+  auto previous = core::Log::setSink([&](const string& message) {
+    std::lock_guard<std::mutex> guard(lock);
+    logged.push_back(message);
+  });
+  writeFile("test_watcher/b", "broken");
+  REQUIRE(eventually([&] { return reloader.getStats().failed == 1; }));
+  core::Log::setSink(previous);
+  reloads.clear();
+  reloader.take(&reloads);
+  REQUIRE(reloads.empty());
+  REQUIRE(reloader.getStats().reloaded == 1);
+  REQUIRE(logged == vector<string>{"Script b not reloaded: does not compile"});
+  fs::remove_all("test_watcher");
+}
+
+TEST_CASE("Reloaded scripts replace their plugin at a round") {
+  fs::remove_all("test_watcher");
+  core::Worlds::load("id", "sample_worlds/simple_case")->save("test_watcher");
+  auto world = core::Worlds::load("id", "test_watcher");
+  world->watchScripts("test_watcher");
+  auto assets = core::AssetStore("test_watcher/assets").list();
+
+  // The editable file of the plugin, the assets stay as they are.
+  writeFile("test_watcher/scripts/id_hello-world", "print('reloaded')");
+  auto reloaded = core::Assets::hash("print('reloaded')");
+  REQUIRE(eventually([&] {
+    world->round();
+    world->save("test_watcher_saved");
+    return fs::exists("test_watcher_saved/assets/" + reloaded);
+  }));
+  REQUIRE(world->getObject("id")->listPluginIds() == vector<string>{"hello-world"});
+  REQUIRE(core::AssetStore("test_watcher/assets").list() == assets);
+
+  // Restarting before a save loads the edited file.
+  core::Worlds::load("id", "test_watcher")->save("test_watcher_restarted");
+  REQUIRE(fs::exists("test_watcher_restarted/assets/" + reloaded));
+  fs::remove_all("test_watcher");
+  fs::remove_all("test_watcher_saved");
+  fs::remove_all("test_watcher_restarted");
+}
+
+TEST_CASE("Loose script files reload until the world is saved") {
+  fs::remove_all("test_watcher");
+  fs::create_directories("test_watcher");
+  fs::copy("sample_worlds/simple_case", "test_watcher", fs::copy_options::recursive);
+  auto world = core::Worlds::load("id", "test_watcher");
+  world->watchScripts("test_watcher");
+
+  writeFile("test_watcher/scripts/id_hello-world", "print('reloaded')");
+  auto reloaded = core::Assets::hash("print('reloaded')");
+  REQUIRE(eventually([&] {
+    world->round();
+    world->save("test_watcher_saved");
+    return fs::exists("test_watcher_saved/assets/" + reloaded);
+  }));
+  fs::remove_all("test_watcher");
+  fs::remove_all("test_watcher_saved");
+}
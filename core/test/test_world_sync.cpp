@@ -0,0 +1,362 @@
+/*
+    Core engine
+    Copyright (C) 2022  Raffaele Ragni
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Affero General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU Affero General Public License for more details.
+
+    You should have received a copy of the GNU Affero General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "test.hpp"
+#include "../src/core.hpp"
+#include "../src/replication.hpp"
+#include "../src/world_sync.hpp"
+
+using std::string;
+using std::shared_ptr;
+using core::WorldSyncClient;
+using core::WorldSyncServer;
+using namespace std::chrono_literals;
+
+static shared_ptr<core::IWorld> makeWorld(size_t count) {
+  auto world = core::Worlds::createNew("server");
+  for (size_t i = 0; i < count; i++) {
+    auto id = "object-" + std::to_string(i);
+    auto object = world->newObject(id);
+    object->setPosition(t::position{1.0 * i, 2, 3});
+    object->setScale(t::scale{1, 1, 1.0 * i});
+    if (i % 10 == 0)
+      world->saveScriptToObject(id, "script", "local x = " + std::to_string(i));
+  }
+  return world;
+}
+
+static void requireSame(shared_ptr<core::IWorld> a, shared_ptr<core::IWorld> b) {
+  REQUIRE(a->listObjectIds() == b->listObjectIds());
+  for (auto const& id : a->listObjectIds()) {
+    auto objectA = a->getObject(id);
+    auto objectB = b->getObject(id);
+    REQUIRE(objectA->getPosition() == objectB->getPosition());
+    REQUIRE(objectA->getRotation() == objectB->getRotation());
+    REQUIRE(objectA->getScale() == objectB->getScale());
+    REQUIRE(objectA->listPluginIds() == objectB->listPluginIds());
+  }
+}
+
+// Both sides poll with time moving on, so that retries kick in.
+struct Join {
+  Join(shared_ptr<core::IWorld> source, const core::LinkConditions& conditions = {},
+      const core::SyncOptions& options = {})
+    : network{conditions}, source{source}, joiner{core::Worlds::createNew("joiner")},
+      server{source, network.open("server"), nullptr, options},
+      client{joiner, network.open("client"), "server", "", options} {}
+
+  void step(std::chrono::milliseconds elapsed = 10ms) {
+    now += elapsed;
+    client.poll(now);
+    server.poll(now);
+  }
+
+  bool run(size_t steps = 10000) {
+    for (size_t i = 0; i < steps && !client.done(); i++)
+      step();
+    return client.done();
+  }
+
+  core::MemoryNetwork network;
+  shared_ptr<core::IWorld> source;
+  shared_ptr<core::IWorld> joiner;
+  WorldSyncServer server;
+  WorldSyncClient client;
+  WorldSyncServer::Clock::time_point now = WorldSyncServer::Clock::now();
+};
+
+TEST_CASE("Sync a world to a joiner") {
+  core::SyncOptions options;
+  options.chunkBytes = 2048;
+  Join join(makeWorld(500), {}, options);
+  REQUIRE(join.run());
+  requireSame(join.source, join.joiner);
+
+  auto progress = join.client.getProgress();
+  REQUIRE(progress.totalObjects == 500);
+  REQUIRE(progress.objects == 500);
+  REQUIRE(progress.chunks == progress.totalChunks);
+  REQUIRE(progress.totalChunks > 1);
+  auto stats = join.server.getStats();
+  REQUIRE(stats.images == 1);
+  REQUIRE(stats.bytesCompressed < stats.bytesRaw);
+  REQUIRE(join.client.getStats().chunksRetried == 0);
+  join.step();
+  REQUIRE(join.server.sessions() == 0);
+}
+
+TEST_CASE("Sync an empty world") {
+  Join join(core::Worlds::createNew("empty"));
+  REQUIRE(join.run());
+  REQUIRE(join.joiner->objectCount() == 0);
+}
+
+TEST_CASE("Sync survives loss, duplicates and reordering") {
+  core::LinkConditions conditions;
+  conditions.loss = 0.2;
+  conditions.duplicate = 0.1;
+  conditions.reorder = 0.1;
+  core::SyncOptions options;
+  options.chunkBytes = 2048;
+  Join join(makeWorld(300), conditions, options);
+  REQUIRE(join.run());
+  requireSame(join.source, join.joiner);
+  REQUIRE(join.client.getStats().chunksRetried > 0);
+}
+
+TEST_CASE("Sync resumes after the link drops") {
+  core::SyncOptions options;
+  options.chunkBytes = 1024;
+  options.window = 2;
+  Join join(makeWorld(300), {}, options);
+  while (join.client.getProgress().chunks < 5)
+    join.step();
+
+  core::LinkConditions down;
+  down.loss = 1;
+  join.network.setConditions(down);
+  for (int i = 0; i < 100; i++)
+    join.step();
+  auto loaded = join.client.getProgress().chunks;
+  REQUIRE(!join.client.done());
+  // Rounds run on the objects already there.
+  join.joiner->round();
+  REQUIRE(join.joiner->objectCount() > 0);
+  REQUIRE(join.joiner->objectCount() < 300);
+
+  join.network.setConditions(core::LinkConditions{});
+  REQUIRE(join.run());
+  requireSame(join.source, join.joiner);
+  REQUIRE(join.server.getStats().images == 1);
+  REQUIRE(join.client.getStats().chunksLoaded == join.client.getProgress().totalChunks);
+  REQUIRE(loaded < join.client.getProgress().totalChunks);
+}
+
+TEST_CASE("Sync starts over when the server lost the session") {
+  core::SyncOptions options;
+  options.chunkBytes = 1024;
+  options.window = 1;
+  options.sessionTimeout = 50ms;
+  Join join(makeWorld(100), {}, options);
+  while (join.client.getProgress().chunks < 2)
+    join.step();
+
+  core::LinkConditions down;
+  down.loss = 1;
+  join.network.setConditions(down);
+  join.step(100ms);
+  REQUIRE(join.server.sessions() == 0);
+  join.network.setConditions(core::LinkConditions{});
+  REQUIRE(join.run());
+  requireSame(join.source, join.joiner);
+  REQUIRE(join.server.getStats().images == 2);
+}
+
+TEST_CASE("Joiners catch up through replication from the image") {
+  core::MemoryNetwork network;
+  auto source = makeWorld(200);
+  auto joiner = core::Worlds::createNew("joiner");
+  core::Replicator sourceReplicator(source, network.open("source"));
+  core::Replicator joinerReplicator(joiner, network.open("joiner"));
+  joinerReplicator.addPeer("source");
+  core::SyncOptions options;
+  options.chunkBytes = 1024;
+  options.window = 1;
+  WorldSyncServer server(source, network.open("sync"), &sourceReplicator, options);
+  WorldSyncClient client(joiner, network.open("sync-client"), "sync", "joiner", options);
+
+  // Changes made while the joiner loads arrive through replication.
+  auto now = WorldSyncServer::Clock::now();
+  for (int i = 0; !client.done() && i < 10000; i++) {
+    now += 10ms;
+    client.poll(now);
+    server.poll(now);
+    auto handle = source->getObject("object-" + std::to_string(i % 200))->getHandle();
+    source->enqueue(core::command::SetPosition{handle, t::position{-1.0 * i, 0, 0}});
+    source->round();
+    sourceReplicator.poll(now);
+  }
+  REQUIRE(client.done());
+  REQUIRE(client.getProgress().emitter == sourceReplicator.getEmitterId());
+  // The joiner was the first peer, replication starts with it.
+  REQUIRE(client.getProgress().sequence == 1);
+  REQUIRE(sourceReplicator.getSequence() > 1);
+
+  for (int i = 0; i < 100; i++) {
+    now += 200ms;
+    joiner->round();
+    joinerReplicator.poll(now);
+    sourceReplicator.poll(now);
+  }
+  requireSame(source, joiner);
+}
+
+TEST_CASE("Sync sends nothing to joiners that did not prove their address") {
+  core::MemoryNetwork network;
+  auto source = makeWorld(20);
+  core::Replicator sourceReplicator(source, network.open("source"));
+  auto victim = network.open("victim");
+  auto spoofer = network.open("spoofer");
+  core::SyncOptions options;
+  options.handshakeTimeout = 100ms;
+  WorldSyncServer server(source, network.open("sync"), &sourceReplicator, options);
+
+  // A JOIN from an address that never answers, naming someone else's.
+  string join(core::world_sync::MAGIC, 4);
+  join += char(core::world_sync::VERSION);
+  join += char(core::world_sync::JOIN);
+  join += string(10, '\0');
+  join += string("\x06\0victim", 8);
+  spoofer->send("sync", join);
+  auto now = WorldSyncServer::Clock::now();
+  for (int i = 0; i < 20; i++) {
+    now += 10ms;
+    server.poll(now);
+    auto handle = source->getObject("object-1")->getHandle();
+    source->enqueue(core::command::SetPosition{handle, t::position{-1.0 * i, 0, 0}});
+    source->round();
+    sourceReplicator.poll(now);
+  }
+  REQUIRE(server.sessions() == 0);
+  string from, datagram;
+  REQUIRE_FALSE(victim->receive(&from, &datagram));
+  size_t manifests = 0;
+  while (spoofer->receive(&from, &datagram))
+    manifests++;
+  REQUIRE(manifests == 1);
+}
+
+TEST_CASE("Joins share images and wait past the limits") {
+  core::MemoryNetwork network;
+  auto source = makeWorld(100);
+  core::SyncOptions options;
+  options.maxImages = 1;
+  options.maxJoiners = 2;
+  WorldSyncServer server(source, network.open("sync"), nullptr, options);
+  vector<shared_ptr<core::IWorld>> joiners;
+  vector<std::unique_ptr<WorldSyncClient>> clients;
+  for (int i = 0; i < 3; i++) {
+    auto address = "client-" + std::to_string(i);
+    joiners.push_back(core::Worlds::createNew(address));
+    clients.push_back(std::make_unique<WorldSyncClient>(joiners[i], network.open(address), "sync", "", options));
+  }
+
+  auto now = WorldSyncServer::Clock::now();
+  for (auto const& client : clients)
+    client->poll(now);
+  server.poll(now);
+  REQUIRE(server.sessions() == 2);
+  REQUIRE(server.images() == 1);
+  REQUIRE(server.getStats().images == 1);
+  REQUIRE(server.getStats().joinsDeferred == 1);
+
+  for (int i = 0; i < 10000; i++) {
+    now += 10ms;
+    for (auto const& client : clients)
+      client->poll(now);
+    server.poll(now);
+  }
+  for (size_t i = 0; i < clients.size(); i++) {
+    REQUIRE(clients[i]->done());
+    requireSame(source, joiners[i]);
+  }
+  REQUIRE(server.sessions() == 0);
+  REQUIRE(server.getStats().images == 2);
+}
+
+TEST_CASE("Joiners that fall behind replication sync again") {
+  core::MemoryNetwork syncNetwork;
+  core::MemoryNetwork replicationNetwork;
+  auto source = makeWorld(50);
+  auto joiner = core::Worlds::createNew("joiner");
+  core::ReplicationOptions replication;
+  replication.maxHistory = 8;
+  core::Replicator sourceReplicator(source, replicationNetwork.open("source"), replication);
+  core::Replicator joinerReplicator(joiner, replicationNetwork.open("joiner"), replication);
+  joinerReplicator.addPeer("source");
+  WorldSyncServer server(source, syncNetwork.open("sync"), &sourceReplicator);
+  WorldSyncClient client(joiner, syncNetwork.open("sync-client"), "sync", "joiner");
+
+  auto now = WorldSyncServer::Clock::now();
+  auto step = [&] {
+    now += 10ms;
+    client.poll(now);
+    server.poll(now);
+    source->round();
+    sourceReplicator.poll(now);
+    joiner->round();
+    joinerReplicator.poll(now);
+  };
+  for (int i = 0; !client.done() && i < 10000; i++)
+    step();
+  REQUIRE(client.done());
+
+  // The joiner hears nothing while the source moves on past its history.
+  core::LinkConditions lossy;
+  lossy.loss = 1;
+  replicationNetwork.setConditions(lossy);
+  source->deleteObject("object-3");
+  for (int i = 0; i < 20; i++) {
+    core::command::CreateObject create;
+    create.id = "created-" + std::to_string(i);
+    source->enqueue(create);
+    auto handle = source->getObject("object-1")->getHandle();
+    source->enqueue(core::command::SetPosition{handle, t::position{-1.0 * i, 0, 0}});
+    step();
+  }
+  replicationNetwork.setConditions(core::LinkConditions{});
+  REQUIRE(sourceReplicator.getStats().lostPeers == 1);
+
+  for (int i = 0; i < 10000 && (client.getStats().rejoins == 0 || !client.done()); i++)
+    step();
+  REQUIRE(client.getStats().rejoins == 1);
+  REQUIRE(client.done());
+  for (int i = 0; i < 10; i++)
+    step();
+  requireSame(source, joiner);
+}
+
+TEST_CASE("Sync ignores malformed datagrams") {
+  Join join(makeWorld(10));
+  auto stranger = join.network.open("stranger");
+  stranger->send("server", "garbage");
+  stranger->send("server", string(core::world_sync::MAGIC, 4) + string(12, '\xff'));
+  join.step();
+  REQUIRE(join.server.getStats().malformed == 2);
+  REQUIRE(join.run());
+}
+
+TEST_CASE("Sync over UDP loopback") {
+  auto source = makeWorld(1000);
+  auto joiner = core::Worlds::createNew("joiner");
+  auto serverTransport = std::make_shared<core::UdpTransport>("127.0.0.1:0");
+  auto clientTransport = std::make_shared<core::UdpTransport>("127.0.0.1:0");
+  WorldSyncServer server(source, serverTransport);
+  WorldSyncClient client(joiner, clientTransport, serverTransport->getAddress());
+  for (int i = 0; i < 5000 && !client.done(); i++) {
+    client.poll();
+    server.poll();
+    std::this_thread::sleep_for(1ms);
+  }
+  REQUIRE(client.done());
+  requireSame(source, joiner);
+}